@@ -3,6 +3,7 @@
 #include "app/application.h"
 
 #include <atlstr.h>
+#include <shlobj.h>
 
 #include <base/command_line.h>
 #include <base/logging.h>
@@ -18,7 +19,17 @@
 
 #include "app/constants.h"
 #include "app/service_configurator.h"
+#include "misc/access_log.h"
+#include "misc/queue_delay_monitor.h"
 #include "misc/tunneling_service.h"
+#include "service/http/http2_upstream.h"
+#include "service/http/http_buffer_pool.h"
+#include "service/http/http_cache.h"
+#include "service/http/http_collapser.h"
+#include "service/http/http_connection_pool.h"
+#include "service/http/http_disk_cache.h"
+#include "service/http/http_preconnector.h"
+#include "service/http/http_upstream_group.h"
 #include "service/service_manager.h"
 #include "ui/main_frame.h"
 #include "service/rpc/rpc_service.h"
@@ -335,6 +346,20 @@ HRESULT Application::PreMessageLoop(int show_mode) throw() {
 
   url::Initialize();
 
+  base::FilePath data_path;
+  wchar_t* local_app_data = nullptr;
+  if (SUCCEEDED(SHGetKnownFolderPath(FOLDERID_LocalAppData, 0, NULL,
+                                     &local_app_data)))
+    data_path = base::FilePath(local_app_data).Append(kServiceName);
+  CoTaskMemFree(local_app_data);
+
+  // Requests are still served without the log.
+  if (!data_path.empty()) {
+    result = misc::AccessLog::Init(data_path.Append(L"Logs"));
+    LOG_IF(WARNING, FAILED(result))
+        << "Failed to initialize AccessLog: 0x" << std::hex << result;
+  }
+
   result = misc::TunnelingService::Init();
   if (FAILED(result)) {
     LOG(ERROR) << "Failed to initialize TunnelingService: 0x" << std::hex
@@ -343,6 +368,76 @@ HRESULT Application::PreMessageLoop(int show_mode) throw() {
     return S_FALSE;
   }
 
+  result = misc::QueueDelayMonitor::Init();
+  if (FAILED(result)) {
+    LOG(ERROR) << "Failed to initialize QueueDelayMonitor: 0x" << std::hex
+               << result;
+    ReportEvent(EVENTLOG_ERROR_TYPE, IDS_ERR_INIT_FAILED);
+    return S_FALSE;
+  }
+
+  result = service::http::HttpCache::Init();
+  if (FAILED(result)) {
+    LOG(ERROR) << "Failed to initialize HttpCache: 0x" << std::hex << result;
+    ReportEvent(EVENTLOG_ERROR_TYPE, IDS_ERR_INIT_FAILED);
+    return S_FALSE;
+  }
+
+  if (!data_path.empty()) {
+    // Responses are still cached in memory without the disk.
+    result = service::http::HttpDiskCache::Init(data_path.Append(L"Cache"));
+    LOG_IF(WARNING, FAILED(result))
+        << "Failed to initialize HttpDiskCache: 0x" << std::hex << result;
+  }
+
+  result = service::http::HttpCollapser::Init();
+  if (FAILED(result)) {
+    LOG(ERROR) << "Failed to initialize HttpCollapser: 0x" << std::hex
+               << result;
+    ReportEvent(EVENTLOG_ERROR_TYPE, IDS_ERR_INIT_FAILED);
+    return S_FALSE;
+  }
+
+  result = service::http::HttpConnectionPool::Init();
+  if (FAILED(result)) {
+    LOG(ERROR) << "Failed to initialize HttpConnectionPool: 0x" << std::hex
+               << result;
+    ReportEvent(EVENTLOG_ERROR_TYPE, IDS_ERR_INIT_FAILED);
+    return S_FALSE;
+  }
+
+  result = service::http::HttpPreconnector::Init();
+  if (FAILED(result)) {
+    LOG(ERROR) << "Failed to initialize HttpPreconnector: 0x" << std::hex
+               << result;
+    ReportEvent(EVENTLOG_ERROR_TYPE, IDS_ERR_INIT_FAILED);
+    return S_FALSE;
+  }
+
+  result = service::http::HttpBufferPool::Init();
+  if (FAILED(result)) {
+    LOG(ERROR) << "Failed to initialize HttpBufferPool: 0x" << std::hex
+               << result;
+    ReportEvent(EVENTLOG_ERROR_TYPE, IDS_ERR_INIT_FAILED);
+    return S_FALSE;
+  }
+
+  result = service::http::Http2Upstream::Init();
+  if (FAILED(result)) {
+    LOG(ERROR) << "Failed to initialize Http2Upstream: 0x" << std::hex
+               << result;
+    ReportEvent(EVENTLOG_ERROR_TYPE, IDS_ERR_INIT_FAILED);
+    return S_FALSE;
+  }
+
+  result = service::http::HttpUpstreamGroup::Init();
+  if (FAILED(result)) {
+    LOG(ERROR) << "Failed to initialize HttpUpstreamGroup: 0x" << std::hex
+               << result;
+    ReportEvent(EVENTLOG_ERROR_TYPE, IDS_ERR_INIT_FAILED);
+    return S_FALSE;
+  }
+
   service_manager_ = new service::ServiceManager();
   if (service_manager_ == nullptr) {
     LOG(ERROR) << "Failed to allocate ServiceManager.";
@@ -404,7 +499,20 @@ HRESULT Application::PostMessageLoop() throw() {
     service_manager_ = nullptr;
   }
 
+  // Tunnels may hold connections made ahead, still monitored by
+  // HttpConnectionPool.
   misc::TunnelingService::Term();
+
+  service::http::HttpUpstreamGroup::Term();
+  service::http::Http2Upstream::Term();
+  service::http::HttpBufferPool::Term();
+  service::http::HttpPreconnector::Term();
+  service::http::HttpConnectionPool::Term();
+  service::http::HttpCollapser::Term();
+  service::http::HttpDiskCache::Term();
+  service::http::HttpCache::Term();
+  misc::QueueDelayMonitor::Term();
+  misc::AccessLog::Term();
   url::Shutdown();
   WSACleanup();
 
@@ -9,6 +9,7 @@ const wchar_t kRpcServiceName[] = L"juno.rpc";
 
 const char kConfigGetMethod[] = "config.get";
 const char kConfigSetMethod[] = "config.set";
+const char kStatsGetMethod[] = "stats.get";
 
 namespace switches {
 
@@ -14,6 +14,7 @@ extern const wchar_t kRpcServiceName[];
 
 extern const char kConfigGetMethod[];
 extern const char kConfigSetMethod[];
+extern const char kStatsGetMethod[];
 
 namespace switches {
 
@@ -26,6 +26,11 @@ class __declspec(novtable) Channel {
   virtual HRESULT ReadAsync(void* buffer, int length, Listener* listener) = 0;
   virtual HRESULT WriteAsync(const void* buffer, int length,
                              Listener* listener) = 0;
+
+  // Retrieves the address of the peer, if the channel is over a socket.
+  virtual bool GetRemoteEndPoint(void* /*address*/, int* /*length*/) const {
+    return false;
+  }
 };
 
 }  // namespace io
@@ -0,0 +1,115 @@
+// Copyright (c) 2017 dacci.org
+
+#ifndef JUNO_IO_CHANNEL_AWAITABLE_H_
+#define JUNO_IO_CHANNEL_AWAITABLE_H_
+
+#include <experimental/coroutine>
+
+#include "io/channel.h"
+
+namespace juno {
+namespace io {
+
+struct IoResult {
+  HRESULT result;
+  int length;
+
+  bool succeeded() const {
+    return SUCCEEDED(result) && length > 0;
+  }
+};
+
+// Base of the awaitables returned by ReadAsync() and WriteAsync(). The
+// awaitable lives in the coroutine frame and acts as the listener of the
+// request, so no per-operation allocation is needed besides the one the
+// channel does internally.
+class ChannelAwaitable : private Channel::Listener {
+ public:
+  bool await_ready() const {
+    return false;
+  }
+
+  IoResult await_resume() const {
+    return {result_, length_};
+  }
+
+ protected:
+  ChannelAwaitable(Channel* channel, void* buffer, int length)
+      : channel_(channel),
+        buffer_(buffer),
+        length_(length),
+        result_(S_OK) {}
+
+  // Must not touch |this| once the request has been dispatched because the
+  // completion may resume (and destroy) the frame on another thread.
+  bool Suspend(std::experimental::coroutine_handle<> handle, bool write) {
+    handle_ = handle;
+
+    auto result = write ? channel_->WriteAsync(buffer_, length_, this)
+                        : channel_->ReadAsync(buffer_, length_, this);
+    if (FAILED(result)) {
+      result_ = result;
+      length_ = 0;
+      return false;
+    }
+
+    return true;
+  }
+
+ private:
+  void OnRead(Channel* /*channel*/, HRESULT result, void* /*buffer*/,
+              int length) override {
+    Complete(result, length);
+  }
+
+  void OnWritten(Channel* /*channel*/, HRESULT result, void* /*buffer*/,
+                 int length) override {
+    Complete(result, length);
+  }
+
+  void Complete(HRESULT result, int length) {
+    result_ = result;
+    length_ = length;
+    handle_.resume();
+  }
+
+  Channel* const channel_;
+  void* const buffer_;
+  int length_;
+  HRESULT result_;
+  std::experimental::coroutine_handle<> handle_;
+};
+
+class ReadAwaitable : public ChannelAwaitable {
+ public:
+  ReadAwaitable(Channel* channel, void* buffer, int length)
+      : ChannelAwaitable(channel, buffer, length) {}
+
+  bool await_suspend(std::experimental::coroutine_handle<> handle) {
+    return Suspend(handle, false);
+  }
+};
+
+class WriteAwaitable : public ChannelAwaitable {
+ public:
+  WriteAwaitable(Channel* channel, const void* buffer, int length)
+      : ChannelAwaitable(channel, const_cast<void*>(buffer), length) {}
+
+  bool await_suspend(std::experimental::coroutine_handle<> handle) {
+    return Suspend(handle, true);
+  }
+};
+
+inline ReadAwaitable ReadAsync(Channel* channel, void* buffer, int length) {
+  return ReadAwaitable(channel, buffer, length);
+}
+
+inline WriteAwaitable WriteAsync(Channel* channel, const void* buffer,
+                                 int length) {
+  return WriteAwaitable(channel, buffer, length);
+}
+
+}  // namespace io
+}  // namespace juno
+
+#endif  // JUNO_IO_CHANNEL_AWAITABLE_H_
@@ -149,6 +149,11 @@ HRESULT SocketChannel::WriteAsync(const void* buffer, int length,
   return DispatchRequest(std::move(request));
 }
 
+bool SocketChannel::GetRemoteEndPoint(void* address, int* length) const {
+  return getpeername(descriptor_, static_cast<sockaddr*>(address), length) ==
+         0;
+}
+
 HRESULT SocketChannel::ConnectAsync(const addrinfo* end_point,
                                     Listener* listener) {
   if (end_point == nullptr || listener == nullptr)
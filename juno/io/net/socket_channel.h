@@ -33,6 +33,7 @@ class SocketChannel : public Socket, public Channel {
                     Channel::Listener* listener) override;
   HRESULT WriteAsync(const void* buffer, int length,
                      Channel::Listener* listener) override;
+  bool GetRemoteEndPoint(void* address, int* length) const override;
 
   HRESULT ConnectAsync(const addrinfo* end_point, Listener* listener);
   HRESULT MonitorConnection(Listener* listener);
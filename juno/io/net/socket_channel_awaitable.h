@@ -0,0 +1,62 @@
+// Copyright (c) 2017 dacci.org
+
+#ifndef JUNO_IO_NET_SOCKET_CHANNEL_AWAITABLE_H_
+#define JUNO_IO_NET_SOCKET_CHANNEL_AWAITABLE_H_
+
+#include <experimental/coroutine>
+
+#include "io/net/socket_channel.h"
+
+namespace juno {
+namespace io {
+namespace net {
+
+class ConnectAwaitable : private SocketChannel::Listener {
+ public:
+  ConnectAwaitable(SocketChannel* channel, const addrinfo* end_point)
+      : channel_(channel), end_point_(end_point), result_(S_OK) {}
+
+  bool await_ready() const {
+    return false;
+  }
+
+  bool await_suspend(std::experimental::coroutine_handle<> handle) {
+    handle_ = handle;
+
+    auto result = channel_->ConnectAsync(end_point_, this);
+    if (FAILED(result)) {
+      result_ = result;
+      return false;
+    }
+
+    return true;
+  }
+
+  HRESULT await_resume() const {
+    return result_;
+  }
+
+ private:
+  void OnConnected(SocketChannel* /*channel*/, HRESULT result) override {
+    result_ = result;
+    handle_.resume();
+  }
+
+  void OnClosed(SocketChannel* /*channel*/, HRESULT /*result*/) override {}
+
+  SocketChannel* const channel_;
+  const addrinfo* const end_point_;
+  HRESULT result_;
+  std::experimental::coroutine_handle<> handle_;
+};
+
+inline ConnectAwaitable ConnectAsync(SocketChannel* channel,
+                                     const addrinfo* end_point) {
+  return ConnectAwaitable(channel, end_point);
+}
+
+}  // namespace net
+}  // namespace io
+}  // namespace juno
+
+#endif  // JUNO_IO_NET_SOCKET_CHANNEL_AWAITABLE_H_
@@ -4,6 +4,8 @@
 
 #include <base/logging.h>
 
+#include <stddef.h>
+
 #include <algorithm>
 #include <string>
 #include <vector>
@@ -35,11 +37,11 @@ class SecurityBuffer : public std::vector<SecBuffer> {
   SecurityBuffer(std::initializer_list<SecBuffer> buffers)
       : std::vector<SecBuffer>(buffers) {
     description_.ulVersion = SECBUFFER_VERSION;
-    description_.cBuffers = static_cast<DWORD>(size());
-    description_.pBuffers = data();
   }
 
   SecBufferDesc* get() {
+    description_.cBuffers = static_cast<DWORD>(size());
+    description_.pBuffers = data();
     return &description_;
   }
 
@@ -212,6 +214,42 @@ HRESULT SecureChannel::WriteAsync(const void* buffer, int length,
   return S_OK;
 }
 
+bool SecureChannel::GetRemoteEndPoint(void* address, int* length) const {
+  return channel_->GetRemoteEndPoint(address, length);
+}
+
+void SecureChannel::SetApplicationProtocols(
+    const std::vector<std::string>& protocols) {
+  std::string list;
+  for (auto& protocol : protocols) {
+    if (protocol.empty() || protocol.size() > 255)
+      continue;
+
+    list.push_back(static_cast<char>(protocol.size()));
+    list.append(protocol);
+  }
+
+  protocols_.clear();
+  if (list.empty())
+    return;
+
+  auto lists_size =
+      offsetof(SEC_APPLICATION_PROTOCOL_LIST, ProtocolList) + list.size();
+  protocols_.resize(offsetof(SEC_APPLICATION_PROTOCOLS, ProtocolLists) +
+                    lists_size);
+
+  auto application_protocols =
+      reinterpret_cast<SEC_APPLICATION_PROTOCOLS*>(&protocols_[0]);
+  application_protocols->ProtocolListsSize =
+      static_cast<unsigned long>(lists_size);  // NOLINT(runtime/int)
+
+  auto& protocol_list = application_protocols->ProtocolLists[0];
+  protocol_list.ProtoNegoExt = SecApplicationProtocolNegotiationExt_ALPN;
+  protocol_list.ProtocolListSize = static_cast<unsigned short>(  // NOLINT
+      list.size());
+  memcpy(protocol_list.ProtocolList, list.data(), list.size());
+}
+
 HRESULT SecureChannel::CheckMessage() const {
   static const uint16_t kMaxLength = 16384;
 
@@ -287,6 +325,10 @@ HRESULT SecureChannel::Negotiate() {
         {0, SECBUFFER_EXTRA, nullptr},
     };
 
+    if (inbound_ && !protocols_.empty())
+      inputs.push_back({static_cast<DWORD>(protocols_.size()),
+                        SECBUFFER_APPLICATION_PROTOCOLS, &protocols_[0]});
+
     if (inbound_)
       result = context_.AcceptContext(
           ASC_REQ_REPLAY_DETECT | ASC_REQ_SEQUENCE_DETECT |
@@ -642,6 +684,12 @@ void SecureChannel::OnWrite() {
 
     switch (status_) {
       case Status::kData: {
+        // Negotiated by now, and nothing to send.
+        if (request->length == 0) {
+          result = S_OK;
+          break;
+        }
+
         std::string message;
         result = Encrypt(request->buffer, request->length, &message);
         if (SUCCEEDED(result)) {
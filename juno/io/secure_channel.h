@@ -11,6 +11,7 @@
 #include <memory>
 #include <queue>
 #include <string>
+#include <vector>
 
 #include "io/channel.h"
 #include "misc/schannel/schannel_context.h"
@@ -27,8 +28,15 @@ class SecureChannel : public Channel, private Channel::Listener {
   void Close() override;
   HRESULT ReadAsync(void* buffer, int length,
                     Channel::Listener* listener) override;
+  // Writing 0 bytes sends nothing, and completes once negotiated, so that a
+  // channel can be negotiated ahead of use.
   HRESULT WriteAsync(const void* buffer, int length,
                      Channel::Listener* listener) override;
+  bool GetRemoteEndPoint(void* address, int* length) const override;
+
+  // Offers |protocols| by ALPN, most preferred first, to the clients of an
+  // inbound channel. Must be called before any I/O.
+  void SetApplicationProtocols(const std::vector<std::string>& protocols);
 
   misc::schannel::SchannelContext* context() {
     return &context_;
@@ -80,6 +88,8 @@ class SecureChannel : public Channel, private Channel::Listener {
 
   Status status_;
   std::string message_;
+  // SEC_APPLICATION_PROTOCOLS, empty if none.
+  std::string protocols_;
   SecPkgContext_StreamSizes stream_sizes_;
 
   std::string decrypted_;
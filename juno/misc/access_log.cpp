@@ -0,0 +1,543 @@
+// Copyright (c) 2017 dacci.org
+
+#include "misc/access_log.h"
+
+#include <ws2tcpip.h>
+
+#include <base/files/file_enumerator.h>
+#include <base/files/file_util.h>
+#include <base/json/string_escape.h>
+#include <base/logging.h>
+#include <base/strings/stringprintf.h>
+#include <base/values.h>
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "io/channel.h"
+
+namespace juno {
+namespace misc {
+namespace {
+
+const wchar_t kFileName[] = L"access.log";
+const wchar_t kRotatedPattern[] = L"access-*.log";
+
+const char* const kServiceNames[] = {"http", "socks", "scissors"};
+
+// Copies |source| into |buffer| of |size|, truncated to fit, and returns the
+// length copied.
+size_t CopyString(const char* source, size_t length, char* buffer,
+                  size_t size) {
+  length = std::min(length, size - 1);
+  memcpy(buffer, source, length);
+  buffer[length] = '\0';
+  return length;
+}
+
+// Formats |address| as "address:port", with IPv6 addresses in brackets.
+bool FormatAddress(const sockaddr_storage& address, char* buffer,
+                   size_t size) {
+  char host[INET6_ADDRSTRLEN];
+  int port;
+
+  switch (address.ss_family) {
+    case AF_INET: {
+      auto address4 = reinterpret_cast<const sockaddr_in*>(&address);
+      if (inet_ntop(AF_INET, &address4->sin_addr, host, sizeof(host)) ==
+          nullptr)
+        return false;
+
+      port = ntohs(address4->sin_port);
+      return sprintf_s(buffer, size, "%s:%d", host, port) > 0;
+    }
+
+    case AF_INET6: {
+      auto address6 = reinterpret_cast<const sockaddr_in6*>(&address);
+      if (inet_ntop(AF_INET6, &address6->sin6_addr, host, sizeof(host)) ==
+          nullptr)
+        return false;
+
+      port = ntohs(address6->sin6_port);
+      return sprintf_s(buffer, size, "[%s]:%d", host, port) > 0;
+    }
+
+    default:
+      return false;
+  }
+}
+
+void AppendString(const char* value, std::string* line) {
+  if (value[0] == '\0')
+    line->append("null");
+  else
+    base::EscapeJSONString(value, true, line);
+}
+
+}  // namespace
+
+// Records pushed by a single thread, and drained by the writer. The thread
+// never waits for the writer; if the writer falls behind, the ring fills up
+// and the records are dropped.
+class AccessLog::Ring {
+ public:
+  Ring() : head_(0), orphaned_(false), tail_(0) {}
+
+  // Returns the number of records held, including |record|, or 0 if the ring
+  // is full.
+  size_t Push(const Record& record) {
+    auto head = head_.load(std::memory_order_relaxed);
+    auto count = head - tail_.load(std::memory_order_acquire);
+    if (count >= kRingSize)
+      return 0;
+
+    records_[head % kRingSize] = record;
+    head_.store(head + 1, std::memory_order_release);
+
+    return count + 1;
+  }
+
+  // Calls |function| with each record pushed so far, then frees them.
+  template <typename Function>
+  void Drain(Function&& function) {
+    auto tail = tail_.load(std::memory_order_relaxed);
+    auto head = head_.load(std::memory_order_acquire);
+
+    for (; tail != head; ++tail)
+      function(records_[tail % kRingSize]);
+
+    tail_.store(tail, std::memory_order_release);
+  }
+
+  // Called by the thread as it exits, after its last push.
+  void Orphan() {
+    orphaned_.store(true, std::memory_order_release);
+  }
+
+  // Returns true if nothing is pushed anymore. Checked before draining, so
+  // that the last records are drained as well.
+  bool IsOrphaned() const {
+    return orphaned_.load(std::memory_order_acquire);
+  }
+
+ private:
+  Record records_[kRingSize];
+
+  // Apart from each other, as written by different threads.
+  alignas(64) std::atomic<size_t> head_;
+  std::atomic<bool> orphaned_;
+  alignas(64) std::atomic<size_t> tail_;
+
+  Ring(const Ring&) = delete;
+  Ring& operator=(const Ring&) = delete;
+};
+
+AccessLog::Record::Record()
+    : service(Service::kHttp),
+      status(0),
+      bytes_in(0),
+      bytes_out(0),
+      client(),
+      method(),
+      host() {}
+
+void AccessLog::Record::Begin(Service service, const std::string& method) {
+  this->service = service;
+  status = 0;
+  start_time = base::Time::Now();
+  start_ticks = base::TimeTicks::Now();
+  first_byte = base::TimeDelta();
+  elapsed = base::TimeDelta();
+  CopyString(method.data(), method.size(), this->method, kMethodSize);
+  host[0] = '\0';
+}
+
+void AccessLog::Record::SetClient(const io::Channel* channel) {
+  int length = sizeof(client);
+  if (channel == nullptr || !channel->GetRemoteEndPoint(&client, &length))
+    client.ss_family = AF_UNSPEC;
+}
+
+void AccessLog::Record::SetClient(const void* address, int length) {
+  memset(&client, 0, sizeof(client));
+  memcpy(&client, address,
+         std::min(static_cast<size_t>(length), sizeof(client)));
+}
+
+void AccessLog::Record::SetHost(const std::string& host, int port) {
+  // Leaves room for the port.
+  auto length = CopyString(host.data(), host.size(), this->host,
+                           kHostSize - 12);
+  sprintf_s(this->host + length, kHostSize - length, ":%d", port);
+}
+
+void AccessLog::Record::SetHost(const void* address) {
+  sockaddr_storage storage{};
+  auto family = static_cast<const sockaddr*>(address)->sa_family;
+  if (family == AF_INET)
+    memcpy(&storage, address, sizeof(sockaddr_in));
+  else if (family == AF_INET6)
+    memcpy(&storage, address, sizeof(sockaddr_in6));
+
+  if (!FormatAddress(storage, host, kHostSize))
+    host[0] = '\0';
+}
+
+void AccessLog::Record::Respond() {
+  if (IsStarted() && first_byte.is_zero())
+    first_byte = base::TimeTicks::Now() - start_ticks;
+}
+
+void AccessLog::Record::End() {
+  if (!IsStarted())
+    return;
+
+  elapsed = base::TimeTicks::Now() - start_ticks;
+  AccessLog::Write(*this);
+  Clear();
+}
+
+void AccessLog::Record::Clear() {
+  status = 0;
+  bytes_in = 0;
+  bytes_out = 0;
+  start_ticks = base::TimeTicks();
+}
+
+AccessLog::Tunnel::Tunnel(const Record& record)
+    : record_(record), discarded_(false) {
+  // Connected by now.
+  record_.Respond();
+}
+
+AccessLog::Tunnel::~Tunnel() {
+  if (!discarded_)
+    record_.End();
+}
+
+AccessLog* AccessLog::instance_ = nullptr;
+std::atomic<uint32_t> AccessLog::last_generation_(0);
+
+HRESULT AccessLog::Init(const base::FilePath& directory) {
+  Term();
+
+  instance_ = new AccessLog(directory);
+  if (instance_ == nullptr)
+    return E_OUTOFMEMORY;
+
+  auto result = instance_->Start();
+  if (FAILED(result))
+    Term();
+
+  return result;
+}
+
+void AccessLog::Term() {
+  if (instance_ != nullptr) {
+    instance_->Stop();
+    delete instance_;
+    instance_ = nullptr;
+  }
+}
+
+void AccessLog::Write(const Record& record) {
+  if (instance_ != nullptr)
+    instance_->WriteImpl(record);
+}
+
+void AccessLog::GetStatistics(base::DictionaryValue* stats) {
+  if (instance_ != nullptr)
+    instance_->GetStatisticsImpl(stats);
+}
+
+AccessLog::AccessLog(const base::FilePath& directory)
+    : directory_(directory),
+      generation_(++last_generation_),
+      file_(INVALID_HANDLE_VALUE),
+      file_size_(0),
+      work_(nullptr),
+      flush_requested_(false),
+      written_(0),
+      dropped_(0),
+      rotations_(0),
+      errors_(0) {}
+
+AccessLog::~AccessLog() {
+  if (work_ != nullptr)
+    CloseThreadpoolWork(work_);
+
+  if (file_ != INVALID_HANDLE_VALUE)
+    CloseHandle(file_);
+}
+
+HRESULT AccessLog::Start() {
+  if (!base::CreateDirectory(directory_)) {
+    LOG(ERROR) << "Failed to create " << directory_.value();
+    return E_FAIL;
+  }
+
+  work_ = CreateThreadpoolWork(OnWork, this, nullptr);
+  if (work_ == nullptr) {
+    auto error = GetLastError();
+    LOG(ERROR) << "Failed to create work: " << error;
+    return HRESULT_FROM_WIN32(error);
+  }
+
+  timer_ = TimerService::GetDefault()->Create(this);
+  if (timer_ == nullptr) {
+    LOG(ERROR) << "Failed to create timer.";
+    return E_OUTOFMEMORY;
+  }
+
+  timer_->Start(kFlushInterval, kFlushInterval);
+
+  return S_OK;
+}
+
+void AccessLog::Stop() {
+  timer_.reset();
+
+  if (work_ != nullptr)
+    WaitForThreadpoolWorkCallbacks(work_, FALSE);
+
+  // Sessions are gone, so nothing is pushed anymore.
+  Flush();
+}
+
+void AccessLog::WriteImpl(const Record& record) {
+  auto ring = GetRing();
+  auto count = ring != nullptr ? ring->Push(record) : 0;
+  if (count == 0) {
+    ++dropped_;
+    return;
+  }
+
+  // Drained ahead of the timer, before the ring overflows.
+  if (count == kRingSize / 2 && !flush_requested_.exchange(true))
+    SubmitThreadpoolWork(work_);
+}
+
+AccessLog::Ring* AccessLog::GetRing() {
+  // Shared with the writer, and orphaned as the thread exits, as the thread
+  // pool recycles its threads. Those of a previous instance are just
+  // released.
+  struct Holder {
+    ~Holder() {
+      if (ring != nullptr)
+        ring->Orphan();
+    }
+
+    std::shared_ptr<Ring> ring;
+    uint32_t generation = 0;
+  };
+
+  static thread_local Holder holder;
+
+  if (holder.generation != generation_) {
+    auto new_ring = std::make_shared<Ring>();
+    if (new_ring == nullptr)
+      return nullptr;
+
+    base::AutoLock guard(lock_);
+
+    rings_.push_back(new_ring);
+    holder.ring = std::move(new_ring);
+    holder.generation = generation_;
+  }
+
+  return holder.ring.get();
+}
+
+void AccessLog::Flush() {
+  std::vector<std::shared_ptr<Ring>> rings;
+
+  {
+    base::AutoLock guard(lock_);
+    rings = rings_;
+  }
+
+  base::AutoLock guard(write_lock_);
+
+  uint64_t count = 0;
+  buffer_.clear();
+
+  std::vector<Ring*> exited;
+  for (const auto& ring : rings) {
+    auto orphaned = ring->IsOrphaned();
+
+    ring->Drain([this, &count](const Record& record) {
+      Format(record, &buffer_);
+      ++count;
+    });
+
+    if (orphaned)
+      exited.push_back(ring.get());
+  }
+
+  // Those of the threads exited are drained for good.
+  if (!exited.empty()) {
+    base::AutoLock rings_guard(lock_);
+
+    auto end = std::remove_if(
+        rings_.begin(), rings_.end(),
+        [&exited](const std::shared_ptr<Ring>& ring) {
+          return std::find(exited.begin(), exited.end(), ring.get()) !=
+                 exited.end();
+        });
+    rings_.erase(end, rings_.end());
+  }
+
+  if (count == 0)
+    return;
+
+  if (file_ != INVALID_HANDLE_VALUE &&
+      (file_size_ >= kMaxFileSize ||
+       base::Time::Now() - file_time_ >=
+           base::TimeDelta::FromHours(kMaxFileAge)))
+    Rotate();
+
+  if (file_ == INVALID_HANDLE_VALUE && !OpenFile()) {
+    dropped_ += count;
+    return;
+  }
+
+  DWORD written = 0;
+  auto size = static_cast<DWORD>(buffer_.size());
+  if (!WriteFile(file_, buffer_.data(), size, &written, nullptr) ||
+      written != size) {
+    LOG(ERROR) << "Failed to write access log: " << GetLastError();
+    ++errors_;
+    dropped_ += count;
+    return;
+  }
+
+  file_size_ += written;
+  written_ += count;
+}
+
+void AccessLog::Format(const Record& record, std::string* line) {
+  base::Time::Exploded time;
+  record.start_time.UTCExplode(&time);
+
+  base::StringAppendF(line,
+                      "{\"time\":\"%04d-%02d-%02dT%02d:%02d:%02d.%03dZ\","
+                      "\"service\":\"%s\",\"client\":",
+                      time.year, time.month, time.day_of_month, time.hour,
+                      time.minute, time.second, time.millisecond,
+                      kServiceNames[static_cast<int>(record.service)]);
+
+  char client[INET6_ADDRSTRLEN + 8];
+  if (!FormatAddress(record.client, client, sizeof(client)))
+    client[0] = '\0';
+  AppendString(client, line);
+
+  line->append(",\"method\":");
+  AppendString(record.method, line);
+  line->append(",\"host\":");
+  AppendString(record.host, line);
+
+  base::StringAppendF(
+      line,
+      ",\"status\":%d,\"bytes_in\":%lld,\"bytes_out\":%lld,"
+      "\"first_byte_ms\":%.3f,\"elapsed_ms\":%.3f}\n",
+      record.status, record.bytes_in, record.bytes_out,
+      record.first_byte.InMillisecondsF(), record.elapsed.InMillisecondsF());
+}
+
+bool AccessLog::OpenFile() {
+  auto path = directory_.Append(kFileName);
+  file_ = CreateFile(path.value().c_str(), FILE_APPEND_DATA,
+                     FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_ALWAYS,
+                     FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file_ == INVALID_HANDLE_VALUE) {
+    LOG(ERROR) << "Failed to open " << path.value() << ": " << GetLastError();
+    ++errors_;
+    return false;
+  }
+
+  LARGE_INTEGER size;
+  file_size_ = GetFileSizeEx(file_, &size) ? size.QuadPart : 0;
+  // The age is counted from when opened, as the file may be appended to
+  // across restarts.
+  file_time_ = base::Time::Now();
+
+  return true;
+}
+
+void AccessLog::Rotate() {
+  write_lock_.AssertAcquired();
+
+  CloseHandle(file_);
+  file_ = INVALID_HANDLE_VALUE;
+
+  base::Time::Exploded time;
+  base::Time::Now().UTCExplode(&time);
+
+  // Sorted by the time rotated.
+  auto name = base::StringPrintf(L"access-%04d%02d%02d-%02d%02d%02d-%03d.log",
+                                 time.year, time.month, time.day_of_month,
+                                 time.hour, time.minute, time.second,
+                                 time.millisecond);
+  if (!base::Move(directory_.Append(kFileName), directory_.Append(name))) {
+    LOG(ERROR) << "Failed to rotate access log: " << GetLastError();
+    ++errors_;
+    return;
+  }
+
+  ++rotations_;
+  DeleteOldFiles();
+}
+
+void AccessLog::DeleteOldFiles() {
+  std::vector<base::FilePath> files;
+
+  base::FileEnumerator enumerator(directory_, false,
+                                  base::FileEnumerator::FILES, kRotatedPattern);
+  for (auto path = enumerator.Next(); !path.empty(); path = enumerator.Next())
+    files.push_back(path);
+
+  if (files.size() <= kMaxFiles)
+    return;
+
+  std::sort(files.begin(), files.end());
+  files.resize(files.size() - kMaxFiles);
+
+  for (const auto& path : files) {
+    LOG_IF(WARNING, !base::DeleteFile(path, false))
+        << "Failed to delete " << path.value();
+  }
+}
+
+void AccessLog::GetStatisticsImpl(base::DictionaryValue* stats) {
+  {
+    base::AutoLock guard(lock_);
+    stats->SetInteger("rings", static_cast<int>(rings_.size()));
+  }
+
+  {
+    base::AutoLock guard(write_lock_);
+    stats->SetDouble("file_size", static_cast<double>(file_size_));
+  }
+
+  stats->SetDouble("written", static_cast<double>(written_));
+  stats->SetDouble("dropped", static_cast<double>(dropped_));
+  stats->SetDouble("rotations", static_cast<double>(rotations_));
+  stats->SetDouble("errors", static_cast<double>(errors_));
+}
+
+void AccessLog::OnTimeout() {
+  Flush();
+}
+
+void CALLBACK AccessLog::OnWork(PTP_CALLBACK_INSTANCE instance, void* context,
+                                PTP_WORK /*work*/) {
+  CallbackMayRunLong(instance);
+
+  auto log = static_cast<AccessLog*>(context);
+  log->flush_requested_ = false;
+  log->Flush();
+}
+
+}  // namespace misc
+}  // namespace juno
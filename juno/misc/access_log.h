@@ -0,0 +1,197 @@
+// Copyright (c) 2017 dacci.org
+
+#ifndef JUNO_MISC_ACCESS_LOG_H_
+#define JUNO_MISC_ACCESS_LOG_H_
+
+#include <stdint.h>
+
+#include <winsock2.h>
+
+#include <base/files/file_path.h>
+#include <base/synchronization/lock.h>
+#include <base/time/time.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "misc/timer_service.h"
+
+namespace base {
+
+class DictionaryValue;
+
+}  // namespace base
+
+namespace juno {
+namespace io {
+
+class Channel;
+
+}  // namespace io
+
+namespace misc {
+
+// Writes a JSON line for each request served, in files rotated by size and
+// age. A request ending only copies its record into a ring of the thread, so
+// that no I/O thread waits for another or for the disk; the rings are drained
+// in batches by a thread pool work, and records not fitting in a ring are
+// dropped and counted.
+class AccessLog : private TimerService::Callback {
+ public:
+  enum class Service {
+    kHttp,
+    kSocks,
+    kScissors,
+  };
+
+  static const size_t kMethodSize = 16;
+  static const size_t kHostSize = 256;
+
+  // A request, filled in by the session serving it. Strings are truncated to
+  // fit, so that it is copied without allocation.
+  struct Record {
+    Record();
+
+    bool IsStarted() const {
+      return !start_ticks.is_null();
+    }
+
+    // Starts the record of a request. The client and the bytes counted so
+    // far are kept, as they belong to the connection the request came on.
+    void Begin(Service service, const std::string& method);
+
+    // The peer of |channel|, if it is over a socket.
+    void SetClient(const io::Channel* channel);
+    void SetClient(const void* address, int length);
+    void SetHost(const std::string& host, int port);
+    // Of a sockaddr of IPv4 or IPv6.
+    void SetHost(const void* address);
+
+    // Marks the first byte of the response, unless marked already.
+    void Respond();
+
+    // Writes the record, if started, and clears it for the next request.
+    void End();
+    // Clears the record without writing it.
+    void Clear();
+
+    Service service;
+    // The status code of HTTP, the reply code of SOCKS, or the result of
+    // Scissors.
+    int status;
+    // Received from and sent to the client.
+    int64_t bytes_in;
+    int64_t bytes_out;
+    base::Time start_time;
+    base::TimeTicks start_ticks;
+    base::TimeDelta first_byte;
+    base::TimeDelta elapsed;
+    sockaddr_storage client;
+    char method[kMethodSize];
+    char host[kHostSize];
+  };
+
+  // The record of a tunnel, written when both directions are closed, that is
+  // when the last reference is released. Each direction is relayed by one
+  // session, counting its own bytes, so the counters are not shared.
+  class Tunnel {
+   public:
+    explicit Tunnel(const Record& record);
+    ~Tunnel();
+
+    void OnRelayed(bool from_client, int length) {
+      if (from_client)
+        record_.bytes_in += length;
+      else
+        record_.bytes_out += length;
+    }
+
+    // The tunnel has failed to start, and the owner of the record ends it.
+    void Discard() {
+      discarded_ = true;
+    }
+
+   private:
+    Record record_;
+    bool discarded_;
+
+    Tunnel(const Tunnel&) = delete;
+    Tunnel& operator=(const Tunnel&) = delete;
+  };
+
+  static HRESULT Init(const base::FilePath& directory);
+  static void Term();
+
+  static void Write(const Record& record);
+  static void GetStatistics(base::DictionaryValue* stats);
+
+ private:
+  class Ring;
+
+  static const size_t kRingSize = 512;
+  static const DWORD kFlushInterval = 500;               // 500 msec
+  static const int64_t kMaxFileSize = 32 * 1024 * 1024;  // 32 MiB
+  static const int64_t kMaxFileAge = 24;                 // 24 hours
+  static const size_t kMaxFiles = 10;
+
+  explicit AccessLog(const base::FilePath& directory);
+  ~AccessLog();
+
+  HRESULT Start();
+  void Stop();
+
+  void WriteImpl(const Record& record);
+  Ring* GetRing();
+
+  // Drains all the rings into the file.
+  void Flush();
+  void Format(const Record& record, std::string* line);
+  bool OpenFile();
+  void Rotate();
+  void DeleteOldFiles();
+
+  void GetStatisticsImpl(base::DictionaryValue* stats);
+
+  void OnTimeout() override;
+
+  static void CALLBACK OnWork(PTP_CALLBACK_INSTANCE instance, void* context,
+                              PTP_WORK work);
+
+  static AccessLog* instance_;
+  static std::atomic<uint32_t> last_generation_;
+
+  const base::FilePath directory_;
+  // Tells the rings of this instance from those of the previous ones.
+  const uint32_t generation_;
+
+  base::Lock lock_;
+  // Registered once for each thread, and removed once the thread has exited
+  // and the ring is drained.
+  std::vector<std::shared_ptr<Ring>> rings_;
+
+  // Held while writing, by either the timer or the work.
+  base::Lock write_lock_;
+  HANDLE file_;
+  int64_t file_size_;
+  base::Time file_time_;
+  std::string buffer_;
+
+  PTP_WORK work_;
+  std::atomic<bool> flush_requested_;
+  std::unique_ptr<TimerService::Timer> timer_;
+
+  std::atomic<uint64_t> written_;
+  std::atomic<uint64_t> dropped_;
+  std::atomic<uint64_t> rotations_;
+  std::atomic<uint64_t> errors_;
+
+  AccessLog(const AccessLog&) = delete;
+  AccessLog& operator=(const AccessLog&) = delete;
+};
+
+}  // namespace misc
+}  // namespace juno
+
+#endif  // JUNO_MISC_ACCESS_LOG_H_
@@ -0,0 +1,107 @@
+// Copyright (c) 2017 dacci.org
+
+#ifndef JUNO_MISC_COROUTINE_FRAME_ALLOCATOR_H_
+#define JUNO_MISC_COROUTINE_FRAME_ALLOCATOR_H_
+
+#include <stddef.h>
+
+namespace juno {
+namespace misc {
+namespace coroutine {
+
+// Bump allocator for coroutine frames owned by a single session. The region
+// is rewound when every frame carved out of it has been released. Requests
+// that do not fit fall back to the global heap.
+class FrameAllocator {
+ public:
+  // Makes |allocator| the one used for frames created on the current thread
+  // while the scope is alive.
+  class Scope {
+   public:
+    explicit Scope(FrameAllocator* allocator) : previous_(current_) {
+      current_ = allocator;
+    }
+
+    ~Scope() {
+      current_ = previous_;
+    }
+
+   private:
+    FrameAllocator* const previous_;
+
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+  };
+
+  static FrameAllocator* current() {
+    return current_;
+  }
+
+  void* Allocate(size_t size) {
+    size = (size + kAlignment - 1) & ~(kAlignment - 1);
+    if (capacity_ - used_ < size) {
+      ++fallbacks_;
+      return nullptr;
+    }
+
+    auto pointer = storage_ + used_;
+    used_ += size;
+    ++count_;
+
+    return pointer;
+  }
+
+  void Deallocate(void* /*pointer*/) {
+    if (--count_ == 0)
+      used_ = 0;
+  }
+
+  // Returns how many requests did not fit and went to the heap.
+  size_t fallbacks() const {
+    return fallbacks_;
+  }
+
+ protected:
+  static const size_t kAlignment = 16;
+
+  FrameAllocator(char* storage, size_t capacity)
+      : storage_(storage),
+        capacity_(capacity),
+        used_(0),
+        count_(0),
+        fallbacks_(0) {}
+  ~FrameAllocator() {}
+
+ private:
+  static __declspec(thread) FrameAllocator* current_;
+
+  char* const storage_;
+  const size_t capacity_;
+  size_t used_;
+  size_t count_;
+  size_t fallbacks_;
+
+  FrameAllocator(const FrameAllocator&) = delete;
+  FrameAllocator& operator=(const FrameAllocator&) = delete;
+};
+
+__declspec(selectany) __declspec(thread) FrameAllocator*
+    FrameAllocator::current_ = nullptr;
+
+template <size_t Size>
+class InlineFrameAllocator : public FrameAllocator {
+ public:
+  InlineFrameAllocator() : FrameAllocator(storage_, Size) {}
+
+ private:
+  __declspec(align(16)) char storage_[Size];
+
+  InlineFrameAllocator(const InlineFrameAllocator&) = delete;
+  InlineFrameAllocator& operator=(const InlineFrameAllocator&) = delete;
+};
+
+}  // namespace coroutine
+}  // namespace misc
+}  // namespace juno
+
+#endif  // JUNO_MISC_COROUTINE_FRAME_ALLOCATOR_H_
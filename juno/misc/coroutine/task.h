@@ -0,0 +1,131 @@
+// Copyright (c) 2017 dacci.org
+
+#ifndef JUNO_MISC_COROUTINE_TASK_H_
+#define JUNO_MISC_COROUTINE_TASK_H_
+
+#include <exception>
+#include <experimental/coroutine>
+#include <new>
+
+#include "misc/coroutine/frame_allocator.h"
+
+namespace juno {
+namespace misc {
+namespace coroutine {
+
+class __declspec(novtable) TaskOwner {
+ public:
+  virtual ~TaskOwner() {}
+
+  // Called after the frame of the task has been released, so the owner may
+  // delete itself (and the allocator the frame came from) from here.
+  virtual void OnTaskCompleted() = 0;
+};
+
+// Fire-and-forget coroutine. The body does not run until Start() is called,
+// and completion is reported to the owner instead of being awaited. The frame
+// is allocated from FrameAllocator::current() when one is in scope.
+class Task {
+ public:
+  struct promise_type;
+  typedef std::experimental::coroutine_handle<promise_type> Handle;
+
+  struct FinalAwaiter {
+    bool await_ready() const noexcept {
+      return false;
+    }
+
+    void await_suspend(Handle handle) noexcept {
+      auto owner = handle.promise().owner_;
+      handle.destroy();
+
+      if (owner != nullptr)
+        owner->OnTaskCompleted();
+    }
+
+    void await_resume() const noexcept {}
+  };
+
+  struct promise_type {
+    promise_type() : owner_(nullptr) {}
+
+    static void* operator new(size_t size) {
+      auto allocator = FrameAllocator::current();
+      auto total = size + kHeaderSize;
+
+      void* pointer = nullptr;
+      if (allocator != nullptr)
+        pointer = allocator->Allocate(total);
+
+      if (pointer == nullptr) {
+        allocator = nullptr;
+        pointer = ::operator new(total);
+      }
+
+      *static_cast<FrameAllocator**>(pointer) = allocator;
+      return static_cast<char*>(pointer) + kHeaderSize;
+    }
+
+    static void operator delete(void* frame) {
+      auto pointer = static_cast<char*>(frame) - kHeaderSize;
+      auto allocator = *reinterpret_cast<FrameAllocator**>(pointer);
+      if (allocator != nullptr)
+        allocator->Deallocate(pointer);
+      else
+        ::operator delete(pointer);
+    }
+
+    Task get_return_object() {
+      return Task(Handle::from_promise(*this));
+    }
+
+    std::experimental::suspend_always initial_suspend() const {
+      return {};
+    }
+
+    FinalAwaiter final_suspend() const noexcept {
+      return {};
+    }
+
+    void return_void() {}
+
+    void unhandled_exception() {
+      std::terminate();
+    }
+
+    TaskOwner* owner_;
+  };
+
+  Task(Task&& other) : handle_(other.handle_) {
+    other.handle_ = nullptr;
+  }
+
+  ~Task() {
+    if (handle_)
+      handle_.destroy();
+  }
+
+  void Start(TaskOwner* owner) {
+    auto handle = handle_;
+    handle_ = nullptr;
+
+    handle.promise().owner_ = owner;
+    handle.resume();
+  }
+
+ private:
+  static const size_t kHeaderSize = 16;
+
+  explicit Task(Handle handle) : handle_(handle) {}
+
+  Handle handle_;
+
+  Task(const Task&) = delete;
+  Task& operator=(const Task&) = delete;
+};
+
+}  // namespace coroutine
+}  // namespace misc
+}  // namespace juno
+
+#endif  // JUNO_MISC_COROUTINE_TASK_H_
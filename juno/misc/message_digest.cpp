@@ -0,0 +1,256 @@
+// Copyright (c) 2017 dacci.org
+
+#include "misc/message_digest.h"
+
+#include <string.h>
+
+namespace juno {
+namespace misc {
+namespace {
+
+const uint32_t kMd5Sines[64] = {
+    0xD76AA478, 0xE8C7B756, 0x242070DB, 0xC1BDCEEE, 0xF57C0FAF, 0x4787C62A,
+    0xA8304613, 0xFD469501, 0x698098D8, 0x8B44F7AF, 0xFFFF5BB1, 0x895CD7BE,
+    0x6B901122, 0xFD987193, 0xA679438E, 0x49B40821, 0xF61E2562, 0xC040B340,
+    0x265E5A51, 0xE9B6C7AA, 0xD62F105D, 0x02441453, 0xD8A1E681, 0xE7D3FBC8,
+    0x21E1CDE6, 0xC33707D6, 0xF4D50D87, 0x455A14ED, 0xA9E3E905, 0xFCEFA3F8,
+    0x676F02D9, 0x8D2A4C8A, 0xFFFA3942, 0x8771F681, 0x6D9D6122, 0xFDE5380C,
+    0xA4BEEA44, 0x4BDECFA9, 0xF6BB4B60, 0xBEBFBC70, 0x289B7EC6, 0xEAA127FA,
+    0xD4EF3085, 0x04881D05, 0xD9D4D039, 0xE6DB99E5, 0x1FA27CF8, 0xC4AC5665,
+    0xF4292244, 0x432AFF97, 0xAB9423A7, 0xFC93A039, 0x655B59C3, 0x8F0CCC92,
+    0xFFEFF47D, 0x85845DD1, 0x6FA87E4F, 0xFE2CE6E0, 0xA3014314, 0x4E0811A1,
+    0xF7537E82, 0xBD3AF235, 0x2AD7D2BB, 0xEB86D391,
+};
+
+const int kMd5Shifts[64] = {
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5, 9,  14, 20, 5, 9,  14, 20, 5, 9,  14, 20, 5, 9,  14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21,
+};
+
+const uint32_t kSha256Constants[64] = {
+    0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1,
+    0x923F82A4, 0xAB1C5ED5, 0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3,
+    0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174, 0xE49B69C1, 0xEFBE4786,
+    0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+    0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147,
+    0x06CA6351, 0x14292967, 0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13,
+    0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85, 0xA2BFE8A1, 0xA81A664B,
+    0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+    0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A,
+    0x5B9CCA4F, 0x682E6FF3, 0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208,
+    0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2,
+};
+
+inline uint32_t RotateLeft(uint32_t value, int count) {
+  return (value << count) | (value >> (32 - count));
+}
+
+inline uint32_t RotateRight(uint32_t value, int count) {
+  return (value >> count) | (value << (32 - count));
+}
+
+void TransformMd5(uint32_t* state, const uint8_t* block) {
+  uint32_t words[16];
+  for (auto i = 0; i < 16; ++i) {
+    words[i] = block[i * 4] | block[i * 4 + 1] << 8 | block[i * 4 + 2] << 16 |
+               static_cast<uint32_t>(block[i * 4 + 3]) << 24;
+  }
+
+  auto a = state[0], b = state[1], c = state[2], d = state[3];
+
+  for (auto i = 0; i < 64; ++i) {
+    uint32_t f;
+    int g;
+    switch (i / 16) {
+      case 0:
+        f = (b & c) | (~b & d);
+        g = i;
+        break;
+
+      case 1:
+        f = (d & b) | (~d & c);
+        g = (5 * i + 1) % 16;
+        break;
+
+      case 2:
+        f = b ^ c ^ d;
+        g = (3 * i + 5) % 16;
+        break;
+
+      default:
+        f = c ^ (b | ~d);
+        g = (7 * i) % 16;
+        break;
+    }
+
+    auto temp = d;
+    d = c;
+    c = b;
+    b += RotateLeft(a + f + kMd5Sines[i] + words[g], kMd5Shifts[i]);
+    a = temp;
+  }
+
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+}
+
+void TransformSha256(uint32_t* state, const uint8_t* block) {
+  uint32_t words[64];
+  for (auto i = 0; i < 16; ++i) {
+    words[i] = static_cast<uint32_t>(block[i * 4]) << 24 |
+               block[i * 4 + 1] << 16 | block[i * 4 + 2] << 8 |
+               block[i * 4 + 3];
+  }
+
+  for (auto i = 16; i < 64; ++i) {
+    auto s0 = RotateRight(words[i - 15], 7) ^ RotateRight(words[i - 15], 18) ^
+              (words[i - 15] >> 3);
+    auto s1 = RotateRight(words[i - 2], 17) ^ RotateRight(words[i - 2], 19) ^
+              (words[i - 2] >> 10);
+    words[i] = words[i - 16] + s0 + words[i - 7] + s1;
+  }
+
+  auto a = state[0], b = state[1], c = state[2], d = state[3];
+  auto e = state[4], f = state[5], g = state[6], h = state[7];
+
+  for (auto i = 0; i < 64; ++i) {
+    auto s1 = RotateRight(e, 6) ^ RotateRight(e, 11) ^ RotateRight(e, 25);
+    auto choice = (e & f) ^ (~e & g);
+    auto temp1 = h + s1 + choice + kSha256Constants[i] + words[i];
+    auto s0 = RotateRight(a, 2) ^ RotateRight(a, 13) ^ RotateRight(a, 22);
+    auto majority = (a & b) ^ (a & c) ^ (b & c);
+    auto temp2 = s0 + majority;
+
+    h = g;
+    g = f;
+    f = e;
+    e = d + temp1;
+    d = c;
+    c = b;
+    b = a;
+    a = temp1 + temp2;
+  }
+
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+  state[4] += e;
+  state[5] += f;
+  state[6] += g;
+  state[7] += h;
+}
+
+typedef void (*Transform)(uint32_t* state, const uint8_t* block);
+
+// Both hashes pad the message the same way, only the byte order of the
+// length differs.
+void Append(Transform transform, uint32_t* state, uint8_t* buffer,
+            uint64_t* total, const void* data, size_t length) {
+  auto input = static_cast<const uint8_t*>(data);
+  auto used = static_cast<size_t>(*total % 64);
+  *total += length;
+
+  if (used > 0) {
+    auto count = 64 - used;
+    if (length < count) {
+      memcpy(buffer + used, input, length);
+      return;
+    }
+
+    memcpy(buffer + used, input, count);
+    transform(state, buffer);
+    input += count;
+    length -= count;
+  }
+
+  for (; length >= 64; input += 64, length -= 64)
+    transform(state, input);
+
+  if (length > 0)
+    memcpy(buffer, input, length);
+}
+
+void Pad(Transform transform, uint32_t* state, uint8_t* buffer, uint64_t total,
+         bool big_endian) {
+  auto used = static_cast<size_t>(total % 64);
+  buffer[used++] = 0x80;
+
+  if (used > 56) {
+    memset(buffer + used, 0, 64 - used);
+    transform(state, buffer);
+    used = 0;
+  }
+  memset(buffer + used, 0, 56 - used);
+
+  auto bits = total * 8;
+  for (auto i = 0; i < 8; ++i) {
+    auto shift = big_endian ? 56 - i * 8 : i * 8;
+    buffer[56 + i] = static_cast<uint8_t>(bits >> shift);
+  }
+
+  transform(state, buffer);
+}
+
+}  // namespace
+
+Md5::Md5() {
+  Reset();
+}
+
+void Md5::Update(const void* data, size_t length) {
+  Append(TransformMd5, state_, buffer_, &length_, data, length);
+}
+
+void Md5::Final(uint8_t* digest) {
+  Pad(TransformMd5, state_, buffer_, length_, false);
+
+  for (auto i = 0; i < 16; ++i)
+    digest[i] = static_cast<uint8_t>(state_[i / 4] >> (i % 4 * 8));
+
+  Reset();
+}
+
+void Md5::Reset() {
+  state_[0] = 0x67452301;
+  state_[1] = 0xEFCDAB89;
+  state_[2] = 0x98BADCFE;
+  state_[3] = 0x10325476;
+  length_ = 0;
+}
+
+Sha256::Sha256() {
+  Reset();
+}
+
+void Sha256::Update(const void* data, size_t length) {
+  Append(TransformSha256, state_, buffer_, &length_, data, length);
+}
+
+void Sha256::Final(uint8_t* digest) {
+  Pad(TransformSha256, state_, buffer_, length_, true);
+
+  for (auto i = 0; i < 32; ++i)
+    digest[i] = static_cast<uint8_t>(state_[i / 4] >> (24 - i % 4 * 8));
+
+  Reset();
+}
+
+void Sha256::Reset() {
+  state_[0] = 0x6A09E667;
+  state_[1] = 0xBB67AE85;
+  state_[2] = 0x3C6EF372;
+  state_[3] = 0xA54FF53A;
+  state_[4] = 0x510E527F;
+  state_[5] = 0x9B05688C;
+  state_[6] = 0x1F83D9AB;
+  state_[7] = 0x5BE0CD19;
+  length_ = 0;
+}
+
+}  // namespace misc
+}  // namespace juno
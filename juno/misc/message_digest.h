@@ -0,0 +1,69 @@
+// Copyright (c) 2017 dacci.org
+
+#ifndef JUNO_MISC_MESSAGE_DIGEST_H_
+#define JUNO_MISC_MESSAGE_DIGEST_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+namespace juno {
+namespace misc {
+
+// MD5, RFC 1321. Holds no handle, so it costs nothing to create one.
+class Md5 {
+ public:
+  static const size_t kSize = 16;
+
+  Md5();
+
+  void Update(const void* data, size_t length);
+  void Update(const std::string& data) {
+    Update(data.data(), data.size());
+  }
+
+  // Writes kSize bytes to |digest|. The object is reset to hash again.
+  void Final(uint8_t* digest);
+
+ private:
+  void Reset();
+
+  uint32_t state_[4];
+  uint64_t length_;
+  uint8_t buffer_[64];
+
+  Md5(const Md5&) = delete;
+  Md5& operator=(const Md5&) = delete;
+};
+
+// SHA-256, FIPS 180-4.
+class Sha256 {
+ public:
+  static const size_t kSize = 32;
+
+  Sha256();
+
+  void Update(const void* data, size_t length);
+  void Update(const std::string& data) {
+    Update(data.data(), data.size());
+  }
+
+  // Writes kSize bytes to |digest|. The object is reset to hash again.
+  void Final(uint8_t* digest);
+
+ private:
+  void Reset();
+
+  uint32_t state_[8];
+  uint64_t length_;
+  uint8_t buffer_[64];
+
+  Sha256(const Sha256&) = delete;
+  Sha256& operator=(const Sha256&) = delete;
+};
+
+}  // namespace misc
+}  // namespace juno
+
+#endif  // JUNO_MISC_MESSAGE_DIGEST_H_
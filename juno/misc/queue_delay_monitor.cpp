@@ -0,0 +1,104 @@
+// Copyright (c) 2017 dacci.org
+
+#include "misc/queue_delay_monitor.h"
+
+#include <base/logging.h>
+
+#include <algorithm>
+
+namespace juno {
+namespace misc {
+
+QueueDelayMonitor* QueueDelayMonitor::instance_ = nullptr;
+
+HRESULT QueueDelayMonitor::Init() {
+  Term();
+
+  instance_ = new QueueDelayMonitor();
+  if (instance_ == nullptr)
+    return E_OUTOFMEMORY;
+
+  auto result = instance_->Start();
+  if (FAILED(result))
+    Term();
+
+  return result;
+}
+
+void QueueDelayMonitor::Term() {
+  if (instance_ != nullptr) {
+    delete instance_;
+    instance_ = nullptr;
+  }
+}
+
+DWORD QueueDelayMonitor::GetDelay() {
+  if (instance_ == nullptr)
+    return 0;
+
+  return instance_->GetDelayImpl();
+}
+
+QueueDelayMonitor::QueueDelayMonitor()
+    : work_(nullptr), submitted_(0), delay_(0) {}
+
+QueueDelayMonitor::~QueueDelayMonitor() {
+  timer_.reset();
+
+  if (work_ != nullptr) {
+    WaitForThreadpoolWorkCallbacks(work_, FALSE);
+    CloseThreadpoolWork(work_);
+    work_ = nullptr;
+  }
+}
+
+HRESULT QueueDelayMonitor::Start() {
+  work_ = CreateThreadpoolWork(OnProbe, this, nullptr);
+  if (work_ == nullptr) {
+    auto error = GetLastError();
+    LOG(ERROR) << "Failed to create work: " << error;
+    return HRESULT_FROM_WIN32(error);
+  }
+
+  timer_ = TimerService::GetDefault()->Create(this);
+  if (timer_ == nullptr) {
+    LOG(ERROR) << "Failed to create timer.";
+    return E_OUTOFMEMORY;
+  }
+
+  timer_->Start(kInterval, kInterval);
+
+  return S_OK;
+}
+
+DWORD QueueDelayMonitor::GetDelayImpl() const {
+  // While a probe is still waiting, its age is a lower bound of the delay.
+  DWORD pending = 0;
+  auto submitted = submitted_.load();
+  if (submitted != 0)
+    pending = static_cast<DWORD>(GetTickCount64() - submitted);
+
+  return std::max(delay_.load(), pending);
+}
+
+void QueueDelayMonitor::OnTimeout() {
+  ULONGLONG expected = 0;
+  if (submitted_.compare_exchange_strong(expected, GetTickCount64()))
+    SubmitThreadpoolWork(work_);
+}
+
+void CALLBACK QueueDelayMonitor::OnProbe(PTP_CALLBACK_INSTANCE /*instance*/,
+                                         void* context, PTP_WORK /*work*/) {
+  auto monitor = static_cast<QueueDelayMonitor*>(context);
+
+  auto sample =
+      static_cast<DWORD>(GetTickCount64() - monitor->submitted_.load());
+  monitor->submitted_.store(0);
+
+  // Exponentially weighted, 1/4 of the new sample.
+  auto delay = monitor->delay_.load();
+  monitor->delay_.store(delay - delay / 4 + sample / 4);
+}
+
+}  // namespace misc
+}  // namespace juno
@@ -0,0 +1,58 @@
+// Copyright (c) 2017 dacci.org
+
+#ifndef JUNO_MISC_QUEUE_DELAY_MONITOR_H_
+#define JUNO_MISC_QUEUE_DELAY_MONITOR_H_
+
+#include <windows.h>
+
+#include <atomic>
+#include <memory>
+
+#include "misc/timer_service.h"
+
+namespace juno {
+namespace misc {
+
+// Periodically submits a probe to the default thread pool and measures how
+// long it waits before running. The delay is the earliest sign of overload,
+// since every I/O completion of the process goes through the same queue.
+class QueueDelayMonitor : private TimerService::Callback {
+ public:
+  static HRESULT Init();
+  static void Term();
+
+  // Returns the smoothed queue delay in milliseconds, or 0 if the monitor is
+  // not running.
+  static DWORD GetDelay();
+
+ private:
+  static const DWORD kInterval = 100;  // 100 msec
+
+  QueueDelayMonitor();
+  ~QueueDelayMonitor();
+
+  HRESULT Start();
+  DWORD GetDelayImpl() const;
+
+  void OnTimeout() override;
+
+  static void CALLBACK OnProbe(PTP_CALLBACK_INSTANCE instance, void* context,
+                               PTP_WORK work);
+
+  static QueueDelayMonitor* instance_;
+
+  PTP_WORK work_;
+  std::unique_ptr<TimerService::Timer> timer_;
+
+  // Tick count when the probe in flight was submitted, 0 if none.
+  std::atomic<ULONGLONG> submitted_;
+  std::atomic<DWORD> delay_;
+
+  QueueDelayMonitor(const QueueDelayMonitor&) = delete;
+  QueueDelayMonitor& operator=(const QueueDelayMonitor&) = delete;
+};
+
+}  // namespace misc
+}  // namespace juno
+
+#endif  // JUNO_MISC_QUEUE_DELAY_MONITOR_H_
@@ -0,0 +1,128 @@
+// Copyright (c) 2017 dacci.org
+
+#ifndef JUNO_MISC_RECLAMATION_QUEUE_H_
+#define JUNO_MISC_RECLAMATION_QUEUE_H_
+
+#include <windows.h>
+
+#include <base/logging.h>
+#include <base/synchronization/lock.h>
+
+#include <atomic>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "misc/timer_service.h"
+
+namespace juno {
+namespace misc {
+
+// Intrusive hook for objects retired through a ReclamationQueue. Retiring the
+// same object more than once is ignored.
+class ReclamationEntry {
+ protected:
+  ReclamationEntry() : retired_(false) {}
+  ~ReclamationEntry() {}
+
+ private:
+  template <class T, class Owner>
+  friend class ReclamationQueue;
+
+  std::atomic<bool> retired_;
+};
+
+// Collects retired objects and hands them to the owner in batches from a
+// timer tick, instead of one thread-pool callback per object. Retire() takes
+// only the lock of the queue, so it can be called with any other lock held.
+//
+// Owner must provide the following member, which moves the ownership of every
+// item in |items| that is safe to destroy into |reclaimed| and removes it from
+// |items|. Items left in |items| are retried on the next tick.
+//
+//   void Reclaim(std::vector<T*>* items,
+//                std::vector<std::unique_ptr<T>>* reclaimed);
+template <class T, class Owner>
+class ReclamationQueue : private TimerService::Callback {
+ public:
+  explicit ReclamationQueue(Owner* owner)
+      : owner_(owner),
+        timer_(TimerService::GetDefault()->Create(this)),
+        scheduled_(false) {}
+
+  ~ReclamationQueue() {
+    timer_.reset();
+    DCHECK(pending_.empty());
+  }
+
+  void Retire(T* item) {
+    ReclamationEntry* entry = item;
+    if (entry->retired_.exchange(true))
+      return;
+
+    base::AutoLock guard(lock_);
+
+    pending_.push_back(item);
+    Schedule();
+  }
+
+ private:
+  static const DWORD kDelay = 10;  // 10 msec
+
+  void Schedule() {
+    lock_.AssertAcquired();
+
+    if (scheduled_)
+      return;
+
+    scheduled_ = true;
+
+    if (timer_ != nullptr)
+      timer_->Start(kDelay, 0);
+    else if (!TrySubmitThreadpoolCallback(OnTick, this, nullptr))
+      LOG(FATAL) << "Failed to schedule reclamation.";
+  }
+
+  static void CALLBACK OnTick(PTP_CALLBACK_INSTANCE /*instance*/,
+                              void* context) {
+    static_cast<ReclamationQueue*>(context)->OnTimeout();
+  }
+
+  // Only one tick runs at a time; scheduled_ stays set until the batch has
+  // been handed back, so Retire() does not schedule another one meanwhile.
+  void OnTimeout() override {
+    lock_.Acquire();
+    batch_.swap(pending_);
+    lock_.Release();
+
+    owner_->Reclaim(&batch_, &reclaimed_);
+    reclaimed_.clear();
+
+    base::AutoLock guard(lock_);
+
+    pending_.insert(pending_.end(), batch_.begin(), batch_.end());
+    batch_.clear();
+
+    scheduled_ = false;
+    if (!pending_.empty())
+      Schedule();
+  }
+
+  Owner* const owner_;
+  std::unique_ptr<TimerService::Timer> timer_;
+
+  base::Lock lock_;
+  bool scheduled_;
+  std::vector<T*> pending_;
+
+  std::vector<T*> batch_;
+  std::vector<std::unique_ptr<T>> reclaimed_;
+
+  ReclamationQueue(const ReclamationQueue&) = delete;
+  ReclamationQueue& operator=(const ReclamationQueue&) = delete;
+};
+
+}  // namespace misc
+}  // namespace juno
+
+#endif  // JUNO_MISC_RECLAMATION_QUEUE_H_
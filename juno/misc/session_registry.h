@@ -0,0 +1,109 @@
+// Copyright (c) 2017 dacci.org
+
+#ifndef JUNO_MISC_SESSION_REGISTRY_H_
+#define JUNO_MISC_SESSION_REGISTRY_H_
+
+#include <stddef.h>
+
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace juno {
+namespace misc {
+
+// Intrusive hook for objects owned by a SessionRegistry. It records the slot
+// the object occupies so that it can be removed without searching.
+class RegistryEntry {
+ protected:
+  RegistryEntry() : registry_index_(kNotRegistered) {}
+  ~RegistryEntry() {}
+
+ private:
+  template <class T>
+  friend class SessionRegistry;
+
+  static const size_t kNotRegistered = static_cast<size_t>(-1);
+
+  size_t registry_index_;
+};
+
+// Dense slot map owning sessions. Add() and Remove() take constant time; the
+// hole left by a removal is filled by the last element, so the order of the
+// iteration is not stable. Not thread-safe; callers keep using the lock of
+// their service, which is now held for a constant amount of work only.
+template <class T>
+class SessionRegistry {
+ public:
+  typedef typename std::vector<std::unique_ptr<T>>::iterator iterator;
+  typedef typename std::vector<std::unique_ptr<T>>::const_iterator
+      const_iterator;
+
+  SessionRegistry() {}
+
+  void Add(std::unique_ptr<T>&& entry) {
+    RegistryEntry* hook = entry.get();
+    hook->registry_index_ = entries_.size();
+    entries_.push_back(std::move(entry));
+  }
+
+  // Returns nullptr if |entry| is not owned by this registry.
+  std::unique_ptr<T> Remove(T* entry) {
+    RegistryEntry* hook = entry;
+    auto index = hook->registry_index_;
+    if (index >= entries_.size() || entries_[index].get() != entry)
+      return nullptr;
+
+    std::unique_ptr<T> removed = std::move(entries_[index]);
+    if (index != entries_.size() - 1) {
+      entries_[index] = std::move(entries_.back());
+      static_cast<RegistryEntry*>(entries_[index].get())->registry_index_ =
+          index;
+    }
+    entries_.pop_back();
+
+    hook->registry_index_ = RegistryEntry::kNotRegistered;
+    return removed;
+  }
+
+  bool Contains(const T* entry) const {
+    const RegistryEntry* hook = entry;
+    return hook->registry_index_ < entries_.size() &&
+           entries_[hook->registry_index_].get() == entry;
+  }
+
+  bool empty() const {
+    return entries_.empty();
+  }
+
+  size_t size() const {
+    return entries_.size();
+  }
+
+  iterator begin() {
+    return entries_.begin();
+  }
+
+  iterator end() {
+    return entries_.end();
+  }
+
+  const_iterator begin() const {
+    return entries_.begin();
+  }
+
+  const_iterator end() const {
+    return entries_.end();
+  }
+
+ private:
+  std::vector<std::unique_ptr<T>> entries_;
+
+  SessionRegistry(const SessionRegistry&) = delete;
+  SessionRegistry& operator=(const SessionRegistry&) = delete;
+};
+
+}  // namespace misc
+}  // namespace juno
+
+#endif  // JUNO_MISC_SESSION_REGISTRY_H_
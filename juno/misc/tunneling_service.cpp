@@ -13,10 +13,13 @@ using ::juno::io::Channel;
 
 TunnelingService* TunnelingService::instance_ = nullptr;
 
-class TunnelingService::Session : public Channel::Listener {
+class TunnelingService::Session : public RegistryEntry,
+                                  public ReclamationEntry,
+                                  public Channel::Listener {
  public:
   Session(TunnelingService* service, const std::shared_ptr<Channel>& from,
-          const std::shared_ptr<Channel>& to);
+          const std::shared_ptr<Channel>& to,
+          const std::shared_ptr<AccessLog::Tunnel>& log, bool from_client);
   ~Session();
 
   HRESULT Start();
@@ -29,6 +32,9 @@ class TunnelingService::Session : public Channel::Listener {
   TunnelingService* service_;
   std::shared_ptr<Channel> from_;
   std::shared_ptr<Channel> to_;
+  // Shared with the session of the other direction.
+  std::shared_ptr<AccessLog::Tunnel> log_;
+  const bool from_client_;
   char buffer_[65535];
 
  private:
@@ -54,19 +60,39 @@ void TunnelingService::Term() {
 }
 
 bool TunnelingService::Bind(const std::shared_ptr<Channel>& a,
-                            const std::shared_ptr<Channel>& b) {
+                            const std::shared_ptr<Channel>& b,
+                            AccessLog::Record* record) {
   if (instance_ == nullptr)
     return false;
 
+  std::shared_ptr<AccessLog::Tunnel> log;
+  if (record != nullptr && record->IsStarted()) {
+    log = std::make_shared<AccessLog::Tunnel>(*record);
+    if (log == nullptr)
+      return false;
+  }
+
   base::AutoLock guard(instance_->lock_);
 
   if (instance_->stopped_)
     return false;
 
-  return instance_->BindSocket(a, b) && instance_->BindSocket(b, a);
+  if (!instance_->BindSocket(a, b, log, true) ||
+      !instance_->BindSocket(b, a, log, false)) {
+    if (log != nullptr)
+      log->Discard();
+
+    return false;
+  }
+
+  if (record != nullptr)
+    record->Clear();
+
+  return true;
 }
 
-TunnelingService::TunnelingService() : empty_(&lock_), stopped_() {}
+TunnelingService::TunnelingService()
+    : empty_(&lock_), stopped_(), reclamation_(this) {}
 
 TunnelingService::~TunnelingService() {
   base::AutoLock guard(lock_);
@@ -82,65 +108,53 @@ TunnelingService::~TunnelingService() {
     empty_.Wait();
 }
 
-bool TunnelingService::BindSocket(const std::shared_ptr<Channel>& from,
-                                  const std::shared_ptr<Channel>& to) {
+bool TunnelingService::BindSocket(
+    const std::shared_ptr<Channel>& from, const std::shared_ptr<Channel>& to,
+    const std::shared_ptr<AccessLog::Tunnel>& log, bool from_client) {
   CHECK(!stopped_);
   lock_.AssertAcquired();
 
-  auto session = std::make_unique<Session>(this, from, to);
+  auto session = std::make_unique<Session>(this, from, to, log, from_client);
   if (session == nullptr)
     return false;
 
   if (FAILED(session->Start()))
     return false;
 
-  sessions_.push_back(std::move(session));
+  sessions_.Add(std::move(session));
 
   return true;
 }
 
 void TunnelingService::EndSession(Session* session) {
-  auto pair = new ServiceSessionPair(this, session);
-  if (pair == nullptr ||
-      !TrySubmitThreadpoolCallback(EndSessionImpl, pair, nullptr)) {
-    delete pair;
-    EndSessionImpl(session);
-  }
+  reclamation_.Retire(session);
 }
 
-void CALLBACK TunnelingService::EndSessionImpl(
-    PTP_CALLBACK_INSTANCE /*instance*/, void* param) {
-  auto pair = static_cast<ServiceSessionPair*>(param);
-  pair->first->EndSessionImpl(pair->second);
-  delete pair;
-}
-
-void TunnelingService::EndSessionImpl(Session* session) {
-  std::unique_ptr<Session> removed;
-
-  lock_.Acquire();
-
-  for (auto i = sessions_.begin(), l = sessions_.end(); i != l; ++i) {
-    if (i->get() == session) {
-      removed = std::move(*i);
-      sessions_.erase(i);
-
-      if (sessions_.empty())
-        empty_.Broadcast();
+void TunnelingService::Reclaim(
+    std::vector<Session*>* sessions,
+    std::vector<std::unique_ptr<Session>>* reclaimed) {
+  base::AutoLock guard(lock_);
 
-      break;
-    }
+  for (auto session : *sessions) {
+    auto removed = sessions_.Remove(session);
+    if (removed != nullptr)
+      reclaimed->push_back(std::move(removed));
   }
+  sessions->clear();
 
-  lock_.Release();
-
-  removed.reset();
+  if (!reclaimed->empty() && sessions_.empty())
+    empty_.Broadcast();
 }
 
-TunnelingService::Session::Session(TunnelingService* service,
-                                   const std::shared_ptr<Channel>& from,
-                                   const std::shared_ptr<Channel>& to)
-    : service_(service), from_(from), to_(to) {}
+TunnelingService::Session::Session(
+    TunnelingService* service, const std::shared_ptr<Channel>& from,
+    const std::shared_ptr<Channel>& to,
+    const std::shared_ptr<AccessLog::Tunnel>& log, bool from_client)
+    : service_(service),
+      from_(from),
+      to_(to),
+      log_(log),
+      from_client_(from_client) {}
 
 TunnelingService::Session::~Session() {
   from_->Close();
@@ -165,6 +179,9 @@ void TunnelingService::Session::OnRead(Channel* /*channel*/, HRESULT result,
 void TunnelingService::Session::OnWritten(Channel* /*channel*/, HRESULT result,
                                           void* /*buffer*/, int length) {
   if (SUCCEEDED(result) && length > 0) {
+    if (log_ != nullptr)
+      log_->OnRelayed(from_client_, length);
+
     result = from_->ReadAsync(buffer_, sizeof(buffer_), this);
     if (SUCCEEDED(result))
       return;
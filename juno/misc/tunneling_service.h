@@ -9,10 +9,12 @@
 #include <base/synchronization/lock.h>
 
 #include <memory>
-#include <utility>
 #include <vector>
 
 #include "io/channel.h"
+#include "misc/access_log.h"
+#include "misc/reclamation_queue.h"
+#include "misc/session_registry.h"
 
 namespace juno {
 namespace misc {
@@ -21,24 +23,29 @@ class TunnelingService {
  public:
   static HRESULT Init();
   static void Term();
+  // Relays between |a|, the client, and |b|. If |record| is given and
+  // started, it is taken over and written when the tunnel is closed, with the
+  // bytes relayed; it is left as it is if failed to bind.
   static bool Bind(const std::shared_ptr<io::Channel>& a,
-                   const std::shared_ptr<io::Channel>& b);
+                   const std::shared_ptr<io::Channel>& b,
+                   AccessLog::Record* record = nullptr);
 
  private:
   class Session;
 
-  typedef std::pair<TunnelingService*, Session*> ServiceSessionPair;
+  friend class ReclamationQueue<Session, TunnelingService>;
 
   TunnelingService();
   ~TunnelingService();
 
   bool BindSocket(const std::shared_ptr<io::Channel>& from,
-                  const std::shared_ptr<io::Channel>& to);
+                  const std::shared_ptr<io::Channel>& to,
+                  const std::shared_ptr<AccessLog::Tunnel>& log,
+                  bool from_client);
 
   void EndSession(Session* session);
-  static void CALLBACK EndSessionImpl(PTP_CALLBACK_INSTANCE instance,
-                                      void* param);
-  void EndSessionImpl(Session* session);
+  void Reclaim(std::vector<Session*>* sessions,
+               std::vector<std::unique_ptr<Session>>* reclaimed);
 
   static TunnelingService* instance_;
 
@@ -46,7 +53,8 @@ class TunnelingService {
   base::ConditionVariable empty_;
   bool stopped_;
 
-  std::vector<std::unique_ptr<Session>> sessions_;
+  SessionRegistry<Session> sessions_;
+  ReclamationQueue<Session, TunnelingService> reclamation_;
 
   TunnelingService(const TunnelingService&) = delete;
   TunnelingService& operator=(const TunnelingService&) = delete;
@@ -0,0 +1,99 @@
+// Copyright (c) 2017 dacci.org
+
+#include "service/admission_controller.h"
+
+#include <base/values.h>
+
+#include <algorithm>
+
+#include "misc/queue_delay_monitor.h"
+
+namespace juno {
+namespace service {
+
+AdmissionController::AdmissionController()
+    : max_sessions_(0),
+      max_rate_(0),
+      max_queue_delay_(0),
+      tokens_(0.0),
+      last_refill_(0),
+      admitted_(0),
+      too_many_sessions_(0),
+      rate_limited_(0),
+      overloaded_(0) {}
+
+void AdmissionController::SetLimits(int max_sessions, int max_rate,
+                                    int max_queue_delay) {
+  base::AutoLock guard(lock_);
+
+  max_sessions_ = std::max(max_sessions, 0);
+  max_rate_ = std::max(max_rate, 0);
+  max_queue_delay_ = std::max(max_queue_delay, 0);
+
+  // Allows a burst of one second worth of admissions.
+  tokens_ = max_rate_;
+  last_refill_ = GetTickCount64();
+}
+
+AdmissionController::Decision AdmissionController::Admit(size_t sessions) {
+  base::AutoLock guard(lock_);
+
+  if (max_sessions_ > 0 && sessions >= static_cast<size_t>(max_sessions_)) {
+    ++too_many_sessions_;
+    return Decision::kTooManySessions;
+  }
+
+  if (max_queue_delay_ > 0 && misc::QueueDelayMonitor::GetDelay() >
+                                  static_cast<DWORD>(max_queue_delay_)) {
+    ++overloaded_;
+    return Decision::kOverloaded;
+  }
+
+  if (max_rate_ > 0) {
+    Refill(GetTickCount64());
+
+    if (tokens_ < 1.0) {
+      ++rate_limited_;
+      return Decision::kRateLimited;
+    }
+
+    tokens_ -= 1.0;
+  }
+
+  ++admitted_;
+  return Decision::kAdmit;
+}
+
+DWORD AdmissionController::GetRetryDelay() const {
+  base::AutoLock guard(lock_);
+
+  if (max_rate_ > 0 && tokens_ < 1.0) {
+    auto delay = static_cast<DWORD>((1.0 - tokens_) * 1000.0 / max_rate_);
+    return std::max(delay, static_cast<DWORD>(1));
+  }
+
+  return kOverloadBackoff;
+}
+
+void AdmissionController::GetStatistics(base::DictionaryValue* stats) const {
+  base::AutoLock guard(lock_);
+
+  stats->SetDouble("admitted", static_cast<double>(admitted_));
+  stats->SetDouble("too_many_sessions",
+                   static_cast<double>(too_many_sessions_));
+  stats->SetDouble("rate_limited", static_cast<double>(rate_limited_));
+  stats->SetDouble("overloaded", static_cast<double>(overloaded_));
+}
+
+void AdmissionController::Refill(ULONGLONG now) {
+  lock_.AssertAcquired();
+
+  auto elapsed = now - last_refill_;
+  last_refill_ = now;
+
+  tokens_ = std::min(tokens_ + elapsed * max_rate_ / 1000.0,
+                     static_cast<double>(max_rate_));
+}
+
+}  // namespace service
+}  // namespace juno
@@ -0,0 +1,73 @@
+// Copyright (c) 2017 dacci.org
+
+#ifndef JUNO_SERVICE_ADMISSION_CONTROLLER_H_
+#define JUNO_SERVICE_ADMISSION_CONTROLLER_H_
+
+#include <windows.h>
+
+#include <base/synchronization/lock.h>
+
+#include <stdint.h>
+
+namespace base {
+
+class DictionaryValue;
+
+}  // namespace base
+
+namespace juno {
+namespace service {
+
+// Decides whether new work is admitted, based on the number of sessions, a
+// token bucket of the admission rate and the queue delay of the thread pool.
+// A limit of zero disables the respective check.
+class AdmissionController {
+ public:
+  enum class Decision {
+    kAdmit,
+    kTooManySessions,
+    kRateLimited,
+    kOverloaded,
+  };
+
+  AdmissionController();
+
+  // |max_rate| is in admissions per second, |max_queue_delay| in msec.
+  void SetLimits(int max_sessions, int max_rate, int max_queue_delay);
+
+  // |sessions| is the number of sessions currently alive.
+  Decision Admit(size_t sessions);
+
+  // Returns the time in msec after which Admit() may succeed again if it was
+  // refused by the rate or the queue delay.
+  DWORD GetRetryDelay() const;
+
+  void GetStatistics(base::DictionaryValue* stats) const;
+
+ private:
+  static const DWORD kOverloadBackoff = 100;  // 100 msec
+
+  void Refill(ULONGLONG now);
+
+  mutable base::Lock lock_;
+
+  int max_sessions_;
+  int max_rate_;
+  int max_queue_delay_;
+
+  double tokens_;
+  ULONGLONG last_refill_;
+
+  uint64_t admitted_;
+  uint64_t too_many_sessions_;
+  uint64_t rate_limited_;
+  uint64_t overloaded_;
+
+  AdmissionController(const AdmissionController&) = delete;
+  AdmissionController& operator=(const AdmissionController&) = delete;
+};
+
+}  // namespace service
+}  // namespace juno
+
+#endif  // JUNO_SERVICE_ADMISSION_CONTROLLER_H_
@@ -0,0 +1,1904 @@
+// Copyright (c) 2017 dacci.org
+
+#include "service/http/http2_connection.h"
+
+#include <base/logging.h>
+
+#include <string.h>
+
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <utility>
+
+#include "service/http/http_chunked_decoder.h"
+#include "service/http/http_request.h"
+#include "service/http/http_response.h"
+#include "service/http/http_status.h"
+#include "service/http/http_util.h"
+
+namespace juno {
+namespace service {
+namespace http {
+
+namespace {
+
+enum FrameType : uint8_t {
+  kData = 0x0,
+  kHeaders = 0x1,
+  kPriority = 0x2,
+  kRstStream = 0x3,
+  kSettings = 0x4,
+  kPushPromise = 0x5,
+  kPing = 0x6,
+  kGoAway = 0x7,
+  kWindowUpdate = 0x8,
+  kContinuation = 0x9,
+};
+
+const uint8_t kEndStreamFlag = 0x01;
+const uint8_t kAckFlag = 0x01;
+const uint8_t kEndHeadersFlag = 0x04;
+const uint8_t kPaddedFlag = 0x08;
+const uint8_t kPriorityFlag = 0x20;
+
+enum ErrorCode : uint32_t {
+  kNoError = 0x0,
+  kProtocolError = 0x1,
+  kInternalError = 0x2,
+  kFlowControlError = 0x3,
+  kStreamClosed = 0x5,
+  kFrameSizeError = 0x6,
+  kRefusedStream = 0x7,
+  kCancel = 0x8,
+  kCompressionError = 0x9,
+  kEnhanceYourCalm = 0xB,
+};
+
+enum SettingId : uint16_t {
+  kSettingsHeaderTableSize = 0x1,
+  kSettingsEnablePush = 0x2,
+  kSettingsMaxConcurrentStreams = 0x3,
+  kSettingsInitialWindowSize = 0x4,
+  kSettingsMaxFrameSize = 0x5,
+  kSettingsMaxHeaderListSize = 0x6,
+};
+
+const size_t kFrameHeaderSize = 9;
+const size_t kMaxFrameSizeLimit = 0xFFFFFF;
+const int64_t kDefaultWindowSize = 65535;
+const int64_t kMaxWindowSize = 0x7FFFFFFF;
+
+// Each header field costs this in addition to its strings.
+const size_t kFieldOverhead = 32;
+
+inline uint16_t ReadUint16(const char* data) {
+  auto bytes = reinterpret_cast<const uint8_t*>(data);
+  return static_cast<uint16_t>(bytes[0] << 8 | bytes[1]);
+}
+
+inline uint32_t ReadUint24(const char* data) {
+  auto bytes = reinterpret_cast<const uint8_t*>(data);
+  return static_cast<uint32_t>(bytes[0]) << 16 | bytes[1] << 8 | bytes[2];
+}
+
+inline uint32_t ReadUint32(const char* data) {
+  auto bytes = reinterpret_cast<const uint8_t*>(data);
+  return static_cast<uint32_t>(bytes[0]) << 24 | bytes[1] << 16 |
+         bytes[2] << 8 | bytes[3];
+}
+
+inline void AppendUint16(std::string* output, uint16_t value) {
+  output->push_back(static_cast<char>(value >> 8));
+  output->push_back(static_cast<char>(value));
+}
+
+inline void AppendUint32(std::string* output, uint32_t value) {
+  output->push_back(static_cast<char>(value >> 24));
+  output->push_back(static_cast<char>(value >> 16));
+  output->push_back(static_cast<char>(value >> 8));
+  output->push_back(static_cast<char>(value));
+}
+
+void AppendSetting(std::string* output, uint16_t id, uint32_t value) {
+  AppendUint16(output, id);
+  AppendUint32(output, value);
+}
+
+// Connection-specific fields, which HTTP/2 does not carry. RFC 9113 8.2.2
+bool IsConnectionSpecific(const std::string& name) {
+  return name.compare("connection") == 0 || name.compare("keep-alive") == 0 ||
+         name.compare("proxy-connection") == 0 ||
+         name.compare("transfer-encoding") == 0 ||
+         name.compare("upgrade") == 0;
+}
+
+// Field names must be in lower case, and neither names nor values may break
+// the HTTP/1.1 message they are put in.
+bool IsValidName(const std::string& name) {
+  if (name.empty())
+    return false;
+
+  for (auto c : name) {
+    if (('A' <= c && c <= 'Z') || static_cast<uint8_t>(c) <= 0x20 ||
+        c == 0x7F || c == ':')
+      return false;
+  }
+
+  return true;
+}
+
+bool IsValidValue(const std::string& value) {
+  return value.find_first_of(std::string("\0\r\n", 3)) == std::string::npos;
+}
+
+std::string ToLower(const std::string& name) {
+  std::string lower(name);
+  for (auto& c : lower) {
+    if ('A' <= c && c <= 'Z')
+      c += 'a' - 'A';
+  }
+
+  return lower;
+}
+
+}  // namespace
+
+const char Http2Connection::kPreface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+class Http2Connection::ScopedCallback {
+ public:
+  explicit ScopedCallback(Http2Connection* connection)
+      : connection_(connection) {
+    base::AtomicRefCountInc(&connection_->ref_count_);
+  }
+
+  ~ScopedCallback() {
+    base::AtomicRefCountDec(&connection_->ref_count_);
+  }
+
+ private:
+  Http2Connection* const connection_;
+
+  ScopedCallback(const ScopedCallback&) = delete;
+  ScopedCallback& operator=(const ScopedCallback&) = delete;
+};
+
+// Presents a stream to the session as the client connection.
+class Http2Connection::StreamChannel : public io::Channel {
+ public:
+  StreamChannel(const std::shared_ptr<Http2Connection>& connection,
+                Stream* stream)
+      : connection_(connection), stream_(stream) {}
+
+  ~StreamChannel() {
+    connection_->DetachStream(stream_);
+  }
+
+  void Close() override {
+    connection_->CloseStream(stream_);
+  }
+
+  HRESULT ReadAsync(void* buffer, int length, Listener* listener) override {
+    return connection_->ReadStream(stream_, buffer, length, listener);
+  }
+
+  HRESULT WriteAsync(const void* buffer, int length,
+                     Listener* listener) override {
+    return connection_->WriteStream(stream_, buffer, length, listener);
+  }
+
+ private:
+  std::shared_ptr<Http2Connection> connection_;
+  Stream* const stream_;
+
+  StreamChannel(const StreamChannel&) = delete;
+  StreamChannel& operator=(const StreamChannel&) = delete;
+};
+
+struct Http2Connection::Stream {
+  struct Request {
+    void* buffer;
+    int length;
+    io::Channel::Listener* listener;
+  };
+
+  explicit Stream(uint32_t id)
+      : id(id),
+        channel(nullptr),
+        callbacks(0),
+        closed(false),
+        reset(false),
+        tunnel(false),
+        head(false),
+        head_received(false),
+        chunked(false),
+        input_ended(false),
+        read(),
+        receive_window(kStreamWindowSize),
+        buffered(0),
+        unacknowledged(0),
+        state(OutputState::kHeader),
+        remaining(0),
+        output_offset(0),
+        output_ended(false),
+        end_sent(false),
+        send_window(0) {}
+
+  // Given to a client stream when it is opened, 0 until then.
+  uint32_t id;
+  io::Channel* channel;
+  // Completions posted and not yet returned.
+  int callbacks;
+  bool closed;
+  bool reset;
+
+  bool tunnel;
+  bool head;
+  // The final response header is received. Client only.
+  bool head_received;
+
+  // What the peer sends as an HTTP/1.1 message, with DATA in chunks if
+  // |chunked|.
+  std::string input;
+  bool chunked;
+  bool input_ended;
+  Request read;
+  int64_t receive_window;
+  // Received but not yet read.
+  int64_t buffered;
+  // Read, but not yet given back to the peer.
+  int64_t unacknowledged;
+
+  // What is sent to the peer, parsed from the HTTP/1.1 message written.
+  OutputState state;
+  std::string header;
+  // The request header waiting for the stream to be opened. Client only.
+  std::string block;
+  HttpChunkedDecoder decoder;
+  int64_t remaining;
+  std::string output;
+  size_t output_offset;
+  bool output_ended;
+  bool end_sent;
+  int64_t send_window;
+  // Completed once what they carry is framed.
+  std::deque<Request> writes;
+};
+
+struct Http2Connection::Completion {
+  std::shared_ptr<Http2Connection> connection;
+  Stream* stream;
+  io::Channel::Listener* listener;
+  bool read;
+  HRESULT result;
+  void* buffer;
+  int length;
+};
+
+Http2Connection::Http2Connection(Role role, Delegate* delegate,
+                                 std::shared_ptr<io::Channel> channel)
+    : role_(role),
+      delegate_(delegate),
+      channel_(std::move(channel)),
+      ref_count_(1),
+      idle_(&lock_),
+      started_(false),
+      closing_(false),
+      closed_(false),
+      reading_(false),
+      writing_(false),
+      ended_(false),
+      goaway_(false),
+      settings_received_(false),
+      last_stream_id_(0),
+      continued_stream_(0),
+      header_flags_(0),
+      initial_window_size_(kDefaultWindowSize),
+      max_frame_size_(kMaxFrameSize),
+      max_concurrent_streams_(kMaxConcurrentStreams),
+      send_window_(kDefaultWindowSize),
+      receive_window_(kConnectionWindowSize),
+      unacknowledged_(0),
+      received_(false),
+      ping_sent_(false) {
+  // Ahead of the requests written before the connection is established.
+  if (role_ == Role::kClient) {
+    output_.assign(kPreface, kPrefaceLength);
+    SendSettings();
+  }
+}
+
+Http2Connection::~Http2Connection() {
+  DCHECK(streams_.empty() && pending_.empty());
+}
+
+void Http2Connection::Start(const std::string& received) {
+  {
+    base::AutoLock guard(lock_);
+
+    DCHECK(role_ == Role::kServer
+               ? received.compare(0, kPrefaceLength, kPreface) == 0
+               : received.empty());
+
+    started_ = true;
+
+    // Unless stopped already.
+    if (!closing_)
+      buffer_ = HttpBufferPool::Acquire(kMaxFrameSize);
+
+    if (buffer_.data() == nullptr) {
+      LOG_IF(ERROR, !closing_) << this << " failed to allocate buffer";
+      Abort();
+    } else {
+      if (role_ == Role::kServer) {
+        SendSettings();
+        input_.assign(received, kPrefaceLength, std::string::npos);
+        ProcessInput();
+      }
+
+      if (!closing_)
+        Read();
+
+      Write();
+    }
+  }
+
+  Dispatch();
+
+  // The delegate may release the connection from here on.
+  base::AtomicRefCountDec(&ref_count_);
+}
+
+void Http2Connection::Stop() {
+  auto ended = false;
+
+  {
+    base::AutoLock guard(lock_);
+
+    DLOG(INFO) << this << " stop requested";
+
+    Abort();
+
+    // Otherwise ended by the callback in progress. Not dispatched, as the
+    // delegate may be holding its own lock.
+    if (!reading_ && !writing_ && !ended_) {
+      ended_ = true;
+      ended = true;
+    }
+  }
+
+  if (ended)
+    delegate_->OnConnectionEnded(this);
+}
+
+void Http2Connection::Shutdown() {
+  {
+    base::AutoLock guard(lock_);
+
+    if (started_)
+      Fail(kNoError);
+    else
+      Abort();
+  }
+
+  Dispatch();
+}
+
+std::unique_ptr<io::Channel> Http2Connection::CreateStream() {
+  DCHECK(role_ == Role::kClient);
+
+  base::AutoLock guard(lock_);
+
+  if (!CanCreateStream())
+    return nullptr;
+
+  auto stream = std::make_unique<Stream>(0);
+  auto channel =
+      std::make_unique<StreamChannel>(shared_from_this(), stream.get());
+  stream->channel = channel.get();
+  pending_.push_back(std::move(stream));
+
+  return std::move(channel);
+}
+
+bool Http2Connection::CheckHealth() {
+  {
+    base::AutoLock guard(lock_);
+
+    if (started_ && !closing_) {
+      if (ping_sent_) {
+        LOG(WARNING) << this << " ping not acknowledged";
+        Abort();
+      } else if (!received_) {
+        static const char kOpaqueData[8] = {};
+        SendFrame(kPing, 0, 0, kOpaqueData, sizeof(kOpaqueData));
+        ping_sent_ = true;
+        Write();
+      }
+
+      received_ = false;
+    }
+  }
+
+  Dispatch();
+
+  base::AutoLock guard(lock_);
+  return !closing_;
+}
+
+bool Http2Connection::IsAvailable() const {
+  base::AutoLock guard(lock_);
+  return CanCreateStream();
+}
+
+size_t Http2Connection::GetStreamCount() const {
+  base::AutoLock guard(lock_);
+  return streams_.size() + pending_.size();
+}
+
+void Http2Connection::ProcessInput() {
+  size_t offset = 0;
+
+  while (!closing_ && input_.size() - offset >= kFrameHeaderSize) {
+    auto frame = input_.data() + offset;
+    auto length = ReadUint24(frame);
+    if (length > kMaxFrameSize) {
+      Fail(kFrameSizeError);
+      break;
+    }
+
+    if (input_.size() - offset < kFrameHeaderSize + length)
+      break;
+
+    offset += kFrameHeaderSize + length;
+    received_ = true;
+
+    auto type = static_cast<uint8_t>(frame[3]);
+    auto flags = static_cast<uint8_t>(frame[4]);
+    auto stream_id = ReadUint32(frame + 5) & 0x7FFFFFFF;
+    if (!ProcessFrame(type, flags, stream_id, frame + kFrameHeaderSize,
+                      length))
+      break;
+  }
+
+  input_.erase(0, offset);
+}
+
+bool Http2Connection::ProcessFrame(uint8_t type, uint8_t flags,
+                                   uint32_t stream_id, const char* payload,
+                                   size_t length) {
+  // The peer must begin with SETTINGS, and must not interleave anything with
+  // a header block.
+  if ((!settings_received_ && type != kSettings) ||
+      (continued_stream_ != 0 &&
+       (type != kContinuation || stream_id != continued_stream_))) {
+    Fail(kProtocolError);
+    return false;
+  }
+
+  switch (type) {
+    case kData:
+      return ProcessData(flags, stream_id, payload, length);
+
+    case kHeaders:
+      return ProcessHeaders(flags, stream_id, payload, length);
+
+    case kPriority:
+      // Streams are served as they come.
+      if (stream_id == 0) {
+        Fail(kProtocolError);
+        return false;
+      }
+      if (length != 5) {
+        Fail(kFrameSizeError);
+        return false;
+      }
+      return true;
+
+    case kRstStream:
+      return ProcessRstStream(stream_id, payload, length);
+
+    case kSettings:
+      return ProcessSettings(flags, stream_id, payload, length);
+
+    case kPing:
+      return ProcessPing(flags, stream_id, payload, length);
+
+    case kGoAway:
+      return ProcessGoAway(stream_id, payload, length);
+
+    case kWindowUpdate:
+      return ProcessWindowUpdate(stream_id, payload, length);
+
+    case kContinuation:
+      if (continued_stream_ == 0) {
+        Fail(kProtocolError);
+        return false;
+      }
+
+      header_block_.append(payload, length);
+      if (header_block_.size() > kMaxHeaderBlockSize) {
+        Fail(kEnhanceYourCalm);
+        return false;
+      }
+
+      if (flags & kEndHeadersFlag)
+        return ProcessHeaderBlock();
+
+      return true;
+
+    case kPushPromise:
+      // Clients never push, and pushes are disabled for servers.
+      Fail(kProtocolError);
+      return false;
+
+    default:
+      // Unknown types are ignored.
+      return true;
+  }
+}
+
+bool Http2Connection::ProcessData(uint8_t flags, uint32_t stream_id,
+                                  const char* payload, size_t length) {
+  if (stream_id == 0 || stream_id > last_stream_id_) {
+    Fail(kProtocolError);
+    return false;
+  }
+
+  size_t offset = 0, padding = 0;
+  if (flags & kPaddedFlag) {
+    if (length < 1 || 1 + static_cast<uint8_t>(payload[0]) > length) {
+      Fail(kProtocolError);
+      return false;
+    }
+
+    padding = static_cast<uint8_t>(payload[0]);
+    offset = 1;
+  }
+
+  // The whole frame is subject to flow control.
+  if (static_cast<int64_t>(length) > receive_window_) {
+    Fail(kFlowControlError);
+    return false;
+  }
+  receive_window_ -= length;
+
+  auto stream = FindStream(stream_id);
+  if (stream == nullptr || stream->reset) {
+    // Sent before the peer knew the stream is closed.
+    Credit(nullptr, length);
+    return true;
+  }
+
+  if (stream->input_ended) {
+    Credit(nullptr, length);
+    ResetStream(stream, kStreamClosed);
+    return true;
+  }
+
+  // Content comes after the final response header.
+  if (role_ == Role::kClient && !stream->head_received) {
+    Credit(nullptr, length);
+    ResetStream(stream, kProtocolError);
+    return true;
+  }
+
+  if (static_cast<int64_t>(length) > stream->receive_window) {
+    Credit(nullptr, length);
+    ResetStream(stream, kFlowControlError);
+    return true;
+  }
+
+  stream->receive_window -= length;
+  stream->buffered += length;
+
+  auto size = length - offset - padding;
+  if (size > 0) {
+    if (stream->chunked) {
+      char chunk_size[24];
+      sprintf_s(chunk_size, "%zx\r\n", size);
+      stream->input.append(chunk_size);
+      stream->input.append(payload + offset, size);
+      stream->input.append("\r\n", 2);
+    } else {
+      stream->input.append(payload + offset, size);
+    }
+  }
+
+  if (flags & kEndStreamFlag) {
+    EndInput(stream, nullptr);
+  } else if (stream->input.empty()) {
+    // Nothing but padding.
+    Credit(stream, stream->buffered);
+    stream->buffered = 0;
+  }
+
+  DeliverInput(stream);
+
+  return true;
+}
+
+bool Http2Connection::ProcessHeaders(uint8_t flags, uint32_t stream_id,
+                                     const char* payload, size_t length) {
+  if (stream_id == 0) {
+    Fail(kProtocolError);
+    return false;
+  }
+
+  size_t offset = 0, padding = 0;
+  if (flags & kPaddedFlag) {
+    if (length < 1) {
+      Fail(kProtocolError);
+      return false;
+    }
+
+    padding = static_cast<uint8_t>(payload[0]);
+    offset = 1;
+  }
+
+  // Priorities are not followed.
+  if (flags & kPriorityFlag)
+    offset += 5;
+
+  if (offset + padding > length) {
+    Fail(kProtocolError);
+    return false;
+  }
+
+  header_block_.assign(payload + offset, length - offset - padding);
+  header_flags_ = flags;
+  continued_stream_ = stream_id;
+
+  if (flags & kEndHeadersFlag)
+    return ProcessHeaderBlock();
+
+  return true;
+}
+
+bool Http2Connection::ProcessHeaderBlock() {
+  auto stream_id = continued_stream_;
+  continued_stream_ = 0;
+
+  // Decoded even if the stream is refused, to keep the table in sync.
+  std::vector<HpackField> fields;
+  auto decoded = decoder_.Decode(header_block_.data(), header_block_.size(),
+                                 &fields);
+  header_block_.clear();
+  if (!decoded) {
+    Fail(kCompressionError);
+    return false;
+  }
+
+  auto end_stream = (header_flags_ & kEndStreamFlag) != 0;
+
+  if (role_ == Role::kServer && stream_id > last_stream_id_) {
+    if (stream_id % 2 == 0) {
+      Fail(kProtocolError);
+      return false;
+    }
+
+    last_stream_id_ = stream_id;
+    OpenStream(stream_id, fields, end_stream);
+    return true;
+  }
+
+  // Servers only respond on the streams opened by this end.
+  if (role_ == Role::kClient &&
+      (stream_id % 2 == 0 || stream_id > last_stream_id_)) {
+    Fail(kProtocolError);
+    return false;
+  }
+
+  auto stream = FindStream(stream_id);
+  if (stream == nullptr || stream->reset) {
+    SendRstStream(stream_id, kStreamClosed);
+  } else if (stream->input_ended) {
+    ResetStream(stream, kStreamClosed);
+  } else if (role_ == Role::kClient && !stream->head_received) {
+    ReceiveResponse(stream, fields, end_stream);
+  } else if (!end_stream) {
+    // Trailers must end the stream.
+    ResetStream(stream, kProtocolError);
+  } else {
+    EndInput(stream, &fields);
+  }
+
+  return true;
+}
+
+bool Http2Connection::ProcessRstStream(uint32_t stream_id,
+                                       const char* /*payload*/,
+                                       size_t length) {
+  if (stream_id == 0 || stream_id > last_stream_id_) {
+    Fail(kProtocolError);
+    return false;
+  }
+
+  if (length != 4) {
+    Fail(kFrameSizeError);
+    return false;
+  }
+
+  auto stream = FindStream(stream_id);
+  if (stream != nullptr)
+    CancelStream(stream);
+
+  return true;
+}
+
+bool Http2Connection::ProcessSettings(uint8_t flags, uint32_t stream_id,
+                                      const char* payload, size_t length) {
+  if (stream_id != 0) {
+    Fail(kProtocolError);
+    return false;
+  }
+
+  if (flags & kAckFlag) {
+    if (length != 0) {
+      Fail(kFrameSizeError);
+      return false;
+    }
+
+    return true;
+  }
+
+  if (length % 6 != 0) {
+    Fail(kFrameSizeError);
+    return false;
+  }
+
+  for (size_t offset = 0; offset < length; offset += 6) {
+    auto value = ReadUint32(payload + offset + 2);
+
+    switch (ReadUint16(payload + offset)) {
+      case kSettingsEnablePush:
+        // Servers may not enable pushes. RFC 9113 6.5.2
+        if (value > 1 || (role_ == Role::kClient && value != 0)) {
+          Fail(kProtocolError);
+          return false;
+        }
+        break;
+
+      case kSettingsInitialWindowSize: {
+        if (value > kMaxWindowSize) {
+          Fail(kFlowControlError);
+          return false;
+        }
+
+        // Applies to the streams open as well.
+        auto delta = value - initial_window_size_;
+        for (auto& pair : streams_) {
+          auto& window = pair.second->send_window;
+          window += delta;
+          if (window > kMaxWindowSize) {
+            Fail(kFlowControlError);
+            return false;
+          }
+        }
+
+        initial_window_size_ = value;
+        break;
+      }
+
+      case kSettingsMaxFrameSize:
+        if (value < kMaxFrameSize || value > kMaxFrameSizeLimit) {
+          Fail(kProtocolError);
+          return false;
+        }
+
+        max_frame_size_ = value;
+        break;
+
+      case kSettingsMaxConcurrentStreams:
+        // Streams open already are left as they are.
+        max_concurrent_streams_ = value;
+        break;
+
+      default:
+        // The others are of no concern, as the encoder does not use the
+        // dynamic table and pushes are never made.
+        break;
+    }
+  }
+
+  settings_received_ = true;
+  SendFrame(kSettings, kAckFlag, 0, nullptr, 0);
+  FlushStreams();
+
+  return true;
+}
+
+bool Http2Connection::ProcessPing(uint8_t flags, uint32_t stream_id,
+                                  const char* payload, size_t length) {
+  if (stream_id != 0) {
+    Fail(kProtocolError);
+    return false;
+  }
+
+  if (length != 8) {
+    Fail(kFrameSizeError);
+    return false;
+  }
+
+  if (flags & kAckFlag)
+    ping_sent_ = false;
+  else
+    SendFrame(kPing, kAckFlag, 0, payload, length);
+
+  return true;
+}
+
+bool Http2Connection::ProcessGoAway(uint32_t stream_id, const char* payload,
+                                    size_t length) {
+  if (stream_id != 0) {
+    Fail(kProtocolError);
+    return false;
+  }
+
+  if (length < 8) {
+    Fail(kFrameSizeError);
+    return false;
+  }
+
+  goaway_ = true;
+
+  auto error = ReadUint32(payload + 4);
+  LOG_IF(WARNING, error != kNoError) << this << " peer going away: " << error;
+
+  if (role_ == Role::kServer)
+    return true;
+
+  // The requests not processed by the server fail, as do those yet to be
+  // sent, and are not retried on another connection.
+  auto last_processed = ReadUint32(payload) & 0x7FFFFFFF;
+  for (auto& pair : streams_) {
+    if (pair.first > last_processed)
+      CancelStream(pair.second.get());
+  }
+  for (auto& stream : pending_)
+    CancelStream(stream.get());
+
+  return true;
+}
+
+bool Http2Connection::ProcessWindowUpdate(uint32_t stream_id,
+                                          const char* payload,
+                                          size_t length) {
+  if (length != 4) {
+    Fail(kFrameSizeError);
+    return false;
+  }
+
+  int64_t increment = ReadUint32(payload) & 0x7FFFFFFF;
+
+  if (stream_id == 0) {
+    send_window_ += increment;
+    if (increment == 0 || send_window_ > kMaxWindowSize) {
+      Fail(increment == 0 ? kProtocolError : kFlowControlError);
+      return false;
+    }
+
+    FlushStreams();
+    return true;
+  }
+
+  if (stream_id > last_stream_id_) {
+    Fail(kProtocolError);
+    return false;
+  }
+
+  auto stream = FindStream(stream_id);
+  if (stream == nullptr || stream->reset)
+    return true;
+
+  stream->send_window += increment;
+  if (increment == 0 || stream->send_window > kMaxWindowSize) {
+    ResetStream(stream, increment == 0 ? kProtocolError : kFlowControlError);
+    return true;
+  }
+
+  FlushStream(stream);
+  return true;
+}
+
+void Http2Connection::OpenStream(uint32_t stream_id,
+                                 const std::vector<HpackField>& fields,
+                                 bool end_stream) {
+  if (goaway_ || CountOpenStreams() >= kMaxConcurrentStreams) {
+    SendRstStream(stream_id, kRefusedStream);
+    return;
+  }
+
+  std::string method, scheme, authority, path, host, cookie, headers;
+  auto has_length = false;
+  auto malformed = false;
+  auto regular = false;
+  size_t list_size = 0;
+
+  for (auto& field : fields) {
+    list_size += field.name.size() + field.value.size() + kFieldOverhead;
+    if (!IsValidValue(field.value)) {
+      malformed = true;
+      break;
+    }
+
+    if (!field.name.empty() && field.name[0] == ':') {
+      std::string* pseudo = nullptr;
+      if (field.name.compare(":method") == 0)
+        pseudo = &method;
+      else if (field.name.compare(":scheme") == 0)
+        pseudo = &scheme;
+      else if (field.name.compare(":authority") == 0)
+        pseudo = &authority;
+      else if (field.name.compare(":path") == 0)
+        pseudo = &path;
+
+      // Pseudo-header fields come first, once each.
+      if (regular || pseudo == nullptr || !pseudo->empty()) {
+        malformed = true;
+        break;
+      }
+
+      *pseudo = field.value;
+      continue;
+    }
+
+    regular = true;
+    if (!IsValidName(field.name) || IsConnectionSpecific(field.name)) {
+      malformed = true;
+      break;
+    }
+
+    if (field.name.compare("te") == 0) {
+      if (field.value.compare("trailers") != 0) {
+        malformed = true;
+        break;
+      }
+
+      // Hop-by-hop, and trailers are passed in any case.
+      continue;
+    }
+
+    // Cookies may be split into crumbs. RFC 9113 8.2.3
+    if (field.name.compare("cookie") == 0) {
+      if (!cookie.empty())
+        cookie.append("; ");
+      cookie.append(field.value);
+      continue;
+    }
+
+    if (field.name.compare("host") == 0)
+      host = field.value;
+    else if (field.name.compare("content-length") == 0)
+      has_length = true;
+
+    headers.append(field.name).append(": ").append(field.value).append("\r\n");
+  }
+
+  auto tunnel = method.compare("CONNECT") == 0;
+  if (authority.empty())
+    authority = host;
+
+  if (!malformed) {
+    if (tunnel)
+      malformed = authority.empty() || !scheme.empty() || !path.empty();
+    else
+      malformed = method.empty() || scheme.empty() || path.empty();
+  }
+
+  if (malformed || list_size > kMaxHeaderBlockSize) {
+    SendRstStream(stream_id, kProtocolError);
+    return;
+  }
+
+  auto stream = std::make_unique<Stream>(stream_id);
+  stream->tunnel = tunnel;
+  stream->head = method.compare("HEAD") == 0;
+  stream->chunked = !tunnel && !end_stream && !has_length;
+  stream->input_ended = end_stream;
+  stream->send_window = initial_window_size_;
+
+  // The session takes the request as if sent to a proxy, and closes the
+  // channel after the response.
+  auto& input = stream->input;
+  input.append(method).append(" ");
+  if (tunnel)
+    input.append(authority);
+  else if (path[0] == '/')
+    input.append(scheme).append("://").append(authority).append(path);
+  else
+    input.append(path);
+  input.append(" HTTP/1.1\r\n");
+
+  if (host.empty() && !authority.empty())
+    input.append("host: ").append(authority).append("\r\n");
+  input.append(headers);
+  if (!cookie.empty())
+    input.append("cookie: ").append(cookie).append("\r\n");
+  if (stream->chunked)
+    input.append("transfer-encoding: chunked\r\n");
+  input.append("connection: close\r\n\r\n");
+
+  auto channel = std::make_unique<StreamChannel>(shared_from_this(),
+                                                 stream.get());
+  stream->channel = channel.get();
+  streams_[stream_id] = std::move(stream);
+  accepted_.push_back(std::move(channel));
+}
+
+void Http2Connection::ReceiveResponse(Stream* stream,
+                                      const std::vector<HpackField>& fields,
+                                      bool end_stream) {
+  std::string status, headers;
+  auto has_length = false;
+  auto malformed = false;
+  auto regular = false;
+  size_t list_size = 0;
+
+  for (auto& field : fields) {
+    list_size += field.name.size() + field.value.size() + kFieldOverhead;
+    if (!IsValidValue(field.value)) {
+      malformed = true;
+      break;
+    }
+
+    if (!field.name.empty() && field.name[0] == ':') {
+      if (regular || field.name.compare(":status") != 0 || !status.empty()) {
+        malformed = true;
+        break;
+      }
+
+      status = field.value;
+      continue;
+    }
+
+    regular = true;
+    if (!IsValidName(field.name) || IsConnectionSpecific(field.name)) {
+      malformed = true;
+      break;
+    }
+
+    if (field.name.compare("content-length") == 0)
+      has_length = true;
+
+    headers.append(field.name).append(": ").append(field.value).append("\r\n");
+  }
+
+  if (!malformed) {
+    malformed = status.size() != 3 ||
+                status.find_first_not_of("0123456789") != std::string::npos;
+  }
+
+  auto code = malformed ? 0 : std::stoi(status);
+  if (malformed || list_size > kMaxHeaderBlockSize || code < 100 ||
+      code == SWITCHING_PROTOCOLS || (code < 200 && end_stream)) {
+    ResetStream(stream, kProtocolError);
+    return;
+  }
+
+  auto message = GetStatusMessage(static_cast<StatusCode>(code));
+  auto& input = stream->input;
+  input.append("HTTP/1.1 ").append(status).append(" ");
+  if (message != nullptr)
+    input.append(message);
+  input.append("\r\n").append(headers);
+
+  // Informational responses precede the final one.
+  if (code < 200) {
+    input.append("\r\n");
+    DeliverInput(stream);
+    return;
+  }
+
+  stream->head_received = true;
+
+  // The tunnel follows a successful response to CONNECT.
+  if (!stream->tunnel || code / 100 != 2) {
+    auto has_content =
+        !stream->head && code != NO_CONTENT && code != NOT_MODIFIED;
+    if (end_stream && !has_length && has_content)
+      input.append("content-length: 0\r\n");
+
+    stream->chunked = !end_stream && !has_length && has_content;
+    if (stream->chunked)
+      input.append("transfer-encoding: chunked\r\n");
+
+    // Each stream carries a single exchange.
+    input.append("connection: close\r\n");
+  }
+
+  input.append("\r\n");
+
+  if (end_stream)
+    EndInput(stream, nullptr);
+  else
+    DeliverInput(stream);
+}
+
+void Http2Connection::EndInput(Stream* stream,
+                               const std::vector<HpackField>* trailers) {
+  if (stream->chunked) {
+    stream->input.append("0\r\n");
+
+    if (trailers != nullptr) {
+      for (auto& field : *trailers) {
+        if (IsValidName(field.name) && !IsConnectionSpecific(field.name) &&
+            IsValidValue(field.value))
+          stream->input.append(field.name)
+              .append(": ")
+              .append(field.value)
+              .append("\r\n");
+      }
+    }
+
+    stream->input.append("\r\n");
+  }
+
+  stream->input_ended = true;
+  DeliverInput(stream);
+}
+
+void Http2Connection::StartStreams() {
+  if (role_ != Role::kClient || closing_ || goaway_)
+    return;
+
+  auto open = CountOpenStreams();
+  for (auto i = pending_.begin();
+       i != pending_.end() && open < max_concurrent_streams_;) {
+    auto stream = i->get();
+    if (stream->reset || stream->block.empty()) {
+      ++i;
+      continue;
+    }
+
+    // Opened in the order the requests are sent.
+    last_stream_id_ += last_stream_id_ == 0 ? 1 : 2;
+    stream->id = last_stream_id_;
+    stream->send_window = initial_window_size_;
+    streams_[stream->id] = std::move(*i);
+    i = pending_.erase(i);
+    ++open;
+
+    std::string block;
+    block.swap(stream->block);
+    SendHeaders(stream, block,
+                stream->output_ended && stream->output.empty());
+    FlushStream(stream);
+  }
+}
+
+bool Http2Connection::CanCreateStream() const {
+  // Stream IDs are reserved for the streams waiting.
+  return !closing_ && !goaway_ &&
+         last_stream_id_ + 2 * (pending_.size() + 1) <= kMaxStreamId;
+}
+
+Http2Connection::Stream* Http2Connection::FindStream(
+    uint32_t stream_id) const {
+  auto found = streams_.find(stream_id);
+  if (found == streams_.end())
+    return nullptr;
+
+  return found->second.get();
+}
+
+size_t Http2Connection::CountOpenStreams() const {
+  size_t count = 0;
+  for (auto& pair : streams_) {
+    auto& stream = pair.second;
+    if (!stream->reset && !(stream->input_ended && stream->end_sent))
+      ++count;
+  }
+
+  return count;
+}
+
+HRESULT Http2Connection::ReadStream(Stream* stream, void* buffer, int length,
+                                    io::Channel::Listener* listener) {
+  if (buffer == nullptr || length < 0 || listener == nullptr)
+    return E_INVALIDARG;
+
+  base::AutoLock guard(lock_);
+
+  if (stream->closed)
+    return E_HANDLE;
+  if (stream->read.listener != nullptr)
+    return E_ILLEGAL_METHOD_CALL;
+
+  stream->read = {buffer, length, listener};
+  DeliverInput(stream);
+  Write();
+
+  return S_OK;
+}
+
+HRESULT Http2Connection::WriteStream(Stream* stream, const void* buffer,
+                                     int length,
+                                     io::Channel::Listener* listener) {
+  if (buffer == nullptr || length < 0 || listener == nullptr)
+    return E_INVALIDARG;
+
+  base::AutoLock guard(lock_);
+
+  if (stream->closed)
+    return E_HANDLE;
+  if (stream->reset)
+    return E_ABORT;
+
+  if (!ProcessOutput(stream, static_cast<const char*>(buffer), length)) {
+    LOG(ERROR) << this << " invalid message on stream " << stream->id;
+    ResetStream(stream, kInternalError);
+    Write();
+    return E_FAIL;
+  }
+
+  stream->writes.push_back({const_cast<void*>(buffer), length, listener});
+  StartStreams();
+  FlushStream(stream);
+  Write();
+
+  return S_OK;
+}
+
+void Http2Connection::CloseStream(Stream* stream) {
+  base::AutoLock guard(lock_);
+
+  if (stream->closed)
+    return;
+
+  stream->closed = true;
+
+  if (!stream->reset) {
+    // The end of the content delimited by closing.
+    if (stream->state == OutputState::kRaw) {
+      stream->state = OutputState::kComplete;
+      stream->output_ended = true;
+      FlushStream(stream);
+    }
+
+    if (stream->id == 0)
+      CancelStream(stream);
+    else if (!stream->end_sent)
+      ResetStream(stream, stream->state == OutputState::kComplete
+                              ? kCancel
+                              : kInternalError);
+    else if (!stream->input_ended)
+      // The rest of the message is not needed any more.
+      ResetStream(stream, role_ == Role::kServer ? kNoError : kCancel);
+  }
+
+  DeliverInput(stream);
+  for (auto& write : stream->writes)
+    Post(stream, write.listener, false, E_ABORT, write.buffer, 0);
+  stream->writes.clear();
+
+  StartStreams();
+  Write();
+}
+
+void Http2Connection::DetachStream(Stream* stream) {
+  CloseStream(stream);
+
+  base::AutoLock guard(lock_);
+
+  while (stream->callbacks > 0)
+    idle_.Wait();
+
+  if (stream->id != 0) {
+    streams_.erase(stream->id);
+    return;
+  }
+
+  auto found = std::find_if(
+      pending_.begin(), pending_.end(),
+      [stream](const std::unique_ptr<Stream>& pending) {
+        return pending.get() == stream;
+      });
+  if (found != pending_.end())
+    pending_.erase(found);
+}
+
+bool Http2Connection::ProcessOutput(Stream* stream, const char* data,
+                                    size_t length) {
+  switch (stream->state) {
+    case OutputState::kHeader: {
+      stream->header.append(data, length);
+
+      // Informational responses may precede the final one.
+      while (stream->state == OutputState::kHeader) {
+        auto result = role_ == Role::kServer ? ProcessResponseHeader(stream)
+                                             : ProcessRequestHeader(stream);
+        if (result <= 0)
+          return result == 0;
+      }
+
+      std::string content;
+      content.swap(stream->header);
+      if (content.empty())
+        return true;
+
+      return ProcessOutput(stream, content.data(), content.size());
+    }
+
+    case OutputState::kLength: {
+      auto size = static_cast<size_t>(
+          std::min(stream->remaining, static_cast<int64_t>(length)));
+      stream->output.append(data, size);
+      stream->remaining -= size;
+      if (stream->remaining == 0) {
+        stream->state = OutputState::kComplete;
+        stream->output_ended = true;
+      }
+      break;
+    }
+
+    case OutputState::kChunked: {
+      size_t offset = 0;
+      while (offset < length && !stream->decoder.IsComplete()) {
+        const char* payload;
+        size_t payload_length;
+        auto consumed = stream->decoder.Decode(data + offset, length - offset,
+                                               &payload, &payload_length);
+        if (consumed < 0)
+          return false;
+
+        if (payload_length > 0)
+          stream->output.append(payload, payload_length);
+        offset += static_cast<size_t>(consumed);
+      }
+
+      if (stream->decoder.IsComplete()) {
+        stream->state = OutputState::kComplete;
+        stream->output_ended = true;
+      }
+      break;
+    }
+
+    case OutputState::kRaw:
+      stream->output.append(data, length);
+      break;
+
+    case OutputState::kComplete:
+      // What follows the content is not a part of the message.
+      break;
+  }
+
+  return true;
+}
+
+int Http2Connection::ProcessResponseHeader(Stream* stream) {
+  HttpResponse response;
+  auto result = response.Parse(stream->header);
+  if (result == HttpResponse::kPartial)
+    return stream->header.size() > kMaxHeaderBlockSize ? -1 : 0;
+  if (result < 0)
+    return -1;
+
+  stream->header.erase(0, result);
+
+  // Protocols can not be switched in HTTP/2.
+  auto status = response.status();
+  if (status == SWITCHING_PROTOCOLS)
+    return -1;
+
+  http_util::ProcessHopByHopHeaders(&response);
+
+  std::string block;
+  HpackEncoder::Encode(":status", std::to_string(status), &block);
+  for (auto& field : response) {
+    auto name = ToLower(field.first);
+    if (!IsConnectionSpecific(name))
+      HpackEncoder::Encode(name, field.second, &block);
+  }
+
+  if (status < 200) {
+    SendHeaders(stream, block, false);
+    return 1;
+  }
+
+  if (stream->tunnel && status / 100 == 2) {
+    stream->state = OutputState::kRaw;
+  } else if (stream->head || status == NO_CONTENT || status == NOT_MODIFIED) {
+    stream->state = OutputState::kComplete;
+  } else {
+    auto content_length = http_util::GetContentLength(response);
+    if (content_length == -2) {
+      stream->decoder.Reset();
+      stream->state = OutputState::kChunked;
+    } else if (content_length > 0) {
+      stream->remaining = content_length;
+      stream->state = OutputState::kLength;
+    } else if (content_length == 0) {
+      stream->state = OutputState::kComplete;
+    } else {
+      stream->state = OutputState::kRaw;
+    }
+  }
+
+  stream->output_ended = stream->state == OutputState::kComplete;
+  SendHeaders(stream, block, stream->output_ended);
+
+  return 1;
+}
+
+int Http2Connection::ProcessRequestHeader(Stream* stream) {
+  HttpRequest request;
+  auto result = request.Parse(stream->header);
+  if (result == HttpRequest::kPartial)
+    return stream->header.size() > kMaxHeaderBlockSize ? -1 : 0;
+  if (result < 0)
+    return -1;
+
+  stream->header.erase(0, result);
+
+  auto& method = request.method();
+  stream->tunnel = method.compare("CONNECT") == 0;
+  stream->head = method.compare("HEAD") == 0;
+
+  // Written as to a proxy, in the absolute form unless tunneling.
+  std::string scheme, authority, path;
+  auto& target = request.path();
+  auto separator = target.find("://");
+  if (stream->tunnel) {
+    authority = target;
+  } else if (separator != std::string::npos && target[0] != '/') {
+    scheme = ToLower(target.substr(0, separator));
+
+    auto start = separator + 3;
+    auto end = target.find_first_of("/?#", start);
+    authority = target.substr(start, end - start);
+    if (end != std::string::npos)
+      path = target.substr(end, target.find('#', end) - end);
+    if (path.empty() || path[0] != '/')
+      path.insert(0, "/");
+
+    // User information is not a part of the authority any more.
+    auto at = authority.rfind('@');
+    if (at != std::string::npos)
+      authority.erase(0, at + 1);
+  } else {
+    scheme = "http";
+    authority = request.GetHeader("Host");
+    path = target;
+  }
+
+  if (authority.empty() || (!stream->tunnel && path.empty()))
+    return -1;
+
+  std::string block;
+  HpackEncoder::Encode(":method", method, &block);
+  if (!stream->tunnel)
+    HpackEncoder::Encode(":scheme", scheme, &block);
+  HpackEncoder::Encode(":authority", authority, &block);
+  if (!stream->tunnel)
+    HpackEncoder::Encode(":path", path, &block);
+
+  http_util::ProcessHopByHopHeaders(&request);
+
+  for (auto& field : request) {
+    auto name = ToLower(field.first);
+    if (IsConnectionSpecific(name) || name.compare("host") == 0)
+      continue;
+    if (name.compare("te") == 0 && field.second.compare("trailers") != 0)
+      continue;
+
+    HpackEncoder::Encode(name, field.second, &block);
+  }
+
+  if (stream->tunnel) {
+    stream->state = OutputState::kRaw;
+  } else {
+    auto content_length = http_util::GetContentLength(request);
+    if (content_length == -2) {
+      stream->decoder.Reset();
+      stream->state = OutputState::kChunked;
+    } else if (content_length > 0) {
+      stream->remaining = content_length;
+      stream->state = OutputState::kLength;
+    } else {
+      stream->state = OutputState::kComplete;
+    }
+  }
+
+  // Sent when the stream is opened.
+  stream->output_ended = stream->state == OutputState::kComplete;
+  stream->block.swap(block);
+
+  return 1;
+}
+
+void Http2Connection::DeliverInput(Stream* stream) {
+  auto read = stream->read;
+  if (read.listener == nullptr)
+    return;
+
+  auto result = S_OK;
+  auto length = 0;
+
+  if (stream->reset || stream->closed) {
+    result = E_ABORT;
+  } else if (!stream->input.empty()) {
+    length = static_cast<int>(
+        std::min(stream->input.size(), static_cast<size_t>(read.length)));
+    memcpy(read.buffer, stream->input.data(), length);
+    stream->input.erase(0, length);
+
+    if (stream->input.empty()) {
+      Credit(stream, stream->buffered);
+      stream->buffered = 0;
+    }
+  } else if (!stream->input_ended) {
+    return;
+  }
+
+  stream->read = {};
+  Post(stream, read.listener, true, result, read.buffer, length);
+}
+
+void Http2Connection::Credit(Stream* stream, int64_t length) {
+  // Given back in batches, but before the client runs short.
+  unacknowledged_ += length;
+  if (unacknowledged_ >= kConnectionWindowSize / 16) {
+    SendWindowUpdate(0, unacknowledged_);
+    receive_window_ += unacknowledged_;
+    unacknowledged_ = 0;
+  }
+
+  if (stream == nullptr || stream->input_ended || stream->reset)
+    return;
+
+  stream->unacknowledged += length;
+  if (stream->unacknowledged >= kStreamWindowSize / 4) {
+    SendWindowUpdate(stream->id, stream->unacknowledged);
+    stream->receive_window += stream->unacknowledged;
+    stream->unacknowledged = 0;
+  }
+}
+
+void Http2Connection::FlushStream(Stream* stream) {
+  // Content waits until the stream is opened.
+  if (stream->reset || stream->id == 0)
+    return;
+
+  while (stream->output_offset < stream->output.size()) {
+    auto window = std::min(stream->send_window, send_window_);
+    if (window <= 0 || output_.size() >= kMaxPendingOutput)
+      return;
+
+    auto size = std::min({stream->output.size() - stream->output_offset,
+                          static_cast<size_t>(window), max_frame_size_});
+    auto last = stream->output_ended &&
+                stream->output_offset + size == stream->output.size();
+
+    SendFrame(kData, last ? kEndStreamFlag : 0, stream->id,
+              stream->output.data() + stream->output_offset, size);
+    stream->output_offset += size;
+    stream->send_window -= size;
+    send_window_ -= size;
+
+    if (last)
+      stream->end_sent = true;
+  }
+
+  stream->output.clear();
+  stream->output_offset = 0;
+
+  if (stream->output_ended && !stream->end_sent) {
+    SendFrame(kData, kEndStreamFlag, stream->id, nullptr, 0);
+    stream->end_sent = true;
+  }
+
+  // The writer waits while the connection is busy.
+  if (output_.size() >= kMaxPendingOutput)
+    return;
+
+  for (auto& write : stream->writes)
+    Post(stream, write.listener, false, S_OK, write.buffer, write.length);
+  stream->writes.clear();
+}
+
+void Http2Connection::FlushStreams() {
+  for (auto& pair : streams_)
+    FlushStream(pair.second.get());
+}
+
+void Http2Connection::ResetStream(Stream* stream, uint32_t error) {
+  if (stream->reset)
+    return;
+
+  if (stream->id != 0)
+    SendRstStream(stream->id, error);
+  CancelStream(stream);
+}
+
+void Http2Connection::CancelStream(Stream* stream) {
+  if (stream->reset)
+    return;
+
+  stream->reset = true;
+
+  // What is left unread is given back to the connection.
+  Credit(nullptr, stream->buffered);
+  stream->buffered = 0;
+  stream->input.clear();
+  stream->output.clear();
+  stream->output_offset = 0;
+
+  DeliverInput(stream);
+  for (auto& write : stream->writes)
+    Post(stream, write.listener, false, E_ABORT, write.buffer, 0);
+  stream->writes.clear();
+}
+
+void Http2Connection::CancelStreams() {
+  for (auto& pair : streams_)
+    CancelStream(pair.second.get());
+  for (auto& stream : pending_)
+    CancelStream(stream.get());
+}
+
+void Http2Connection::SendFrame(uint8_t type, uint8_t flags,
+                                uint32_t stream_id, const char* payload,
+                                size_t length) {
+  DCHECK(length <= kMaxFrameSizeLimit);
+
+  char header[kFrameHeaderSize] = {
+      static_cast<char>(length >> 16),
+      static_cast<char>(length >> 8),
+      static_cast<char>(length),
+      static_cast<char>(type),
+      static_cast<char>(flags),
+      static_cast<char>(stream_id >> 24 & 0x7F),
+      static_cast<char>(stream_id >> 16),
+      static_cast<char>(stream_id >> 8),
+      static_cast<char>(stream_id),
+  };
+
+  output_.append(header, sizeof(header));
+  if (length > 0)
+    output_.append(payload, length);
+}
+
+void Http2Connection::SendSettings() {
+  std::string settings;
+  if (role_ == Role::kServer)
+    AppendSetting(&settings, kSettingsMaxConcurrentStreams,
+                  kMaxConcurrentStreams);
+  else
+    AppendSetting(&settings, kSettingsEnablePush, 0);
+  AppendSetting(&settings, kSettingsInitialWindowSize,
+                static_cast<uint32_t>(kStreamWindowSize));
+  AppendSetting(&settings, kSettingsMaxHeaderListSize,
+                static_cast<uint32_t>(kMaxHeaderBlockSize));
+  SendFrame(kSettings, 0, 0, settings.data(), settings.size());
+  SendWindowUpdate(0, kConnectionWindowSize - kDefaultWindowSize);
+}
+
+void Http2Connection::SendHeaders(Stream* stream, const std::string& block,
+                                  bool end_stream) {
+  uint8_t type = kHeaders;
+  size_t offset = 0;
+
+  do {
+    auto size = std::min(block.size() - offset, max_frame_size_);
+    uint8_t flags = 0;
+    if (offset + size == block.size())
+      flags |= kEndHeadersFlag;
+    if (type == kHeaders && end_stream)
+      flags |= kEndStreamFlag;
+
+    SendFrame(type, flags, stream->id, block.data() + offset, size);
+    offset += size;
+    type = kContinuation;
+  } while (offset < block.size());
+
+  if (end_stream)
+    stream->end_sent = true;
+}
+
+void Http2Connection::SendRstStream(uint32_t stream_id, uint32_t error) {
+  std::string payload;
+  AppendUint32(&payload, error);
+  SendFrame(kRstStream, 0, stream_id, payload.data(), payload.size());
+}
+
+void Http2Connection::SendWindowUpdate(uint32_t stream_id,
+                                       int64_t increment) {
+  std::string payload;
+  AppendUint32(&payload, static_cast<uint32_t>(increment));
+  SendFrame(kWindowUpdate, 0, stream_id, payload.data(), payload.size());
+}
+
+void Http2Connection::Fail(uint32_t error) {
+  if (closing_)
+    return;
+
+  LOG_IF(WARNING, error != kNoError) << this << " connection error: "
+                                     << error;
+
+  closing_ = true;
+  CancelStreams();
+
+  std::string payload;
+  AppendUint32(&payload, last_stream_id_);
+  AppendUint32(&payload, error);
+  SendFrame(kGoAway, 0, 0, payload.data(), payload.size());
+
+  // The channel is closed once GOAWAY is sent.
+  Write();
+}
+
+void Http2Connection::Abort() {
+  closing_ = true;
+  CancelStreams();
+  output_.clear();
+
+  if (!closed_) {
+    closed_ = true;
+    channel_->Close();
+  }
+}
+
+void Http2Connection::Post(Stream* stream, io::Channel::Listener* listener,
+                           bool read, HRESULT result, void* buffer,
+                           int length) {
+  std::unique_ptr<Completion> completion(new Completion{
+      shared_from_this(), stream, listener, read, result, buffer, length});
+
+  ++stream->callbacks;
+  if (!TrySubmitThreadpoolCallback(OnCompleted, completion.get(), nullptr)) {
+    --stream->callbacks;
+    LOG(ERROR) << this << " failed to submit callback: " << GetLastError();
+    return;
+  }
+
+  completion.release();
+}
+
+void CALLBACK Http2Connection::OnCompleted(PTP_CALLBACK_INSTANCE /*instance*/,
+                                           void* context) {
+  std::unique_ptr<Completion> completion(static_cast<Completion*>(context));
+  auto connection = completion->connection.get();
+  auto stream = completion->stream;
+
+  if (completion->read)
+    completion->listener->OnRead(stream->channel, completion->result,
+                                 completion->buffer, completion->length);
+  else
+    completion->listener->OnWritten(stream->channel, completion->result,
+                                    completion->buffer, completion->length);
+
+  base::AutoLock guard(connection->lock_);
+
+  if (--stream->callbacks == 0)
+    connection->idle_.Broadcast();
+}
+
+HRESULT Http2Connection::Read() {
+  auto result = channel_->ReadAsync(
+      buffer_.data(), static_cast<int>(buffer_.size()), this);
+  if (FAILED(result)) {
+    LOG(ERROR) << this << " failed to read: 0x" << std::hex << result;
+    Abort();
+    return result;
+  }
+
+  reading_ = true;
+
+  return S_OK;
+}
+
+HRESULT Http2Connection::Write() {
+  // A client writes nothing until connected.
+  if (writing_ || closed_ || !started_)
+    return S_FALSE;
+
+  if (output_.empty()) {
+    // Closed once everything, GOAWAY in particular, is sent.
+    if (closing_) {
+      closed_ = true;
+      channel_->Close();
+    }
+
+    return S_FALSE;
+  }
+
+  writing_buffer_.swap(output_);
+  output_.clear();
+
+  auto result = channel_->WriteAsync(
+      writing_buffer_.data(), static_cast<int>(writing_buffer_.size()), this);
+  if (FAILED(result)) {
+    LOG(ERROR) << this << " failed to write: 0x" << std::hex << result;
+    Abort();
+    return result;
+  }
+
+  writing_ = true;
+
+  return S_OK;
+}
+
+void Http2Connection::Dispatch() {
+  std::vector<std::unique_ptr<io::Channel>> accepted;
+  auto ended = false;
+
+  {
+    base::AutoLock guard(lock_);
+
+    accepted.swap(accepted_);
+
+    if (closing_ && !reading_ && !writing_ && !ended_) {
+      ended_ = true;
+      ended = true;
+    }
+  }
+
+  // Outside the lock, as the delegate and the sessions call back into the
+  // connection.
+  for (auto& channel : accepted)
+    delegate_->OnStreamAccepted(std::move(channel));
+
+  if (ended)
+    delegate_->OnConnectionEnded(this);
+}
+
+void Http2Connection::OnRead(io::Channel* /*channel*/, HRESULT result,
+                             void* buffer, int length) {
+  ScopedCallback callback(this);
+
+  {
+    base::AutoLock guard(lock_);
+
+    reading_ = false;
+
+    if (FAILED(result) || length <= 0) {
+      LOG_IF(ERROR, FAILED(result) && !closed_)
+          << this << " failed to receive: 0x" << std::hex << result;
+      Abort();
+    } else if (!closing_) {
+      input_.append(static_cast<char*>(buffer), length);
+      ProcessInput();
+      StartStreams();
+
+      if (!closing_)
+        Read();
+
+      Write();
+    }
+  }
+
+  Dispatch();
+}
+
+void Http2Connection::OnWritten(io::Channel* /*channel*/, HRESULT result,
+                                void* /*buffer*/, int length) {
+  ScopedCallback callback(this);
+
+  {
+    base::AutoLock guard(lock_);
+
+    writing_ = false;
+
+    if (FAILED(result) || length != static_cast<int>(writing_buffer_.size())) {
+      LOG_IF(ERROR, !closed_) << this << " failed to send: 0x" << std::hex
+                              << result;
+      Abort();
+    } else {
+      writing_buffer_.clear();
+
+      // The streams held back go on.
+      if (!closing_)
+        FlushStreams();
+
+      Write();
+    }
+  }
+
+  Dispatch();
+}
+
+}  // namespace http
+}  // namespace service
+}  // namespace juno
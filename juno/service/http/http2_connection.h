@@ -0,0 +1,253 @@
+// Copyright (c) 2017 dacci.org
+
+#ifndef JUNO_SERVICE_HTTP_HTTP2_CONNECTION_H_
+#define JUNO_SERVICE_HTTP_HTTP2_CONNECTION_H_
+
+#include <windows.h>
+
+#include <base/atomic_ref_count.h>
+#include <base/synchronization/condition_variable.h>
+#include <base/synchronization/lock.h>
+
+#include <stdint.h>
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "io/channel.h"
+#include "misc/reclamation_queue.h"
+#include "service/http/http2_hpack.h"
+#include "service/http/http_buffer_pool.h"
+
+namespace juno {
+namespace service {
+namespace http {
+
+// An HTTP/2 connection, RFC 9113, at either end.
+// As a server, it takes a connection from a client, either in cleartext with
+// prior knowledge or over TLS negotiated by ALPN. Each stream opened by the
+// client is handed to the delegate as a channel of its own, which reads the
+// request as an HTTP/1.1 message and takes the response as such, so a stream
+// goes through a session just as an HTTP/1.1 connection does.
+// As a client, it multiplexes the streams created by CreateStream over one
+// connection. Each stream takes an HTTP/1.1 request written, and reads the
+// response as an HTTP/1.1 message.
+// CONNECT streams carry the tunnel in DATA frames once the response is sent.
+class Http2Connection : public std::enable_shared_from_this<Http2Connection>,
+                        public misc::ReclamationEntry,
+                        private io::Channel::Listener {
+ public:
+  enum class Role {
+    kClient,
+    kServer,
+  };
+
+  class __declspec(novtable) Delegate {
+   public:
+    virtual ~Delegate() {}
+
+    // Takes a stream opened by the client.
+    virtual void OnStreamAccepted(std::unique_ptr<io::Channel>&& stream) = 0;
+    // Called once the connection is closed and nothing is in progress. The
+    // connection must be released through a ReclamationQueue.
+    virtual void OnConnectionEnded(Http2Connection* connection) = 0;
+  };
+
+  static const char kPreface[];
+  static const size_t kPrefaceLength = 24;
+
+  Http2Connection(Role role, Delegate* delegate,
+                  std::shared_ptr<io::Channel> channel);
+  ~Http2Connection();
+
+  // Starts with |received|, what is read from the client so far, which must
+  // begin with the connection preface. As a client, |received| is empty and
+  // |channel| must be connected. It must be called once, even if stopped.
+  void Start(const std::string& received);
+  void Stop();
+  // Closes the connection after sending GOAWAY.
+  void Shutdown();
+
+  // Returns a new stream, or nullptr if no more streams can be created. The
+  // stream is opened when its request header is written. Client only.
+  std::unique_ptr<io::Channel> CreateStream();
+
+  // Pings the peer if nothing is received since the last call, and fails the
+  // connection if the ping sent by the last call is not acknowledged yet.
+  // Returns false if the connection is closed.
+  bool CheckHealth();
+
+  // Returns true if new streams may be created.
+  bool IsAvailable() const;
+  size_t GetStreamCount() const;
+
+  // Returns true if no callback of the channel is running on this connection.
+  bool IsReclaimable() {
+    return base::AtomicRefCountIsZero(&ref_count_);
+  }
+
+ private:
+  class ScopedCallback;
+  class StreamChannel;
+  struct Stream;
+  struct Completion;
+
+  // What the message written to a stream is parsed for.
+  enum class OutputState {
+    kHeader,
+    kLength,   // content of the length given
+    kChunked,  // chunked content, decoded
+    kRaw,      // content until the stream is closed, or the tunnel
+    kComplete,
+  };
+
+  static const size_t kMaxFrameSize = 16 * 1024;
+  static const size_t kMaxHeaderBlockSize = 64 * 1024;
+  static const uint32_t kMaxConcurrentStreams = 100;
+  static const int64_t kStreamWindowSize = 256 * 1024;
+  static const int64_t kConnectionWindowSize = 1024 * 1024;
+  // Writes to the streams are held back while this much is yet to be sent.
+  static const size_t kMaxPendingOutput = 256 * 1024;
+  static const uint32_t kMaxStreamId = 0x7FFFFFFF;
+
+  void ProcessInput();
+  bool ProcessFrame(uint8_t type, uint8_t flags, uint32_t stream_id,
+                    const char* payload, size_t length);
+  bool ProcessData(uint8_t flags, uint32_t stream_id, const char* payload,
+                   size_t length);
+  bool ProcessHeaders(uint8_t flags, uint32_t stream_id, const char* payload,
+                      size_t length);
+  bool ProcessHeaderBlock();
+  bool ProcessRstStream(uint32_t stream_id, const char* payload,
+                        size_t length);
+  bool ProcessSettings(uint8_t flags, uint32_t stream_id, const char* payload,
+                       size_t length);
+  bool ProcessPing(uint8_t flags, uint32_t stream_id, const char* payload,
+                   size_t length);
+  bool ProcessGoAway(uint32_t stream_id, const char* payload, size_t length);
+  bool ProcessWindowUpdate(uint32_t stream_id, const char* payload,
+                           size_t length);
+
+  // Server: opens a stream for the request received.
+  void OpenStream(uint32_t stream_id, const std::vector<HpackField>& fields,
+                  bool end_stream);
+  // Client: takes the response header received on |stream|.
+  void ReceiveResponse(Stream* stream, const std::vector<HpackField>& fields,
+                       bool end_stream);
+  void EndInput(Stream* stream, const std::vector<HpackField>* trailers);
+  // Client: sends the requests waiting for a stream ID, as far as the server
+  // allows.
+  void StartStreams();
+  bool CanCreateStream() const;
+  Stream* FindStream(uint32_t stream_id) const;
+  size_t CountOpenStreams() const;
+
+  HRESULT ReadStream(Stream* stream, void* buffer, int length,
+                     io::Channel::Listener* listener);
+  HRESULT WriteStream(Stream* stream, const void* buffer, int length,
+                      io::Channel::Listener* listener);
+  void CloseStream(Stream* stream);
+  void DetachStream(Stream* stream);
+
+  bool ProcessOutput(Stream* stream, const char* data, size_t length);
+  // Returns 1 if a header is processed, 0 if incomplete, or -1 on error.
+  int ProcessResponseHeader(Stream* stream);
+  int ProcessRequestHeader(Stream* stream);
+  void DeliverInput(Stream* stream);
+  void Credit(Stream* stream, int64_t length);
+  void FlushStream(Stream* stream);
+  void FlushStreams();
+  void ResetStream(Stream* stream, uint32_t error);
+  // Fails what is pending on |stream| without telling the peer.
+  void CancelStream(Stream* stream);
+  void CancelStreams();
+
+  void SendFrame(uint8_t type, uint8_t flags, uint32_t stream_id,
+                 const char* payload, size_t length);
+  void SendSettings();
+  void SendHeaders(Stream* stream, const std::string& block, bool end_stream);
+  void SendRstStream(uint32_t stream_id, uint32_t error);
+  void SendWindowUpdate(uint32_t stream_id, int64_t increment);
+  void Fail(uint32_t error);
+  void Abort();
+
+  void Post(Stream* stream, io::Channel::Listener* listener, bool read,
+            HRESULT result, void* buffer, int length);
+  static void CALLBACK OnCompleted(PTP_CALLBACK_INSTANCE instance,
+                                   void* context);
+
+  HRESULT Read();
+  HRESULT Write();
+  void Dispatch();
+
+  void OnRead(io::Channel* channel, HRESULT result, void* buffer,
+              int length) override;
+  void OnWritten(io::Channel* channel, HRESULT result, void* buffer,
+                 int length) override;
+
+  const Role role_;
+  Delegate* const delegate_;
+  std::shared_ptr<io::Channel> channel_;
+
+  // The connection is held by the delegate until this drops to zero, so that
+  // the channel is never destroyed from its own callback. Start counts as a
+  // callback until it returns.
+  base::AtomicRefCount ref_count_;
+
+  mutable base::Lock lock_;
+  base::ConditionVariable idle_;
+
+  bool started_;
+  bool closing_;
+  bool closed_;
+  bool reading_;
+  bool writing_;
+  bool ended_;
+  // The peer is going away, so no more streams are opened.
+  bool goaway_;
+
+  HttpBufferPool::Buffer buffer_;
+  std::string input_;
+  std::string output_;
+  std::string writing_buffer_;
+
+  bool settings_received_;
+  // The highest stream ID opened by either end.
+  uint32_t last_stream_id_;
+  // The stream whose header block is continued, 0 if none.
+  uint32_t continued_stream_;
+  uint8_t header_flags_;
+  std::string header_block_;
+  HpackDecoder decoder_;
+
+  // Set by the peer.
+  int64_t initial_window_size_;
+  size_t max_frame_size_;
+  uint32_t max_concurrent_streams_;
+
+  int64_t send_window_;
+  int64_t receive_window_;
+  // Received and consumed, but not yet given back to the peer.
+  int64_t unacknowledged_;
+
+  // Anything is received since the last health check.
+  bool received_;
+  bool ping_sent_;
+
+  std::map<uint32_t, std::unique_ptr<Stream>> streams_;
+  // Client streams not given an ID yet, in the order created.
+  std::vector<std::unique_ptr<Stream>> pending_;
+  // Streams opened during a callback, handed to the delegate after it.
+  std::vector<std::unique_ptr<io::Channel>> accepted_;
+
+  Http2Connection(const Http2Connection&) = delete;
+  Http2Connection& operator=(const Http2Connection&) = delete;
+};
+
+}  // namespace http
+}  // namespace service
+}  // namespace juno
+
+#endif  // JUNO_SERVICE_HTTP_HTTP2_CONNECTION_H_
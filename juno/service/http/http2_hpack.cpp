@@ -0,0 +1,436 @@
+// Copyright (c) 2017 dacci.org
+
+#include "service/http/http2_hpack.h"
+
+#include <utility>
+
+namespace juno {
+namespace service {
+namespace http {
+
+namespace {
+
+struct StaticEntry {
+  const char* name;
+  const char* value;
+};
+
+const StaticEntry kStaticTable[] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+const uint64_t kStaticTableSize =
+    sizeof(kStaticTable) / sizeof(kStaticTable[0]);
+
+// Each entry of the dynamic table costs this in addition to its strings.
+const size_t kEntryOverhead = 32;
+
+// The Huffman code of RFC 7541 is canonical, so only the code lengths are
+// kept and the codes are assigned in the order of the length and the symbol.
+const uint8_t kHuffmanLengths[] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+const int kEos = 256;
+const int kMinCodeLength = 5;
+const int kMaxCodeLength = 30;
+
+struct HuffmanTable {
+  uint32_t codes[kEos + 1];
+
+  // The symbols in the order of their codes, and for each length, the first
+  // code, the number of codes and the position of the first in |symbols|.
+  uint16_t symbols[kEos + 1];
+  uint32_t first[kMaxCodeLength + 1];
+  uint32_t count[kMaxCodeLength + 1];
+  uint32_t offset[kMaxCodeLength + 1];
+};
+
+HuffmanTable BuildHuffmanTable() {
+  HuffmanTable table = {};
+
+  auto index = 0;
+  for (auto length = 1; length <= kMaxCodeLength; ++length) {
+    for (auto symbol = 0; symbol <= kEos; ++symbol) {
+      if (kHuffmanLengths[symbol] == length)
+        table.symbols[index++] = static_cast<uint16_t>(symbol);
+    }
+  }
+
+  uint32_t code = 0;
+  index = 0;
+  for (auto length = 1; length <= kMaxCodeLength; ++length) {
+    table.first[length] = code;
+    table.offset[length] = index;
+
+    for (; index <= kEos; ++index) {
+      auto symbol = table.symbols[index];
+      if (kHuffmanLengths[symbol] != length)
+        break;
+
+      table.codes[symbol] = code++;
+    }
+
+    table.count[length] = index - table.offset[length];
+    code <<= 1;
+  }
+
+  return table;
+}
+
+const HuffmanTable& GetHuffmanTable() {
+  static const HuffmanTable table = BuildHuffmanTable();
+  return table;
+}
+
+bool HuffmanDecode(const uint8_t* data, size_t length, std::string* output) {
+  auto& table = GetHuffmanTable();
+
+  output->clear();
+  output->reserve(length + length / 2);
+
+  uint64_t bits = 0;
+  auto available = 0;
+  size_t offset = 0;
+
+  for (;;) {
+    for (; available <= 56 && offset < length; available += 8)
+      bits = bits << 8 | data[offset++];
+
+    // Codes of the same length are consecutive, and the longer ones begin
+    // after all the shorter ones.
+    auto code_length = kMinCodeLength;
+    uint32_t code = 0;
+    for (; code_length <= available && code_length <= kMaxCodeLength;
+         ++code_length) {
+      code = static_cast<uint32_t>(bits >> (available - code_length)) &
+             ((1u << code_length) - 1);
+      if (code - table.first[code_length] < table.count[code_length])
+        break;
+    }
+    if (code_length > available || code_length > kMaxCodeLength)
+      break;
+
+    auto symbol = table.symbols[table.offset[code_length] + code -
+                                table.first[code_length]];
+    if (symbol == kEos)
+      return false;
+
+    output->push_back(static_cast<char>(symbol));
+    available -= code_length;
+  }
+
+  // What is left must be the padding, the most significant bits of EOS.
+  if (available > 7)
+    return false;
+
+  auto padding = (1u << available) - 1;
+  return (bits & padding) == padding;
+}
+
+size_t GetHuffmanLength(const std::string& input) {
+  size_t bits = 0;
+  for (auto c : input)
+    bits += kHuffmanLengths[static_cast<uint8_t>(c)];
+
+  return (bits + 7) / 8;
+}
+
+void HuffmanEncode(const std::string& input, std::string* output) {
+  auto& table = GetHuffmanTable();
+
+  uint64_t bits = 0;
+  auto available = 0;
+
+  for (auto c : input) {
+    auto symbol = static_cast<uint8_t>(c);
+    bits = bits << kHuffmanLengths[symbol] | table.codes[symbol];
+    available += kHuffmanLengths[symbol];
+
+    for (; available >= 8; available -= 8)
+      output->push_back(static_cast<char>(bits >> (available - 8)));
+  }
+
+  if (available > 0)
+    output->push_back(
+        static_cast<char>(bits << (8 - available) | (0xFF >> available)));
+}
+
+bool DecodeInteger(const uint8_t* data, size_t length, size_t* offset,
+                   int prefix, uint64_t* value) {
+  if (*offset >= length)
+    return false;
+
+  uint64_t max = (1u << prefix) - 1;
+  *value = data[(*offset)++] & max;
+  if (*value < max)
+    return true;
+
+  // Nothing legitimate needs more than 35 bits.
+  for (auto shift = 0; shift <= 28; shift += 7) {
+    if (*offset >= length)
+      return false;
+
+    auto octet = data[(*offset)++];
+    *value += static_cast<uint64_t>(octet & 0x7F) << shift;
+    if ((octet & 0x80) == 0)
+      return true;
+  }
+
+  return false;
+}
+
+bool DecodeString(const uint8_t* data, size_t length, size_t* offset,
+                  std::string* output) {
+  if (*offset >= length)
+    return false;
+
+  auto huffman = (data[*offset] & 0x80) != 0;
+
+  uint64_t size;
+  if (!DecodeInteger(data, length, offset, 7, &size) ||
+      size > length - *offset)
+    return false;
+
+  auto start = data + *offset;
+  *offset += static_cast<size_t>(size);
+
+  if (huffman)
+    return HuffmanDecode(start, static_cast<size_t>(size), output);
+
+  output->assign(reinterpret_cast<const char*>(start),
+                 static_cast<size_t>(size));
+  return true;
+}
+
+void EncodeInteger(uint8_t flags, int prefix, uint64_t value,
+                   std::string* output) {
+  uint64_t max = (1u << prefix) - 1;
+  if (value < max) {
+    output->push_back(static_cast<char>(flags | value));
+    return;
+  }
+
+  output->push_back(static_cast<char>(flags | max));
+  for (value -= max; value >= 0x80; value >>= 7)
+    output->push_back(static_cast<char>((value & 0x7F) | 0x80));
+  output->push_back(static_cast<char>(value));
+}
+
+void EncodeString(const std::string& input, std::string* output) {
+  auto length = GetHuffmanLength(input);
+  if (length < input.size()) {
+    EncodeInteger(0x80, 7, length, output);
+    HuffmanEncode(input, output);
+  } else {
+    EncodeInteger(0x00, 7, input.size(), output);
+    output->append(input);
+  }
+}
+
+}  // namespace
+
+HpackDecoder::HpackDecoder() : table_size_(0), max_size_(kMaxTableSize) {}
+
+HpackDecoder::~HpackDecoder() {}
+
+bool HpackDecoder::Decode(const char* data, size_t length,
+                          std::vector<HpackField>* fields) {
+  auto input = reinterpret_cast<const uint8_t*>(data);
+  size_t offset = 0;
+  auto leading = true;
+
+  while (offset < length) {
+    auto octet = input[offset];
+    uint64_t index;
+
+    if (octet & 0x80) {
+      // Indexed header field.
+      HpackField field;
+      if (!DecodeInteger(input, length, &offset, 7, &index) ||
+          !GetField(index, &field))
+        return false;
+
+      fields->push_back(std::move(field));
+    } else if ((octet & 0xE0) == 0x20) {
+      // Dynamic table size update, only allowed at the beginning.
+      if (!leading || !DecodeInteger(input, length, &offset, 5, &index) ||
+          index > kMaxTableSize)
+        return false;
+
+      max_size_ = static_cast<size_t>(index);
+      Evict(max_size_);
+      continue;
+    } else {
+      // Literal header field, with incremental indexing if 01xxxxxx, or
+      // without indexing or never indexed otherwise.
+      auto indexing = (octet & 0x40) != 0;
+
+      HpackField field;
+      if (!DecodeInteger(input, length, &offset, indexing ? 6 : 4, &index))
+        return false;
+
+      if (index == 0) {
+        if (!DecodeString(input, length, &offset, &field.name))
+          return false;
+      } else if (!GetField(index, &field)) {
+        return false;
+      }
+
+      if (!DecodeString(input, length, &offset, &field.value))
+        return false;
+
+      if (indexing)
+        Insert(field);
+
+      fields->push_back(std::move(field));
+    }
+
+    leading = false;
+  }
+
+  return true;
+}
+
+bool HpackDecoder::GetField(uint64_t index, HpackField* field) const {
+  if (index == 0)
+    return false;
+
+  if (index <= kStaticTableSize) {
+    auto& entry = kStaticTable[index - 1];
+    field->name = entry.name;
+    field->value = entry.value;
+    return true;
+  }
+
+  index -= kStaticTableSize + 1;
+  if (index >= table_.size())
+    return false;
+
+  *field = table_[static_cast<size_t>(index)];
+  return true;
+}
+
+void HpackDecoder::Insert(const HpackField& field) {
+  auto size = field.name.size() + field.value.size() + kEntryOverhead;
+  if (size > max_size_) {
+    Evict(0);
+    return;
+  }
+
+  Evict(max_size_ - size);
+  table_.push_front(field);
+  table_size_ += size;
+}
+
+void HpackDecoder::Evict(size_t max_size) {
+  while (table_size_ > max_size) {
+    auto& field = table_.back();
+    table_size_ -= field.name.size() + field.value.size() + kEntryOverhead;
+    table_.pop_back();
+  }
+}
+
+void HpackEncoder::Encode(const std::string& name, const std::string& value,
+                          std::string* output) {
+  uint64_t name_index = 0;
+  for (uint64_t i = 0; i < kStaticTableSize; ++i) {
+    auto& entry = kStaticTable[i];
+    if (name.compare(entry.name) != 0)
+      continue;
+
+    if (value.compare(entry.value) == 0) {
+      EncodeInteger(0x80, 7, i + 1, output);
+      return;
+    }
+
+    if (name_index == 0)
+      name_index = i + 1;
+  }
+
+  // Literal header field without indexing.
+  EncodeInteger(0x00, 4, name_index, output);
+  if (name_index == 0)
+    EncodeString(name, output);
+  EncodeString(value, output);
+}
+
+}  // namespace http
+}  // namespace service
+}  // namespace juno
@@ -0,0 +1,69 @@
+// Copyright (c) 2017 dacci.org
+
+#ifndef JUNO_SERVICE_HTTP_HTTP2_HPACK_H_
+#define JUNO_SERVICE_HTTP_HTTP2_HPACK_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <deque>
+#include <string>
+#include <vector>
+
+namespace juno {
+namespace service {
+namespace http {
+
+// Header compression for HTTP/2, as specified by RFC 7541.
+
+struct HpackField {
+  std::string name;
+  std::string value;
+};
+
+class HpackDecoder {
+ public:
+  // The size of the dynamic table, which is the default of
+  // SETTINGS_HEADER_TABLE_SIZE and never changed by this end.
+  static const size_t kMaxTableSize = 4096;
+
+  HpackDecoder();
+  ~HpackDecoder();
+
+  // Decodes a complete header block into |fields|. Returns false on a
+  // compression error, after which the decoder must not be used any more as
+  // the dynamic table is out of sync with the peer.
+  bool Decode(const char* data, size_t length, std::vector<HpackField>* fields);
+
+ private:
+  bool GetField(uint64_t index, HpackField* field) const;
+  void Insert(const HpackField& field);
+  void Evict(size_t max_size);
+
+  // Most recent entries first, as they are indexed.
+  std::deque<HpackField> table_;
+  size_t table_size_;
+  size_t max_size_;
+
+  HpackDecoder(const HpackDecoder&) = delete;
+  HpackDecoder& operator=(const HpackDecoder&) = delete;
+};
+
+// Encodes with the static table and Huffman code only. The dynamic table is
+// left empty, so the encoder is stateless and the peer's table size is of no
+// concern.
+class HpackEncoder {
+ public:
+  // Appends |name| and |value| to |output|. |name| must be in lower case.
+  static void Encode(const std::string& name, const std::string& value,
+                     std::string* output);
+
+ private:
+  HpackEncoder() = delete;
+};
+
+}  // namespace http
+}  // namespace service
+}  // namespace juno
+
+#endif  // JUNO_SERVICE_HTTP_HTTP2_HPACK_H_
@@ -0,0 +1,332 @@
+// Copyright (c) 2017 dacci.org
+
+#include "service/http/http2_upstream.h"
+
+#include <base/logging.h>
+#include <base/values.h>
+
+#include <algorithm>
+#include <utility>
+
+namespace juno {
+namespace service {
+namespace http {
+
+using ::juno::io::net::SocketChannel;
+using ::juno::io::net::SocketResolver;
+
+Http2Upstream* Http2Upstream::instance_ = nullptr;
+
+HRESULT Http2Upstream::Init() {
+  Term();
+
+  instance_ = new Http2Upstream();
+  if (instance_ == nullptr)
+    return E_OUTOFMEMORY;
+
+  auto result = instance_->Start();
+  if (FAILED(result))
+    Term();
+
+  return result;
+}
+
+void Http2Upstream::Term() {
+  if (instance_ != nullptr) {
+    delete instance_;
+    instance_ = nullptr;
+  }
+}
+
+std::unique_ptr<io::Channel> Http2Upstream::Open(const std::string& host,
+                                                 int port) {
+  if (instance_ == nullptr)
+    return nullptr;
+
+  return instance_->OpenImpl(host, port);
+}
+
+void Http2Upstream::GetStatistics(base::DictionaryValue* stats) {
+  if (instance_ != nullptr)
+    instance_->GetStatisticsImpl(stats);
+}
+
+Http2Upstream::Http2Upstream()
+    : empty_(&lock_),
+      streams_(0),
+      opened_(0),
+      failed_(0),
+      expired_(0),
+      reclamation_(this) {}
+
+Http2Upstream::~Http2Upstream() {
+  timer_.reset();
+
+  std::vector<std::shared_ptr<Http2Connection>> connections;
+
+  {
+    base::AutoLock guard(lock_);
+
+    for (auto& pair : entries_)
+      connections.push_back(pair.second.connection);
+  }
+
+  // Each ends through OnConnectionEnded, so the lock must not be held.
+  for (auto& connection : connections)
+    connection->Stop();
+  connections.clear();
+
+  base::AutoLock guard(lock_);
+
+  while (!entries_.empty())
+    empty_.Wait();
+}
+
+HRESULT Http2Upstream::Start() {
+  timer_ = misc::TimerService::GetDefault()->Create(this);
+  if (timer_ == nullptr) {
+    LOG(ERROR) << "Failed to create timer.";
+    return E_OUTOFMEMORY;
+  }
+
+  timer_->Start(kSweepInterval, kSweepInterval);
+
+  return S_OK;
+}
+
+std::unique_ptr<io::Channel> Http2Upstream::OpenImpl(const std::string& host,
+                                                     int port) {
+  auto key = MakeKey(host, port);
+
+  {
+    base::AutoLock guard(lock_);
+
+    auto stream = CreateStream(key);
+    if (stream != nullptr)
+      return stream;
+  }
+
+  // Resolved out of the lock, as it may take a while.
+  auto resolver = std::make_unique<SocketResolver>();
+  auto result = resolver->Resolve(host, port);
+  if (FAILED(result)) {
+    LOG(WARNING) << "Failed to resolve " << key << ": 0x" << std::hex
+                 << result;
+    return nullptr;
+  }
+
+  auto socket = std::make_shared<SocketChannel>();
+  auto connection = std::make_shared<Http2Connection>(
+      Http2Connection::Role::kClient, this, socket);
+  // Not held here once added, as it may be reclaimed as soon as started.
+  auto pointer = connection.get();
+  std::unique_ptr<io::Channel> stream;
+  const addrinfo* end_point;
+
+  {
+    base::AutoLock guard(lock_);
+
+    // Another one may have been opened meanwhile.
+    stream = CreateStream(key);
+    if (stream != nullptr)
+      return stream;
+
+    stream = pointer->CreateStream();
+    if (stream == nullptr)
+      return nullptr;
+
+    DLOG(INFO) << pointer << " connecting to " << key;
+
+    ++opened_;
+    ++streams_;
+    hosts_[key].push_back(pointer);
+
+    auto& entry = entries_[pointer];
+    entry.key = key;
+    entry.connection = std::move(connection);
+    entry.socket = socket.get();
+    entry.resolver = std::move(resolver);
+    entry.last_used = GetTickCount64();
+    end_point = entry.resolver->begin()->get();
+  }
+
+  result = socket->ConnectAsync(end_point, this);
+  if (FAILED(result)) {
+    LOG(WARNING) << "Failed to connect to " << key << ": 0x" << std::hex
+                 << result;
+    stream.reset();
+    pointer->Stop();
+    pointer->Start(std::string());
+    return nullptr;
+  }
+
+  // The request written meanwhile is sent once connected.
+  return stream;
+}
+
+std::unique_ptr<io::Channel> Http2Upstream::CreateStream(
+    const std::string& key) {
+  lock_.AssertAcquired();
+
+  auto found = hosts_.find(key);
+  if (found == hosts_.end())
+    return nullptr;
+
+  Http2Connection* least_loaded = nullptr;
+  size_t least_streams = 0, available = 0;
+  for (auto connection : found->second) {
+    if (!connection->IsAvailable())
+      continue;
+
+    ++available;
+
+    auto streams = connection->GetStreamCount();
+    if (least_loaded == nullptr || streams < least_streams) {
+      least_loaded = connection;
+      least_streams = streams;
+    }
+  }
+
+  if (least_loaded == nullptr ||
+      (least_streams >= kStreamsPerConnection &&
+       available < kMaxConnectionsPerHost))
+    return nullptr;
+
+  // Queued on the connection if the server allows no more streams.
+  auto stream = least_loaded->CreateStream();
+  if (stream == nullptr)
+    return nullptr;
+
+  ++streams_;
+  entries_.at(least_loaded).last_used = GetTickCount64();
+
+  return stream;
+}
+
+void Http2Upstream::GetStatisticsImpl(base::DictionaryValue* stats) {
+  base::AutoLock guard(lock_);
+
+  size_t streams = 0;
+  for (auto& pair : entries_)
+    streams += pair.first->GetStreamCount();
+
+  stats->SetInteger("connections", static_cast<int>(entries_.size()));
+  stats->SetInteger("hosts", static_cast<int>(hosts_.size()));
+  stats->SetInteger("streams", static_cast<int>(streams));
+  stats->SetDouble("streams_opened", static_cast<double>(streams_));
+  stats->SetDouble("opened", static_cast<double>(opened_));
+  stats->SetDouble("failed", static_cast<double>(failed_));
+  stats->SetDouble("expired", static_cast<double>(expired_));
+}
+
+void Http2Upstream::Reclaim(
+    std::vector<Http2Connection*>* connections,
+    std::vector<std::unique_ptr<Http2Connection>>* /*reclaimed*/) {
+  // The last references are dropped out of the lock.
+  std::vector<std::shared_ptr<Http2Connection>> released;
+
+  base::AutoLock guard(lock_);
+
+  auto end = std::remove_if(
+      connections->begin(), connections->end(),
+      [&](Http2Connection* connection) {
+        if (!connection->IsReclaimable())
+          return false;
+
+        auto found = entries_.find(connection);
+        if (found == entries_.end()) {
+          DLOG(WARNING) << connection << " connection not found";
+          return true;
+        }
+
+        auto& host = hosts_[found->second.key];
+        host.erase(std::remove(host.begin(), host.end(), connection),
+                   host.end());
+        if (host.empty())
+          hosts_.erase(found->second.key);
+
+        released.push_back(std::move(found->second.connection));
+        entries_.erase(found);
+
+        return true;
+      });
+  connections->erase(end, connections->end());
+
+  if (entries_.empty())
+    empty_.Broadcast();
+}
+
+void Http2Upstream::OnTimeout() {
+  std::vector<std::shared_ptr<Http2Connection>> idle, active;
+
+  {
+    base::AutoLock guard(lock_);
+
+    auto now = GetTickCount64();
+    for (auto& pair : entries_) {
+      auto& entry = pair.second;
+      if (entry.resolver != nullptr || !pair.first->IsAvailable())
+        continue;
+
+      if (pair.first->GetStreamCount() == 0 &&
+          now - entry.last_used >= kIdleTimeout) {
+        ++expired_;
+        idle.push_back(entry.connection);
+      } else {
+        active.push_back(entry.connection);
+      }
+    }
+  }
+
+  for (auto& connection : idle)
+    connection->Shutdown();
+
+  for (auto& connection : active) {
+    if (!connection->CheckHealth())
+      DLOG(WARNING) << connection.get() << " connection lost";
+  }
+}
+
+void Http2Upstream::OnConnected(SocketChannel* socket, HRESULT result) {
+  Http2Connection* connection = nullptr;
+  std::unique_ptr<SocketResolver> resolver;
+
+  {
+    base::AutoLock guard(lock_);
+
+    for (auto& pair : entries_) {
+      if (pair.second.socket == socket) {
+        connection = pair.first;
+        resolver = std::move(pair.second.resolver);
+        break;
+      }
+    }
+
+    if (connection != nullptr && FAILED(result))
+      ++failed_;
+  }
+
+  if (connection == nullptr)
+    return;
+
+  if (FAILED(result)) {
+    LOG(WARNING) << connection << " failed to connect: 0x" << std::hex
+                 << result;
+    connection->Stop();
+  }
+
+  // Not released until started.
+  connection->Start(std::string());
+}
+
+void Http2Upstream::OnConnectionEnded(Http2Connection* connection) {
+  reclamation_.Retire(connection);
+}
+
+std::string Http2Upstream::MakeKey(const std::string& host, int port) {
+  return host + ":" + std::to_string(port);
+}
+
+}  // namespace http
+}  // namespace service
+}  // namespace juno
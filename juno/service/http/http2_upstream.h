@@ -0,0 +1,125 @@
+// Copyright (c) 2017 dacci.org
+
+#ifndef JUNO_SERVICE_HTTP_HTTP2_UPSTREAM_H_
+#define JUNO_SERVICE_HTTP_HTTP2_UPSTREAM_H_
+
+#include <windows.h>
+
+#include <base/synchronization/condition_variable.h>
+#include <base/synchronization/lock.h>
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "io/net/socket_channel.h"
+#include "io/net/socket_resolver.h"
+#include "misc/reclamation_queue.h"
+#include "misc/timer_service.h"
+#include "service/http/http2_connection.h"
+
+namespace base {
+
+class DictionaryValue;
+
+}  // namespace base
+
+namespace juno {
+namespace service {
+namespace http {
+
+// Multiplexes the requests to remote proxies over HTTP/2 connections, keyed
+// by the host and port of the proxy. A request goes on the least loaded
+// connection, and another connection is opened while all of them are busy,
+// up to a few per proxy.
+// Connections are pinged while in use, and shut down once idle for a while.
+class Http2Upstream : private io::net::SocketChannel::Listener,
+                      private Http2Connection::Delegate,
+                      private misc::TimerService::Callback {
+ public:
+  static HRESULT Init();
+  static void Term();
+
+  // Returns a new stream to the proxy at |host|:|port|, or nullptr on
+  // failure. The stream takes a request written as an HTTP/1.1 message to a
+  // proxy, and reads the response as such. It carries a single exchange.
+  static std::unique_ptr<io::Channel> Open(const std::string& host, int port);
+
+  static void GetStatistics(base::DictionaryValue* stats);
+
+ private:
+  friend class misc::ReclamationQueue<Http2Connection, Http2Upstream>;
+
+  static const size_t kMaxConnectionsPerHost = 4;
+  // Another connection is opened once this many streams are on each.
+  static const size_t kStreamsPerConnection = 100;
+  static const DWORD kIdleTimeout = 30 * 1000;   // 30 sec
+  static const DWORD kSweepInterval = 5 * 1000;  // 5 sec
+
+  struct Entry {
+    std::string key;
+    std::shared_ptr<Http2Connection> connection;
+    io::net::SocketChannel* socket;
+    // Held until connected, as the socket refers to the address.
+    std::unique_ptr<io::net::SocketResolver> resolver;
+    ULONGLONG last_used;
+  };
+
+  typedef std::unordered_map<Http2Connection*, Entry> EntryMap;
+  typedef std::unordered_map<std::string, std::vector<Http2Connection*>>
+      HostMap;
+
+  Http2Upstream();
+  ~Http2Upstream();
+
+  HRESULT Start();
+
+  std::unique_ptr<io::Channel> OpenImpl(const std::string& host, int port);
+  // Returns a stream on a connection to |key| unless another connection
+  // should be opened.
+  std::unique_ptr<io::Channel> CreateStream(const std::string& key);
+  void GetStatisticsImpl(base::DictionaryValue* stats);
+
+  void Reclaim(std::vector<Http2Connection*>* connections,
+               std::vector<std::unique_ptr<Http2Connection>>* reclaimed);
+
+  void OnTimeout() override;
+
+  void OnConnected(io::net::SocketChannel* socket, HRESULT result) override;
+  void OnClosed(io::net::SocketChannel* /*socket*/,
+                HRESULT /*result*/) override {}
+
+  void OnStreamAccepted(std::unique_ptr<io::Channel>&& /*stream*/) override {
+    // Servers never open streams.
+  }
+  void OnConnectionEnded(Http2Connection* connection) override;
+
+  static std::string MakeKey(const std::string& host, int port);
+
+  static Http2Upstream* instance_;
+
+  base::Lock lock_;
+  base::ConditionVariable empty_;
+  EntryMap entries_;
+  HostMap hosts_;
+
+  uint64_t streams_;
+  uint64_t opened_;
+  uint64_t failed_;
+  uint64_t expired_;
+
+  std::unique_ptr<misc::TimerService::Timer> timer_;
+  misc::ReclamationQueue<Http2Connection, Http2Upstream> reclamation_;
+
+  Http2Upstream(const Http2Upstream&) = delete;
+  Http2Upstream& operator=(const Http2Upstream&) = delete;
+};
+
+}  // namespace http
+}  // namespace service
+}  // namespace juno
+
+#endif  // JUNO_SERVICE_HTTP_HTTP2_UPSTREAM_H_
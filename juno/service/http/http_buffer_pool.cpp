@@ -0,0 +1,173 @@
+// Copyright (c) 2017 dacci.org
+
+#include "service/http/http_buffer_pool.h"
+
+#include <base/values.h>
+
+#include <new>
+#include <utility>
+
+namespace juno {
+namespace service {
+namespace http {
+
+HttpBufferPool* HttpBufferPool::instance_ = nullptr;
+
+HttpBufferPool::Buffer::Buffer(Buffer&& other)
+    : data_(other.data_), size_(other.size_) {
+  other.data_ = nullptr;
+  other.size_ = 0;
+}
+
+HttpBufferPool::Buffer::~Buffer() {
+  Reset();
+}
+
+HttpBufferPool::Buffer& HttpBufferPool::Buffer::operator=(Buffer&& other) {
+  if (this != &other) {
+    Reset();
+
+    data_ = other.data_;
+    size_ = other.size_;
+    other.data_ = nullptr;
+    other.size_ = 0;
+  }
+
+  return *this;
+}
+
+void HttpBufferPool::Buffer::Reset() {
+  if (data_ != nullptr) {
+    HttpBufferPool::Release(data_, size_);
+    data_ = nullptr;
+    size_ = 0;
+  }
+}
+
+HRESULT HttpBufferPool::Init() {
+  Term();
+
+  instance_ = new HttpBufferPool();
+  if (instance_ == nullptr)
+    return E_OUTOFMEMORY;
+
+  return S_OK;
+}
+
+void HttpBufferPool::Term() {
+  if (instance_ != nullptr) {
+    delete instance_;
+    instance_ = nullptr;
+  }
+}
+
+HttpBufferPool::Buffer HttpBufferPool::Acquire(size_t size) {
+  auto index = GetIndex(size);
+
+  if (instance_ != nullptr)
+    return instance_->AcquireImpl(index);
+
+  auto data = new (std::nothrow) char[GetSize(index)];
+  if (data == nullptr)
+    return Buffer();
+
+  return Buffer(data, GetSize(index));
+}
+
+void HttpBufferPool::GetStatistics(base::DictionaryValue* stats) {
+  if (instance_ != nullptr)
+    instance_->GetStatisticsImpl(stats);
+}
+
+HttpBufferPool::HttpBufferPool()
+    : in_use_(), reused_(0), allocated_(0), freed_(0) {}
+
+HttpBufferPool::~HttpBufferPool() {
+  for (auto& idle : idle_) {
+    for (auto data : idle)
+      delete[] data;
+  }
+}
+
+HttpBufferPool::Buffer HttpBufferPool::AcquireImpl(int index) {
+  {
+    base::AutoLock guard(lock_);
+
+    ++in_use_[index];
+
+    auto& idle = idle_[index];
+    if (!idle.empty()) {
+      auto data = idle.back();
+      idle.pop_back();
+      ++reused_;
+      return Buffer(data, GetSize(index));
+    }
+
+    ++allocated_;
+  }
+
+  // Allocated out of the lock, as it may take a while.
+  auto data = new (std::nothrow) char[GetSize(index)];
+  if (data == nullptr) {
+    base::AutoLock guard(lock_);
+    --in_use_[index];
+    --allocated_;
+    return Buffer();
+  }
+
+  return Buffer(data, GetSize(index));
+}
+
+void HttpBufferPool::ReleaseImpl(char* data, int index) {
+  {
+    base::AutoLock guard(lock_);
+
+    --in_use_[index];
+
+    auto& idle = idle_[index];
+    if (idle.size() < kMaxIdleSize / GetSize(index)) {
+      idle.push_back(data);
+      return;
+    }
+
+    ++freed_;
+  }
+
+  delete[] data;
+}
+
+void HttpBufferPool::GetStatisticsImpl(base::DictionaryValue* stats) {
+  base::AutoLock guard(lock_);
+
+  size_t in_use = 0;
+  size_t idle = 0;
+  for (auto i = 0; i < kSizeCount; ++i) {
+    in_use += in_use_[i] * GetSize(i);
+    idle += idle_[i].size() * GetSize(i);
+  }
+
+  stats->SetDouble("in_use", static_cast<double>(in_use));
+  stats->SetDouble("idle", static_cast<double>(idle));
+  stats->SetDouble("reused", static_cast<double>(reused_));
+  stats->SetDouble("allocated", static_cast<double>(allocated_));
+  stats->SetDouble("freed", static_cast<double>(freed_));
+}
+
+int HttpBufferPool::GetIndex(size_t size) {
+  auto index = 0;
+  while (index < kSizeCount - 1 && GetSize(index) < size)
+    ++index;
+
+  return index;
+}
+
+void HttpBufferPool::Release(char* data, size_t size) {
+  if (instance_ != nullptr)
+    instance_->ReleaseImpl(data, GetIndex(size));
+  else
+    delete[] data;
+}
+
+}  // namespace http
+}  // namespace service
+}  // namespace juno
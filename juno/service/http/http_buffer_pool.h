@@ -0,0 +1,109 @@
+// Copyright (c) 2017 dacci.org
+
+#ifndef JUNO_SERVICE_HTTP_HTTP_BUFFER_POOL_H_
+#define JUNO_SERVICE_HTTP_HTTP_BUFFER_POOL_H_
+
+#include <windows.h>
+
+#include <base/synchronization/lock.h>
+
+#include <stdint.h>
+
+#include <vector>
+
+namespace base {
+
+class DictionaryValue;
+
+}  // namespace base
+
+namespace juno {
+namespace service {
+namespace http {
+
+// Recycles the I/O buffers of all the HTTP proxy sessions. Buffers come in a
+// few sizes, each four times the previous one, and a limited amount of each
+// size is kept while unused.
+class HttpBufferPool {
+ public:
+  static const size_t kMinSize = 4 * 1024;    // 4 KiB
+  static const size_t kMaxSize = 256 * 1024;  // 256 KiB
+
+  // A buffer taken from the pool, returned to it when destroyed.
+  class Buffer {
+   public:
+    Buffer() : data_(nullptr), size_(0) {}
+    Buffer(Buffer&& other);
+    ~Buffer();
+
+    Buffer& operator=(Buffer&& other);
+
+    char* data() const {
+      return data_;
+    }
+
+    size_t size() const {
+      return size_;
+    }
+
+   private:
+    friend class HttpBufferPool;
+
+    Buffer(char* data, size_t size) : data_(data), size_(size) {}
+
+    void Reset();
+
+    char* data_;
+    size_t size_;
+
+    Buffer(const Buffer&) = delete;
+    Buffer& operator=(const Buffer&) = delete;
+  };
+
+  static HRESULT Init();
+  static void Term();
+
+  // Returns a buffer of |size| rounded up to one of the sizes, but at most
+  // kMaxSize. The buffer is empty if out of memory.
+  static Buffer Acquire(size_t size);
+
+  static void GetStatistics(base::DictionaryValue* stats);
+
+ private:
+  static const int kSizeCount = 4;
+  // The amount of buffers kept for each size.
+  static const size_t kMaxIdleSize = 4 * 1024 * 1024;  // 4 MiB
+
+  HttpBufferPool();
+  ~HttpBufferPool();
+
+  Buffer AcquireImpl(int index);
+  void ReleaseImpl(char* data, int index);
+  void GetStatisticsImpl(base::DictionaryValue* stats);
+
+  static int GetIndex(size_t size);
+  static size_t GetSize(int index) {
+    return kMinSize << (index * 2);
+  }
+
+  static void Release(char* data, size_t size);
+
+  static HttpBufferPool* instance_;
+
+  base::Lock lock_;
+  std::vector<char*> idle_[kSizeCount];
+  size_t in_use_[kSizeCount];
+
+  uint64_t reused_;
+  uint64_t allocated_;
+  uint64_t freed_;
+
+  HttpBufferPool(const HttpBufferPool&) = delete;
+  HttpBufferPool& operator=(const HttpBufferPool&) = delete;
+};
+
+}  // namespace http
+}  // namespace service
+}  // namespace juno
+
+#endif  // JUNO_SERVICE_HTTP_HTTP_BUFFER_POOL_H_
@@ -0,0 +1,606 @@
+// Copyright (c) 2017 dacci.org
+
+#include "service/http/http_cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <base/logging.h>
+#include <base/values.h>
+
+#include <algorithm>
+#include <utility>
+
+#include "service/http/http_disk_cache.h"
+#include "service/http/http_request.h"
+#include "service/http/http_response.h"
+#include "service/http/http_util.h"
+
+namespace juno {
+namespace service {
+namespace http {
+namespace {
+
+using http_util::ForEachElement;
+
+const std::string kAge("Age");
+const std::string kAuthorization("Authorization");
+const std::string kDate("Date");
+const std::string kExpires("Expires");
+const std::string kIfModifiedSince("If-Modified-Since");
+const std::string kIfNoneMatch("If-None-Match");
+const std::string kLastModified("Last-Modified");
+const std::string kPragma("Pragma");
+const std::string kSetCookie("Set-Cookie");
+
+const char* const kConditionals[] = {
+    "If-Match", "If-None-Match", "If-Modified-Since", "If-Unmodified-Since",
+    "If-Range",
+};
+
+// Upper bound of the heuristic freshness, RFC 9111 4.2.2.
+const int64_t kMaxHeuristicFreshness = 24 * 60 * 60;  // 1 day
+
+struct CacheControl {
+  bool no_store = false;
+  bool no_cache = false;
+  bool is_private = false;
+  bool is_public = false;
+  bool must_revalidate = false;
+  int64_t max_age = -1;
+  int64_t s_maxage = -1;
+};
+
+template <class Headers>
+const std::string* FindHeader(const Headers& headers, const std::string& name) {
+  for (auto& pair : headers) {
+    if (_stricmp(pair.first.c_str(), name.c_str()) == 0)
+      return &pair.second;
+  }
+
+  return nullptr;
+}
+
+int64_t ParseSeconds(const std::string& value) {
+  auto start = value.c_str();
+  if (*start == '"')
+    ++start;
+
+  char* end;
+  auto seconds = _strtoi64(start, &end, 10);
+  if (end == start || seconds < 0)
+    return 0;
+
+  return seconds;
+}
+
+template <class Headers>
+void ParseCacheControl(const Headers& headers, CacheControl* control) {
+  for (auto& pair : headers) {
+    if (_stricmp(pair.first.c_str(), kCacheControl.c_str()) != 0)
+      continue;
+
+    ForEachElement(pair.second, [control](const std::string& directive) {
+      auto name = directive.substr(0, directive.find('='));
+      auto value = name.size() < directive.size()
+                       ? directive.substr(name.size() + 1)
+                       : std::string();
+
+      if (_stricmp(name.c_str(), "no-store") == 0)
+        control->no_store = true;
+      else if (_stricmp(name.c_str(), "no-cache") == 0)
+        control->no_cache = true;
+      else if (_stricmp(name.c_str(), "private") == 0)
+        control->is_private = true;
+      else if (_stricmp(name.c_str(), "public") == 0)
+        control->is_public = true;
+      else if (_stricmp(name.c_str(), "must-revalidate") == 0 ||
+               _stricmp(name.c_str(), "proxy-revalidate") == 0)
+        control->must_revalidate = true;
+      else if (_stricmp(name.c_str(), "max-age") == 0)
+        control->max_age = ParseSeconds(value);
+      else if (_stricmp(name.c_str(), "s-maxage") == 0)
+        control->s_maxage = ParseSeconds(value);
+    });
+  }
+}
+
+bool ParseTime(const std::string* value, base::Time* time) {
+  return value != nullptr && base::Time::FromUTCString(value->c_str(), time);
+}
+
+bool IsHeuristicallyCacheable(int status) {
+  switch (status) {
+    case 200:
+    case 203:
+    case 204:
+    case 300:
+    case 301:
+    case 308:
+    case 404:
+    case 405:
+    case 410:
+    case 414:
+    case 501:
+      return true;
+
+    default:
+      return false;
+  }
+}
+
+}  // namespace
+
+class HttpCache::MemoryWriter : public HttpCache::Writer {
+ public:
+  MemoryWriter(const std::string& key, std::unique_ptr<Entry>&& entry,
+               int64_t length)
+      : key_(key), entry_(std::move(entry)), length_(length) {
+    body_.reserve(static_cast<size_t>(length));
+  }
+
+  void Append(const char* data, size_t length) override {
+    body_.append(data, length);
+  }
+
+  void Commit() override {
+    if (instance_ == nullptr || entry_ == nullptr ||
+        static_cast<int64_t>(body_.size()) != length_)
+      return;
+
+    auto body = std::make_shared<const std::string>(std::move(body_));
+    if (body == nullptr)
+      return;
+
+    entry_->body = std::shared_ptr<const char>(body, body->data());
+    entry_->body_size = body->size();
+    instance_->StoreImpl(key_, std::move(entry_));
+  }
+
+ private:
+  const std::string key_;
+  std::unique_ptr<Entry> entry_;
+  const int64_t length_;
+  std::string body_;
+
+  MemoryWriter(const MemoryWriter&) = delete;
+  MemoryWriter& operator=(const MemoryWriter&) = delete;
+};
+
+HttpCache* HttpCache::instance_ = nullptr;
+
+HRESULT HttpCache::Init() {
+  Term();
+
+  instance_ = new HttpCache();
+  if (instance_ == nullptr)
+    return E_OUTOFMEMORY;
+
+  return S_OK;
+}
+
+void HttpCache::Term() {
+  if (instance_ != nullptr) {
+    delete instance_;
+    instance_ = nullptr;
+  }
+}
+
+std::string HttpCache::GetKey(const std::string& url) {
+  return "GET " + url;
+}
+
+bool HttpCache::IsConditional(const HttpRequest& request) {
+  for (auto name : kConditionals) {
+    if (FindHeader(request, name) != nullptr)
+      return true;
+  }
+
+  return false;
+}
+
+std::shared_ptr<const HttpCache::Entry> HttpCache::Lookup(
+    const std::string& key, const HttpRequest& request) {
+  if (instance_ == nullptr)
+    return nullptr;
+
+  return instance_->LookupImpl(key, request);
+}
+
+bool HttpCache::IsFresh(const Entry& entry, const HttpRequest& request,
+                        base::Time now) {
+  if (entry.no_cache)
+    return false;
+
+  CacheControl control;
+  ParseCacheControl(request, &control);
+
+  if (FindHeader(request, kCacheControl) == nullptr) {
+    auto pragma = FindHeader(request, kPragma);
+    if (pragma != nullptr && _stricmp(pragma->c_str(), "no-cache") == 0)
+      control.no_cache = true;
+  }
+
+  if (control.no_cache)
+    return false;
+
+  auto age = entry.initial_age + (now - entry.response_time);
+  if (control.max_age >= 0 &&
+      age > base::TimeDelta::FromSeconds(control.max_age))
+    return false;
+
+  return age < entry.freshness;
+}
+
+bool HttpCache::AddValidators(const Entry& entry, HttpRequest* request) {
+  auto validated = false;
+
+  auto etag = FindHeader(entry.headers, kETag);
+  if (etag != nullptr) {
+    request->SetHeader(kIfNoneMatch, *etag);
+    validated = true;
+  }
+
+  auto last_modified = FindHeader(entry.headers, kLastModified);
+  if (last_modified != nullptr) {
+    request->SetHeader(kIfModifiedSince, *last_modified);
+    validated = true;
+  }
+
+  return validated;
+}
+
+void HttpCache::BuildResponse(const Entry& entry, base::Time now,
+                              HttpResponse* response) {
+  response->Clear();
+  response->SetStatus(static_cast<StatusCode>(entry.status),
+                      entry.message.c_str());
+
+  for (auto& pair : entry.headers)
+    response->AddHeader(pair.first, pair.second);
+
+  auto age = entry.initial_age + (now - entry.response_time);
+  response->SetHeader(kAge,
+                      std::to_string(std::max<int64_t>(age.InSeconds(), 0)));
+}
+
+std::unique_ptr<HttpCache::Writer> HttpCache::CreateWriter(
+    const std::string& key, const HttpRequest& request,
+    const HttpResponse& response, int64_t content_length,
+    base::Time request_time) {
+  if (instance_ == nullptr || content_length < 0)
+    return nullptr;
+
+  auto on_disk = kMaxMemoryEntrySize < content_length;
+  if (on_disk && (!HttpDiskCache::IsAvailable() ||
+                  HttpDiskCache::kMaxEntrySize < content_length))
+    return nullptr;
+
+  auto entry = CreateEntry(request, response, request_time);
+  if (entry == nullptr)
+    return nullptr;
+
+  if (on_disk)
+    return HttpDiskCache::CreateWriter(key, std::move(entry), content_length);
+
+  return std::make_unique<MemoryWriter>(key, std::move(entry), content_length);
+}
+
+std::unique_ptr<HttpCache::Entry> HttpCache::CreateEntry(
+    const HttpRequest& request, const HttpResponse& response,
+    base::Time request_time) {
+  if (!IsHeuristicallyCacheable(response.status()))
+    return nullptr;
+
+  CacheControl request_control, response_control;
+  ParseCacheControl(request, &request_control);
+  ParseCacheControl(response, &response_control);
+
+  if (request_control.no_store || response_control.no_store ||
+      response_control.is_private)
+    return nullptr;
+
+  // RFC 9111 3.5
+  if (FindHeader(request, kAuthorization) != nullptr &&
+      !response_control.is_public && !response_control.must_revalidate &&
+      response_control.s_maxage < 0)
+    return nullptr;
+
+  // Cookies are specific to the client they are sent to.
+  if (FindHeader(response, kSetCookie) != nullptr)
+    return nullptr;
+
+  auto entry = std::make_unique<Entry>();
+  if (entry == nullptr)
+    return nullptr;
+
+  auto storable = true;
+  for (auto& pair : response) {
+    if (_stricmp(pair.first.c_str(), kVary.c_str()) != 0)
+      continue;
+
+    ForEachElement(pair.second, [&](const std::string& name) {
+      if (name == "*") {
+        storable = false;
+        return;
+      }
+
+      std::string value;
+      for (auto& header : request) {
+        if (_stricmp(header.first.c_str(), name.c_str()) != 0)
+          continue;
+
+        if (!value.empty())
+          value.append(", ");
+        value.append(header.second);
+      }
+
+      entry->vary.push_back({name, value});
+    });
+  }
+  if (!storable)
+    return nullptr;
+
+  entry->status = response.status();
+  entry->message = response.message();
+  entry->headers.assign(response.begin(), response.end());
+  entry->body_size = 0;
+  UpdateAge(entry.get(), request_time, base::Time::Now());
+
+  // Useless if it can neither be served nor validated.
+  if (entry->freshness <= base::TimeDelta() &&
+      FindHeader(entry->headers, kETag) == nullptr &&
+      FindHeader(entry->headers, kLastModified) == nullptr)
+    return nullptr;
+
+  return entry;
+}
+
+std::shared_ptr<const HttpCache::Entry> HttpCache::Update(
+    const std::string& key, const Entry& entry, const HttpResponse& response,
+    base::Time request_time) {
+  auto updated = std::make_shared<Entry>(entry);
+  if (updated == nullptr)
+    return nullptr;
+
+  // RFC 9111 3.2: the stored headers are replaced with the ones in the 304
+  // response, except for the ones describing the body.
+  for (auto& pair : response) {
+    if (_stricmp(pair.first.c_str(), kContentLength.c_str()) == 0)
+      continue;
+
+    updated->headers.remove_if([&pair](const HttpHeaders::Pair& stored) {
+      return _stricmp(stored.first.c_str(), pair.first.c_str()) == 0;
+    });
+  }
+  for (auto& pair : response) {
+    if (_stricmp(pair.first.c_str(), kContentLength.c_str()) != 0)
+      updated->headers.push_back(pair);
+  }
+
+  UpdateAge(updated.get(), request_time, base::Time::Now());
+
+  if (instance_ != nullptr) {
+    base::AutoLock guard(instance_->lock_);
+    ++instance_->revalidated_;
+  }
+
+  std::shared_ptr<const Entry> result = updated;
+  if (kMaxMemoryEntrySize < static_cast<int64_t>(updated->body_size))
+    HttpDiskCache::Update(key, *updated);
+  else if (instance_ != nullptr)
+    instance_->StoreImpl(key, std::move(updated));
+
+  return result;
+}
+
+void HttpCache::Invalidate(const std::string& key) {
+  if (instance_ != nullptr)
+    instance_->InvalidateImpl(key);
+
+  HttpDiskCache::Invalidate(key);
+}
+
+void HttpCache::RecordServed(size_t bytes, base::TimeDelta latency) {
+  if (instance_ != nullptr)
+    instance_->RecordServedImpl(bytes, latency);
+}
+
+void HttpCache::GetStatistics(base::DictionaryValue* stats) {
+  if (instance_ != nullptr)
+    instance_->GetStatisticsImpl(stats);
+
+  if (HttpDiskCache::IsAvailable()) {
+    auto disk = std::make_unique<base::DictionaryValue>();
+    HttpDiskCache::GetStatistics(disk.get());
+    stats->Set("disk", std::move(disk));
+  }
+}
+
+HttpCache::HttpCache()
+    : size_(0),
+      lookups_(0),
+      hits_(0),
+      revalidated_(0),
+      stored_(0),
+      evicted_(0),
+      bytes_saved_(0) {}
+
+HttpCache::~HttpCache() {}
+
+std::shared_ptr<const HttpCache::Entry> HttpCache::LookupImpl(
+    const std::string& key, const HttpRequest& request) {
+  {
+    base::AutoLock guard(lock_);
+
+    ++lookups_;
+
+    auto found = nodes_.find(key);
+    if (found != nodes_.end()) {
+      auto& node = found->second;
+      if (!MatchVary(*node.entry, request))
+        return nullptr;
+
+      lru_.splice(lru_.begin(), lru_, node.lru);
+
+      return node.entry;
+    }
+  }
+
+  auto entry = HttpDiskCache::Lookup(key);
+  if (entry == nullptr || !MatchVary(*entry, request))
+    return nullptr;
+
+  return entry;
+}
+
+void HttpCache::StoreImpl(const std::string& key,
+                          std::shared_ptr<const Entry>&& entry) {
+  auto size = GetSize(key, *entry);
+  if (size > kMaxSize)
+    return;
+
+  base::AutoLock guard(lock_);
+
+  auto found = nodes_.find(key);
+  if (found != nodes_.end())
+    Erase(found);
+
+  while (!lru_.empty() && size_ + size > kMaxSize) {
+    ++evicted_;
+    Erase(nodes_.find(*lru_.back()));
+  }
+
+  auto inserted = nodes_.insert({key, Node()}).first;
+  auto& node = inserted->second;
+  node.entry = std::move(entry);
+  node.size = size;
+  node.lru = lru_.insert(lru_.begin(), &inserted->first);
+
+  size_ += size;
+  ++stored_;
+}
+
+void HttpCache::InvalidateImpl(const std::string& key) {
+  base::AutoLock guard(lock_);
+
+  auto found = nodes_.find(key);
+  if (found != nodes_.end())
+    Erase(found);
+}
+
+void HttpCache::RecordServedImpl(size_t bytes, base::TimeDelta latency) {
+  base::AutoLock guard(lock_);
+
+  ++hits_;
+  bytes_saved_ += bytes;
+  served_latency_ += latency;
+}
+
+void HttpCache::GetStatisticsImpl(base::DictionaryValue* stats) {
+  base::AutoLock guard(lock_);
+
+  stats->SetInteger("entries", static_cast<int>(nodes_.size()));
+  stats->SetDouble("size", static_cast<double>(size_));
+  stats->SetDouble("lookups", static_cast<double>(lookups_));
+  stats->SetDouble("hits", static_cast<double>(hits_));
+  stats->SetDouble("revalidated", static_cast<double>(revalidated_));
+  stats->SetDouble("stored", static_cast<double>(stored_));
+  stats->SetDouble("evicted", static_cast<double>(evicted_));
+  stats->SetDouble("bytes_saved", static_cast<double>(bytes_saved_));
+
+  if (lookups_ > 0)
+    stats->SetDouble("hit_ratio", static_cast<double>(hits_) / lookups_);
+
+  // Average in milliseconds.
+  if (hits_ > 0)
+    stats->SetDouble("served_latency",
+                     served_latency_.InMillisecondsF() / hits_);
+}
+
+void HttpCache::Erase(std::unordered_map<std::string, Node>::iterator node) {
+  lock_.AssertAcquired();
+
+  size_ -= node->second.size;
+  lru_.erase(node->second.lru);
+  nodes_.erase(node);
+}
+
+bool HttpCache::MatchVary(const Entry& entry, const HttpRequest& request) {
+  for (auto& vary : entry.vary) {
+    std::string value;
+    for (auto& header : request) {
+      if (_stricmp(header.first.c_str(), vary.first.c_str()) != 0)
+        continue;
+
+      if (!value.empty())
+        value.append(", ");
+      value.append(header.second);
+    }
+
+    if (value != vary.second)
+      return false;
+  }
+
+  return true;
+}
+
+size_t HttpCache::GetSize(const std::string& key, const Entry& entry) {
+  auto size = sizeof(Entry) + key.size() + entry.message.size();
+
+  for (auto& pair : entry.headers)
+    size += pair.first.size() + pair.second.size() + 4;
+
+  return size + entry.body_size;
+}
+
+void HttpCache::UpdateAge(Entry* entry, base::Time request_time,
+                          base::Time response_time) {
+  CacheControl control;
+  ParseCacheControl(entry->headers, &control);
+
+  entry->response_time = response_time;
+  entry->no_cache = control.no_cache;
+
+  // RFC 9111 4.2.3
+  base::Time date;
+  if (!ParseTime(FindHeader(entry->headers, kDate), &date))
+    date = response_time;
+
+  auto apparent_age = std::max(base::TimeDelta(), response_time - date);
+
+  int64_t age_value = 0;
+  auto age = FindHeader(entry->headers, kAge);
+  if (age != nullptr)
+    age_value = ParseSeconds(*age);
+
+  auto corrected_age_value =
+      base::TimeDelta::FromSeconds(age_value) + (response_time - request_time);
+  entry->initial_age = std::max(apparent_age, corrected_age_value);
+
+  // RFC 9111 4.2.1
+  base::Time expires, last_modified;
+  if (control.s_maxage >= 0) {
+    entry->freshness = base::TimeDelta::FromSeconds(control.s_maxage);
+  } else if (control.max_age >= 0) {
+    entry->freshness = base::TimeDelta::FromSeconds(control.max_age);
+  } else if (FindHeader(entry->headers, kExpires) != nullptr) {
+    // An invalid date means the response is already expired.
+    if (ParseTime(FindHeader(entry->headers, kExpires), &expires))
+      entry->freshness = expires - date;
+    else
+      entry->freshness = base::TimeDelta();
+  } else if (ParseTime(FindHeader(entry->headers, kLastModified),
+                       &last_modified) &&
+             IsHeuristicallyCacheable(entry->status)) {
+    entry->freshness =
+        std::min((date - last_modified) / 10,
+                 base::TimeDelta::FromSeconds(kMaxHeuristicFreshness));
+  } else {
+    entry->freshness = base::TimeDelta();
+  }
+}
+
+}  // namespace http
+}  // namespace service
+}  // namespace juno
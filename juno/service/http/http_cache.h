@@ -0,0 +1,183 @@
+// Copyright (c) 2017 dacci.org
+
+#ifndef JUNO_SERVICE_HTTP_HTTP_CACHE_H_
+#define JUNO_SERVICE_HTTP_HTTP_CACHE_H_
+
+#include <windows.h>
+
+#include <base/synchronization/lock.h>
+#include <base/time/time.h>
+
+#include <stdint.h>
+
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "service/http/http_headers.h"
+
+namespace base {
+
+class DictionaryValue;
+
+}  // namespace base
+
+namespace juno {
+namespace service {
+namespace http {
+
+class HttpRequest;
+class HttpResponse;
+
+// Shared cache of HTTP responses, following RFC 9111 for a shared cache.
+// Only complete responses of GET requests with known length are stored.
+// Small responses are kept in memory, large ones in HttpDiskCache if it is
+// available. Entries are immutable once stored, so a session can keep sending
+// one after it was replaced or evicted.
+class HttpCache {
+ public:
+  struct Entry {
+    int status;
+    std::string message;
+    HttpHeaders::List headers;
+
+    // Request headers nominated by Vary and their values.
+    std::vector<HttpHeaders::Pair> vary;
+
+    // Points into the memory or the file mapping the body is stored in,
+    // and keeps it alive.
+    std::shared_ptr<const char> body;
+    size_t body_size;
+
+    base::Time response_time;
+    base::TimeDelta initial_age;
+    base::TimeDelta freshness;
+
+    // The response must be validated before each reuse.
+    bool no_cache;
+  };
+
+  // Receives the body of a response while it is forwarded to the client.
+  class __declspec(novtable) Writer {
+   public:
+    // The body is discarded unless committed.
+    virtual ~Writer() {}
+
+    virtual void Append(const char* data, size_t length) = 0;
+
+    // Stores the entry if the whole body has been appended.
+    virtual void Commit() = 0;
+  };
+
+  static HRESULT Init();
+  static void Term();
+
+  // Returns the key of GET requests to |url|.
+  static std::string GetKey(const std::string& url);
+
+  // Returns true if |request| carries its own preconditions, in which case
+  // the client is left to validate its copy.
+  static bool IsConditional(const HttpRequest& request);
+
+  // Returns the entry stored with |key| matching |request|, or nullptr.
+  static std::shared_ptr<const Entry> Lookup(const std::string& key,
+                                             const HttpRequest& request);
+
+  // Returns true if |entry| can be served to |request| without validation.
+  static bool IsFresh(const Entry& entry, const HttpRequest& request,
+                      base::Time now);
+
+  // Adds the validators of |entry| to |request|. Returns false if |entry|
+  // has no validator.
+  static bool AddValidators(const Entry& entry, HttpRequest* request);
+
+  // Builds the response to serve |entry|, except for the body.
+  static void BuildResponse(const Entry& entry, base::Time now,
+                            HttpResponse* response);
+
+  // Returns a writer to store |response| to |request| with |key| if it can
+  // be stored, nullptr otherwise.
+  static std::unique_ptr<Writer> CreateWriter(const std::string& key,
+                                              const HttpRequest& request,
+                                              const HttpResponse& response,
+                                              int64_t content_length,
+                                              base::Time request_time);
+
+  // Returns a new entry of |response| to |request| without its body, or
+  // nullptr if |response| cannot be stored.
+  static std::unique_ptr<Entry> CreateEntry(const HttpRequest& request,
+                                            const HttpResponse& response,
+                                            base::Time request_time);
+
+  // Returns true if |request| selects the same response as the request which
+  // |entry| answered, RFC 9111 4.1.
+  static bool MatchVary(const Entry& entry, const HttpRequest& request);
+
+  // Freshens |entry| with the headers of 304 |response| and stores it again.
+  // Returns the new entry.
+  static std::shared_ptr<const Entry> Update(const std::string& key,
+                                             const Entry& entry,
+                                             const HttpResponse& response,
+                                             base::Time request_time);
+
+  static void Invalidate(const std::string& key);
+
+  // Records that |bytes| of body were served from the cache in |latency|.
+  static void RecordServed(size_t bytes, base::TimeDelta latency);
+
+  static void GetStatistics(base::DictionaryValue* stats);
+
+ private:
+  class MemoryWriter;
+
+  static const size_t kMaxSize = 64 * 1024 * 1024;            // 64 MiB
+  static const int64_t kMaxMemoryEntrySize = 1 * 1024 * 1024;  // 1 MiB
+
+  struct Node {
+    std::shared_ptr<const Entry> entry;
+    size_t size;
+    std::list<const std::string*>::iterator lru;
+  };
+
+  HttpCache();
+  ~HttpCache();
+
+  std::shared_ptr<const Entry> LookupImpl(const std::string& key,
+                                          const HttpRequest& request);
+  void StoreImpl(const std::string& key, std::shared_ptr<const Entry>&& entry);
+  void InvalidateImpl(const std::string& key);
+  void RecordServedImpl(size_t bytes, base::TimeDelta latency);
+  void GetStatisticsImpl(base::DictionaryValue* stats);
+
+  void Erase(std::unordered_map<std::string, Node>::iterator node);
+
+  static size_t GetSize(const std::string& key, const Entry& entry);
+  static void UpdateAge(Entry* entry, base::Time request_time,
+                        base::Time response_time);
+
+  static HttpCache* instance_;
+
+  base::Lock lock_;
+  std::unordered_map<std::string, Node> nodes_;
+  std::list<const std::string*> lru_;  // Most recently used first.
+  size_t size_;
+
+  uint64_t lookups_;
+  uint64_t hits_;
+  uint64_t revalidated_;
+  uint64_t stored_;
+  uint64_t evicted_;
+  uint64_t bytes_saved_;
+  base::TimeDelta served_latency_;
+
+  HttpCache(const HttpCache&) = delete;
+  HttpCache& operator=(const HttpCache&) = delete;
+};
+
+}  // namespace http
+}  // namespace service
+}  // namespace juno
+
+#endif  // JUNO_SERVICE_HTTP_HTTP_CACHE_H_
@@ -0,0 +1,235 @@
+// Copyright (c) 2017 dacci.org
+
+#include "service/http/http_chunked_decoder.h"
+
+#include <algorithm>
+
+#include "service/http/http_scan.h"
+
+namespace juno {
+namespace service {
+namespace http {
+
+namespace {
+
+// Keeps the size of a chunk within int64_t.
+const int kMaxSizeDigits = 15;
+
+int HexToInt(char c) {
+  if ('0' <= c && c <= '9')
+    return c - '0';
+  if ('A' <= c && c <= 'F')
+    return c - 'A' + 10;
+  if ('a' <= c && c <= 'f')
+    return c - 'a' + 10;
+  return -1;
+}
+
+}  // namespace
+
+HttpChunkedDecoder::HttpChunkedDecoder() {
+  Reset();
+}
+
+void HttpChunkedDecoder::Reset() {
+  state_ = State::kSize;
+  size_ = 0;
+  digits_ = 0;
+  remaining_ = 0;
+  trailer_size_ = 0;
+}
+
+int64_t HttpChunkedDecoder::Decode(const char* data, size_t length,
+                                   const char** payload,
+                                   size_t* payload_length) {
+  *payload = nullptr;
+  *payload_length = 0;
+
+  size_t offset = 0;
+
+  while (offset < length) {
+    auto c = data[offset];
+
+    switch (state_) {
+      case State::kSize: {
+        auto digits = http_scan::CountHexDigits(data + offset, length - offset);
+        if (digits > 0) {
+          if (digits > static_cast<size_t>(kMaxSizeDigits - digits_)) {
+            state_ = State::kError;
+            return -1;
+          }
+
+          for (auto end = offset + digits; offset < end; ++offset)
+            size_ = size_ * 16 + HexToInt(data[offset]);
+
+          digits_ += static_cast<int>(digits);
+          break;
+        }
+
+        if (digits_ == 0) {
+          state_ = State::kError;
+          return -1;
+        } else if (c == ';' || c == ' ' || c == '\t') {
+          state_ = State::kExtension;
+        } else if (c == '\x0D') {
+          state_ = State::kSizeLF;
+        } else if (c == '\x0A') {
+          EndSize();
+        } else {
+          state_ = State::kError;
+          return -1;
+        }
+
+        ++offset;
+        break;
+      }
+
+      case State::kExtension: {
+        // Extensions are not interpreted, and forwarded as they are.
+        auto end = offset + http_scan::FindLineEnd(data + offset,
+                                                   length - offset);
+        if (end == length) {
+          offset = length;
+          break;
+        }
+
+        if (data[end] == '\x0D')
+          state_ = State::kSizeLF;
+        else
+          EndSize();
+
+        offset = end + 1;
+        break;
+      }
+
+      case State::kSizeLF:
+        if (c != '\x0A') {
+          state_ = State::kError;
+          return -1;
+        }
+
+        EndSize();
+        ++offset;
+        break;
+
+      case State::kData: {
+        auto available = static_cast<uint64_t>(length - offset);
+        auto size = static_cast<size_t>(std::min(remaining_, available));
+
+        *payload = data + offset;
+        *payload_length = size;
+
+        offset += size;
+        remaining_ -= size;
+        if (remaining_ == 0)
+          state_ = State::kDataCR;
+
+        return offset;
+      }
+
+      case State::kDataCR:
+        if (c == '\x0D') {
+          state_ = State::kDataLF;
+        } else if (c == '\x0A') {
+          state_ = State::kSize;
+        } else {
+          state_ = State::kError;
+          return -1;
+        }
+
+        ++offset;
+        break;
+
+      case State::kDataLF:
+        if (c != '\x0A') {
+          state_ = State::kError;
+          return -1;
+        }
+
+        state_ = State::kSize;
+        ++offset;
+        break;
+
+      case State::kTrailer:
+        if (c == '\x0D') {
+          state_ = State::kEndLF;
+        } else if (c == '\x0A') {
+          state_ = State::kComplete;
+          return offset + 1;
+        } else {
+          state_ = State::kTrailerField;
+          continue;
+        }
+
+        ++offset;
+        break;
+
+      case State::kTrailerField: {
+        // Trailer fields are forwarded with the body, if at all.
+        auto end = offset + http_scan::FindLineEnd(data + offset,
+                                                   length - offset);
+        trailer_size_ += end - offset;
+        if (trailer_size_ > kMaxTrailerSize) {
+          state_ = State::kError;
+          return -1;
+        }
+
+        if (end == length) {
+          offset = length;
+          break;
+        }
+
+        if (data[end] == '\x0D')
+          state_ = State::kTrailerLF;
+        else
+          state_ = State::kTrailer;
+
+        offset = end + 1;
+        break;
+      }
+
+      case State::kTrailerLF:
+        if (c != '\x0A') {
+          state_ = State::kError;
+          return -1;
+        }
+
+        state_ = State::kTrailer;
+        ++offset;
+        break;
+
+      case State::kEndLF:
+        if (c != '\x0A') {
+          state_ = State::kError;
+          return -1;
+        }
+
+        state_ = State::kComplete;
+        return offset + 1;
+
+      case State::kComplete:
+        return offset;
+
+      default:
+        return -1;
+    }
+  }
+
+  return offset;
+}
+
+void HttpChunkedDecoder::EndSize() {
+  if (size_ == 0) {
+    state_ = State::kTrailer;
+  } else {
+    remaining_ = size_;
+    state_ = State::kData;
+  }
+
+  size_ = 0;
+  digits_ = 0;
+}
+
+}  // namespace http
+}  // namespace service
+}  // namespace juno
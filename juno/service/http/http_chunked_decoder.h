@@ -0,0 +1,69 @@
+// Copyright (c) 2017 dacci.org
+
+#ifndef JUNO_SERVICE_HTTP_HTTP_CHUNKED_DECODER_H_
+#define JUNO_SERVICE_HTTP_HTTP_CHUNKED_DECODER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace juno {
+namespace service {
+namespace http {
+
+// Incremental decoder of the chunked transfer coding, RFC 9112 7.1.
+// The state is kept across calls, so each byte of the body is examined once
+// however it is split into reads, and chunk-data is only skipped over.
+class HttpChunkedDecoder {
+ public:
+  static const size_t kMaxTrailerSize = 64 * 1024;  // 64 KiB
+
+  HttpChunkedDecoder();
+
+  void Reset();
+
+  // Decodes up to |length| bytes at |data|, following those decoded before.
+  // Stops after the first chunk-data found, which |*payload| and
+  // |*payload_length| are set to, or at the end of the body. Returns the
+  // number of bytes consumed, or -1 if the body is malformed.
+  int64_t Decode(const char* data, size_t length, const char** payload,
+                 size_t* payload_length);
+
+  // Returns true once the last chunk and the trailer section are consumed.
+  bool IsComplete() const {
+    return state_ == State::kComplete;
+  }
+
+ private:
+  enum class State {
+    kSize,
+    kExtension,
+    kSizeLF,
+    kData,
+    kDataCR,
+    kDataLF,
+    kTrailer,
+    kTrailerField,
+    kTrailerLF,
+    kEndLF,
+    kComplete,
+    kError,
+  };
+
+  // Called at the end of a chunk-size line.
+  void EndSize();
+
+  State state_;
+  uint64_t size_;
+  int digits_;
+  uint64_t remaining_;
+  size_t trailer_size_;
+
+  HttpChunkedDecoder(const HttpChunkedDecoder&) = delete;
+  HttpChunkedDecoder& operator=(const HttpChunkedDecoder&) = delete;
+};
+
+}  // namespace http
+}  // namespace service
+}  // namespace juno
+
+#endif  // JUNO_SERVICE_HTTP_HTTP_CHUNKED_DECODER_H_
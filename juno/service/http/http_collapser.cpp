@@ -0,0 +1,311 @@
+// Copyright (c) 2017 dacci.org
+
+#include "service/http/http_collapser.h"
+
+#include <base/logging.h>
+#include <base/values.h>
+
+#include <string.h>
+
+#include <algorithm>
+#include <utility>
+
+namespace juno {
+namespace service {
+namespace http {
+
+// Forwards the body received by the leader to the subscribers, and to the
+// cache.
+class HttpCollapser::Flight::Writer : public HttpCache::Writer {
+ public:
+  Writer(const std::shared_ptr<Flight>& flight,
+         std::unique_ptr<HttpCache::Writer>&& writer)
+      : flight_(flight), writer_(std::move(writer)), committed_(false) {}
+
+  ~Writer() override {
+    flight_->Finish(committed_ ? State::kCompleted : State::kFailed);
+  }
+
+  void Append(const char* data, size_t length) override {
+    writer_->Append(data, length);
+    flight_->Append(data, length);
+  }
+
+  void Commit() override {
+    writer_->Commit();
+
+    base::AutoLock guard(flight_->lock_);
+    committed_ = static_cast<int64_t>(flight_->received_) == flight_->length_;
+  }
+
+ private:
+  const std::shared_ptr<Flight> flight_;
+  const std::unique_ptr<HttpCache::Writer> writer_;
+  bool committed_;
+
+  Writer(const Writer&) = delete;
+  Writer& operator=(const Writer&) = delete;
+};
+
+HttpCollapser::Flight::Flight(const std::string& key)
+    : key_(key), state_(State::kPending), length_(0), received_(0) {}
+
+HttpCollapser::Flight::~Flight() {
+  DCHECK(waiting_.empty());
+}
+
+HttpCollapser::Flight::State HttpCollapser::Flight::Read(
+    Subscriber* subscriber, size_t offset, const char** data, size_t* length) {
+  base::AutoLock guard(lock_);
+
+  *data = nullptr;
+  *length = 0;
+
+  switch (state_) {
+    case State::kPending:
+      break;
+
+    case State::kStreaming:
+    case State::kCompleted:
+      if (offset < received_) {
+        *data = body_.get() + offset;
+        *length = received_ - offset;
+        return state_;
+      }
+
+      if (state_ == State::kCompleted)
+        return state_;
+
+      break;
+
+    default:
+      return state_;
+  }
+
+  if (std::find(waiting_.begin(), waiting_.end(), subscriber) ==
+      waiting_.end())
+    waiting_.push_back(subscriber);
+
+  return state_;
+}
+
+void HttpCollapser::Flight::Unsubscribe(Subscriber* subscriber) {
+  base::AutoLock guard(lock_);
+
+  waiting_.erase(std::remove(waiting_.begin(), waiting_.end(), subscriber),
+                 waiting_.end());
+}
+
+bool HttpCollapser::Flight::Subscribe(Subscriber* subscriber) {
+  base::AutoLock guard(lock_);
+
+  if (state_ != State::kPending && state_ != State::kStreaming)
+    return false;
+
+  waiting_.push_back(subscriber);
+
+  return true;
+}
+
+void HttpCollapser::Flight::Stream(std::unique_ptr<HttpCache::Entry>&& entry,
+                                   int64_t length) {
+  std::vector<Subscriber*> waiting;
+
+  {
+    base::AutoLock guard(lock_);
+
+    entry_ = std::move(entry);
+    length_ = length;
+    body_.reset(new char[static_cast<size_t>(std::max<int64_t>(length, 1))]);
+    state_ = State::kStreaming;
+
+    TakeWaiting(&waiting);
+  }
+
+  Notify(waiting);
+}
+
+void HttpCollapser::Flight::Append(const char* data, size_t length) {
+  std::vector<Subscriber*> waiting;
+
+  {
+    base::AutoLock guard(lock_);
+
+    if (state_ != State::kStreaming)
+      return;
+
+    // The part received is never modified, so subscribers can send it without
+    // the lock held.
+    length = std::min(length, static_cast<size_t>(length_) - received_);
+    memcpy(body_.get() + received_, data, length);
+    received_ += length;
+
+    TakeWaiting(&waiting);
+  }
+
+  Notify(waiting);
+}
+
+void HttpCollapser::Flight::Finish(State state) {
+  std::vector<Subscriber*> waiting;
+
+  {
+    base::AutoLock guard(lock_);
+
+    // Only a flight streaming can fail or complete, and only its writer
+    // finishes it.
+    if (state_ == State::kPending)
+      state = State::kEnded;
+    else if (state_ != State::kStreaming || state == State::kEnded)
+      return;
+
+    state_ = state;
+    TakeWaiting(&waiting);
+  }
+
+  if (instance_ != nullptr)
+    instance_->Remove(this, state);
+
+  Notify(waiting);
+}
+
+void HttpCollapser::Flight::TakeWaiting(std::vector<Subscriber*>* waiting) {
+  lock_.AssertAcquired();
+
+  for (auto subscriber : waiting_)
+    subscriber->AddRef();
+
+  waiting->swap(waiting_);
+}
+
+void HttpCollapser::Flight::Notify(const std::vector<Subscriber*>& waiting) {
+  for (auto subscriber : waiting)
+    subscriber->OnFlightUpdated(this);
+}
+
+HttpCollapser* HttpCollapser::instance_ = nullptr;
+
+HRESULT HttpCollapser::Init() {
+  Term();
+
+  instance_ = new HttpCollapser();
+  if (instance_ == nullptr)
+    return E_OUTOFMEMORY;
+
+  return S_OK;
+}
+
+void HttpCollapser::Term() {
+  if (instance_ != nullptr) {
+    delete instance_;
+    instance_ = nullptr;
+  }
+}
+
+std::shared_ptr<HttpCollapser::Flight> HttpCollapser::Join(
+    const std::string& key, Subscriber* subscriber, bool* leader) {
+  if (instance_ == nullptr)
+    return nullptr;
+
+  return instance_->JoinImpl(key, subscriber, leader);
+}
+
+std::unique_ptr<HttpCache::Writer> HttpCollapser::Publish(
+    const std::shared_ptr<Flight>& flight,
+    std::unique_ptr<HttpCache::Entry>&& entry, int64_t length,
+    std::unique_ptr<HttpCache::Writer>&& writer) {
+  // Only responses the cache accepts are shared with other clients.
+  if (writer == nullptr || entry == nullptr || length < 0 ||
+      kMaxBodySize < length) {
+    flight->Finish(Flight::State::kEnded);
+    return std::move(writer);
+  }
+
+  auto streaming = std::make_unique<Flight::Writer>(flight, std::move(writer));
+  if (streaming == nullptr) {
+    flight->Finish(Flight::State::kEnded);
+    return nullptr;
+  }
+
+  flight->Stream(std::move(entry), length);
+
+  return std::move(streaming);
+}
+
+void HttpCollapser::End(const std::shared_ptr<Flight>& flight) {
+  flight->Finish(Flight::State::kEnded);
+}
+
+void HttpCollapser::GetStatistics(base::DictionaryValue* stats) {
+  if (instance_ != nullptr)
+    instance_->GetStatisticsImpl(stats);
+}
+
+HttpCollapser::HttpCollapser()
+    : led_(0), collapsed_(0), completed_(0), ended_(0), failed_(0) {}
+
+HttpCollapser::~HttpCollapser() {}
+
+std::shared_ptr<HttpCollapser::Flight> HttpCollapser::JoinImpl(
+    const std::string& key, Subscriber* subscriber, bool* leader) {
+  base::AutoLock guard(lock_);
+
+  auto& flight = flights_[key];
+  if (flight != nullptr && flight->Subscribe(subscriber)) {
+    ++collapsed_;
+    *leader = false;
+    return flight;
+  }
+
+  // Replaces the flight finishing, if any.
+  flight = std::make_shared<Flight>(key);
+  if (flight == nullptr) {
+    flights_.erase(key);
+    return nullptr;
+  }
+
+  ++led_;
+  *leader = true;
+
+  return flight;
+}
+
+void HttpCollapser::Remove(Flight* flight, Flight::State state) {
+  base::AutoLock guard(lock_);
+
+  switch (state) {
+    case Flight::State::kCompleted:
+      ++completed_;
+      break;
+
+    case Flight::State::kEnded:
+      ++ended_;
+      break;
+
+    case Flight::State::kFailed:
+      ++failed_;
+      break;
+
+    default:
+      break;
+  }
+
+  auto found = flights_.find(flight->key_);
+  if (found != flights_.end() && found->second.get() == flight)
+    flights_.erase(found);
+}
+
+void HttpCollapser::GetStatisticsImpl(base::DictionaryValue* stats) {
+  base::AutoLock guard(lock_);
+
+  stats->SetInteger("flights", static_cast<int>(flights_.size()));
+  stats->SetDouble("led", static_cast<double>(led_));
+  stats->SetDouble("collapsed", static_cast<double>(collapsed_));
+  stats->SetDouble("completed", static_cast<double>(completed_));
+  stats->SetDouble("ended", static_cast<double>(ended_));
+  stats->SetDouble("failed", static_cast<double>(failed_));
+}
+
+}  // namespace http
+}  // namespace service
+}  // namespace juno
@@ -0,0 +1,165 @@
+// Copyright (c) 2017 dacci.org
+
+#ifndef JUNO_SERVICE_HTTP_HTTP_COLLAPSER_H_
+#define JUNO_SERVICE_HTTP_HTTP_COLLAPSER_H_
+
+#include <windows.h>
+
+#include <base/synchronization/lock.h>
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "service/http/http_cache.h"
+
+namespace base {
+
+class DictionaryValue;
+
+}  // namespace base
+
+namespace juno {
+namespace service {
+namespace http {
+
+// Coalesces concurrent cache misses of the same resource, so that only the
+// first request goes to the upstream server. The response is fanned out to
+// the other requests while it arrives, if it may be stored by a shared cache;
+// otherwise they are sent on their own.
+class HttpCollapser {
+ public:
+  class Flight;
+
+  class __declspec(novtable) Subscriber {
+   public:
+    virtual ~Subscriber() {}
+
+    // Called with the lock of the flight held, so the subscriber is kept alive
+    // until OnFlightUpdated returns.
+    virtual void AddRef() = 0;
+
+    // Called without any lock held when |flight| has progressed. Must release
+    // the reference taken by AddRef.
+    virtual void OnFlightUpdated(Flight* flight) = 0;
+  };
+
+  // A request in progress that others wait for.
+  class Flight {
+   public:
+    enum class State {
+      kPending,    // Waiting for the response.
+      kStreaming,  // Receiving the body.
+      kCompleted,  // The whole body has been received.
+      kEnded,      // Ended without a response to share.
+      kFailed,     // Aborted while receiving the body.
+    };
+
+    explicit Flight(const std::string& key);
+    ~Flight();
+
+    // Returns the state of this flight. While streaming, |*data| and |*length|
+    // are set to the part of the body received after |offset|; if it is empty,
+    // |subscriber| is notified when more arrives. |subscriber| is also
+    // notified when a pending flight progresses.
+    State Read(Subscriber* subscriber, size_t offset, const char** data,
+               size_t* length);
+
+    // Stops notifying |subscriber|.
+    void Unsubscribe(Subscriber* subscriber);
+
+    // Valid once streaming.
+    const HttpCache::Entry& entry() const {
+      return *entry_;
+    }
+
+    int64_t length() const {
+      return length_;
+    }
+
+   private:
+    friend class HttpCollapser;
+    class Writer;
+
+    bool Subscribe(Subscriber* subscriber);
+    void Stream(std::unique_ptr<HttpCache::Entry>&& entry, int64_t length);
+    void Append(const char* data, size_t length);
+    void Finish(State state);
+
+    // Moves the subscribers waiting to |waiting| with a reference to each.
+    void TakeWaiting(std::vector<Subscriber*>* waiting);
+    void Notify(const std::vector<Subscriber*>& waiting);
+
+    const std::string key_;
+
+    base::Lock lock_;
+    State state_;
+    std::unique_ptr<const HttpCache::Entry> entry_;
+    int64_t length_;
+    std::unique_ptr<char[]> body_;
+    size_t received_;
+    std::vector<Subscriber*> waiting_;
+
+    Flight(const Flight&) = delete;
+    Flight& operator=(const Flight&) = delete;
+  };
+
+  static const int64_t kMaxBodySize = 16 * 1024 * 1024;  // 16 MiB
+
+  static HRESULT Init();
+  static void Term();
+
+  // Returns the flight of |key|. If the caller is the first, |*leader| is set
+  // to true and the caller must send the request and either Publish or End
+  // the flight. Otherwise |subscriber| is notified when the flight progresses.
+  // Returns nullptr if requests cannot be collapsed.
+  static std::shared_ptr<Flight> Join(const std::string& key,
+                                      Subscriber* subscriber, bool* leader);
+
+  // Starts streaming the response |entry| with a body of |length| bytes to
+  // the subscribers of |flight|. Returns a writer which feeds the body to
+  // them as well as to |writer|, or |writer| itself after ending |flight| if
+  // the response cannot be shared.
+  static std::unique_ptr<HttpCache::Writer> Publish(
+      const std::shared_ptr<Flight>& flight,
+      std::unique_ptr<HttpCache::Entry>&& entry, int64_t length,
+      std::unique_ptr<HttpCache::Writer>&& writer);
+
+  // Ends |flight| led by the caller if it is not streaming. The subscribers
+  // then send their requests on their own.
+  static void End(const std::shared_ptr<Flight>& flight);
+
+  static void GetStatistics(base::DictionaryValue* stats);
+
+ private:
+  HttpCollapser();
+  ~HttpCollapser();
+
+  std::shared_ptr<Flight> JoinImpl(const std::string& key,
+                                   Subscriber* subscriber, bool* leader);
+  void Remove(Flight* flight, Flight::State state);
+  void GetStatisticsImpl(base::DictionaryValue* stats);
+
+  static HttpCollapser* instance_;
+
+  base::Lock lock_;
+  std::unordered_map<std::string, std::shared_ptr<Flight>> flights_;
+
+  uint64_t led_;
+  uint64_t collapsed_;
+  uint64_t completed_;
+  uint64_t ended_;
+  uint64_t failed_;
+
+  HttpCollapser(const HttpCollapser&) = delete;
+  HttpCollapser& operator=(const HttpCollapser&) = delete;
+};
+
+}  // namespace http
+}  // namespace service
+}  // namespace juno
+
+#endif  // JUNO_SERVICE_HTTP_HTTP_COLLAPSER_H_
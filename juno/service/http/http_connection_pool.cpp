@@ -0,0 +1,412 @@
+// Copyright (c) 2017 dacci.org
+
+#include "service/http/http_connection_pool.h"
+
+#include <base/logging.h>
+#include <base/values.h>
+
+#include <algorithm>
+#include <utility>
+
+namespace juno {
+namespace service {
+namespace http {
+
+using ::juno::io::net::SocketChannel;
+
+HttpConnectionPool* HttpConnectionPool::instance_ = nullptr;
+
+HRESULT HttpConnectionPool::Init() {
+  Term();
+
+  instance_ = new HttpConnectionPool();
+  if (instance_ == nullptr)
+    return E_OUTOFMEMORY;
+
+  auto result = instance_->Start();
+  if (FAILED(result))
+    Term();
+
+  return result;
+}
+
+void HttpConnectionPool::Term() {
+  if (instance_ != nullptr) {
+    delete instance_;
+    instance_ = nullptr;
+  }
+}
+
+std::shared_ptr<SocketChannel> HttpConnectionPool::Acquire(
+    const std::string& host, int port, bool* fresh) {
+  if (instance_ == nullptr)
+    return nullptr;
+
+  return instance_->AcquireImpl(MakeKey(host, port), fresh);
+}
+
+std::shared_ptr<SocketChannel> HttpConnectionPool::AcquireFresh(
+    const std::string& host, int port) {
+  if (instance_ == nullptr)
+    return nullptr;
+
+  return instance_->AcquireFreshImpl(MakeKey(host, port));
+}
+
+bool HttpConnectionPool::Add(const std::string& host, int port,
+                             const std::shared_ptr<SocketChannel>& socket) {
+  if (instance_ == nullptr)
+    return false;
+
+  return instance_->AddImpl(MakeKey(host, port), socket);
+}
+
+void HttpConnectionPool::Release(std::shared_ptr<SocketChannel>&& socket) {
+  if (socket == nullptr)
+    return;
+
+  if (instance_ == nullptr) {
+    socket->Close();
+    socket.reset();
+    return;
+  }
+
+  instance_->ReleaseImpl(std::move(socket));
+}
+
+void HttpConnectionPool::AddFresh(const std::string& host, int port,
+                                  std::shared_ptr<SocketChannel>&& socket) {
+  if (socket == nullptr)
+    return;
+
+  if (instance_ == nullptr) {
+    socket->Close();
+    socket.reset();
+    return;
+  }
+
+  instance_->AddFreshImpl(MakeKey(host, port), std::move(socket));
+}
+
+size_t HttpConnectionPool::GetFreshCount(const std::string& host, int port) {
+  if (instance_ == nullptr)
+    return 0;
+
+  return instance_->GetFreshCountImpl(MakeKey(host, port));
+}
+
+void HttpConnectionPool::GetStatistics(base::DictionaryValue* stats) {
+  if (instance_ != nullptr)
+    instance_->GetStatisticsImpl(stats);
+}
+
+HttpConnectionPool::HttpConnectionPool()
+    : idle_count_(0),
+      hits_(0),
+      misses_(0),
+      discarded_(0),
+      expired_(0),
+      disconnected_(0),
+      preconnected_(0),
+      preconnect_used_(0),
+      preconnect_wasted_(0) {}
+
+HttpConnectionPool::~HttpConnectionPool() {
+  timer_.reset();
+
+  std::vector<std::shared_ptr<SocketChannel>> sockets;
+
+  {
+    base::AutoLock guard(lock_);
+
+    for (auto& pair : entries_) {
+      if (pair.second.idle != nullptr)
+        sockets.push_back(std::move(pair.second.idle));
+    }
+    entries_.clear();
+    idle_.clear();
+    idle_count_ = 0;
+
+    sockets.insert(sockets.end(), closed_.begin(), closed_.end());
+    closed_.clear();
+  }
+
+  // Destroying a socket calls back OnClosed, so the lock must not be held.
+  sockets.clear();
+}
+
+HRESULT HttpConnectionPool::Start() {
+  timer_ = misc::TimerService::GetDefault()->Create(this);
+  if (timer_ == nullptr) {
+    LOG(ERROR) << "Failed to create timer.";
+    return E_OUTOFMEMORY;
+  }
+
+  timer_->Start(kSweepInterval, kSweepInterval);
+
+  return S_OK;
+}
+
+std::shared_ptr<SocketChannel> HttpConnectionPool::AcquireImpl(
+    const std::string& key, bool* fresh) {
+  base::AutoLock guard(lock_);
+
+  auto found = idle_.find(key);
+  if (found == idle_.end()) {
+    ++misses_;
+    return nullptr;
+  }
+
+  // The most recently released one is the least likely to be timed out by
+  // the peer.
+  auto socket = found->second.back();
+  found->second.pop_back();
+  if (found->second.empty())
+    idle_.erase(found);
+  --idle_count_;
+
+  auto& entry = entries_.at(socket);
+  if (fresh != nullptr)
+    *fresh = entry.fresh;
+  if (entry.fresh) {
+    entry.fresh = false;
+    ++preconnect_used_;
+  }
+
+  ++hits_;
+  return std::move(entry.idle);
+}
+
+std::shared_ptr<SocketChannel> HttpConnectionPool::AcquireFreshImpl(
+    const std::string& key) {
+  base::AutoLock guard(lock_);
+
+  auto found = idle_.find(key);
+  if (found == idle_.end())
+    return nullptr;
+
+  // The most recently made one first, as in AcquireImpl.
+  const auto& idle = found->second;
+  for (auto i = idle.rbegin(), l = idle.rend(); i != l; ++i) {
+    auto socket = *i;
+    auto entry = entries_.find(socket);
+    if (!entry->second.fresh)
+      continue;
+
+    auto channel = std::move(entry->second.idle);
+    entries_.erase(entry);
+    RemoveIdle(key, socket);
+
+    ++preconnect_used_;
+    return channel;
+  }
+
+  return nullptr;
+}
+
+bool HttpConnectionPool::AddImpl(const std::string& key,
+                                 const std::shared_ptr<SocketChannel>& socket) {
+  base::AutoLock guard(lock_);
+
+  auto& entry = entries_[socket.get()];
+  entry.key = key;
+
+  auto result = socket->MonitorConnection(this);
+  if (FAILED(result)) {
+    LOG(WARNING) << "Failed to monitor connection: 0x" << std::hex << result;
+    entries_.erase(socket.get());
+    return false;
+  }
+
+  return true;
+}
+
+void HttpConnectionPool::ReleaseImpl(std::shared_ptr<SocketChannel>&& socket) {
+  base::AutoLock guard(lock_);
+
+  do {
+    auto found = entries_.find(socket.get());
+    if (found == entries_.end())
+      break;
+
+    auto& entry = found->second;
+    auto& idle = idle_[entry.key];
+    if (idle.size() >= kMaxIdlePerHost || idle_count_ >= kMaxIdle) {
+      if (idle.empty())
+        idle_.erase(entry.key);
+
+      entries_.erase(found);
+      break;
+    }
+
+    idle.push_back(socket.get());
+    ++idle_count_;
+
+    entry.idle = std::move(socket);
+    entry.released = GetTickCount64();
+    return;
+  } while (false);
+
+  ++discarded_;
+  socket->Close();
+  closed_.push_back(std::move(socket));
+}
+
+void HttpConnectionPool::AddFreshImpl(const std::string& key,
+                                      std::shared_ptr<SocketChannel>&& socket) {
+  base::AutoLock guard(lock_);
+
+  ++preconnected_;
+
+  do {
+    auto& idle = idle_[key];
+    if (idle.size() >= kMaxIdlePerHost || idle_count_ >= kMaxIdle) {
+      if (idle.empty())
+        idle_.erase(key);
+      break;
+    }
+
+    auto& entry = entries_[socket.get()];
+    entry.key = key;
+
+    auto result = socket->MonitorConnection(this);
+    if (FAILED(result)) {
+      LOG(WARNING) << "Failed to monitor connection: 0x" << std::hex << result;
+      entries_.erase(socket.get());
+      if (idle.empty())
+        idle_.erase(key);
+      break;
+    }
+
+    idle.push_back(socket.get());
+    ++idle_count_;
+
+    entry.idle = std::move(socket);
+    entry.released = GetTickCount64();
+    entry.fresh = true;
+    return;
+  } while (false);
+
+  ++preconnect_wasted_;
+  socket->Close();
+  closed_.push_back(std::move(socket));
+}
+
+size_t HttpConnectionPool::GetFreshCountImpl(const std::string& key) {
+  base::AutoLock guard(lock_);
+
+  auto found = idle_.find(key);
+  if (found == idle_.end())
+    return 0;
+
+  return std::count_if(
+      found->second.begin(), found->second.end(),
+      [this](SocketChannel* socket) { return entries_.at(socket).fresh; });
+}
+
+void HttpConnectionPool::GetStatisticsImpl(base::DictionaryValue* stats) {
+  base::AutoLock guard(lock_);
+
+  stats->SetInteger("idle", static_cast<int>(idle_count_));
+  stats->SetInteger("hosts", static_cast<int>(idle_.size()));
+  stats->SetDouble("hits", static_cast<double>(hits_));
+  stats->SetDouble("misses", static_cast<double>(misses_));
+  stats->SetDouble("discarded", static_cast<double>(discarded_));
+  stats->SetDouble("expired", static_cast<double>(expired_));
+  stats->SetDouble("disconnected", static_cast<double>(disconnected_));
+
+  auto requests = hits_ + misses_;
+  if (requests > 0)
+    stats->SetDouble("hit_rate", static_cast<double>(hits_) / requests);
+
+  stats->SetDouble("preconnected", static_cast<double>(preconnected_));
+  stats->SetDouble("preconnect_used", static_cast<double>(preconnect_used_));
+  stats->SetDouble("preconnect_wasted",
+                   static_cast<double>(preconnect_wasted_));
+
+  auto preconnects = preconnect_used_ + preconnect_wasted_;
+  if (preconnects > 0)
+    stats->SetDouble("preconnect_use_rate",
+                     static_cast<double>(preconnect_used_) / preconnects);
+}
+
+void HttpConnectionPool::RemoveIdle(const std::string& key,
+                                    SocketChannel* socket) {
+  lock_.AssertAcquired();
+
+  auto found = idle_.find(key);
+  if (found == idle_.end())
+    return;
+
+  auto& idle = found->second;
+  auto end = std::remove(idle.begin(), idle.end(), socket);
+  idle_count_ -= static_cast<size_t>(idle.end() - end);
+  idle.erase(end, idle.end());
+
+  if (idle.empty())
+    idle_.erase(found);
+}
+
+void HttpConnectionPool::CountWasted(const Entry& entry) {
+  lock_.AssertAcquired();
+
+  if (entry.fresh)
+    ++preconnect_wasted_;
+}
+
+void HttpConnectionPool::OnTimeout() {
+  std::vector<std::shared_ptr<SocketChannel>> sockets;
+
+  {
+    base::AutoLock guard(lock_);
+
+    sockets.swap(closed_);
+
+    auto now = GetTickCount64();
+    for (auto i = entries_.begin(), l = entries_.end(); i != l;) {
+      auto& entry = i->second;
+      auto timeout = entry.fresh ? kFreshTimeout : kIdleTimeout;
+      if (entry.idle == nullptr || now - entry.released < timeout) {
+        ++i;
+        continue;
+      }
+
+      ++expired_;
+      CountWasted(entry);
+      RemoveIdle(entry.key, i->first);
+      sockets.push_back(std::move(entry.idle));
+      i = entries_.erase(i);
+    }
+  }
+
+  sockets.clear();
+}
+
+void HttpConnectionPool::OnClosed(SocketChannel* socket, HRESULT /*result*/) {
+  base::AutoLock guard(lock_);
+
+  auto found = entries_.find(socket);
+  if (found == entries_.end())
+    return;
+
+  auto& entry = found->second;
+  if (entry.idle != nullptr) {
+    DLOG(INFO) << "Idle connection to " << entry.key << " closed.";
+
+    ++disconnected_;
+    CountWasted(entry);
+    RemoveIdle(entry.key, socket);
+    closed_.push_back(std::move(entry.idle));
+  }
+
+  entries_.erase(found);
+}
+
+std::string HttpConnectionPool::MakeKey(const std::string& host, int port) {
+  // Hosts parsed by GURL are already canonicalized.
+  return host + ":" + std::to_string(port);
+}
+
+}  // namespace http
+}  // namespace service
+}  // namespace juno
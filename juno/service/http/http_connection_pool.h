@@ -0,0 +1,151 @@
+// Copyright (c) 2017 dacci.org
+
+#ifndef JUNO_SERVICE_HTTP_HTTP_CONNECTION_POOL_H_
+#define JUNO_SERVICE_HTTP_HTTP_CONNECTION_POOL_H_
+
+#include <windows.h>
+
+#include <base/synchronization/lock.h>
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "io/net/socket_channel.h"
+#include "misc/timer_service.h"
+
+namespace base {
+
+class DictionaryValue;
+
+}  // namespace base
+
+namespace juno {
+namespace service {
+namespace http {
+
+// Keeps idle upstream connections of all the HTTP proxies, keyed by the host
+// and port they are connected to, so a session can reuse one regardless of
+// which host its previous request went to.
+// Every connection added is monitored by the pool; a connection closed by the
+// peer while idle is dropped without being handed out.
+// Connections made ahead by HttpPreconnector are kept as fresh until first
+// used, for a shorter time, and counted as used or wasted.
+class HttpConnectionPool : private io::net::SocketChannel::Listener,
+                           private misc::TimerService::Callback {
+ public:
+  static HRESULT Init();
+  static void Term();
+
+  // Returns an idle connection to |host|:|port|, or nullptr if none.
+  // |fresh| is set if the connection has never been used.
+  static std::shared_ptr<io::net::SocketChannel> Acquire(
+      const std::string& host, int port, bool* fresh = nullptr);
+
+  // Returns a fresh connection to |host|:|port|, or nullptr if none. It
+  // leaves the pool for good, so it can be handed over to a tunnel.
+  static std::shared_ptr<io::net::SocketChannel> AcquireFresh(
+      const std::string& host, int port);
+
+  // Starts monitoring |socket| newly connected to |host|:|port|, so that it
+  // can be released to the pool later.
+  static bool Add(const std::string& host, int port,
+                  const std::shared_ptr<io::net::SocketChannel>& socket);
+
+  // Returns |socket| to the pool. It must not have any I/O in progress.
+  // The connection is closed if the pool cannot keep it.
+  static void Release(std::shared_ptr<io::net::SocketChannel>&& socket);
+
+  // Keeps |socket| made ahead to |host|:|port| as fresh. The connection is
+  // closed if the pool cannot keep it.
+  static void AddFresh(const std::string& host, int port,
+                       std::shared_ptr<io::net::SocketChannel>&& socket);
+
+  // Returns the number of fresh connections to |host|:|port|.
+  static size_t GetFreshCount(const std::string& host, int port);
+
+  static void GetStatistics(base::DictionaryValue* stats);
+
+ private:
+  static const size_t kMaxIdlePerHost = 8;
+  static const size_t kMaxIdle = 256;
+  static const DWORD kIdleTimeout = 30 * 1000;   // 30 sec
+  static const DWORD kFreshTimeout = 10 * 1000;  // 10 sec
+  static const DWORD kSweepInterval = 5 * 1000;  // 5 sec
+
+  struct Entry {
+    std::string key;
+    // Holds the connection while it is idle, nullptr while it is in use.
+    std::shared_ptr<io::net::SocketChannel> idle;
+    ULONGLONG released;
+    // Made ahead and never used.
+    bool fresh;
+  };
+
+  typedef std::unordered_map<io::net::SocketChannel*, Entry> EntryMap;
+  typedef std::unordered_map<std::string, std::vector<io::net::SocketChannel*>>
+      IdleMap;
+
+  HttpConnectionPool();
+  ~HttpConnectionPool();
+
+  HRESULT Start();
+
+  std::shared_ptr<io::net::SocketChannel> AcquireImpl(const std::string& key,
+                                                      bool* fresh);
+  std::shared_ptr<io::net::SocketChannel> AcquireFreshImpl(
+      const std::string& key);
+  bool AddImpl(const std::string& key,
+               const std::shared_ptr<io::net::SocketChannel>& socket);
+  void ReleaseImpl(std::shared_ptr<io::net::SocketChannel>&& socket);
+  void AddFreshImpl(const std::string& key,
+                    std::shared_ptr<io::net::SocketChannel>&& socket);
+  size_t GetFreshCountImpl(const std::string& key);
+  void GetStatisticsImpl(base::DictionaryValue* stats);
+
+  void RemoveIdle(const std::string& key, io::net::SocketChannel* socket);
+  // Counts |entry| as wasted if it leaves the pool still fresh.
+  void CountWasted(const Entry& entry);
+
+  void OnTimeout() override;
+
+  void OnConnected(io::net::SocketChannel* /*socket*/,
+                   HRESULT /*result*/) override {}
+  void OnClosed(io::net::SocketChannel* socket, HRESULT result) override;
+
+  static std::string MakeKey(const std::string& host, int port);
+
+  static HttpConnectionPool* instance_;
+
+  base::Lock lock_;
+  EntryMap entries_;
+  IdleMap idle_;
+  size_t idle_count_;
+
+  // Connections which can no longer be used. They are destroyed on the next
+  // sweep, since a socket cannot be destroyed from its own callback.
+  std::vector<std::shared_ptr<io::net::SocketChannel>> closed_;
+
+  uint64_t hits_;
+  uint64_t misses_;
+  uint64_t discarded_;
+  uint64_t expired_;
+  uint64_t disconnected_;
+  uint64_t preconnected_;
+  uint64_t preconnect_used_;
+  uint64_t preconnect_wasted_;
+
+  std::unique_ptr<misc::TimerService::Timer> timer_;
+
+  HttpConnectionPool(const HttpConnectionPool&) = delete;
+  HttpConnectionPool& operator=(const HttpConnectionPool&) = delete;
+};
+
+}  // namespace http
+}  // namespace service
+}  // namespace juno
+
+#endif  // JUNO_SERVICE_HTTP_HTTP_CONNECTION_POOL_H_
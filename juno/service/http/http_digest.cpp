@@ -2,149 +2,48 @@
 
 #include "service/http/http_digest.h"
 
-#include <windows.h>
-#include <wincrypt.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
 
-#include <memory>
+#include <atomic>
+#include <random>
 #include <string>
 
+#include "misc/message_digest.h"
+#include "misc/string_util.h"
+#include "service/http/http_util.h"
+
 namespace juno {
 namespace service {
 namespace http {
 namespace {
 
-class CryptHash {
- public:
-  ~CryptHash() {
-    Destroy();
-  }
-
-  bool Hash(const void* data, size_t length) {
-    if (handle_ == NULL)
-      return false;
-
-    return CryptHashData(handle_, static_cast<const BYTE*>(data),
-                         static_cast<DWORD>(length), 0) != FALSE;
-  }
-
-  bool Hash(const char* string) {
-    return Hash(string, strlen(string));
-  }
+// Challenges are numbered from 1, as 0 is what no context has been used with.
+std::atomic<uint64_t> last_challenge(0);
 
-  bool Hash(const std::string& string) {
-    return Hash(string.c_str(), string.size());
-  }
+std::string ToHex(const uint8_t* data, size_t length) {
+  static const char kDigits[] = "0123456789abcdef";
 
-  template <typename T>
-  bool Hash(const T& data) {
-    return Hash(&data, sizeof(data));
+  std::string hex;
+  hex.reserve(length * 2);
+  for (size_t i = 0; i < length; ++i) {
+    hex.push_back(kDigits[data[i] >> 4]);
+    hex.push_back(kDigits[data[i] & 0x0F]);
   }
 
-  const std::string& Complete() {
-    BOOL succeeded;
-
-    do {
-      if (handle_ == NULL)
-        break;
-
-      DWORD hash_length = 0;
-      DWORD length = sizeof(hash_length);
-      succeeded =
-          CryptGetHashParam(handle_, HP_HASHSIZE,
-                            reinterpret_cast<BYTE*>(&hash_length), &length, 0);
-      if (!succeeded)
-        break;
-
-      auto hash_data = std::make_unique<BYTE[]>(hash_length);
-      if (hash_data == nullptr)
-        break;
-
-      succeeded = CryptGetHashParam(handle_, HP_HASHVAL, hash_data.get(),
-                                    &hash_length, 0);
-      if (!succeeded)
-        break;
-
-      hash_.resize(hash_length * 2);
-      length = static_cast<DWORD>(hash_.capacity());
-
-      succeeded = CryptBinaryToStringA(
-          hash_data.get(), hash_length,
-          CRYPT_STRING_HEXRAW | CRYPT_STRING_NOCRLF, &hash_[0], &length);
-      if (!succeeded) {
-        hash_.clear();
-        break;
-      }
-
-      Destroy();
-    } while (false);
-
-    return hash_;
-  }
-
- private:
-  friend class CryptProvider;
-
-  explicit CryptHash(HCRYPTHASH handle) : handle_(handle) {}
-
-  void Destroy() {
-    if (handle_ != NULL) {
-      CryptDestroyHash(handle_);
-      handle_ = NULL;
-    }
-  }
-
-  HCRYPTHASH handle_;
-  std::string hash_;
-
-  CryptHash(const CryptHash&) = delete;
-  CryptHash& operator=(const CryptHash&) = delete;
-};
-
-class CryptProvider {
- public:
-  CryptProvider() : handle_(NULL) {
-    CryptAcquireContext(&handle_, nullptr, nullptr, PROV_RSA_FULL,
-                        CRYPT_VERIFYCONTEXT);
-  }
-
-  ~CryptProvider() {
-    if (IsValid()) {
-      CryptReleaseContext(handle_, 0);
-      handle_ = NULL;
-    }
-  }
-
-  std::unique_ptr<CryptHash> CreateHash(ALG_ID algorithm) {
-    struct Wrapper : CryptHash {
-      explicit Wrapper(HCRYPTHASH handle) : CryptHash(handle) {}
-    };
-
-    HCRYPTHASH hash = NULL;
-    if (!CryptCreateHash(handle_, algorithm, NULL, 0, &hash))
-      return nullptr;
-
-    return std::make_unique<Wrapper>(hash);
-  }
-
-  std::unique_ptr<BYTE[]> GenerateRandom(DWORD length) {
-    auto random = std::make_unique<BYTE[]>(length);
-    if (random == nullptr)
-      return nullptr;
+  return hex;
+}
 
-    auto succeeded = CryptGenRandom(handle_, length, random.get());
-    if (!succeeded)
-      return nullptr;
+std::string GenerateCnonce() {
+  std::random_device random;
 
-    return std::move(random);
-  }
+  char cnonce[33];
+  sprintf_s(cnonce, "%08x%08x%08x%08x", random(), random(), random(),
+            random());
 
-  bool IsValid() const {
-    return handle_ != NULL;
-  }
-
- private:
-  HCRYPTPROV handle_;
-};
+  return cnonce;
+}
 
 bool GetPair(const char* input, std::string* name, std::string* value,
              const char** endptr) {
@@ -206,13 +105,15 @@ bool GetPair(const char* input, std::string* name, std::string* value,
 
 }  // namespace
 
-static CryptProvider crypt_provider;
-
-enum class HttpDigest::Algorithm { kMD5SESS, kMD5 };
+enum class HttpDigest::Algorithm { kMD5, kSHA256 };
 
-HttpDigest::HttpDigest() {
-  Reset();
-}
+HttpDigest::HttpDigest(const std::string& username,
+                       const std::string& password)
+    : id_(++last_challenge),
+      username_(username),
+      password_(password),
+      digest_(Algorithm::kMD5),
+      session_(false) {}
 
 bool HttpDigest::Input(const std::string& input) {
   auto header = input.data();
@@ -221,8 +122,6 @@ bool HttpDigest::Input(const std::string& input) {
   else
     return false;
 
-  Reset();
-
   for (;;) {
     while (*header && isspace(*header))
       ++header;
@@ -234,11 +133,6 @@ bool HttpDigest::Input(const std::string& input) {
 
     if (name.compare("nonce") == 0) {
       nonce_ = std::move(value);
-    } else if (name.compare("stale") == 0) {
-      if (value.compare("true") == 0) {
-        stale_ = true;
-        nonce_count_ = 1;
-      }
     } else if (name.compare("realm") == 0) {
       realm_ = std::move(value);
     } else if (name.compare("opaque") == 0) {
@@ -246,28 +140,31 @@ bool HttpDigest::Input(const std::string& input) {
     } else if (name.compare("qop") == 0) {
       auto auth_found = false, auth_int_found = false;
 
-      char* tok_buf = nullptr;
-      auto token = strtok_s(&value[0], ",", &tok_buf);
-      while (token != nullptr) {
-        if (strcmp(token, "auth") == 0)
+      http_util::ForEachElement(value, [&](const std::string& token) {
+        if (token.compare("auth") == 0)
           auth_found = true;
-        else if (strcmp(token, "auth-int") == 0)
+        else if (token.compare("auth-int") == 0)
           auth_int_found = true;
-
-        token = strtok_s(nullptr, ",", &tok_buf);
-      }
+      });
 
       if (auth_found)
         qop_ = "auth";
       else if (auth_int_found)
         qop_ = "auth-int";
     } else if (name.compare("algorithm") == 0) {
-      if (value.compare("MD5-sess") == 0)
-        digest_ = Algorithm::kMD5SESS;
-      else if (value.compare("MD5") == 0)
+      if (_stricmp(value, "MD5") == 0) {
         digest_ = Algorithm::kMD5;
-      else
+      } else if (_stricmp(value, "MD5-sess") == 0) {
+        digest_ = Algorithm::kMD5;
+        session_ = true;
+      } else if (_stricmp(value, "SHA-256") == 0) {
+        digest_ = Algorithm::kSHA256;
+      } else if (_stricmp(value, "SHA-256-sess") == 0) {
+        digest_ = Algorithm::kSHA256;
+        session_ = true;
+      } else {
         return false;
+      }
 
       algorithm_ = std::move(value);
     }
@@ -278,94 +175,47 @@ bool HttpDigest::Input(const std::string& input) {
       ++header;
   }
 
+  if (nonce_.empty())
+    return false;
+
+  ha1_ = Hash(username_ + ':' + realm_ + ':' + password_);
+
   return true;
 }
 
 bool HttpDigest::Output(const std::string& method, const std::string& path,
-                        std::string* output) {
-  if (nonce_count_ == 0)
-    nonce_count_ = 1;
-
-  if (cnonce_.empty()) {
-    SYSTEMTIME system_time;
-    FILETIME file_time;
-    GetSystemTime(&system_time);
-    SystemTimeToFileTime(&system_time, &file_time);
-
-    auto random1 = crypt_provider.GenerateRandom(4);
-    auto random2 = crypt_provider.GenerateRandom(4);
-
-    std::string cnonce_buffer;
-    cnonce_buffer.resize(32);
-    sprintf_s(&cnonce_buffer[0], cnonce_buffer.capacity(), "%08x%08x%08x%08x",
-              *reinterpret_cast<DWORD*>(random1.get()),
-              *reinterpret_cast<DWORD*>(random2.get()),
-              file_time.dwHighDateTime, file_time.dwLowDateTime);
-
-    cnonce_.resize(44);
-    auto length = static_cast<DWORD>(cnonce_.capacity());
-    CryptBinaryToStringA(reinterpret_cast<const BYTE*>(cnonce_buffer.data()),
-                         static_cast<DWORD>(cnonce_buffer.size()),
-                         CRYPT_STRING_BASE64 | CRYPT_STRING_NOCRLF, &cnonce_[0],
-                         &length);
-    cnonce_.resize(length);
-  }
-
-  std::string ha1;
-  {
-    auto hash = crypt_provider.CreateHash(CALG_MD5);
-    hash->Hash(username_);
-    hash->Hash(":");
-    hash->Hash(realm_);
-    hash->Hash(":");
-    hash->Hash(password_);
-    ha1 = hash->Complete();
-  }
-
-  if (digest_ == Algorithm::kMD5SESS) {
-    auto hash = crypt_provider.CreateHash(CALG_MD5);
-    hash->Hash(ha1);
-    hash->Hash(":");
-    hash->Hash(nonce_);
-    hash->Hash(":");
-    hash->Hash(cnonce_);
-    ha1 = hash->Complete();
+                        Context* context, std::string* output) const {
+  // A new cnonce for each challenge, and so is the session key.
+  if (context->challenge != id_) {
+    context->challenge = id_;
+    context->cnonce = GenerateCnonce();
+    context->nonce_count = 0;
+
+    if (session_)
+      context->session_key = Hash(ha1_ + ':' + nonce_ + ':' + context->cnonce);
+    else
+      context->session_key = ha1_;
   }
 
-  std::string ha2;
-  {
-    auto hash = crypt_provider.CreateHash(CALG_MD5);
-    hash->Hash(method);
-    hash->Hash(":");
-    hash->Hash(path);
-
-    if (qop_.compare("auth-int") == 0) {
-      hash->Hash(":");
-      hash->Hash("d41d8cd98f00b204e9800998ecf8427e");  // MD5 hash of empty
-    }
-
-    ha2 = hash->Complete();
-  }
+  auto a2 = method + ':' + path;
+  if (qop_.compare("auth-int") == 0)
+    a2.append(":").append(Hash(std::string()));  // hash of empty body
 
-  auto hash = crypt_provider.CreateHash(CALG_MD5);
-  hash->Hash(ha1);
-  hash->Hash(":");
-  hash->Hash(nonce_);
+  auto data = context->session_key + ':' + nonce_;
 
+  char nc[9];
   if (!qop_.empty()) {
-    char nc[9];
-    sprintf_s(nc, "%08x", nonce_count_);
-
-    hash->Hash(":");
-    hash->Hash(nc);
-    hash->Hash(":");
-    hash->Hash(cnonce_);
-    hash->Hash(":");
-    hash->Hash(qop_);
+    sprintf_s(nc, "%08x", ++context->nonce_count);
+
+    data.append(":")
+        .append(nc)
+        .append(":")
+        .append(context->cnonce)
+        .append(":")
+        .append(qop_);
   }
 
-  hash->Hash(":");
-  hash->Hash(ha2);
+  data.append(":").append(Hash(a2));
 
   output->assign("Digest ")
       .append("username=\"")
@@ -378,21 +228,15 @@ bool HttpDigest::Output(const std::string& method, const std::string& path,
       .append(path);
 
   if (!qop_.empty()) {
-    char nc[9];
-    sprintf_s(nc, "%08x", nonce_count_);
-
     output->append("\", cnonce=\"")
-        .append(cnonce_)
+        .append(context->cnonce)
         .append("\", nc=\"")
         .append(nc)
         .append("\", qop=\"")
         .append(qop_);
-
-    if (qop_.compare("auth") == 0)
-      ++nonce_count_;
   }
 
-  output->append("\", response=\"").append(hash->Complete());
+  output->append("\", response=\"").append(Hash(data));
 
   if (!opaque_.empty())
     output->append("\", opaque=\"").append(opaque_);
@@ -405,25 +249,24 @@ bool HttpDigest::Output(const std::string& method, const std::string& path,
   return true;
 }
 
-void HttpDigest::SetCredential(const std::string& username,
-                               const std::string& password) {
-  username_ = username;
-  password_ = password;
-
-  Reset();
+bool HttpDigest::IsStrongerThan(const HttpDigest& other) const {
+  return digest_ == Algorithm::kSHA256 && other.digest_ == Algorithm::kMD5;
 }
 
-void HttpDigest::Reset() {
-  nonce_count_ = 0;
-  digest_ = Algorithm::kMD5;
-  stale_ = false;
-
-  nonce_.clear();
-  cnonce_.clear();
-  realm_.clear();
-  opaque_.clear();
-  qop_.clear();
-  algorithm_.clear();
+std::string HttpDigest::Hash(const std::string& data) const {
+  uint8_t digest[misc::Sha256::kSize];
+
+  if (digest_ == Algorithm::kSHA256) {
+    misc::Sha256 hash;
+    hash.Update(data);
+    hash.Final(digest);
+    return ToHex(digest, misc::Sha256::kSize);
+  }
+
+  misc::Md5 hash;
+  hash.Update(data);
+  hash.Final(digest);
+  return ToHex(digest, misc::Md5::kSize);
 }
 
 }  // namespace http
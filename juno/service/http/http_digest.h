@@ -3,41 +3,66 @@
 #ifndef JUNO_SERVICE_HTTP_HTTP_DIGEST_H_
 #define JUNO_SERVICE_HTTP_HTTP_DIGEST_H_
 
+#include <stdint.h>
+
 #include <string>
 
 namespace juno {
 namespace service {
 namespace http {
 
+// Digest access authentication, RFC 7616, with MD5 and SHA-256.
+// A challenge is immutable once parsed, so it is shared by sessions without
+// locking. What changes from one request to the next is kept by each client
+// in a Context.
 class HttpDigest {
  public:
-  HttpDigest();
+  // The cnonce and the nonce count of a client, for the challenge it was
+  // last used with.
+  struct Context {
+    Context() : challenge(0), nonce_count(0) {}
+
+    uint64_t challenge;
+    std::string cnonce;
+    uint32_t nonce_count;
+    // H(A1), which of the -sess algorithms depends on the cnonce.
+    std::string session_key;
+  };
+
+  HttpDigest(const std::string& username, const std::string& password);
 
+  // Parses the challenge, and precomputes what does not depend on requests.
   bool Input(const std::string& input);
   bool Output(const std::string& method, const std::string& path,
-              std::string* output);
+              Context* context, std::string* output) const;
 
-  void SetCredential(const std::string& username, const std::string& password);
+  // Returns true if the challenge is preferred to |other|, when a server
+  // offers more than one.
+  bool IsStrongerThan(const HttpDigest& other) const;
 
  private:
   enum class Algorithm;
 
-  void Reset();
+  std::string Hash(const std::string& data) const;
+
+  // Identifies the challenge, so that contexts are renewed with it.
+  uint64_t id_;
 
   std::string username_;
   std::string password_;
 
-  int nonce_count_;
   Algorithm digest_;
-  bool stale_;
+  bool session_;
 
   std::string nonce_;
-  std::string cnonce_;
   std::string realm_;
   std::string opaque_;
   std::string qop_;
   std::string algorithm_;
 
+  // H(username:realm:password)
+  std::string ha1_;
+
   HttpDigest(const HttpDigest&) = delete;
   HttpDigest& operator=(const HttpDigest&) = delete;
 };
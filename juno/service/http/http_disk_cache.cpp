@@ -0,0 +1,934 @@
+// Copyright (c) 2017 dacci.org
+
+#include "service/http/http_disk_cache.h"
+
+#include <base/files/file_enumerator.h>
+#include <base/files/file_util.h>
+#include <base/logging.h>
+#include <base/pickle.h>
+#include <base/strings/stringprintf.h>
+#include <base/values.h>
+
+#include <stddef.h>
+
+#include <vector>
+
+namespace juno {
+namespace service {
+namespace http {
+namespace {
+
+const uint32_t kRecordMagic = 0x434E554A;  // "JUNC"
+
+enum RecordState : uint32_t {
+  kPending,
+  kCommitted,
+  kRemoved,
+};
+
+struct RecordHeader {
+  uint32_t magic;
+  uint32_t state;
+  uint32_t key_length;
+  uint32_t meta_length;
+  uint64_t body_length;
+};
+
+const int kIndexVersion = 1;
+
+const wchar_t kIndexFile[] = L"index";
+const wchar_t kIndexTempFile[] = L"index.tmp";
+const wchar_t kSegmentPattern[] = L"*.seg";
+
+}  // namespace
+
+class HttpDiskCache::Segment {
+ public:
+  Segment(uint32_t id, HANDLE file)
+      : id_(id), file_(file), mapping_(NULL), mapped_size_(0) {}
+
+  ~Segment() {
+    if (mapping_ != NULL)
+      CloseHandle(mapping_);
+
+    CloseHandle(file_);
+  }
+
+  bool Read(uint64_t offset, void* buffer, size_t length) {
+    OVERLAPPED overlapped{};
+    overlapped.Offset = static_cast<DWORD>(offset);
+    overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+
+    DWORD bytes = 0;
+    return ReadFile(file_, buffer, static_cast<DWORD>(length), &bytes,
+                    &overlapped) &&
+           bytes == length;
+  }
+
+  bool Write(uint64_t offset, const void* buffer, size_t length) {
+    OVERLAPPED overlapped{};
+    overlapped.Offset = static_cast<DWORD>(offset);
+    overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+
+    DWORD bytes = 0;
+    return WriteFile(file_, buffer, static_cast<DWORD>(length), &bytes,
+                     &overlapped) &&
+           bytes == length;
+  }
+
+  uint64_t GetSize() const {
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file_, &size))
+      return 0;
+
+    return size.QuadPart;
+  }
+
+  // Returns a mapping of the file covering at least |end| bytes. The file
+  // grows while records are appended, so the mapping is recreated as needed.
+  HANDLE GetMapping(uint64_t end) {
+    if (mapping_ != NULL && end <= mapped_size_)
+      return mapping_;
+
+    if (mapping_ != NULL) {
+      // Views already mapped keep the old mapping alive.
+      CloseHandle(mapping_);
+      mapping_ = NULL;
+    }
+
+    mapped_size_ = GetSize();
+    if (mapped_size_ < end)
+      return NULL;
+
+    mapping_ = CreateFileMapping(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    LOG_IF(ERROR, mapping_ == NULL) << "Failed to map segment " << id_ << ": "
+                                    << GetLastError();
+
+    return mapping_;
+  }
+
+  // The file is deleted once all handles and views of it are closed.
+  void Delete() {
+    FILE_DISPOSITION_INFO info{TRUE};
+    if (!SetFileInformationByHandle(file_, FileDispositionInfo, &info,
+                                    sizeof(info)))
+      LOG(WARNING) << "Failed to delete segment " << id_ << ": "
+                   << GetLastError();
+  }
+
+  uint32_t id() const {
+    return id_;
+  }
+
+ private:
+  const uint32_t id_;
+  const HANDLE file_;
+  HANDLE mapping_;
+  uint64_t mapped_size_;
+
+  Segment(const Segment&) = delete;
+  Segment& operator=(const Segment&) = delete;
+};
+
+class HttpDiskCache::View {
+ public:
+  explicit View(void* address) : address_(address) {}
+
+  ~View() {
+    UnmapViewOfFile(address_);
+  }
+
+ private:
+  void* const address_;
+
+  View(const View&) = delete;
+  View& operator=(const View&) = delete;
+};
+
+struct HttpDiskCache::Operation {
+  std::shared_ptr<Segment> segment;
+  uint64_t offset;
+  std::string data;
+
+  // Set to the last operation of a record, which publishes it.
+  std::string key;
+  std::unique_ptr<Record> record;
+};
+
+class HttpDiskCache::Writer : public HttpCache::Writer {
+ public:
+  Writer(HttpDiskCache* cache, const std::string& key,
+         std::unique_ptr<Record>&& record,
+         const std::shared_ptr<Segment>& segment)
+      : cache_(cache),
+        key_(key),
+        record_(std::move(record)),
+        segment_(segment),
+        written_(0) {}
+
+  ~Writer() override {
+    if (record_ != nullptr)
+      Drop();
+  }
+
+  void Append(const char* data, size_t length) override {
+    if (record_ == nullptr)
+      return;
+
+    if (written_ + length > record_->body_length) {
+      Drop();
+      return;
+    }
+
+    auto operation = std::make_unique<Operation>();
+    if (operation == nullptr) {
+      Drop();
+      return;
+    }
+
+    operation->segment = segment_;
+    operation->offset = record_->body_offset + written_;
+    operation->data.assign(data, length);
+
+    bool queued;
+    {
+      base::AutoLock guard(cache_->lock_);
+      queued = cache_->Enqueue(std::move(operation), false);
+    }
+
+    // Rather than holding the session back, the record is given up if the
+    // disk cannot keep up.
+    if (!queued) {
+      Drop();
+      return;
+    }
+
+    written_ += length;
+  }
+
+  void Commit() override {
+    if (record_ == nullptr || written_ != record_->body_length)
+      return;
+
+    auto operation = std::make_unique<Operation>();
+    if (operation == nullptr)
+      return;
+
+    auto state = kCommitted;
+    operation->segment = segment_;
+    operation->offset = record_->offset + offsetof(RecordHeader, state);
+    operation->data.assign(reinterpret_cast<const char*>(&state),
+                           sizeof(state));
+    operation->key = key_;
+    operation->record = std::move(record_);
+
+    base::AutoLock guard(cache_->lock_);
+    cache_->Enqueue(std::move(operation), true);
+  }
+
+ private:
+  void Drop() {
+    base::AutoLock guard(cache_->lock_);
+
+    cache_->reservations_.erase({record_->segment, record_->offset});
+    ++cache_->dropped_;
+    record_.reset();
+  }
+
+  HttpDiskCache* const cache_;
+  const std::string key_;
+  std::unique_ptr<Record> record_;
+  const std::shared_ptr<Segment> segment_;
+  uint64_t written_;
+
+  Writer(const Writer&) = delete;
+  Writer& operator=(const Writer&) = delete;
+};
+
+HttpDiskCache* HttpDiskCache::instance_ = nullptr;
+
+HRESULT HttpDiskCache::Init(const base::FilePath& directory) {
+  Term();
+
+  instance_ = new HttpDiskCache(directory);
+  if (instance_ == nullptr)
+    return E_OUTOFMEMORY;
+
+  auto result = instance_->Start();
+  if (FAILED(result))
+    Term();
+
+  return result;
+}
+
+void HttpDiskCache::Term() {
+  if (instance_ != nullptr) {
+    instance_->Stop();
+    delete instance_;
+    instance_ = nullptr;
+  }
+}
+
+std::shared_ptr<const HttpCache::Entry> HttpDiskCache::Lookup(
+    const std::string& key) {
+  if (instance_ == nullptr)
+    return nullptr;
+
+  return instance_->LookupImpl(key);
+}
+
+std::unique_ptr<HttpCache::Writer> HttpDiskCache::CreateWriter(
+    const std::string& key, std::unique_ptr<HttpCache::Entry>&& entry,
+    int64_t length) {
+  if (instance_ == nullptr || length < 0 || kMaxEntrySize < length)
+    return nullptr;
+
+  return instance_->CreateWriterImpl(key, std::move(entry), length);
+}
+
+void HttpDiskCache::Update(const std::string& key,
+                           const HttpCache::Entry& entry) {
+  if (instance_ != nullptr)
+    instance_->UpdateImpl(key, entry);
+}
+
+void HttpDiskCache::Invalidate(const std::string& key) {
+  if (instance_ != nullptr)
+    instance_->InvalidateImpl(key);
+}
+
+void HttpDiskCache::GetStatistics(base::DictionaryValue* stats) {
+  if (instance_ != nullptr)
+    instance_->GetStatisticsImpl(stats);
+}
+
+HttpDiskCache::HttpDiskCache(const base::FilePath& directory)
+    : directory_(directory),
+      end_(0),
+      size_(0),
+      dirty_(false),
+      work_(nullptr),
+      pending_size_(0),
+      writing_(false),
+      hits_(0),
+      stored_(0),
+      dropped_(0),
+      evicted_(0) {}
+
+HttpDiskCache::~HttpDiskCache() {
+  if (work_ != nullptr)
+    CloseThreadpoolWork(work_);
+}
+
+HRESULT HttpDiskCache::Start() {
+  if (!base::CreateDirectory(directory_)) {
+    LOG(ERROR) << "Failed to create " << directory_.value();
+    return E_FAIL;
+  }
+
+  work_ = CreateThreadpoolWork(OnWork, this, nullptr);
+  if (work_ == nullptr) {
+    auto error = GetLastError();
+    LOG(ERROR) << "Failed to create work: " << error;
+    return HRESULT_FROM_WIN32(error);
+  }
+
+  base::AutoLock guard(lock_);
+
+  base::FileEnumerator enumerator(directory_, false,
+                                  base::FileEnumerator::FILES, kSegmentPattern);
+  for (auto path = enumerator.Next(); !path.empty(); path = enumerator.Next()) {
+    wchar_t* end;
+    auto id = wcstoul(path.BaseName().value().c_str(), &end, 16);
+    if (*end == L'.')
+      OpenSegment(id, false);
+  }
+
+  Position scan_from;
+  if (!LoadIndex(&scan_from)) {
+    records_.clear();
+    size_ = 0;
+    scan_from = Position();
+  }
+
+  for (auto& pair : segments_) {
+    if (pair.first < scan_from.first)
+      continue;
+
+    auto offset = pair.first == scan_from.first ? scan_from.second : 0;
+    ScanSegment(pair.second, offset);
+  }
+
+  while (segments_.size() > kMaxSegments)
+    EvictSegment();
+
+  DLOG(INFO) << records_.size() << " records in " << segments_.size()
+             << " segments";
+
+  timer_ = misc::TimerService::GetDefault()->Create(this);
+  if (timer_ == nullptr) {
+    LOG(ERROR) << "Failed to create timer.";
+    return E_OUTOFMEMORY;
+  }
+
+  timer_->Start(kSaveInterval, kSaveInterval);
+
+  return S_OK;
+}
+
+void HttpDiskCache::Stop() {
+  timer_.reset();
+
+  // Writers are gone with the sessions, so the queue only drains from here.
+  if (work_ != nullptr)
+    WaitForThreadpoolWorkCallbacks(work_, FALSE);
+
+  SaveIndex();
+}
+
+bool HttpDiskCache::LoadIndex(Position* scan_from) {
+  lock_.AssertAcquired();
+
+  std::string data;
+  if (!base::ReadFileToString(directory_.Append(kIndexFile), &data))
+    return false;
+
+  base::Pickle pickle(data.data(), static_cast<int>(data.size()));
+  base::PickleIterator iterator(pickle);
+
+  int version;
+  uint64_t count;
+  if (!iterator.ReadInt(&version) || version != kIndexVersion ||
+      !iterator.ReadUInt32(&scan_from->first) ||
+      !iterator.ReadUInt64(&scan_from->second) ||
+      !iterator.ReadUInt64(&count))
+    return false;
+
+  for (uint64_t i = 0; i < count; ++i) {
+    std::string key;
+    auto record = std::make_unique<Record>();
+    auto entry = std::make_shared<HttpCache::Entry>();
+    if (record == nullptr || entry == nullptr)
+      return false;
+
+    if (!iterator.ReadString(&key) || !iterator.ReadUInt32(&record->segment) ||
+        !iterator.ReadUInt64(&record->offset) ||
+        !iterator.ReadUInt64(&record->body_offset) ||
+        !iterator.ReadUInt64(&record->body_length) ||
+        !DeserializeEntry(&iterator, entry.get()))
+      return false;
+
+    if (segments_.find(record->segment) == segments_.end())
+      continue;
+
+    record->entry = std::move(entry);
+    size_ += record->body_length;
+    records_[key] = std::move(record);
+  }
+
+  return true;
+}
+
+void HttpDiskCache::SaveIndex() {
+  base::Pickle pickle;
+
+  {
+    base::AutoLock guard(lock_);
+
+    if (!dirty_)
+      return;
+
+    // Records reserved but not yet committed have to be scanned again.
+    Position scan_from;
+    if (!reservations_.empty())
+      scan_from = *reservations_.begin();
+    else if (!segments_.empty())
+      scan_from = Position(segments_.rbegin()->first, end_);
+
+    pickle.WriteInt(kIndexVersion);
+    pickle.WriteUInt32(scan_from.first);
+    pickle.WriteUInt64(scan_from.second);
+    pickle.WriteUInt64(records_.size());
+
+    for (auto& pair : records_) {
+      auto& record = pair.second;
+      pickle.WriteString(pair.first);
+      pickle.WriteUInt32(record->segment);
+      pickle.WriteUInt64(record->offset);
+      pickle.WriteUInt64(record->body_offset);
+      pickle.WriteUInt64(record->body_length);
+      SerializeEntry(*record->entry, &pickle);
+    }
+
+    dirty_ = false;
+  }
+
+  auto temp_path = directory_.Append(kIndexTempFile);
+  auto written = base::WriteFile(
+      temp_path, static_cast<const char*>(pickle.data()),
+      static_cast<int>(pickle.size()));
+  if (written != static_cast<int>(pickle.size()) ||
+      !base::ReplaceFile(temp_path, directory_.Append(kIndexFile), nullptr)) {
+    LOG(ERROR) << "Failed to save the index of the disk cache.";
+
+    base::AutoLock guard(lock_);
+    dirty_ = true;
+  }
+}
+
+void HttpDiskCache::ScanSegment(const std::shared_ptr<Segment>& segment,
+                                uint64_t offset) {
+  lock_.AssertAcquired();
+
+  auto size = segment->GetSize();
+
+  while (offset + sizeof(RecordHeader) <= size) {
+    RecordHeader header;
+    if (!segment->Read(offset, &header, sizeof(header)) ||
+        header.magic != kRecordMagic)
+      break;
+
+    auto body_offset = offset + sizeof(header) + header.key_length +
+                       header.meta_length;
+    auto end = body_offset + header.body_length;
+    if (size < end)
+      break;
+
+    if (header.state == kCommitted || header.state == kRemoved) {
+      std::string key(header.key_length, '\0');
+      std::string meta(header.meta_length, '\0');
+      if (!segment->Read(offset + sizeof(header), &key[0], key.size()) ||
+          !segment->Read(offset + sizeof(header) + key.size(), &meta[0],
+                         meta.size()))
+        break;
+
+      auto found = records_.find(key);
+      if (found != records_.end()) {
+        size_ -= found->second->body_length;
+        records_.erase(found);
+      }
+
+      if (header.state == kCommitted) {
+        base::Pickle pickle(meta.data(), static_cast<int>(meta.size()));
+        base::PickleIterator iterator(pickle);
+
+        auto record = std::make_unique<Record>();
+        auto entry = std::make_shared<HttpCache::Entry>();
+        if (record != nullptr && entry != nullptr &&
+            DeserializeEntry(&iterator, entry.get())) {
+          record->segment = segment->id();
+          record->offset = offset;
+          record->body_offset = body_offset;
+          record->body_length = header.body_length;
+          record->entry = std::move(entry);
+
+          size_ += record->body_length;
+          records_[key] = std::move(record);
+        }
+      }
+
+      dirty_ = true;
+    }
+
+    offset = end;
+  }
+
+  if (segment == segments_.rbegin()->second)
+    end_ = offset;
+}
+
+std::shared_ptr<const HttpCache::Entry> HttpDiskCache::LookupImpl(
+    const std::string& key) {
+  base::AutoLock guard(lock_);
+
+  auto found = records_.find(key);
+  if (found == records_.end())
+    return nullptr;
+
+  auto& record = found->second;
+  auto segment = segments_.find(record->segment);
+  if (segment == segments_.end() || record->body_length == 0)
+    return nullptr;
+
+  auto mapping =
+      segment->second->GetMapping(record->body_offset + record->body_length);
+  if (mapping == NULL)
+    return nullptr;
+
+  SYSTEM_INFO system_info;
+  GetSystemInfo(&system_info);
+
+  // Views have to start at a multiple of the allocation granularity.
+  auto delta = record->body_offset % system_info.dwAllocationGranularity;
+  auto start = record->body_offset - delta;
+  auto length = static_cast<SIZE_T>(delta + record->body_length);
+  auto address =
+      MapViewOfFile(mapping, FILE_MAP_READ, static_cast<DWORD>(start >> 32),
+                    static_cast<DWORD>(start), length);
+  if (address == nullptr) {
+    LOG(ERROR) << "Failed to map view: " << GetLastError();
+    return nullptr;
+  }
+
+  auto view = std::make_shared<View>(address);
+  auto entry = std::make_shared<HttpCache::Entry>(*record->entry);
+  if (view == nullptr || entry == nullptr)
+    return nullptr;
+
+  entry->body = std::shared_ptr<const char>(
+      view, static_cast<const char*>(address) + delta);
+  entry->body_size = static_cast<size_t>(record->body_length);
+
+  ++hits_;
+
+  return entry;
+}
+
+std::unique_ptr<HttpCache::Writer> HttpDiskCache::CreateWriterImpl(
+    const std::string& key, std::unique_ptr<HttpCache::Entry>&& entry,
+    int64_t length) {
+  base::Pickle meta;
+  SerializeEntry(*entry, &meta);
+
+  RecordHeader header{kRecordMagic, kPending,
+                      static_cast<uint32_t>(key.size()),
+                      static_cast<uint32_t>(meta.size()),
+                      static_cast<uint64_t>(length)};
+
+  auto operation = std::make_unique<Operation>();
+  auto record = std::make_unique<Record>();
+  if (operation == nullptr || record == nullptr)
+    return nullptr;
+
+  operation->data.assign(reinterpret_cast<const char*>(&header),
+                         sizeof(header));
+  operation->data.append(key);
+  operation->data.append(static_cast<const char*>(meta.data()), meta.size());
+
+  base::AutoLock guard(lock_);
+
+  uint64_t offset;
+  auto segment = Reserve(operation->data.size() + length, &offset);
+  if (segment == nullptr)
+    return nullptr;
+
+  record->segment = segment->id();
+  record->offset = offset;
+  record->body_offset = offset + operation->data.size();
+  record->body_length = length;
+  record->entry = std::move(entry);
+
+  auto writer = std::make_unique<Writer>(this, key, std::move(record), segment);
+  if (writer == nullptr)
+    return nullptr;
+
+  reservations_.insert({segment->id(), offset});
+
+  operation->segment = std::move(segment);
+  operation->offset = offset;
+  Enqueue(std::move(operation), true);
+
+  return std::move(writer);
+}
+
+void HttpDiskCache::UpdateImpl(const std::string& key,
+                               const HttpCache::Entry& entry) {
+  auto updated = std::make_shared<HttpCache::Entry>(entry);
+  if (updated == nullptr)
+    return;
+
+  updated->body.reset();
+  updated->body_size = 0;
+
+  base::AutoLock guard(lock_);
+
+  auto found = records_.find(key);
+  if (found == records_.end())
+    return;
+
+  // Saved with the index, the headers freshened are lost on a crash; the
+  // entry is then validated once more.
+  found->second->entry = std::move(updated);
+  dirty_ = true;
+}
+
+void HttpDiskCache::InvalidateImpl(const std::string& key) {
+  base::AutoLock guard(lock_);
+
+  auto found = records_.find(key);
+  if (found == records_.end())
+    return;
+
+  size_ -= found->second->body_length;
+  records_.erase(found);
+  dirty_ = true;
+
+  // Appends a tombstone, so the record is not recovered by a scan.
+  auto operation = std::make_unique<Operation>();
+  if (operation == nullptr)
+    return;
+
+  RecordHeader header{kRecordMagic, kRemoved,
+                      static_cast<uint32_t>(key.size()), 0, 0};
+  operation->data.assign(reinterpret_cast<const char*>(&header),
+                         sizeof(header));
+  operation->data.append(key);
+
+  operation->segment = Reserve(operation->data.size(), &operation->offset);
+  if (operation->segment != nullptr)
+    Enqueue(std::move(operation), true);
+}
+
+void HttpDiskCache::GetStatisticsImpl(base::DictionaryValue* stats) {
+  base::AutoLock guard(lock_);
+
+  stats->SetInteger("entries", static_cast<int>(records_.size()));
+  stats->SetInteger("segments", static_cast<int>(segments_.size()));
+  stats->SetDouble("size", static_cast<double>(size_));
+  stats->SetDouble("pending", static_cast<double>(pending_size_));
+  stats->SetDouble("hits", static_cast<double>(hits_));
+  stats->SetDouble("stored", static_cast<double>(stored_));
+  stats->SetDouble("dropped", static_cast<double>(dropped_));
+  stats->SetDouble("evicted", static_cast<double>(evicted_));
+}
+
+std::shared_ptr<HttpDiskCache::Segment> HttpDiskCache::Reserve(
+    uint64_t length, uint64_t* offset) {
+  lock_.AssertAcquired();
+
+  if (length > kSegmentSize)
+    return nullptr;
+
+  if (segments_.empty() || end_ + length > kSegmentSize) {
+    auto id = segments_.empty() ? 0 : segments_.rbegin()->first + 1;
+    if (OpenSegment(id, true) == nullptr)
+      return nullptr;
+
+    end_ = 0;
+    dirty_ = true;
+
+    while (segments_.size() > kMaxSegments)
+      EvictSegment();
+  }
+
+  *offset = end_;
+  end_ += length;
+
+  return segments_.rbegin()->second;
+}
+
+std::shared_ptr<HttpDiskCache::Segment> HttpDiskCache::OpenSegment(
+    uint32_t id, bool create) {
+  lock_.AssertAcquired();
+
+  auto path = directory_.Append(base::StringPrintf(L"%08x.seg", id));
+  auto file = CreateFile(path.value().c_str(),
+                         GENERIC_READ | GENERIC_WRITE | DELETE,
+                         FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr,
+                         create ? CREATE_ALWAYS : OPEN_EXISTING,
+                         FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file == INVALID_HANDLE_VALUE) {
+    LOG(ERROR) << "Failed to open " << path.value() << ": " << GetLastError();
+    return nullptr;
+  }
+
+  auto segment = std::make_shared<Segment>(id, file);
+  if (segment == nullptr) {
+    CloseHandle(file);
+    return nullptr;
+  }
+
+  segments_[id] = segment;
+
+  return segment;
+}
+
+void HttpDiskCache::EvictSegment() {
+  lock_.AssertAcquired();
+
+  auto oldest = segments_.begin();
+  auto id = oldest->first;
+
+  for (auto i = records_.begin(), l = records_.end(); i != l;) {
+    if (i->second->segment == id) {
+      size_ -= i->second->body_length;
+      i = records_.erase(i);
+    } else {
+      ++i;
+    }
+  }
+
+  // Entries being served keep the file until their views are unmapped.
+  oldest->second->Delete();
+  segments_.erase(oldest);
+
+  ++evicted_;
+  dirty_ = true;
+}
+
+bool HttpDiskCache::Enqueue(std::unique_ptr<Operation>&& operation,
+                            bool force) {
+  lock_.AssertAcquired();
+
+  auto size = operation->data.size();
+  if (!force && pending_size_ + size > kMaxPendingSize)
+    return false;
+
+  pending_size_ += size;
+  queue_.push(std::move(operation));
+
+  if (!writing_) {
+    writing_ = true;
+    SubmitThreadpoolWork(work_);
+  }
+
+  return true;
+}
+
+void HttpDiskCache::Perform(Operation* operation) {
+  auto& data = operation->data;
+  auto succeeded =
+      operation->segment->Write(operation->offset, data.data(), data.size());
+  LOG_IF(ERROR, !succeeded) << "Failed to write segment "
+                            << operation->segment->id() << ": "
+                            << GetLastError();
+
+  base::AutoLock guard(lock_);
+
+  pending_size_ -= data.size();
+
+  if (operation->record != nullptr) {
+    auto& record = operation->record;
+    Position reservation(record->segment, record->offset);
+
+    if (succeeded) {
+      Publish(operation->key, std::move(record), reservation);
+    } else {
+      reservations_.erase(reservation);
+      ++dropped_;
+    }
+  }
+}
+
+void HttpDiskCache::Publish(const std::string& key,
+                            std::unique_ptr<Record>&& record,
+                            const Position& reservation) {
+  lock_.AssertAcquired();
+
+  reservations_.erase(reservation);
+
+  // The segment may have been evicted meanwhile.
+  if (segments_.find(record->segment) == segments_.end()) {
+    ++dropped_;
+    return;
+  }
+
+  auto found = records_.find(key);
+  if (found != records_.end())
+    size_ -= found->second->body_length;
+
+  size_ += record->body_length;
+  records_[key] = std::move(record);
+
+  ++stored_;
+  dirty_ = true;
+}
+
+void HttpDiskCache::OnTimeout() {
+  SaveIndex();
+}
+
+void CALLBACK HttpDiskCache::OnWork(PTP_CALLBACK_INSTANCE instance,
+                                    void* context, PTP_WORK /*work*/) {
+  CallbackMayRunLong(instance);
+
+  auto cache = static_cast<HttpDiskCache*>(context);
+
+  while (true) {
+    std::unique_ptr<Operation> operation;
+
+    {
+      base::AutoLock guard(cache->lock_);
+
+      if (cache->queue_.empty()) {
+        cache->writing_ = false;
+        break;
+      }
+
+      operation = std::move(cache->queue_.front());
+      cache->queue_.pop();
+    }
+
+    cache->Perform(operation.get());
+  }
+}
+
+void HttpDiskCache::SerializeEntry(const HttpCache::Entry& entry,
+                                   base::Pickle* pickle) {
+  pickle->WriteInt(entry.status);
+  pickle->WriteString(entry.message);
+
+  pickle->WriteUInt32(static_cast<uint32_t>(entry.headers.size()));
+  for (auto& pair : entry.headers) {
+    pickle->WriteString(pair.first);
+    pickle->WriteString(pair.second);
+  }
+
+  pickle->WriteUInt32(static_cast<uint32_t>(entry.vary.size()));
+  for (auto& pair : entry.vary) {
+    pickle->WriteString(pair.first);
+    pickle->WriteString(pair.second);
+  }
+
+  pickle->WriteInt64(entry.response_time.ToInternalValue());
+  pickle->WriteInt64(entry.initial_age.ToInternalValue());
+  pickle->WriteInt64(entry.freshness.ToInternalValue());
+  pickle->WriteBool(entry.no_cache);
+}
+
+bool HttpDiskCache::DeserializeEntry(base::PickleIterator* iterator,
+                                     HttpCache::Entry* entry) {
+  uint32_t count;
+
+  if (!iterator->ReadInt(&entry->status) ||
+      !iterator->ReadString(&entry->message) || !iterator->ReadUInt32(&count))
+    return false;
+
+  for (uint32_t i = 0; i < count; ++i) {
+    HttpHeaders::Pair pair;
+    if (!iterator->ReadString(&pair.first) ||
+        !iterator->ReadString(&pair.second))
+      return false;
+
+    entry->headers.push_back(std::move(pair));
+  }
+
+  if (!iterator->ReadUInt32(&count))
+    return false;
+
+  for (uint32_t i = 0; i < count; ++i) {
+    HttpHeaders::Pair pair;
+    if (!iterator->ReadString(&pair.first) ||
+        !iterator->ReadString(&pair.second))
+      return false;
+
+    entry->vary.push_back(std::move(pair));
+  }
+
+  int64_t response_time, initial_age, freshness;
+  if (!iterator->ReadInt64(&response_time) ||
+      !iterator->ReadInt64(&initial_age) || !iterator->ReadInt64(&freshness) ||
+      !iterator->ReadBool(&entry->no_cache))
+    return false;
+
+  entry->response_time = base::Time::FromInternalValue(response_time);
+  entry->initial_age = base::TimeDelta::FromInternalValue(initial_age);
+  entry->freshness = base::TimeDelta::FromInternalValue(freshness);
+  entry->body_size = 0;
+
+  return true;
+}
+
+}  // namespace http
+}  // namespace service
+}  // namespace juno
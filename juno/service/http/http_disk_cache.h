@@ -0,0 +1,161 @@
+// Copyright (c) 2017 dacci.org
+
+#ifndef JUNO_SERVICE_HTTP_HTTP_DISK_CACHE_H_
+#define JUNO_SERVICE_HTTP_HTTP_DISK_CACHE_H_
+
+#include <windows.h>
+
+#include <base/files/file_path.h>
+#include <base/synchronization/lock.h>
+
+#include <stdint.h>
+
+#include <map>
+#include <memory>
+#include <queue>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#include "misc/timer_service.h"
+#include "service/http/http_cache.h"
+
+namespace base {
+
+class DictionaryValue;
+class Pickle;
+class PickleIterator;
+
+}  // namespace base
+
+namespace juno {
+namespace service {
+namespace http {
+
+// Second tier of HttpCache for large responses.
+// Records are appended to segment files and served from mapped views of
+// them. All writes are done on a worker thread, in order; a record becomes
+// visible once its body has been written. The index is saved on shutdown and
+// periodically, and records appended after the last save are recovered by
+// scanning the segments on startup.
+class HttpDiskCache : private misc::TimerService::Callback {
+ public:
+  static const int64_t kMaxEntrySize = 256 * 1024 * 1024;  // 256 MiB
+
+  static HRESULT Init(const base::FilePath& directory);
+  static void Term();
+
+  static bool IsAvailable() {
+    return instance_ != nullptr;
+  }
+
+  // Returns the entry stored with |key| with its body mapped, or nullptr.
+  static std::shared_ptr<const HttpCache::Entry> Lookup(const std::string& key);
+
+  // Returns a writer to store |entry| with a body of |length| bytes.
+  static std::unique_ptr<HttpCache::Writer> CreateWriter(
+      const std::string& key, std::unique_ptr<HttpCache::Entry>&& entry,
+      int64_t length);
+
+  // Replaces the headers of the entry stored with |key| with |entry|'s.
+  static void Update(const std::string& key, const HttpCache::Entry& entry);
+
+  static void Invalidate(const std::string& key);
+
+  static void GetStatistics(base::DictionaryValue* stats);
+
+ private:
+  class Segment;
+  class View;
+  class Writer;
+  struct Operation;
+
+  struct Record {
+    uint32_t segment;
+    uint64_t offset;
+    uint64_t body_offset;
+    uint64_t body_length;
+
+    // The entry without its body.
+    std::shared_ptr<const HttpCache::Entry> entry;
+  };
+
+  typedef std::pair<uint32_t, uint64_t> Position;
+
+  static const uint64_t kSegmentSize = 512 * 1024 * 1024;  // 512 MiB
+  static const size_t kMaxSegments = 8;
+  static const size_t kMaxPendingSize = 64 * 1024 * 1024;  // 64 MiB
+  static const DWORD kSaveInterval = 60 * 1000;            // 1 min
+
+  explicit HttpDiskCache(const base::FilePath& directory);
+  ~HttpDiskCache();
+
+  HRESULT Start();
+  void Stop();
+
+  bool LoadIndex(Position* scan_from);
+  void SaveIndex();
+  void ScanSegment(const std::shared_ptr<Segment>& segment, uint64_t offset);
+
+  std::shared_ptr<const HttpCache::Entry> LookupImpl(const std::string& key);
+  std::unique_ptr<HttpCache::Writer> CreateWriterImpl(
+      const std::string& key, std::unique_ptr<HttpCache::Entry>&& entry,
+      int64_t length);
+  void UpdateImpl(const std::string& key, const HttpCache::Entry& entry);
+  void InvalidateImpl(const std::string& key);
+  void GetStatisticsImpl(base::DictionaryValue* stats);
+
+  // Reserves |length| bytes at the end of the current segment.
+  std::shared_ptr<Segment> Reserve(uint64_t length, uint64_t* offset);
+  std::shared_ptr<Segment> OpenSegment(uint32_t id, bool create);
+  void EvictSegment();
+
+  bool Enqueue(std::unique_ptr<Operation>&& operation, bool force);
+  void Perform(Operation* operation);
+  void Publish(const std::string& key, std::unique_ptr<Record>&& record,
+               const Position& reservation);
+
+  void OnTimeout() override;
+
+  static void CALLBACK OnWork(PTP_CALLBACK_INSTANCE instance, void* context,
+                              PTP_WORK work);
+
+  static void SerializeEntry(const HttpCache::Entry& entry,
+                             base::Pickle* pickle);
+  static bool DeserializeEntry(base::PickleIterator* iterator,
+                               HttpCache::Entry* entry);
+
+  static HttpDiskCache* instance_;
+
+  const base::FilePath directory_;
+
+  base::Lock lock_;
+  std::map<uint32_t, std::shared_ptr<Segment>> segments_;
+  uint64_t end_;  // End of the current segment.
+  std::unordered_map<std::string, std::unique_ptr<Record>> records_;
+  std::set<Position> reservations_;
+  uint64_t size_;
+  bool dirty_;
+
+  PTP_WORK work_;
+  std::queue<std::unique_ptr<Operation>> queue_;
+  size_t pending_size_;
+  bool writing_;
+
+  uint64_t hits_;
+  uint64_t stored_;
+  uint64_t dropped_;
+  uint64_t evicted_;
+
+  std::unique_ptr<misc::TimerService::Timer> timer_;
+
+  HttpDiskCache(const HttpDiskCache&) = delete;
+  HttpDiskCache& operator=(const HttpDiskCache&) = delete;
+};
+
+}  // namespace http
+}  // namespace service
+}  // namespace juno
+
+#endif  // JUNO_SERVICE_HTTP_HTTP_DISK_CACHE_H_
@@ -0,0 +1,113 @@
+// Copyright (c) 2017 dacci.org
+
+#include "service/http/http_filter_pipeline.h"
+
+#include <base/logging.h>
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "service/http/http_headers.h"
+
+namespace juno {
+namespace service {
+namespace http {
+
+HttpFilterPipeline::HttpFilterPipeline(
+    const std::vector<HttpProxyConfig::HeaderFilter>& filters) {
+  for (auto& filter : filters) {
+    if (filter.request)
+      Add(filter, &request_);
+
+    if (filter.response)
+      Add(filter, &response_);
+  }
+}
+
+HttpFilterPipeline::~HttpFilterPipeline() {}
+
+void HttpFilterPipeline::Apply(HttpHeaders* headers, bool request) const {
+  Apply(request ? request_ : response_, headers);
+}
+
+void HttpFilterPipeline::Add(const HttpProxyConfig::HeaderFilter& filter,
+                             std::vector<Group>* groups) {
+  Filter compiled;
+  compiled.action = filter.action;
+  compiled.name = filter.name;
+  compiled.value = filter.value;
+  compiled.replace = filter.replace;
+
+  auto editing = filter.action == HttpProxyConfig::FilterAction::kEdit ||
+                 filter.action == HttpProxyConfig::FilterAction::kEditR;
+  if (editing) {
+    try {
+      compiled.pattern.assign(filter.value, std::regex::ECMAScript |
+                                                std::regex::optimize);
+    } catch (const std::regex_error& error) {
+      LOG(WARNING) << "invalid pattern for " << filter.name << ": "
+                   << error.what();
+      return;
+    }
+  }
+
+  auto group = std::find_if(
+      groups->begin(), groups->end(), [&filter](const Group& group) {
+        return _stricmp(group.name.c_str(), filter.name.c_str()) == 0;
+      });
+  if (group == groups->end()) {
+    groups->push_back({filter.name, true, {}});
+    group = groups->end() - 1;
+  }
+
+  group->conditional &=
+      editing || filter.action == HttpProxyConfig::FilterAction::kUnset;
+  group->filters.push_back(std::move(compiled));
+}
+
+void HttpFilterPipeline::Apply(const std::vector<Group>& groups,
+                               HttpHeaders* headers) {
+  for (auto& group : groups) {
+    if (group.conditional && !headers->HeaderExists(group.name))
+      continue;
+
+    for (auto& filter : group.filters) {
+      switch (filter.action) {
+        case HttpProxyConfig::FilterAction::kSet:
+          headers->SetHeader(filter.name, filter.value);
+          break;
+
+        case HttpProxyConfig::FilterAction::kAppend:
+          headers->AppendHeader(filter.name, filter.value);
+          break;
+
+        case HttpProxyConfig::FilterAction::kAdd:
+          headers->AddHeader(filter.name, filter.value);
+          break;
+
+        case HttpProxyConfig::FilterAction::kUnset:
+          headers->RemoveHeader(filter.name);
+          break;
+
+        case HttpProxyConfig::FilterAction::kMerge:
+          headers->MergeHeader(filter.name, filter.value);
+          break;
+
+        case HttpProxyConfig::FilterAction::kEdit:
+          headers->EditHeader(filter.name, filter.pattern, filter.replace,
+                              false);
+          break;
+
+        case HttpProxyConfig::FilterAction::kEditR:
+          headers->EditHeader(filter.name, filter.pattern, filter.replace,
+                              true);
+          break;
+      }
+    }
+  }
+}
+
+}  // namespace http
+}  // namespace service
+}  // namespace juno
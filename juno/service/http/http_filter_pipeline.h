@@ -0,0 +1,64 @@
+// Copyright (c) 2017 dacci.org
+
+#ifndef JUNO_SERVICE_HTTP_HTTP_FILTER_PIPELINE_H_
+#define JUNO_SERVICE_HTTP_HTTP_FILTER_PIPELINE_H_
+
+#include <regex>
+#include <string>
+#include <vector>
+
+#include "service/http/http_proxy_config.h"
+
+namespace juno {
+namespace service {
+namespace http {
+
+class HttpHeaders;
+
+// The header filters of HttpProxyConfig compiled once per configuration.
+// Filters are split into those for requests and those for responses, and
+// grouped by the header they act on, keeping their order within the header.
+// Immutable once built, so it is shared by the sessions without locking.
+class HttpFilterPipeline {
+ public:
+  explicit HttpFilterPipeline(
+      const std::vector<HttpProxyConfig::HeaderFilter>& filters);
+  ~HttpFilterPipeline();
+
+  void Apply(HttpHeaders* headers, bool request) const;
+
+ private:
+  struct Filter {
+    HttpProxyConfig::FilterAction action;
+    std::string name;
+    std::string value;
+    std::string replace;
+    std::regex pattern;
+  };
+
+  // The filters acting on the header |name|, which is compared
+  // case-insensitively.
+  struct Group {
+    std::string name;
+    // Every filter edits or removes the header, so the group is skipped if
+    // the header does not exist.
+    bool conditional;
+    std::vector<Filter> filters;
+  };
+
+  static void Add(const HttpProxyConfig::HeaderFilter& filter,
+                  std::vector<Group>* groups);
+  static void Apply(const std::vector<Group>& groups, HttpHeaders* headers);
+
+  std::vector<Group> request_;
+  std::vector<Group> response_;
+
+  HttpFilterPipeline(const HttpFilterPipeline&) = delete;
+  HttpFilterPipeline& operator=(const HttpFilterPipeline&) = delete;
+};
+
+}  // namespace http
+}  // namespace service
+}  // namespace juno
+
+#endif  // JUNO_SERVICE_HTTP_HTTP_FILTER_PIPELINE_H_
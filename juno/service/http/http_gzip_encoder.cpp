@@ -0,0 +1,802 @@
+// Copyright (c) 2017 dacci.org
+
+#include "service/http/http_gzip_encoder.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+namespace juno {
+namespace service {
+namespace http {
+
+namespace {
+
+const int kLiteralCodes = 286;
+// The fixed code assigns two more, which are never used.
+const int kFixedLiteralCodes = 288;
+const int kDistanceCodes = 30;
+const int kCodeLengthCodes = 19;
+const int kLengthCodes = 29;
+const int kEndOfBlock = 256;
+const int kMaxBits = 15;
+const int kMaxCodeLengthBits = 7;
+const size_t kMaxStoredSize = 65535;
+
+// Tuned as zlib's default level.
+const int kGoodLength = 8;
+const int kMaxLazy = 16;
+const int kNiceLength = 128;
+const int kMaxChain = 128;
+// Matches of the minimum length this far away are costlier than literals.
+const uint32_t kTooFar = 4096;
+
+const char kGzipHeader[] = "\x1F\x8B\x08\x00\x00\x00\x00\x00\x00\xFF";
+const size_t kGzipHeaderSize = sizeof(kGzipHeader) - 1;
+
+const int kLengthExtra[kLengthCodes] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2,
+    2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0,
+};
+
+const int kLengthBase[kLengthCodes] = {
+    3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+    31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+};
+
+const int kDistanceExtra[kDistanceCodes] = {
+    0, 0, 0, 0, 1, 1, 2, 2,  3,  3,  4,  4,  5,  5,  6,
+    6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13,
+};
+
+const int kDistanceBase[kDistanceCodes] = {
+    1,    2,    3,    4,    5,    7,     9,     13,    17,  25,
+    33,   49,   65,   97,   129,  193,   257,   385,   513, 769,
+    1025, 1537, 2049, 3073, 4097, 6145,  8193,  12289, 16385, 24577,
+};
+
+const int kCodeLengthExtra[kCodeLengthCodes] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 2, 3, 7,
+};
+
+const uint8_t kCodeLengthOrder[kCodeLengthCodes] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15,
+};
+
+uint16_t ReverseBits(uint32_t code, int length) {
+  uint32_t reversed = 0;
+  for (auto i = 0; i < length; ++i, code >>= 1)
+    reversed = (reversed << 1) | (code & 1);
+  return static_cast<uint16_t>(reversed);
+}
+
+// Assigns the canonical codes, bit-reversed as they are sent LSB first.
+void GenerateCodes(const uint8_t* lengths, int count, uint16_t* codes) {
+  int counts[kMaxBits + 1] = {};
+  for (auto i = 0; i < count; ++i)
+    ++counts[lengths[i]];
+  counts[0] = 0;
+
+  uint32_t next[kMaxBits + 1] = {};
+  uint32_t code = 0;
+  for (auto bits = 1; bits <= kMaxBits; ++bits) {
+    code = (code + counts[bits - 1]) << 1;
+    next[bits] = code;
+  }
+
+  for (auto i = 0; i < count; ++i) {
+    codes[i] = lengths[i] != 0 ? ReverseBits(next[lengths[i]]++, lengths[i])
+                               : 0;
+  }
+}
+
+// Computes the code lengths of |count| weights sorted in ascending order, in
+// place, by the algorithm of Moffat and Katajainen.
+void CalculateMinimumRedundancy(uint32_t* a, int count) {
+  a[0] += a[1];
+
+  int root = 0, leaf = 2, next;
+  for (next = 1; next < count - 1; ++next) {
+    if (leaf >= count || a[root] < a[leaf]) {
+      a[next] = a[root];
+      a[root++] = next;
+    } else {
+      a[next] = a[leaf++];
+    }
+
+    if (leaf >= count || (root < next && a[root] < a[leaf])) {
+      a[next] += a[root];
+      a[root++] = next;
+    } else {
+      a[next] += a[leaf++];
+    }
+  }
+
+  a[count - 2] = 0;
+  for (next = count - 3; next >= 0; --next)
+    a[next] = a[a[next]] + 1;
+
+  int available = 1, used = 0;
+  uint32_t depth = 0;
+  root = count - 2;
+  next = count - 1;
+  while (available > 0) {
+    while (root >= 0 && a[root] == depth) {
+      ++used;
+      --root;
+    }
+    while (available > used) {
+      a[next--] = depth;
+      --available;
+    }
+    available = 2 * used;
+    ++depth;
+    used = 0;
+  }
+}
+
+// Computes the lengths of the Huffman codes of |count| symbols for their
+// |frequencies|, none longer than |max_bits|. At least two symbols are given
+// codes, so that the code is complete.
+void BuildLengths(const uint32_t* frequencies, int count, int max_bits,
+                  uint8_t* lengths) {
+  struct Symbol {
+    uint32_t frequency;
+    uint16_t symbol;
+  } symbols[kLiteralCodes];
+  int used = 0;
+
+  for (auto i = 0; i < count; ++i) {
+    lengths[i] = 0;
+    if (frequencies[i] != 0)
+      symbols[used++] = {frequencies[i], static_cast<uint16_t>(i)};
+  }
+
+  if (used < 2) {
+    lengths[0] = 1;
+    lengths[1] = 1;
+    if (used == 1 && symbols[0].symbol > 1) {
+      lengths[1] = 0;
+      lengths[symbols[0].symbol] = 1;
+    }
+    return;
+  }
+
+  std::sort(symbols, symbols + used, [](const Symbol& a, const Symbol& b) {
+    return a.frequency < b.frequency ||
+           (a.frequency == b.frequency && a.symbol < b.symbol);
+  });
+
+  uint32_t weights[kLiteralCodes];
+  for (auto i = 0; i < used; ++i)
+    weights[i] = symbols[i].frequency;
+  CalculateMinimumRedundancy(weights, used);
+
+  int counts[33] = {};
+  for (auto i = 0; i < used; ++i)
+    ++counts[std::min<uint32_t>(weights[i], 32)];
+
+  // Codes too long are shortened, lengthening others to keep the code
+  // complete.
+  for (auto i = max_bits + 1; i <= 32; ++i) {
+    counts[max_bits] += counts[i];
+    counts[i] = 0;
+  }
+
+  uint32_t total = 0;
+  for (auto i = max_bits; i > 0; --i)
+    total += static_cast<uint32_t>(counts[i]) << (max_bits - i);
+
+  while (total != 1u << max_bits) {
+    --counts[max_bits];
+    for (auto i = max_bits - 1; i > 0; --i) {
+      if (counts[i] != 0) {
+        --counts[i];
+        counts[i + 1] += 2;
+        break;
+      }
+    }
+    --total;
+  }
+
+  // The least frequent symbols take the longest codes.
+  auto symbol = symbols;
+  for (auto bits = max_bits; bits > 0; --bits) {
+    for (auto i = counts[bits]; i > 0; --i)
+      lengths[(symbol++)->symbol] = static_cast<uint8_t>(bits);
+  }
+}
+
+struct Tables {
+  Tables();
+
+  // Indexed by the length - 3.
+  uint8_t length_codes[256];
+  // Indexed by the distance - 1 if less than 256, 256 + that >> 7 otherwise.
+  uint8_t distance_codes[512];
+  uint32_t crc[256];
+
+  uint8_t fixed_literal_lengths[kFixedLiteralCodes];
+  uint16_t fixed_literal_codes[kFixedLiteralCodes];
+  uint8_t fixed_distance_lengths[kDistanceCodes];
+  uint16_t fixed_distance_codes[kDistanceCodes];
+};
+
+Tables::Tables() {
+  for (auto code = 0; code < kLengthCodes - 1; ++code) {
+    for (auto n = 0; n < 1 << kLengthExtra[code]; ++n)
+      length_codes[kLengthBase[code] - 3 + n] = static_cast<uint8_t>(code);
+  }
+  length_codes[255] = kLengthCodes - 1;
+
+  for (auto code = 0; code < kDistanceCodes; ++code) {
+    for (auto n = 0; n < 1 << kDistanceExtra[code]; ++n) {
+      auto distance = kDistanceBase[code] - 1 + n;
+      if (distance < 256)
+        distance_codes[distance] = static_cast<uint8_t>(code);
+      else
+        distance_codes[256 + (distance >> 7)] = static_cast<uint8_t>(code);
+    }
+  }
+
+  for (uint32_t i = 0; i < 256; ++i) {
+    auto value = i;
+    for (auto bit = 0; bit < 8; ++bit)
+      value = value & 1 ? 0xEDB88320 ^ (value >> 1) : value >> 1;
+    crc[i] = value;
+  }
+
+  // RFC 1951 3.2.6
+  for (auto i = 0; i < kFixedLiteralCodes; ++i) {
+    if (i < 144)
+      fixed_literal_lengths[i] = 8;
+    else if (i < 256)
+      fixed_literal_lengths[i] = 9;
+    else if (i < 280)
+      fixed_literal_lengths[i] = 7;
+    else
+      fixed_literal_lengths[i] = 8;
+  }
+  GenerateCodes(fixed_literal_lengths, kFixedLiteralCodes,
+                fixed_literal_codes);
+
+  for (auto i = 0; i < kDistanceCodes; ++i)
+    fixed_distance_lengths[i] = 5;
+  GenerateCodes(fixed_distance_lengths, kDistanceCodes, fixed_distance_codes);
+}
+
+const Tables& GetTables() {
+  static const Tables tables;
+  return tables;
+}
+
+int GetDistanceCode(uint32_t distance) {
+  auto& tables = GetTables();
+  --distance;
+  return distance < 256 ? tables.distance_codes[distance]
+                        : tables.distance_codes[256 + (distance >> 7)];
+}
+
+uint32_t UpdateCrc(uint32_t crc, const uint8_t* data, size_t length) {
+  auto& table = GetTables().crc;
+  for (size_t i = 0; i < length; ++i)
+    crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+  return crc;
+}
+
+}  // namespace
+
+// The dynamic Huffman codes of a block, and how they are sent.
+struct HttpGzipEncoder::Tree {
+  uint8_t literal_lengths[kLiteralCodes];
+  uint16_t literal_codes[kLiteralCodes];
+  uint8_t distance_lengths[kDistanceCodes];
+  uint16_t distance_codes[kDistanceCodes];
+  uint8_t code_lengths[kCodeLengthCodes];
+  uint16_t code_codes[kCodeLengthCodes];
+
+  int literal_count;
+  int distance_count;
+  int code_length_count;
+
+  // The code lengths, run-length encoded.
+  uint8_t symbols[kLiteralCodes + kDistanceCodes];
+  uint8_t extras[kLiteralCodes + kDistanceCodes];
+  int symbol_count;
+
+  // The size of the header sent after the block type.
+  uint64_t header_bits;
+
+  void Build(const uint32_t* literal_frequencies,
+             const uint32_t* distance_frequencies);
+  void AddSymbol(int symbol, int extra, uint32_t* frequencies);
+};
+
+void HttpGzipEncoder::Tree::Build(const uint32_t* literal_frequencies,
+                                  const uint32_t* distance_frequencies) {
+  BuildLengths(literal_frequencies, kLiteralCodes, kMaxBits, literal_lengths);
+  GenerateCodes(literal_lengths, kLiteralCodes, literal_codes);
+  BuildLengths(distance_frequencies, kDistanceCodes, kMaxBits,
+               distance_lengths);
+  GenerateCodes(distance_lengths, kDistanceCodes, distance_codes);
+
+  literal_count = kLiteralCodes;
+  while (literal_count > 257 && literal_lengths[literal_count - 1] == 0)
+    --literal_count;
+
+  distance_count = kDistanceCodes;
+  while (distance_count > 1 && distance_lengths[distance_count - 1] == 0)
+    --distance_count;
+
+  // The lengths of both codes are sent as one sequence, RFC 1951 3.2.7.
+  uint8_t lengths[kLiteralCodes + kDistanceCodes];
+  memcpy(lengths, literal_lengths, literal_count);
+  memcpy(lengths + literal_count, distance_lengths, distance_count);
+  auto count = literal_count + distance_count;
+
+  uint32_t frequencies[kCodeLengthCodes] = {};
+  symbol_count = 0;
+
+  for (auto i = 0; i < count;) {
+    auto length = lengths[i];
+    auto run = 1;
+    while (i + run < count && lengths[i + run] == length)
+      ++run;
+    i += run;
+
+    if (length == 0) {
+      while (run >= 11) {
+        auto repeat = std::min(run, 138);
+        AddSymbol(18, repeat - 11, frequencies);
+        run -= repeat;
+      }
+      if (run >= 3) {
+        AddSymbol(17, run - 3, frequencies);
+        run = 0;
+      }
+    } else {
+      AddSymbol(length, 0, frequencies);
+      --run;
+      while (run >= 3) {
+        auto repeat = std::min(run, 6);
+        AddSymbol(16, repeat - 3, frequencies);
+        run -= repeat;
+      }
+    }
+
+    for (; run > 0; --run)
+      AddSymbol(length, 0, frequencies);
+  }
+
+  BuildLengths(frequencies, kCodeLengthCodes, kMaxCodeLengthBits,
+               code_lengths);
+  GenerateCodes(code_lengths, kCodeLengthCodes, code_codes);
+
+  code_length_count = kCodeLengthCodes;
+  while (code_length_count > 4 &&
+         code_lengths[kCodeLengthOrder[code_length_count - 1]] == 0)
+    --code_length_count;
+
+  header_bits = 5 + 5 + 4 + 3 * code_length_count;
+  for (auto i = 0; i < kCodeLengthCodes; ++i)
+    header_bits += frequencies[i] * (code_lengths[i] + kCodeLengthExtra[i]);
+}
+
+void HttpGzipEncoder::Tree::AddSymbol(int symbol, int extra,
+                                      uint32_t* frequencies) {
+  symbols[symbol_count] = static_cast<uint8_t>(symbol);
+  extras[symbol_count] = static_cast<uint8_t>(extra);
+  ++symbol_count;
+  ++frequencies[symbol];
+}
+
+HttpGzipEncoder::HttpGzipEncoder()
+    : window_(new uint8_t[kWindowSize * 2]),
+      head_(new uint16_t[kHashSize]),
+      prev_(new uint16_t[kWindowSize]),
+      strstart_(0),
+      lookahead_(0),
+      block_start_(0),
+      match_available_(false),
+      match_length_(kMinMatch - 1),
+      match_distance_(0),
+      symbol_lengths_(new uint8_t[kMaxSymbols]),
+      symbol_distances_(new uint16_t[kMaxSymbols]),
+      symbol_count_(0),
+      literal_frequencies_(),
+      distance_frequencies_(),
+      bit_buffer_(0),
+      bit_count_(0),
+      output_(nullptr),
+      crc_(0),
+      total_in_(0),
+      total_out_(0) {
+  memset(head_.get(), 0, kHashSize * sizeof(head_[0]));
+}
+
+HttpGzipEncoder::~HttpGzipEncoder() {}
+
+void HttpGzipEncoder::Reset(std::string* output) {
+  // Position 0 stands for none, so no chain goes back to the last stream.
+  memset(head_.get(), 0, kHashSize * sizeof(head_[0]));
+
+  strstart_ = 0;
+  lookahead_ = 0;
+  block_start_ = 0;
+  match_available_ = false;
+  match_length_ = kMinMatch - 1;
+  match_distance_ = 0;
+
+  symbol_count_ = 0;
+  memset(literal_frequencies_, 0, sizeof(literal_frequencies_));
+  memset(distance_frequencies_, 0, sizeof(distance_frequencies_));
+
+  bit_buffer_ = 0;
+  bit_count_ = 0;
+
+  crc_ = 0xFFFFFFFF;
+  total_in_ = 0;
+  total_out_ = kGzipHeaderSize;
+
+  output->append(kGzipHeader, kGzipHeaderSize);
+}
+
+void HttpGzipEncoder::Encode(const void* data, size_t length,
+                             std::string* output) {
+  auto input = static_cast<const uint8_t*>(data);
+  auto start = output->size();
+  output_ = output;
+
+  crc_ = UpdateCrc(crc_, input, length);
+  total_in_ += length;
+
+  while (length > 0) {
+    if (strstart_ + lookahead_ == kWindowSize * 2)
+      SlideWindow();
+
+    auto size = std::min<size_t>(length,
+                                 kWindowSize * 2 - strstart_ - lookahead_);
+    memcpy(window_.get() + strstart_ + lookahead_, input, size);
+    lookahead_ += static_cast<uint32_t>(size);
+    input += size;
+    length -= size;
+
+    Deflate(false);
+  }
+
+  total_out_ += output->size() - start;
+  output_ = nullptr;
+}
+
+void HttpGzipEncoder::Flush(std::string* output) {
+  auto start = output->size();
+  output_ = output;
+
+  Deflate(true);
+  EmitBlock(false);
+
+  // An empty stored block, as zlib's Z_SYNC_FLUSH.
+  PutBits(0, 3);
+  AlignBits();
+  PutByte(0x00);
+  PutByte(0x00);
+  PutByte(0xFF);
+  PutByte(0xFF);
+
+  total_out_ += output->size() - start;
+  output_ = nullptr;
+}
+
+void HttpGzipEncoder::Finish(std::string* output) {
+  auto start = output->size();
+  output_ = output;
+
+  Deflate(true);
+  EmitBlock(true);
+  AlignBits();
+
+  auto crc = crc_ ^ 0xFFFFFFFF;
+  auto size = static_cast<uint32_t>(total_in_);
+  for (auto i = 0; i < 4; ++i)
+    PutByte(static_cast<uint8_t>(crc >> (i * 8)));
+  for (auto i = 0; i < 4; ++i)
+    PutByte(static_cast<uint8_t>(size >> (i * 8)));
+
+  total_out_ += output->size() - start;
+  output_ = nullptr;
+}
+
+void HttpGzipEncoder::Deflate(bool flush) {
+  while (lookahead_ >= kMinLookahead || (flush && lookahead_ > 0)) {
+    uint32_t head = 0;
+    if (lookahead_ >= kMinMatch)
+      head = InsertString(strstart_);
+
+    auto previous_length = match_length_;
+    auto previous_distance = match_distance_;
+    match_length_ = kMinMatch - 1;
+
+    if (head != 0 && previous_length < kMaxLazy &&
+        strstart_ - head <= kMaxDistance) {
+      uint32_t match_start = 0;
+      auto length = LongestMatch(head, previous_length, &match_start);
+      if (length > previous_length) {
+        match_length_ = length;
+        match_distance_ = strstart_ - match_start;
+
+        if (length == kMinMatch && match_distance_ > kTooFar)
+          match_length_ = kMinMatch - 1;
+      }
+    }
+
+    if (previous_length >= kMinMatch && match_length_ <= previous_length) {
+      // The match found at the previous position is taken. The strings in it
+      // are inserted, but not searched.
+      auto max_insert = strstart_ + lookahead_ - kMinMatch;
+      TallyMatch(previous_distance, previous_length);
+
+      lookahead_ -= previous_length - 1;
+      for (auto n = previous_length - 2; n > 0; --n) {
+        if (++strstart_ <= max_insert)
+          InsertString(strstart_);
+      }
+
+      match_available_ = false;
+      match_length_ = kMinMatch - 1;
+      ++strstart_;
+    } else if (match_available_) {
+      TallyLiteral(window_[strstart_ - 1]);
+      ++strstart_;
+      --lookahead_;
+    } else {
+      match_available_ = true;
+      ++strstart_;
+      --lookahead_;
+      continue;
+    }
+
+    if (symbol_count_ == kMaxSymbols)
+      EmitBlock(false);
+  }
+
+  if (flush && match_available_) {
+    TallyLiteral(window_[strstart_ - 1]);
+    match_available_ = false;
+  }
+}
+
+uint32_t HttpGzipEncoder::InsertString(uint32_t position) {
+  auto data = window_.get() + position;
+  auto key = static_cast<uint32_t>(data[0]) | data[1] << 8 | data[2] << 16;
+  auto hash = (key * 0x9E3779B1) >> (32 - kHashBits);
+
+  uint32_t head = head_[hash];
+  prev_[position & kWindowMask] = static_cast<uint16_t>(head);
+  head_[hash] = static_cast<uint16_t>(position);
+
+  return head;
+}
+
+int HttpGzipEncoder::LongestMatch(uint32_t current, int previous_length,
+                                  uint32_t* match_start) const {
+  auto max_length = static_cast<int>(
+      std::min<uint32_t>(kMaxMatch, lookahead_));
+  auto best_length = previous_length;
+  if (best_length >= max_length)
+    return best_length;
+
+  auto nice_length = std::min(kNiceLength, max_length);
+  auto chain = previous_length >= kGoodLength ? kMaxChain / 4 : kMaxChain;
+  auto limit = strstart_ > kMaxDistance ? strstart_ - kMaxDistance : 0;
+  auto scan = window_.get() + strstart_;
+
+  do {
+    auto match = window_.get() + current;
+    if (match[best_length] != scan[best_length] ||
+        match[best_length - 1] != scan[best_length - 1] ||
+        match[0] != scan[0] || match[1] != scan[1])
+      continue;
+
+    // Compared 8 bytes at a time, as far as the input goes.
+    auto length = 2;
+    while (length + 8 <= max_length) {
+      uint64_t a, b;
+      memcpy(&a, scan + length, sizeof(a));
+      memcpy(&b, match + length, sizeof(b));
+      if (a != b)
+        break;
+      length += 8;
+    }
+    while (length < max_length && match[length] == scan[length])
+      ++length;
+
+    if (length > best_length) {
+      *match_start = current;
+      best_length = length;
+      if (length >= nice_length)
+        break;
+    }
+  } while ((current = prev_[current & kWindowMask]) > limit && --chain != 0);
+
+  return best_length;
+}
+
+void HttpGzipEncoder::SlideWindow() {
+  // A stored block is sent from the window, so the block is ended before
+  // any of it is dropped.
+  if (block_start_ < kWindowSize)
+    EmitBlock(false);
+
+  memcpy(window_.get(), window_.get() + kWindowSize, kWindowSize);
+  strstart_ -= kWindowSize;
+  block_start_ -= kWindowSize;
+
+  for (uint32_t i = 0; i < kHashSize; ++i)
+    head_[i] = head_[i] >= kWindowSize ? head_[i] - kWindowSize : 0;
+  for (uint32_t i = 0; i < kWindowSize; ++i)
+    prev_[i] = prev_[i] >= kWindowSize ? prev_[i] - kWindowSize : 0;
+}
+
+void HttpGzipEncoder::TallyLiteral(uint8_t literal) {
+  symbol_lengths_[symbol_count_] = literal;
+  symbol_distances_[symbol_count_] = 0;
+  ++symbol_count_;
+  ++literal_frequencies_[literal];
+}
+
+void HttpGzipEncoder::TallyMatch(uint32_t distance, int length) {
+  auto code = GetTables().length_codes[length - kMinMatch];
+
+  symbol_lengths_[symbol_count_] = static_cast<uint8_t>(length - kMinMatch);
+  symbol_distances_[symbol_count_] = static_cast<uint16_t>(distance);
+  ++symbol_count_;
+  ++literal_frequencies_[kEndOfBlock + 1 + code];
+  ++distance_frequencies_[GetDistanceCode(distance)];
+}
+
+void HttpGzipEncoder::EmitBlock(bool last) {
+  auto& tables = GetTables();
+  literal_frequencies_[kEndOfBlock] = 1;
+
+  Tree tree;
+  tree.Build(literal_frequencies_, distance_frequencies_);
+
+  uint64_t dynamic_bits = 3 + tree.header_bits;
+  uint64_t fixed_bits = 3;
+  for (auto i = 0; i < kLiteralCodes; ++i) {
+    auto extra = i > kEndOfBlock ? kLengthExtra[i - kEndOfBlock - 1] : 0;
+    dynamic_bits += literal_frequencies_[i] * (tree.literal_lengths[i] + extra);
+    fixed_bits +=
+        literal_frequencies_[i] * (tables.fixed_literal_lengths[i] + extra);
+  }
+  for (auto i = 0; i < kDistanceCodes; ++i) {
+    dynamic_bits += distance_frequencies_[i] *
+                    (tree.distance_lengths[i] + kDistanceExtra[i]);
+    fixed_bits += distance_frequencies_[i] *
+                  (tables.fixed_distance_lengths[i] + kDistanceExtra[i]);
+  }
+
+  // The literal held for a longer match is not in the block yet.
+  auto block_end = strstart_ - (match_available_ ? 1 : 0);
+  auto stored_size = block_end - block_start_;
+  auto stored_count = std::max<size_t>(
+      (stored_size + kMaxStoredSize - 1) / kMaxStoredSize, 1);
+  uint64_t stored_bits = (stored_size + stored_count * 5) * 8;
+
+  if (stored_bits <= fixed_bits && stored_bits <= dynamic_bits) {
+    SendStored(last);
+  } else if (fixed_bits <= dynamic_bits) {
+    PutBits((last ? 1 : 0) | 1 << 1, 3);
+    SendSymbols(tables.fixed_literal_lengths, tables.fixed_literal_codes,
+                tables.fixed_distance_lengths, tables.fixed_distance_codes);
+  } else {
+    PutBits((last ? 1 : 0) | 2 << 1, 3);
+    SendTrees(tree);
+    SendSymbols(tree.literal_lengths, tree.literal_codes,
+                tree.distance_lengths, tree.distance_codes);
+  }
+
+  symbol_count_ = 0;
+  memset(literal_frequencies_, 0, sizeof(literal_frequencies_));
+  memset(distance_frequencies_, 0, sizeof(distance_frequencies_));
+  block_start_ = block_end;
+}
+
+void HttpGzipEncoder::SendStored(bool last) {
+  auto data = window_.get() + block_start_;
+  size_t size = strstart_ - (match_available_ ? 1 : 0) - block_start_;
+
+  do {
+    auto length = std::min(size, kMaxStoredSize);
+    size -= length;
+
+    PutBits(last && size == 0 ? 1 : 0, 3);
+    AlignBits();
+    PutByte(static_cast<uint8_t>(length));
+    PutByte(static_cast<uint8_t>(length >> 8));
+    PutByte(static_cast<uint8_t>(~length));
+    PutByte(static_cast<uint8_t>(~length >> 8));
+    output_->append(reinterpret_cast<const char*>(data), length);
+    data += length;
+  } while (size > 0);
+}
+
+void HttpGzipEncoder::SendTrees(const Tree& tree) {
+  PutBits(tree.literal_count - 257, 5);
+  PutBits(tree.distance_count - 1, 5);
+  PutBits(tree.code_length_count - 4, 4);
+
+  for (auto i = 0; i < tree.code_length_count; ++i)
+    PutBits(tree.code_lengths[kCodeLengthOrder[i]], 3);
+
+  for (auto i = 0; i < tree.symbol_count; ++i) {
+    auto symbol = tree.symbols[i];
+    PutBits(tree.code_codes[symbol], tree.code_lengths[symbol]);
+    if (kCodeLengthExtra[symbol] != 0)
+      PutBits(tree.extras[i], kCodeLengthExtra[symbol]);
+  }
+}
+
+void HttpGzipEncoder::SendSymbols(const uint8_t* literal_lengths,
+                                  const uint16_t* literal_codes,
+                                  const uint8_t* distance_lengths,
+                                  const uint16_t* distance_codes) {
+  auto& tables = GetTables();
+
+  for (size_t i = 0; i < symbol_count_; ++i) {
+    auto value = symbol_lengths_[i];
+    uint32_t distance = symbol_distances_[i];
+
+    if (distance == 0) {
+      PutBits(literal_codes[value], literal_lengths[value]);
+      continue;
+    }
+
+    auto code = tables.length_codes[value];
+    auto symbol = kEndOfBlock + 1 + code;
+    PutBits(literal_codes[symbol], literal_lengths[symbol]);
+    if (kLengthExtra[code] != 0)
+      PutBits(value + kMinMatch - kLengthBase[code], kLengthExtra[code]);
+
+    code = static_cast<uint8_t>(GetDistanceCode(distance));
+    PutBits(distance_codes[code], distance_lengths[code]);
+    if (kDistanceExtra[code] != 0)
+      PutBits(distance - kDistanceBase[code], kDistanceExtra[code]);
+  }
+
+  PutBits(literal_codes[kEndOfBlock], literal_lengths[kEndOfBlock]);
+}
+
+void HttpGzipEncoder::PutBits(uint32_t value, int count) {
+  bit_buffer_ |= static_cast<uint64_t>(value) << bit_count_;
+  bit_count_ += count;
+
+  if (bit_count_ >= 32) {
+    char bytes[4];
+    for (auto i = 0; i < 4; ++i)
+      bytes[i] = static_cast<char>(bit_buffer_ >> (i * 8));
+    output_->append(bytes, sizeof(bytes));
+
+    bit_buffer_ >>= 32;
+    bit_count_ -= 32;
+  }
+}
+
+void HttpGzipEncoder::AlignBits() {
+  while (bit_count_ > 0) {
+    output_->push_back(static_cast<char>(bit_buffer_));
+    bit_buffer_ >>= 8;
+    bit_count_ -= 8;
+  }
+
+  bit_buffer_ = 0;
+  bit_count_ = 0;
+}
+
+void HttpGzipEncoder::PutByte(uint8_t value) {
+  output_->push_back(static_cast<char>(value));
+}
+
+}  // namespace http
+}  // namespace service
+}  // namespace juno
@@ -0,0 +1,126 @@
+// Copyright (c) 2017 dacci.org
+
+#ifndef JUNO_SERVICE_HTTP_HTTP_GZIP_ENCODER_H_
+#define JUNO_SERVICE_HTTP_HTTP_GZIP_ENCODER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+
+namespace juno {
+namespace service {
+namespace http {
+
+// Streaming encoder of the gzip format, RFC 1952, compressing with DEFLATE,
+// RFC 1951. Matches are found over a 32 KiB window through hash chains with
+// lazy evaluation, and each block is sent with dynamic or fixed Huffman codes
+// or stored, whichever is the smallest.
+// All the state is allocated once, so an encoder is reused from one body to
+// the next without allocating. Output is appended to the string given, and
+// nothing else allocates.
+class HttpGzipEncoder {
+ public:
+  HttpGzipEncoder();
+  ~HttpGzipEncoder();
+
+  // Begins a new stream, appending the gzip header to |output|.
+  void Reset(std::string* output);
+
+  // Compresses |length| bytes at |data|. What is compressed is appended to
+  // |output| a block at a time, so some of the input may be held back.
+  void Encode(const void* data, size_t length, std::string* output);
+
+  // Ends the current block on a byte boundary, so that all the input so far
+  // can be decoded from |output|.
+  void Flush(std::string* output);
+
+  // Ends the stream with the gzip trailer.
+  void Finish(std::string* output);
+
+  // The number of bytes given to and taken from the current stream.
+  uint64_t total_in() const {
+    return total_in_;
+  }
+
+  uint64_t total_out() const {
+    return total_out_;
+  }
+
+ private:
+  struct Tree;
+
+  static const int kWindowBits = 15;
+  static const uint32_t kWindowSize = 1 << kWindowBits;
+  static const uint32_t kWindowMask = kWindowSize - 1;
+  static const int kHashBits = 15;
+  static const uint32_t kHashSize = 1 << kHashBits;
+  static const int kMinMatch = 3;
+  static const int kMaxMatch = 258;
+  // Enough to find the longest match ahead, and insert its last string.
+  static const uint32_t kMinLookahead = kMaxMatch + kMinMatch + 1;
+  static const uint32_t kMaxDistance = kWindowSize - kMinLookahead;
+  static const size_t kMaxSymbols = 16 * 1024;
+
+  // Consumes the input in the window, as far as matches can be found in it,
+  // or all of it if |flush|.
+  void Deflate(bool flush);
+  uint32_t InsertString(uint32_t position);
+  int LongestMatch(uint32_t current, int previous_length,
+                   uint32_t* match_start) const;
+  // Moves the upper half of the window down, making room for more input.
+  void SlideWindow();
+
+  void TallyLiteral(uint8_t literal);
+  void TallyMatch(uint32_t distance, int length);
+  // Sends the symbols tallied as a block of the smallest type.
+  void EmitBlock(bool last);
+  void SendStored(bool last);
+  void SendTrees(const Tree& tree);
+  void SendSymbols(const uint8_t* literal_lengths,
+                   const uint16_t* literal_codes,
+                   const uint8_t* distance_lengths,
+                   const uint16_t* distance_codes);
+
+  void PutBits(uint32_t value, int count);
+  // Writes out the bits pending, padding the last byte with zeros.
+  void AlignBits();
+  void PutByte(uint8_t value);
+
+  std::unique_ptr<uint8_t[]> window_;
+  std::unique_ptr<uint16_t[]> head_;
+  std::unique_ptr<uint16_t[]> prev_;
+
+  uint32_t strstart_;
+  uint32_t lookahead_;
+  // The start of the block in the window.
+  uint32_t block_start_;
+  // A literal is held at strstart_ - 1, to see if a longer match follows.
+  bool match_available_;
+  int match_length_;
+  uint32_t match_distance_;
+
+  std::unique_ptr<uint8_t[]> symbol_lengths_;
+  std::unique_ptr<uint16_t[]> symbol_distances_;
+  size_t symbol_count_;
+  uint32_t literal_frequencies_[286];
+  uint32_t distance_frequencies_[30];
+
+  uint64_t bit_buffer_;
+  int bit_count_;
+  std::string* output_;
+
+  uint32_t crc_;
+  uint64_t total_in_;
+  uint64_t total_out_;
+
+  HttpGzipEncoder(const HttpGzipEncoder&) = delete;
+  HttpGzipEncoder& operator=(const HttpGzipEncoder&) = delete;
+};
+
+}  // namespace http
+}  // namespace service
+}  // namespace juno
+
+#endif  // JUNO_SERVICE_HTTP_HTTP_GZIP_ENCODER_H_
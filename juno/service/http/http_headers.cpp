@@ -6,24 +6,109 @@
 
 #include <picohttpparser/picohttpparser.h>
 
+#include <algorithm>
+#include <iterator>
 #include <regex>
 #include <string>
 #include <utility>
 
+#include "service/http/http_scan.h"
+
 namespace juno {
 namespace service {
 namespace http {
 
+namespace {
+
+// Headers looked up on every message. The index of each is its bit in
+// HttpHeaders::known_.
+const char* const kKnownHeaders[] = {
+    "Age",
+    "Authorization",
+    "Cache-Control",
+    "Connection",
+    "Content-Length",
+    "Date",
+    "ETag",
+    "Expect",
+    "Expires",
+    "Host",
+    "If-Modified-Since",
+    "If-None-Match",
+    "Keep-Alive",
+    "Last-Modified",
+    "Pragma",
+    "Proxy-Authenticate",
+    "Proxy-Authorization",
+    "Proxy-Connection",
+    "Set-Cookie",
+    "Transfer-Encoding",
+    "Vary",
+};
+
+const int kKnownCount = static_cast<int>(_countof(kKnownHeaders));
+
+static_assert(kKnownCount <= 32, "too many known headers");
+
+}  // namespace
+
 const std::string HttpHeaders::kNotFound;
 
-HttpHeaders::HttpHeaders() {}
+HttpHeaders::Field::Field(base::StringPiece name, base::StringPiece value,
+                          base::StringPiece line, uint32_t hash, int known)
+    : materialized_(false),
+      name_(name),
+      value_(value),
+      line_(line),
+      hash_(hash),
+      known_(known) {}
+
+HttpHeaders::Field::Field(std::string&& name, std::string&& value,
+                          uint32_t hash, int known)
+    : pair_(std::move(name), std::move(value)),
+      materialized_(true),
+      hash_(hash),
+      known_(known) {}
+
+const HttpHeaders::Pair& HttpHeaders::Field::pair() const {
+  if (!materialized_) {
+    pair_.first.assign(name_.data(), name_.size());
+    pair_.second.assign(value_.data(), value_.size());
+    materialized_ = true;
+  }
+
+  return pair_;
+}
+
+std::string* HttpHeaders::Field::mutable_value() {
+  pair();
+  line_ = base::StringPiece();
+
+  return &pair_.second;
+}
+
+HttpHeaders::HttpHeaders() : known_(0) {}
+
+void HttpHeaders::AddHeader(const std::string& name, const std::string& value) {
+  auto hash = Hash(name.data(), name.size());
+  auto known = FindKnown(name.data(), name.size(), hash);
+
+  if (fields_.empty())
+    fields_.reserve(kInitialCapacity);
+
+  fields_.emplace_back(std::string(name), std::string(value), hash, known);
+  known_ |= KnownBit(known);
+}
 
 void HttpHeaders::AppendHeader(const std::string& name,
                                const std::string& value) {
-  for (auto& pair : list_) {
-    if (_stricmp(pair.first.c_str(), name.c_str()) == 0) {
-      pair.second.append(", ");
-      pair.second.append(value);
+  auto key = MakeKey(name);
+
+  for (auto& field : fields_) {
+    if (Matches(field, key)) {
+      auto merged = field.mutable_value();
+      merged->append(", ");
+      merged->append(value);
       return;
     }
   }
@@ -32,67 +117,70 @@ void HttpHeaders::AppendHeader(const std::string& name,
 }
 
 void HttpHeaders::SetHeader(const std::string& name, const std::string& value) {
-  auto first = true;
+  auto key = MakeKey(name);
   auto found = false;
 
-  for (auto i = list_.begin(), l = list_.end(); i != l;) {
-    if (_stricmp(i->first.c_str(), name.c_str()) == 0) {
-      found = true;
+  auto end = std::remove_if(fields_.begin(), fields_.end(),
+                            [&key, &found](const Field& field) {
+                              if (!Matches(field, key))
+                                return false;
 
-      if (first) {
-        first = false;
-        i->second = value;
-      } else {
-        list_.erase(i++);
-        continue;
-      }
-    }
+                              if (found)
+                                return true;
 
-    ++i;
-  }
+                              found = true;
+                              return false;
+                            });
+  fields_.erase(end, fields_.end());
 
-  if (!found)
+  if (!found) {
     AddHeader(name, value);
+    return;
+  }
+
+  for (auto& field : fields_) {
+    if (Matches(field, key)) {
+      field.mutable_value()->assign(value);
+      break;
+    }
+  }
 }
 
 void HttpHeaders::MergeHeader(const std::string& name,
                               const std::string& value) {
-  for (auto& pair : list_) {
-    if (_stricmp(pair.first.c_str(), name.c_str()) == 0) {
-      auto start = pair.second.c_str();
-      auto end = start;
+  auto key = MakeKey(name);
 
-      while (true) {
-        while (*end) {
-          if (*end == ',')
-            break;
+  for (auto& field : fields_) {
+    if (Matches(field, key)) {
+      auto current = field.value();
+      auto start = current.data();
+      auto last = start + current.size();
 
-          ++end;
-        }
+      while (true) {
+        auto end = start + http_scan::FindChar(start, last - start, ',');
 
         if (_strnicmp(value.c_str(), start, end - start) == 0)
           return;
 
-        if (*end == '\0')
+        if (end == last)
           break;
 
         start = end + 1;
 
-        while (*start) {
+        while (start < last) {
           if (*start != ' ')
             break;
 
           ++start;
         }
 
-        if (*start == '\0')
+        if (start == last)
           break;
-
-        end = start;
       }
 
-      pair.second.append(", ");
-      pair.second.append(value);
+      auto merged = field.mutable_value();
+      merged->append(", ");
+      merged->append(value);
       return;
     }
   }
@@ -109,13 +197,28 @@ void HttpHeaders::EditHeader(const std::string& name, const std::string& value,
     return;
   }
 
+  EditHeader(name, pattern, replace, all);
+}
+
+void HttpHeaders::EditHeader(const std::string& name,
+                             const std::regex& pattern,
+                             const std::string& replace, bool all) {
   auto flags = std::regex_constants::match_default;
   if (!all)
     flags |= std::regex_constants::format_first_only;
 
-  for (auto& pair : list_) {
-    if (_stricmp(pair.first.c_str(), name.c_str()) == 0) {
-      pair.second = std::regex_replace(pair.second, pattern, replace, flags);
+  auto key = MakeKey(name);
+
+  for (auto& field : fields_) {
+    if (Matches(field, key)) {
+      // Values left unchanged are not copied.
+      auto value = field.value();
+      std::string edited;
+      std::regex_replace(std::back_inserter(edited), value.data(),
+                         value.data() + value.size(), pattern, replace, flags);
+      if (edited.compare(0, std::string::npos, value.data(), value.size()) != 0)
+        field.mutable_value()->swap(edited);
+
       if (!all)
         break;
     }
@@ -124,29 +227,43 @@ void HttpHeaders::EditHeader(const std::string& name, const std::string& value,
 
 void HttpHeaders::RemoveHeader(const std::string& name,
                                const std::string& value, bool exact) {
-  auto comparator = exact ? strcmp : _stricmp;
-
-  for (auto i = list_.begin(), l = list_.end(); i != l; ++i) {
-    if (_stricmp(i->first.c_str(), name.c_str()) == 0 &&
-        comparator(i->second.c_str(), value.c_str()) == 0) {
-      list_.erase(i);
+  auto comparator = exact ? strncmp : _strnicmp;
+  auto key = MakeKey(name);
+
+  for (auto i = fields_.begin(), l = fields_.end(); i != l; ++i) {
+    if (!Matches(*i, key))
+      continue;
+
+    auto field_value = i->value();
+    if (field_value.size() == value.size() &&
+        comparator(field_value.data(), value.data(), value.size()) == 0) {
+      fields_.erase(i);
+      UpdateKnown(key.known);
       break;
     }
   }
 }
 
 void HttpHeaders::RemoveHeader(const std::string& name) {
-  for (auto i = list_.begin(), l = list_.end(); i != l;) {
-    if (_stricmp(i->first.c_str(), name.c_str()) == 0)
-      list_.erase(i++);
-    else
-      ++i;
-  }
+  auto key = MakeKey(name);
+  if (key.known >= 0 && (known_ & KnownBit(key.known)) == 0)
+    return;
+
+  auto end = std::remove_if(
+      fields_.begin(), fields_.end(),
+      [&key](const Field& field) { return Matches(field, key); });
+  fields_.erase(end, fields_.end());
+
+  known_ &= ~KnownBit(key.known);
 }
 
 bool HttpHeaders::HeaderExists(const std::string& name) const {
-  for (auto& pair : list_) {
-    if (_stricmp(pair.first.c_str(), name.c_str()) == 0)
+  auto key = MakeKey(name);
+  if (key.known >= 0)
+    return (known_ & KnownBit(key.known)) != 0;
+
+  for (auto& field : fields_) {
+    if (Matches(field, key))
       return true;
   }
 
@@ -155,12 +272,16 @@ bool HttpHeaders::HeaderExists(const std::string& name) const {
 
 const std::string& HttpHeaders::GetHeader(const std::string& name,
                                           size_t position) const {
+  auto key = MakeKey(name);
+  if (key.known >= 0 && (known_ & KnownBit(key.known)) == 0)
+    return kNotFound;
+
   size_t index = 0;
 
-  for (auto& pair : list_) {
-    if (_stricmp(pair.first.c_str(), name.c_str()) == 0) {
+  for (auto& field : fields_) {
+    if (Matches(field, key)) {
       if (index == position)
-        return pair.second;
+        return field.pair().second;
       ++index;
     }
   }
@@ -171,27 +292,93 @@ const std::string& HttpHeaders::GetHeader(const std::string& name,
 HttpHeaders::ValueList HttpHeaders::GetAllHeaders(
     const std::string& name) const {
   ValueList new_list;
+  auto key = MakeKey(name);
 
-  for (auto& pair : list_) {
-    if (_stricmp(pair.first.c_str(), name.c_str()) == 0)
-      new_list.push_back(pair.second);
+  for (auto& field : fields_) {
+    if (Matches(field, key))
+      new_list.push_back(field.value().as_string());
   }
 
   return new_list;
 }
 
-void HttpHeaders::SerializeHeaders(std::string* buffer) const {
-  for (auto& pair : list_) {
-    buffer->append(pair.first);
-    buffer->append(": ");
-    buffer->append(pair.second);
-    buffer->append("\x0D\x0A");
+size_t HttpHeaders::GetHeadersSize() const {
+  size_t size = 0;
+
+  for (auto& field : fields_) {
+    auto line = field.line();
+    if (line.empty())
+      size += field.name().size() + 2 + field.value().size() + 2;
+    else
+      size += line.size();
+  }
+
+  return size;
+}
+
+char* HttpHeaders::SerializeHeaders(char* output) const {
+  // Lines received next to each other are copied at once.
+  const char* span = nullptr;
+  size_t span_length = 0;
+
+  for (auto& field : fields_) {
+    auto line = field.line();
+    if (!line.empty() && span + span_length == line.data()) {
+      span_length += line.size();
+      continue;
+    }
+
+    output = Append(output, span, span_length);
+
+    span = line.data();
+    span_length = line.size();
+
+    if (line.empty()) {
+      auto name = field.name();
+      auto value = field.value();
+      output = Append(output, name.data(), name.size());
+      output = Append(output, ": ", 2);
+      output = Append(output, value.data(), value.size());
+      output = Append(output, "\x0D\x0A", 2);
+    }
   }
+
+  return Append(output, span, span_length);
 }
 
-void HttpHeaders::AddHeaders(const phr_header* headers, size_t count) {
+void HttpHeaders::AddHeaders(const char* block, size_t length,
+                             const phr_header* headers, size_t count) {
+  // The fields refer to this copy, as the buffer parsed is reused.
+  block_.assign(block, length);
+  auto base = block_.data();
+  auto block_end = base + block_.size();
+
+  fields_.reserve(fields_.size() + count);
+
   for (size_t i = 0; i < count; ++i) {
     const auto& current = headers[i];
+    auto name = current.name_len == 0 ? base : base + (current.name - block);
+    auto hash = Hash(name, current.name_len);
+    auto known = FindKnown(name, current.name_len, hash);
+    known_ |= KnownBit(known);
+
+    if (current.name_len != 0 &&
+        (i + 1 == count || headers[i + 1].name_len != 0)) {
+      auto value = base + (current.value - block);
+      auto value_end = value + current.value_len;
+      auto line_end = value_end + http_scan::FindChar(
+                                      value_end, block_end - value_end, '\x0A');
+      auto line = line_end == block_end
+                      ? base::StringPiece()
+                      : base::StringPiece(name, line_end + 1 - name);
+
+      fields_.emplace_back(base::StringPiece(name, current.name_len),
+                           base::StringPiece(value, current.value_len), line,
+                           hash, known);
+      continue;
+    }
+
+    // Folded lines are joined into a value of its own.
     std::string value(current.value, current.value_len);
 
     for (auto j = i + 1; j < count; ++j) {
@@ -211,9 +398,73 @@ void HttpHeaders::AddHeaders(const phr_header* headers, size_t count) {
       i = j;
     }
 
-    list_.push_back(std::make_pair(std::string(current.name, current.name_len),
-                                   std::move(value)));
+    fields_.emplace_back(std::string(name, current.name_len), std::move(value),
+                         hash, known);
+  }
+}
+
+HttpHeaders::Key HttpHeaders::MakeKey(const std::string& name) {
+  auto hash = Hash(name.data(), name.size());
+  return {name, hash, FindKnown(name.data(), name.size(), hash)};
+}
+
+uint32_t HttpHeaders::Hash(const char* name, size_t length) {
+  // FNV-1a of the name in lower case.
+  uint32_t hash = 2166136261u;
+
+  for (size_t i = 0; i < length; ++i) {
+    auto c = static_cast<uint8_t>(name[i]);
+    if ('A' <= c && c <= 'Z')
+      c |= 0x20;
+
+    hash = (hash ^ c) * 16777619u;
+  }
+
+  return hash;
+}
+
+int HttpHeaders::FindKnown(const char* name, size_t length, uint32_t hash) {
+  static const struct KnownHashes {
+    KnownHashes() {
+      for (auto i = 0; i < kKnownCount; ++i)
+        values[i] = Hash(kKnownHeaders[i], strlen(kKnownHeaders[i]));
+    }
+
+    uint32_t values[kKnownCount];
+  } known_hashes;
+
+  for (auto i = 0; i < kKnownCount; ++i) {
+    if (known_hashes.values[i] == hash &&
+        strlen(kKnownHeaders[i]) == length &&
+        _strnicmp(kKnownHeaders[i], name, length) == 0)
+      return i;
   }
+
+  return -1;
+}
+
+bool HttpHeaders::Matches(const Field& field, const Key& key) {
+  if (key.known >= 0)
+    return field.known() == key.known;
+
+  if (field.hash() != key.hash || field.known() >= 0)
+    return false;
+
+  auto name = field.name();
+  return name.size() == key.name.size() &&
+         _strnicmp(name.data(), key.name.data(), name.size()) == 0;
+}
+
+void HttpHeaders::UpdateKnown(int known) {
+  if (known < 0)
+    return;
+
+  for (auto& field : fields_) {
+    if (field.known() == known)
+      return;
+  }
+
+  known_ &= ~KnownBit(known);
 }
 
 }  // namespace http
@@ -3,9 +3,17 @@
 #ifndef JUNO_SERVICE_HTTP_HTTP_HEADERS_H_
 #define JUNO_SERVICE_HTTP_HTTP_HEADERS_H_
 
+#include <stdint.h>
+#include <string.h>
+
+#include <base/strings/string_piece.h>
+
+#include <iterator>
 #include <list>
+#include <regex>
 #include <string>
 #include <utility>
+#include <vector>
 
 struct phr_header;
 
@@ -13,21 +21,65 @@ namespace juno {
 namespace service {
 namespace http {
 
+// Header fields are kept in order in a vector, each with the hash of its
+// case-folded name, so lookups compare names only on a hash match. Headers
+// which the proxy looks up on every message are also indexed, so that those
+// absent are found without a scan.
+// Parsed fields refer to a copy of the header block of the message, and are
+// copied to strings only when read as such or modified. The lines of those
+// left untouched are serialized as they were received.
 class HttpHeaders {
+ private:
+  class Field;
+
  public:
   typedef std::pair<std::string, std::string> Pair;
   typedef std::list<Pair> List;
   typedef std::list<std::string> ValueList;
 
+  // Iterates the fields as Pairs.
+  class const_iterator
+      : public std::iterator<std::forward_iterator_tag, const Pair> {
+   public:
+    explicit const_iterator(std::vector<Field>::const_iterator field)
+        : field_(field) {}
+
+    const Pair& operator*() const {
+      return field_->pair();
+    }
+
+    const Pair* operator->() const {
+      return &field_->pair();
+    }
+
+    const_iterator& operator++() {
+      ++field_;
+      return *this;
+    }
+
+    const_iterator operator++(int) {
+      return const_iterator(field_++);
+    }
+
+    bool operator==(const const_iterator& other) const {
+      return field_ == other.field_;
+    }
+
+    bool operator!=(const const_iterator& other) const {
+      return field_ != other.field_;
+    }
+
+   private:
+    std::vector<Field>::const_iterator field_;
+  };
+
   static const std::string kNotFound;
 
   HttpHeaders();
 
   // The response header is added to the existing set of headers,
   // even if this header already exists.
-  void AddHeader(const std::string& name, const std::string& value) {
-    list_.push_back(std::make_pair(name, value));
-  }
+  void AddHeader(const std::string& name, const std::string& value);
 
   // The request header is appended to any existing header of the same name.
   // When a new value is merged onto an existing header it is separated
@@ -50,6 +102,8 @@ class HttpHeaders {
   // a regular expression search-and-replace.
   void EditHeader(const std::string& name, const std::string& find,
                   const std::string& replace, bool all);
+  void EditHeader(const std::string& name, const std::regex& pattern,
+                  const std::string& replace, bool all);
 
   void RemoveHeader(const std::string& name, const std::string& value,
                     bool exact);
@@ -60,7 +114,9 @@ class HttpHeaders {
   void RemoveHeader(const std::string& name);
 
   void ClearHeaders() {
-    list_.clear();
+    fields_.clear();
+    known_ = 0;
+    block_.clear();
   }
 
   bool HeaderExists(const std::string& name) const;
@@ -72,21 +128,107 @@ class HttpHeaders {
 
   ValueList GetAllHeaders(const std::string& name) const;
 
-  void SerializeHeaders(std::string* buffer) const;
+  // Returns the exact number of bytes SerializeHeaders writes.
+  size_t GetHeadersSize() const;
+
+  // Writes the header lines to |output|, which must have room for
+  // GetHeadersSize() bytes, and returns the end of what is written.
+  char* SerializeHeaders(char* output) const;
 
-  auto begin() const {
-    return list_.begin();
+  const_iterator begin() const {
+    return const_iterator(fields_.begin());
   }
 
-  auto end() const {
-    return list_.end();
+  const_iterator end() const {
+    return const_iterator(fields_.end());
   }
 
  protected:
-  void AddHeaders(const phr_header* headers, size_t count);
+  // Adds |headers| parsed from the header block of |length| bytes at |block|.
+  void AddHeaders(const char* block, size_t length, const phr_header* headers,
+                  size_t count);
+
+  static char* Append(char* output, const char* data, size_t length) {
+    if (length > 0)
+      memcpy(output, data, length);
+    return output + length;
+  }
 
  private:
-  List list_;
+  class Field {
+   public:
+    // A field parsed, referring to |name|, |value| and its |line|.
+    Field(base::StringPiece name, base::StringPiece value,
+          base::StringPiece line, uint32_t hash, int known);
+    Field(std::string&& name, std::string&& value, uint32_t hash, int known);
+
+    base::StringPiece name() const {
+      return materialized_ ? base::StringPiece(pair_.first) : name_;
+    }
+
+    base::StringPiece value() const {
+      return materialized_ ? base::StringPiece(pair_.second) : value_;
+    }
+
+    // The line received, empty if this field has been added or modified.
+    base::StringPiece line() const {
+      return line_;
+    }
+
+    const Pair& pair() const;
+
+    // Returns the value to modify.
+    std::string* mutable_value();
+
+    uint32_t hash() const {
+      return hash_;
+    }
+
+    int known() const {
+      return known_;
+    }
+
+   private:
+    // Copied from the views on first use.
+    mutable Pair pair_;
+    mutable bool materialized_;
+
+    base::StringPiece name_;
+    base::StringPiece value_;
+    base::StringPiece line_;
+    uint32_t hash_;
+    int known_;  // Index of the known header, or -1.
+  };
+
+  // Enough for most messages.
+  static const size_t kInitialCapacity = 16;
+
+  // A name looked up.
+  struct Key {
+    const std::string& name;
+    uint32_t hash;
+    int known;
+  };
+
+  static Key MakeKey(const std::string& name);
+  static uint32_t Hash(const char* name, size_t length);
+  static int FindKnown(const char* name, size_t length, uint32_t hash);
+
+  static bool Matches(const Field& field, const Key& key);
+
+  // Returns the bit of |known| in known_.
+  static uint32_t KnownBit(int known) {
+    return known < 0 ? 0 : 1u << known;
+  }
+
+  // Clears the bit of |known| if no field of it is left.
+  void UpdateKnown(int known);
+
+  std::vector<Field> fields_;
+  uint32_t known_;  // The known headers present.
+
+  // The header block the fields parsed refer to.
+  std::string block_;
 
   HttpHeaders(const HttpHeaders&) = delete;
   HttpHeaders& operator=(const HttpHeaders&) = delete;
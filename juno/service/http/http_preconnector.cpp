@@ -0,0 +1,325 @@
+// Copyright (c) 2017 dacci.org
+
+#include "service/http/http_preconnector.h"
+
+#include <base/logging.h>
+#include <base/values.h>
+
+#include <math.h>
+
+#include <algorithm>
+#include <utility>
+
+#include "service/http/http_connection_pool.h"
+
+namespace juno {
+namespace service {
+namespace http {
+namespace {
+
+// Weight of the past in the average rate, which halves in about 2.4 ticks.
+const double kDecay = 0.75;
+
+// A destination connected to twice in a few seconds is hot; once is not.
+const double kHotRate = 0.3;
+
+// Forgotten some 10 to 20 seconds after the last connection.
+const double kColdRate = 0.01;
+
+}  // namespace
+
+using ::juno::io::net::SocketChannel;
+using ::juno::io::net::SocketResolver;
+
+HttpPreconnector* HttpPreconnector::instance_ = nullptr;
+
+HRESULT HttpPreconnector::Init() {
+  Term();
+
+  instance_ = new HttpPreconnector();
+  if (instance_ == nullptr)
+    return E_OUTOFMEMORY;
+
+  auto result = instance_->Start();
+  if (FAILED(result))
+    Term();
+
+  return result;
+}
+
+void HttpPreconnector::Term() {
+  if (instance_ != nullptr) {
+    delete instance_;
+    instance_ = nullptr;
+  }
+}
+
+void HttpPreconnector::Learn(const std::string& host, int port) {
+  if (instance_ != nullptr)
+    instance_->LearnImpl(host, port);
+}
+
+void HttpPreconnector::GetStatistics(base::DictionaryValue* stats) {
+  if (instance_ != nullptr)
+    instance_->GetStatisticsImpl(stats);
+}
+
+HttpPreconnector::HttpPreconnector()
+    : hot_count_(0),
+      started_(0),
+      connected_(0),
+      failed_(0),
+      work_(nullptr) {}
+
+HttpPreconnector::~HttpPreconnector() {
+  timer_.reset();
+
+  if (work_ != nullptr) {
+    WaitForThreadpoolWorkCallbacks(work_, TRUE);
+    CloseThreadpoolWork(work_);
+  }
+
+  std::unordered_map<SocketChannel*, Attempt> attempts;
+  std::vector<std::shared_ptr<SocketChannel>> sockets;
+
+  {
+    base::AutoLock guard(lock_);
+
+    attempts.swap(attempts_);
+    sockets.swap(closed_);
+  }
+
+  // Each socket is destroyed before its resolver, which holds the address
+  // being connected to.
+  for (auto& pair : attempts)
+    pair.second.socket->Close();
+  attempts.clear();
+  sockets.clear();
+}
+
+HRESULT HttpPreconnector::Start() {
+  work_ = CreateThreadpoolWork(OnWork, this, nullptr);
+  if (work_ == nullptr) {
+    auto error = GetLastError();
+    LOG(ERROR) << "Failed to create work: " << error;
+    return HRESULT_FROM_WIN32(error);
+  }
+
+  timer_ = misc::TimerService::GetDefault()->Create(this);
+  if (timer_ == nullptr) {
+    LOG(ERROR) << "Failed to create timer.";
+    return E_OUTOFMEMORY;
+  }
+
+  timer_->Start(kInterval, kInterval);
+
+  return S_OK;
+}
+
+void HttpPreconnector::LearnImpl(const std::string& host, int port) {
+  auto key = MakeKey(host, port);
+
+  base::AutoLock guard(lock_);
+
+  auto found = destinations_.find(key);
+  if (found == destinations_.end()) {
+    if (destinations_.size() >= kMaxDestinations)
+      return;
+
+    auto& destination = destinations_[key];
+    destination.host = host;
+    destination.port = port;
+    destination.count = 1;
+    destination.rate = 0.0;
+    destination.connecting = 0;
+    return;
+  }
+
+  ++found->second.count;
+}
+
+void HttpPreconnector::GetStatisticsImpl(base::DictionaryValue* stats) {
+  base::AutoLock guard(lock_);
+
+  stats->SetInteger("destinations", static_cast<int>(destinations_.size()));
+  stats->SetInteger("hot", static_cast<int>(hot_count_));
+  stats->SetInteger("connecting", static_cast<int>(attempts_.size()));
+  stats->SetDouble("started", static_cast<double>(started_));
+  stats->SetDouble("connected", static_cast<double>(connected_));
+  stats->SetDouble("failed", static_cast<double>(failed_));
+}
+
+void HttpPreconnector::Connect() {
+  while (true) {
+    std::string key;
+
+    {
+      base::AutoLock guard(lock_);
+
+      if (queue_.empty())
+        break;
+
+      key = std::move(queue_.back());
+      queue_.pop_back();
+    }
+
+    Connect(key);
+  }
+}
+
+void HttpPreconnector::Connect(const std::string& key) {
+  std::string host;
+  int port;
+
+  {
+    base::AutoLock guard(lock_);
+
+    // Not forgotten while connecting.
+    const auto& destination = destinations_.at(key);
+    host = destination.host;
+    port = destination.port;
+  }
+
+  auto resolver = std::make_unique<SocketResolver>();
+  auto socket = std::make_shared<SocketChannel>();
+
+  HRESULT result = E_OUTOFMEMORY;
+  if (resolver != nullptr && socket != nullptr)
+    result = resolver->Resolve(host, port);
+
+  base::AutoLock guard(lock_);
+
+  if (SUCCEEDED(result)) {
+    auto end_point = resolver->begin()->get();
+
+    auto& attempt = attempts_[socket.get()];
+    attempt.key = key;
+    attempt.resolver = std::move(resolver);
+    attempt.socket = socket;
+
+    result = socket->ConnectAsync(end_point, this);
+    if (SUCCEEDED(result)) {
+      ++started_;
+      return;
+    }
+
+    attempts_.erase(socket.get());
+  }
+
+  DLOG(WARNING) << "Failed to preconnect to " << key << ": 0x" << std::hex
+                << result;
+
+  ++failed_;
+  --destinations_.at(key).connecting;
+}
+
+void HttpPreconnector::OnTimeout() {
+  std::vector<std::shared_ptr<SocketChannel>> sockets;
+  bool submit;
+
+  {
+    base::AutoLock guard(lock_);
+
+    sockets.swap(closed_);
+
+    std::vector<DestinationMap::value_type*> hot;
+    for (auto i = destinations_.begin(), l = destinations_.end(); i != l;) {
+      auto& destination = i->second;
+      destination.rate =
+          destination.rate * kDecay + destination.count * (1.0 - kDecay);
+      destination.count = 0;
+
+      if (destination.rate < kColdRate && destination.connecting == 0) {
+        i = destinations_.erase(i);
+        continue;
+      }
+
+      if (destination.rate >= kHotRate)
+        hot.push_back(&*i);
+
+      ++i;
+    }
+
+    if (hot.size() > kMaxHotHosts) {
+      std::partial_sort(hot.begin(), hot.begin() + kMaxHotHosts, hot.end(),
+                        [](const auto* a, const auto* b) {
+                          return a->second.rate > b->second.rate;
+                        });
+      hot.resize(kMaxHotHosts);
+    }
+    hot_count_ = hot.size();
+
+    for (auto pair : hot) {
+      auto& destination = pair->second;
+
+      // As many as expected to be taken until the next tick.
+      auto wanted = std::min(kMaxFreshPerHost,
+                             static_cast<size_t>(ceil(destination.rate)));
+      auto held = destination.connecting +
+                  HttpConnectionPool::GetFreshCount(destination.host,
+                                                    destination.port);
+
+      for (; held < wanted; ++held) {
+        queue_.push_back(pair->first);
+        ++destination.connecting;
+      }
+    }
+
+    submit = !queue_.empty();
+  }
+
+  if (submit)
+    SubmitThreadpoolWork(work_);
+
+  sockets.clear();
+}
+
+void HttpPreconnector::OnConnected(SocketChannel* socket, HRESULT result) {
+  std::shared_ptr<SocketChannel> channel;
+  std::string host;
+  int port;
+
+  {
+    base::AutoLock guard(lock_);
+
+    // Being destroyed.
+    auto found = attempts_.find(socket);
+    if (found == attempts_.end())
+      return;
+
+    auto& destination = destinations_.at(found->second.key);
+    --destination.connecting;
+
+    channel = std::move(found->second.socket);
+    attempts_.erase(found);
+
+    if (FAILED(result)) {
+      DLOG(WARNING) << "Failed to preconnect to " << destination.host << ":"
+                    << destination.port << ": 0x" << std::hex << result;
+      ++failed_;
+      closed_.push_back(std::move(channel));
+      return;
+    }
+
+    ++connected_;
+    host = destination.host;
+    port = destination.port;
+  }
+
+  HttpConnectionPool::AddFresh(host, port, std::move(channel));
+}
+
+void CALLBACK HttpPreconnector::OnWork(PTP_CALLBACK_INSTANCE instance,
+                                       void* context, PTP_WORK /*work*/) {
+  // Resolving names may take long.
+  CallbackMayRunLong(instance);
+  static_cast<HttpPreconnector*>(context)->Connect();
+}
+
+std::string HttpPreconnector::MakeKey(const std::string& host, int port) {
+  return host + ":" + std::to_string(port);
+}
+
+}  // namespace http
+}  // namespace service
+}  // namespace juno
@@ -0,0 +1,126 @@
+// Copyright (c) 2017 dacci.org
+
+#ifndef JUNO_SERVICE_HTTP_HTTP_PRECONNECTOR_H_
+#define JUNO_SERVICE_HTTP_HTTP_PRECONNECTOR_H_
+
+#include <windows.h>
+
+#include <base/synchronization/lock.h>
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "io/net/socket_channel.h"
+#include "io/net/socket_resolver.h"
+#include "misc/timer_service.h"
+
+namespace base {
+
+class DictionaryValue;
+
+}  // namespace base
+
+namespace juno {
+namespace service {
+namespace http {
+
+// Learns the destinations to which sessions open new connections most often,
+// and keeps a few connections to each of them made ahead in
+// HttpConnectionPool, so that a session finds one already connected instead
+// of waiting for the round trip.
+// The rate of new connections to each destination is averaged every second;
+// while it is high enough, the destination is kept as many fresh connections
+// as it is expected to take in a second, up to kMaxFreshPerHost. How often
+// they are used or wasted is counted by the pool.
+class HttpPreconnector : private io::net::SocketChannel::Listener,
+                         private misc::TimerService::Callback {
+ public:
+  static HRESULT Init();
+  static void Term();
+
+  // Tells that a session is opening a new connection to |host|:|port|, or
+  // has taken one made ahead.
+  static void Learn(const std::string& host, int port);
+
+  static void GetStatistics(base::DictionaryValue* stats);
+
+ private:
+  static const DWORD kInterval = 1000;  // 1 sec
+  static const size_t kMaxFreshPerHost = 4;
+  static const size_t kMaxHotHosts = 32;
+  static const size_t kMaxDestinations = 1024;
+
+  struct Destination {
+    std::string host;
+    int port;
+    // New connections since the last tick, and their average rate per tick.
+    uint32_t count;
+    double rate;
+    size_t connecting;
+  };
+
+  // A connection being made ahead.
+  struct Attempt {
+    std::string key;
+    std::unique_ptr<io::net::SocketResolver> resolver;
+    std::shared_ptr<io::net::SocketChannel> socket;
+  };
+
+  typedef std::unordered_map<std::string, Destination> DestinationMap;
+
+  HttpPreconnector();
+  ~HttpPreconnector();
+
+  HRESULT Start();
+
+  void LearnImpl(const std::string& host, int port);
+  void GetStatisticsImpl(base::DictionaryValue* stats);
+
+  // Connects to each destination taken from queue_.
+  void Connect();
+  void Connect(const std::string& key);
+
+  void OnTimeout() override;
+
+  void OnConnected(io::net::SocketChannel* socket, HRESULT result) override;
+  void OnClosed(io::net::SocketChannel* /*socket*/,
+                HRESULT /*result*/) override {}
+
+  static void CALLBACK OnWork(PTP_CALLBACK_INSTANCE instance, void* context,
+                              PTP_WORK work);
+
+  static std::string MakeKey(const std::string& host, int port);
+
+  static HttpPreconnector* instance_;
+
+  base::Lock lock_;
+  DestinationMap destinations_;
+  size_t hot_count_;
+  // The keys of the destinations to connect to, once each.
+  std::vector<std::string> queue_;
+  std::unordered_map<io::net::SocketChannel*, Attempt> attempts_;
+
+  // Sockets failed to connect. They are destroyed on the next tick, since a
+  // socket cannot be destroyed from its own callback.
+  std::vector<std::shared_ptr<io::net::SocketChannel>> closed_;
+
+  uint64_t started_;
+  uint64_t connected_;
+  uint64_t failed_;
+
+  PTP_WORK work_;
+  std::unique_ptr<misc::TimerService::Timer> timer_;
+
+  HttpPreconnector(const HttpPreconnector&) = delete;
+  HttpPreconnector& operator=(const HttpPreconnector&) = delete;
+};
+
+}  // namespace http
+}  // namespace service
+}  // namespace juno
+
+#endif  // JUNO_SERVICE_HTTP_HTTP_PRECONNECTOR_H_
@@ -5,11 +5,25 @@
 #include <windows.h>
 #include <wincrypt.h>
 
+#include <base/logging.h>
+#include <base/values.h>
+
+#include <algorithm>
+#include <memory>
 #include <string>
 #include <utility>
 
+#include "misc/access_log.h"
+#include "service/http/http2_upstream.h"
+#include "service/http/http_buffer_pool.h"
+#include "service/http/http_cache.h"
+#include "service/http/http_collapser.h"
+#include "service/http/http_connection_pool.h"
+#include "service/http/http_preconnector.h"
 #include "service/http/http_proxy_session.h"
+#include "service/http/http_scan.h"
 #include "service/http/http_util.h"
+#include "service/http/http_upstream_group.h"
 
 namespace juno {
 namespace service {
@@ -19,8 +33,11 @@ HttpProxy::HttpProxy()
     : config_(nullptr),
       empty_(&lock_),
       stopped_(),
-      auth_digest_(false),
-      auth_basic_(false) {}
+      encoded_responses_(0),
+      encoded_input_(0),
+      encoded_output_(0),
+      reclamation_(this),
+      http2_reclamation_(this) {}
 
 HttpProxy::~HttpProxy() {
   HttpProxy::Stop();
@@ -30,7 +47,17 @@ bool HttpProxy::UpdateConfig(const ServiceConfig* config) {
   base::AutoLock guard(lock_);
 
   config_ = static_cast<const HttpProxyConfig*>(config);
+
+  std::shared_ptr<const HttpFilterPipeline> filters =
+      std::make_shared<HttpFilterPipeline>(config_->header_filters_);
+  std::atomic_store(&filters_, filters);
+
+  std::shared_ptr<const HttpRouter> router =
+      std::make_shared<HttpRouter>(*config_);
+  std::atomic_store(&router_, router);
+
   SetCredential();
+  admission_.SetLimits(config_->max_sessions_, 0, config_->max_queue_delay_);
 
   return true;
 }
@@ -43,67 +70,113 @@ void HttpProxy::Stop() {
   for (auto& session : sessions_)
     session->Stop();
 
-  while (!sessions_.empty())
+  for (auto& connection : http2_connections_)
+    connection->Stop();
+
+  while (!sessions_.empty() || !http2_connections_.empty())
     empty_.Wait();
 }
 
 void HttpProxy::EndSession(HttpProxySession* session) {
-  auto pair = new ServiceSessionPair(this, session);
-  if (pair == nullptr ||
-      !TrySubmitThreadpoolCallback(EndSessionImpl, pair, nullptr)) {
-    delete pair;
-    EndSessionImpl(session);
+  reclamation_.Retire(session);
+}
+
+void HttpProxy::StartHttp2(std::shared_ptr<io::Channel>&& client,
+                           const std::string& received) {
+  auto connection = std::make_shared<Http2Connection>(
+      Http2Connection::Role::kServer, this, std::move(client));
+  // Not held here, as it may be reclaimed as soon as Start returns.
+  auto pointer = connection.get();
+
+  {
+    base::AutoLock guard(lock_);
+
+    // Even if stopped, the connection ends through OnConnectionEnded so that
+    // the client is not destroyed here, from its own callback.
+    http2_connections_.push_back(std::move(connection));
+    if (stopped_)
+      pointer->Stop();
   }
+
+  // Streams are accepted as the connection goes.
+  pointer->Start(received);
+}
+
+HttpRouter::Route HttpProxy::FindRoute(const std::string& host) const {
+  auto router = std::atomic_load(&router_);
+  if (router == nullptr)
+    return HttpRouter::Route();
+
+  return router->Find(host);
 }
 
 void HttpProxy::FilterHeaders(HttpHeaders* headers, bool request) const {
-  for (auto& filter : config_->header_filters_) {
-    if (request && filter.request || !request && filter.response) {
-      switch (filter.action) {
-        case HttpProxyConfig::FilterAction::kSet:
-          headers->SetHeader(filter.name, filter.value);
-          break;
-
-        case HttpProxyConfig::FilterAction::kAppend:
-          headers->AppendHeader(filter.name, filter.value);
-          break;
-
-        case HttpProxyConfig::FilterAction::kAdd:
-          headers->AddHeader(filter.name, filter.value);
-          break;
-
-        case HttpProxyConfig::FilterAction::kUnset:
-          headers->RemoveHeader(filter.name);
-          break;
-
-        case HttpProxyConfig::FilterAction::kMerge:
-          headers->MergeHeader(filter.name, filter.value);
-          break;
-
-        case HttpProxyConfig::FilterAction::kEdit:
-          headers->EditHeader(filter.name, filter.value, filter.replace, false);
-          break;
-
-        case HttpProxyConfig::FilterAction::kEditR:
-          headers->EditHeader(filter.name, filter.value, filter.replace, true);
-          break;
+  auto filters = std::atomic_load(&filters_);
+  if (filters != nullptr)
+    filters->Apply(headers, request);
+}
+
+void HttpProxy::ProcessAuthenticate(HttpResponse* response,
+                                    HttpRequest* request,
+                                    HttpDigest::Context* context) {
+  auto current = std::atomic_load(&credential_);
+  if (current != nullptr && response->HeaderExists(kProxyAuthenticate)) {
+    auto credential = std::make_shared<Credential>();
+    credential->username = current->username;
+    credential->password = current->password;
+    credential->basic = current->basic;
+    credential->auth_basic = false;
+
+    // The strongest of the Digest challenges is taken.
+    for (auto& field : response->GetAllHeaders(kProxyAuthenticate)) {
+      if (strncmp(field.c_str(), "Digest", 6) == 0) {
+        auto digest = std::make_shared<HttpDigest>(credential->username,
+                                                   credential->password);
+        if (digest->Input(field) &&
+            (credential->digest == nullptr ||
+             digest->IsStrongerThan(*credential->digest)))
+          credential->digest = std::move(digest);
+      } else if (strncmp(field.c_str(), "Basic", 5) == 0) {
+        credential->auth_basic = true;
       }
     }
+
+    // Dropped if replaced meanwhile, by a new credential or challenge.
+    std::shared_ptr<const Credential> replaced = std::move(credential);
+    std::atomic_compare_exchange_strong(&credential_, &current, replaced);
   }
+
+  ProcessAuthorization(request, context);
 }
 
-void HttpProxy::ProcessAuthenticate(HttpResponse* response,
-                                    HttpRequest* request) {
-  base::AutoLock guard(lock_);
+void HttpProxy::ProcessAuthorization(HttpRequest* request,
+                                     HttpDigest::Context* context) const {
+  // client's request has precedence
+  if (request->HeaderExists(kProxyAuthorization))
+    return;
+
+  auto credential = std::atomic_load(&credential_);
+  if (credential == nullptr)
+    return;
 
-  DoProcessAuthenticate(response);
-  DoProcessAuthorization(request);
+  if (credential->digest != nullptr) {
+    std::string field;
+    if (credential->digest->Output(request->method(), request->path(),
+                                   context, &field))
+      request->SetHeader(kProxyAuthorization, field);
+  } else if (credential->auth_basic) {
+    request->SetHeader(kProxyAuthorization, credential->basic);
+  }
 }
 
-void HttpProxy::ProcessAuthorization(HttpRequest* request) {
+void HttpProxy::RecordEncoding(uint64_t input, uint64_t output,
+                               base::TimeDelta elapsed) {
   base::AutoLock guard(lock_);
 
-  DoProcessAuthorization(request);
+  ++encoded_responses_;
+  encoded_input_ += input;
+  encoded_output_ += output;
+  encoding_time_ += elapsed;
 }
 
 void HttpProxy::OnAccepted(std::unique_ptr<io::Channel>&& client) {
@@ -117,8 +190,20 @@ void HttpProxy::OnAccepted(std::unique_ptr<io::Channel>&& client) {
   if (stopped_)
     return;
 
-  if (session->Start())
-    sessions_.push_back(std::move(session));
+  auto decision = admission_.Admit(sessions_.size());
+  auto started = decision == AdmissionController::Decision::kAdmit
+                     ? session->Start()
+                     : session->Reject(SERVICE_UNAVAILABLE);
+  if (started)
+    sessions_.Add(std::move(session));
+}
+
+void HttpProxy::OnStreamAccepted(std::unique_ptr<io::Channel>&& stream) {
+  OnAccepted(std::move(stream));
+}
+
+void HttpProxy::OnConnectionEnded(Http2Connection* connection) {
+  http2_reclamation_.Retire(connection);
 }
 
 void HttpProxy::OnReceivedFrom(
@@ -126,86 +211,159 @@ void HttpProxy::OnReceivedFrom(
   // Do nothing
 }
 
-void CALLBACK HttpProxy::EndSessionImpl(PTP_CALLBACK_INSTANCE /*instance*/,
-                                        void* param) {
-  auto pair = static_cast<ServiceSessionPair*>(param);
-  pair->first->EndSessionImpl(pair->second);
-  delete pair;
-}
+void HttpProxy::GetStatistics(base::DictionaryValue* stats) const {
+  base::AutoLock guard(lock_);
 
-void HttpProxy::EndSessionImpl(HttpProxySession* session) {
-  std::unique_ptr<HttpProxySession> removed;
+  stats->SetInteger("sessions", static_cast<int>(sessions_.size()));
+  admission_.GetStatistics(stats);
+  stats->SetString("scanner", http_scan::GetInstructionSet());
+
+  size_t streams = 0;
+  for (auto& connection : http2_connections_)
+    streams += connection->GetStreamCount();
+
+  auto http2 = std::make_unique<base::DictionaryValue>();
+  http2->SetInteger("connections",
+                    static_cast<int>(http2_connections_.size()));
+  http2->SetInteger("streams", static_cast<int>(streams));
+  stats->Set("http2", std::move(http2));
+
+  auto upstream = std::make_unique<base::DictionaryValue>();
+  Http2Upstream::GetStatistics(upstream.get());
+  stats->Set("http2_upstream", std::move(upstream));
+
+  auto compression = std::make_unique<base::DictionaryValue>();
+  compression->SetDouble("responses", static_cast<double>(encoded_responses_));
+  compression->SetDouble("input", static_cast<double>(encoded_input_));
+  compression->SetDouble("output", static_cast<double>(encoded_output_));
+  if (encoded_input_ > 0) {
+    auto megabytes = encoded_input_ / (1024.0 * 1024.0);
+    compression->SetDouble(
+        "saved_ratio",
+        1.0 - static_cast<double>(encoded_output_) / encoded_input_);
+    compression->SetDouble("msec_per_mb",
+                           encoding_time_.InMillisecondsF() / megabytes);
+  }
+  stats->Set("compression", std::move(compression));
 
-  lock_.Acquire();
+  auto pool = std::make_unique<base::DictionaryValue>();
+  HttpConnectionPool::GetStatistics(pool.get());
+  stats->Set("connection_pool", std::move(pool));
 
-  for (auto i = sessions_.begin(), l = sessions_.end(); i != l; ++i) {
-    if (i->get() == session) {
-      removed = std::move(*i);
-      sessions_.erase(i);
+  auto preconnect = std::make_unique<base::DictionaryValue>();
+  HttpPreconnector::GetStatistics(preconnect.get());
+  stats->Set("preconnect", std::move(preconnect));
 
-      if (sessions_.empty())
-        empty_.Broadcast();
+  auto upstreams = std::make_unique<base::DictionaryValue>();
+  HttpUpstreamGroup::GetStatistics(upstreams.get());
+  stats->Set("upstreams", std::move(upstreams));
 
-      break;
-    }
-  }
+  auto buffers = std::make_unique<base::DictionaryValue>();
+  HttpBufferPool::GetStatistics(buffers.get());
+  stats->Set("buffer_pool", std::move(buffers));
+
+  auto cache = std::make_unique<base::DictionaryValue>();
+  HttpCache::GetStatistics(cache.get());
+  stats->Set("cache", std::move(cache));
 
-  lock_.Release();
+  auto collapser = std::make_unique<base::DictionaryValue>();
+  HttpCollapser::GetStatistics(collapser.get());
+  stats->Set("collapser", std::move(collapser));
 
-  removed.reset();
+  auto access_log = std::make_unique<base::DictionaryValue>();
+  misc::AccessLog::GetStatistics(access_log.get());
+  stats->Set("access_log", std::move(access_log));
 }
 
-void HttpProxy::SetCredential() {
-  digest_.SetCredential(config_->remote_proxy_user_,
-                        config_->remote_proxy_password_);
+std::vector<std::string> HttpProxy::GetApplicationProtocols() const {
+  return {"h2", "http/1.1"};
+}
 
-  auto auth =
-      config_->remote_proxy_user_ + ':' + config_->remote_proxy_password_;
+void HttpProxy::Reclaim(
+    std::vector<HttpProxySession*>* sessions,
+    std::vector<std::unique_ptr<HttpProxySession>>* reclaimed) {
+  base::AutoLock guard(lock_);
 
-  auto buffer_size = static_cast<DWORD>(((auth.size() - 1) / 3 + 1) * 4);
-  basic_credential_.resize(buffer_size);
-  buffer_size = static_cast<DWORD>(basic_credential_.capacity());
+  auto end = std::remove_if(
+      sessions->begin(), sessions->end(), [&](HttpProxySession* session) {
+        if (!session->IsReclaimable())
+          return false;
 
-  CryptBinaryToStringA(reinterpret_cast<const BYTE*>(auth.c_str()),
-                       static_cast<DWORD>(auth.size()),
-                       CRYPT_STRING_BASE64 | CRYPT_STRING_NOCRLF,
-                       &basic_credential_[0], &buffer_size);
+        auto removed = sessions_.Remove(session);
+        if (removed != nullptr)
+          reclaimed->push_back(std::move(removed));
+        else
+          DLOG(WARNING) << session << " session not found";
+
+        return true;
+      });
+  sessions->erase(end, sessions->end());
 
-  basic_credential_.insert(0, "Basic ");
+  if (!reclaimed->empty() && sessions_.empty() && http2_connections_.empty())
+    empty_.Broadcast();
 }
 
-void HttpProxy::DoProcessAuthenticate(HttpResponse* response) {
-  if (!response->HeaderExists(kProxyAuthenticate))
-    return;
-  if (!config_->auth_remote_proxy_)
-    return;
+void HttpProxy::Reclaim(
+    std::vector<Http2Connection*>* connections,
+    std::vector<std::unique_ptr<Http2Connection>>* /*reclaimed*/) {
+  // The last references are dropped out of the lock.
+  std::vector<std::shared_ptr<Http2Connection>> released;
 
-  auth_digest_ = false;
-  auth_basic_ = false;
+  base::AutoLock guard(lock_);
 
-  for (auto& field : response->GetAllHeaders(kProxyAuthenticate)) {
-    if (strncmp(field.c_str(), "Digest", 6) == 0)
-      auth_digest_ = digest_.Input(field);
-    else if (strncmp(field.c_str(), "Basic", 5) == 0)
-      auth_basic_ = true;
-  }
+  auto end = std::remove_if(
+      connections->begin(), connections->end(),
+      [&](Http2Connection* connection) {
+        if (!connection->IsReclaimable())
+          return false;
+
+        auto found = std::find_if(
+            http2_connections_.begin(), http2_connections_.end(),
+            [connection](const std::shared_ptr<Http2Connection>& pointer) {
+              return pointer.get() == connection;
+            });
+        if (found != http2_connections_.end()) {
+          released.push_back(std::move(*found));
+          http2_connections_.erase(found);
+        } else {
+          DLOG(WARNING) << connection << " connection not found";
+        }
+
+        return true;
+      });
+  connections->erase(end, connections->end());
+
+  if (sessions_.empty() && http2_connections_.empty())
+    empty_.Broadcast();
 }
 
-void HttpProxy::DoProcessAuthorization(HttpRequest* request) {
-  // client's request has precedence
-  if (request->HeaderExists(kProxyAuthorization))
+void HttpProxy::SetCredential() {
+  if (!config_->auth_remote_proxy_) {
+    std::atomic_store(&credential_, std::shared_ptr<const Credential>());
     return;
+  }
 
-  if (!config_->auth_remote_proxy_)
-    return;
+  auto credential = std::make_shared<Credential>();
+  credential->username = config_->remote_proxy_user_;
+  credential->password = config_->remote_proxy_password_;
+  credential->auth_basic = false;
 
-  if (auth_digest_) {
-    std::string field;
-    if (digest_.Output(request->method(), request->path(), &field))
-      request->SetHeader(kProxyAuthorization, field);
-  } else if (auth_basic_) {
-    request->SetHeader(kProxyAuthorization, basic_credential_);
-  }
+  auto auth = credential->username + ':' + credential->password;
+
+  auto buffer_size = static_cast<DWORD>(((auth.size() - 1) / 3 + 1) * 4);
+  credential->basic.resize(buffer_size);
+  buffer_size = static_cast<DWORD>(credential->basic.capacity());
+
+  CryptBinaryToStringA(reinterpret_cast<const BYTE*>(auth.c_str()),
+                       static_cast<DWORD>(auth.size()),
+                       CRYPT_STRING_BASE64 | CRYPT_STRING_NOCRLF,
+                       &credential->basic[0], &buffer_size);
+
+  credential->basic.insert(0, "Basic ");
+
+  // Challenged again with the new credential.
+  std::shared_ptr<const Credential> replaced = std::move(credential);
+  std::atomic_store(&credential_, replaced);
 }
 
 }  // namespace http
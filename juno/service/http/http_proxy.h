@@ -5,15 +5,23 @@
 
 #include <base/synchronization/condition_variable.h>
 #include <base/synchronization/lock.h>
+#include <base/time/time.h>
+
+#include <stdint.h>
 
 #include <memory>
 #include <string>
-#include <utility>
 #include <vector>
 
+#include "misc/reclamation_queue.h"
+#include "misc/session_registry.h"
+#include "service/admission_controller.h"
 #include "service/service.h"
+#include "service/http/http2_connection.h"
 #include "service/http/http_digest.h"
+#include "service/http/http_filter_pipeline.h"
 #include "service/http/http_proxy_config.h"
+#include "service/http/http_router.h"
 
 namespace juno {
 namespace service {
@@ -24,7 +32,7 @@ class HttpProxySession;
 class HttpRequest;
 class HttpResponse;
 
-class HttpProxy : public Service {
+class HttpProxy : public Service, private Http2Connection::Delegate {
  public:
   HttpProxy();
   ~HttpProxy();
@@ -34,35 +42,81 @@ class HttpProxy : public Service {
 
   void EndSession(HttpProxySession* session);
 
+  // Takes over |client|, from which |received| is read so far, beginning
+  // with the HTTP/2 connection preface.
+  void StartHttp2(std::shared_ptr<io::Channel>&& client,
+                  const std::string& received);
+
   void FilterHeaders(HttpHeaders* headers, bool request) const;
-  void ProcessAuthenticate(HttpResponse* response, HttpRequest* request);
-  void ProcessAuthorization(HttpRequest* request);
+  // Returns how a request to |host| goes.
+  HttpRouter::Route FindRoute(const std::string& host) const;
+  // Neither takes the lock, so that sessions are authorized concurrently.
+  // Both go by credential_ alone, as config_ may be replaced meanwhile.
+  // |context| is what the session keeps for Digest authentication.
+  void ProcessAuthenticate(HttpResponse* response, HttpRequest* request,
+                           HttpDigest::Context* context);
+  void ProcessAuthorization(HttpRequest* request,
+                            HttpDigest::Context* context) const;
+
+  // Records that a response body of |input| bytes is compressed to |output|
+  // bytes, taking |elapsed| to encode.
+  void RecordEncoding(uint64_t input, uint64_t output,
+                      base::TimeDelta elapsed);
 
   void OnAccepted(std::unique_ptr<io::Channel>&& client) override;
   void OnReceivedFrom(std::unique_ptr<io::net::Datagram>&& datagram) override;
 
+  void GetStatistics(base::DictionaryValue* stats) const override;
+  std::vector<std::string> GetApplicationProtocols() const override;
+
  private:
-  typedef std::pair<HttpProxy*, HttpProxySession*> ServiceSessionPair;
+  // The credential for the remote proxy, and what it last asked for.
+  struct Credential {
+    std::string username;
+    std::string password;
+    std::string basic;
+
+    bool auth_basic;
+    std::shared_ptr<const HttpDigest> digest;
+  };
 
-  static void CALLBACK EndSessionImpl(PTP_CALLBACK_INSTANCE instance,
-                                      void* param);
-  void EndSessionImpl(HttpProxySession* session);
+  friend class misc::ReclamationQueue<HttpProxySession, HttpProxy>;
+  friend class misc::ReclamationQueue<Http2Connection, HttpProxy>;
+
+  void OnStreamAccepted(std::unique_ptr<io::Channel>&& stream) override;
+  void OnConnectionEnded(Http2Connection* connection) override;
+
+  void Reclaim(std::vector<HttpProxySession*>* sessions,
+               std::vector<std::unique_ptr<HttpProxySession>>* reclaimed);
+  // Releases the connections, which are destroyed with their last stream.
+  void Reclaim(std::vector<Http2Connection*>* connections,
+               std::vector<std::unique_ptr<Http2Connection>>* reclaimed);
 
   void SetCredential();
-  void DoProcessAuthenticate(HttpResponse* response);
-  void DoProcessAuthorization(HttpRequest* request);
 
   const HttpProxyConfig* config_;
-
-  base::Lock lock_;
+  // Compiled from config_, and replaced atomically.
+  std::shared_ptr<const HttpFilterPipeline> filters_;
+  // Replaced atomically, either by config_ or by a challenge. nullptr if
+  // the remote proxy is not authenticated to.
+  std::shared_ptr<const Credential> credential_;
+  // Compiled from config_, and replaced atomically.
+  std::shared_ptr<const HttpRouter> router_;
+
+  mutable base::Lock lock_;
   base::ConditionVariable empty_;
   bool stopped_;
-  std::vector<std::unique_ptr<HttpProxySession>> sessions_;
+  misc::SessionRegistry<HttpProxySession> sessions_;
+  std::vector<std::shared_ptr<Http2Connection>> http2_connections_;
+  AdmissionController admission_;
+
+  uint64_t encoded_responses_;
+  uint64_t encoded_input_;
+  uint64_t encoded_output_;
+  base::TimeDelta encoding_time_;
 
-  bool auth_digest_;
-  bool auth_basic_;
-  HttpDigest digest_;
-  std::string basic_credential_;
+  misc::ReclamationQueue<HttpProxySession, HttpProxy> reclamation_;
+  misc::ReclamationQueue<Http2Connection, HttpProxy> http2_reclamation_;
 
   HttpProxy(const HttpProxy&) = delete;
   HttpProxy& operator=(const HttpProxy&) = delete;
@@ -23,6 +23,34 @@ struct HttpProxyConfig : ServiceConfig {
     kEditR,
   };
 
+  // How a parent proxy is picked for each request, weighted.
+  enum class UpstreamBalance {
+    kLeastRequests,
+    kLatency,
+  };
+
+  struct Upstream {
+    std::string host;
+    int port;
+    // The share of the requests, relative to the others.
+    int weight;
+  };
+
+  enum class RouteAction {
+    kDirect,
+    kProxy,
+    kBlock,
+  };
+
+  struct Route {
+    // A domain, which matches its subdomains as well, an IP address prefix
+    // in CIDR notation, or "*" for any other destination.
+    std::string destination;
+    RouteAction action;
+    // The parent proxies of kProxy, those of the remote proxy if empty.
+    std::vector<Upstream> upstreams;
+  };
+
   struct HeaderFilter {
     bool request;
     bool response;
@@ -38,7 +66,24 @@ struct HttpProxyConfig : ServiceConfig {
   bool auth_remote_proxy_;
   std::string remote_proxy_user_;
   std::string remote_proxy_password_;
+  // Requests to the remote proxy are multiplexed over HTTP/2 connections.
+  bool remote_proxy_http2_;
+  // Parent proxies the requests are balanced over, used instead of
+  // remote_proxy_host_ and remote_proxy_port_ unless empty.
+  std::vector<Upstream> upstreams_;
+  UpstreamBalance upstream_balance_;
+  // The most specific route to a destination is taken, the remote proxy
+  // or direct by use_remote_proxy_ if none.
+  std::vector<Route> routes_;
   std::vector<HeaderFilter> header_filters_;
+
+  // How long a request waits for the same one in progress, 0 to disable.
+  int collapse_timeout_;  // msec
+
+  // Response bodies are compressed with gzip for the clients accepting it.
+  bool compress_responses_;
+  // The media types compressed, each either type/subtype or type/*.
+  std::vector<std::string> compress_types_;
 };
 
 }  // namespace http
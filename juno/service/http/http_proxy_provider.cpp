@@ -8,10 +8,13 @@
 #include <base/strings/string_number_conversions.h>
 #include <base/strings/sys_string_conversions.h>
 
+#include <iterator>
 #include <string>
+#include <vector>
 
 #include "service/http/http_proxy.h"
 #include "service/http/http_proxy_config.h"
+#include "service/http/http_util.h"
 #include "service/http/ui/http_proxy_dialog.h"
 
 namespace juno {
@@ -25,6 +28,14 @@ const wchar_t kRemoteProxyPortReg[] = L"RemoteProxyPort";
 const wchar_t kAuthRemoteProxyReg[] = L"AuthRemoteProxy";
 const wchar_t kRemoteProxyUserReg[] = L"RemoteProxyUser";
 const wchar_t kRemoteProxyPasswordReg[] = L"RemoteProxyPassword";
+const wchar_t kRemoteProxyHttp2Reg[] = L"RemoteProxyHttp2";
+const wchar_t kUpstreamsReg[] = L"Upstreams";
+const wchar_t kHostReg[] = L"Host";
+const wchar_t kPortReg[] = L"Port";
+const wchar_t kWeightReg[] = L"Weight";
+const wchar_t kUpstreamBalanceReg[] = L"UpstreamBalance";
+const wchar_t kRoutesReg[] = L"Routes";
+const wchar_t kDestinationReg[] = L"Destination";
 const wchar_t kHeaderFiltersReg[] = L"HeaderFilters";
 const wchar_t kRequestReg[] = L"Request";
 const wchar_t kResponseReg[] = L"Response";
@@ -32,6 +43,9 @@ const wchar_t kActionReg[] = L"Action";
 const wchar_t kNameReg[] = L"Name";
 const wchar_t kValueReg[] = L"Value";
 const wchar_t kReplaceReg[] = L"Replace";
+const wchar_t kCollapseTimeoutReg[] = L"CollapseTimeout";
+const wchar_t kCompressResponsesReg[] = L"CompressResponses";
+const wchar_t kCompressTypesReg[] = L"CompressTypes";
 
 const std::string kUseRemoteProxyJson = "use_remote_proxy";
 const std::string kRemoteProxyHostJson = "remote_proxy_host";
@@ -39,6 +53,14 @@ const std::string kRemoteProxyPortJson = "remote_proxy_port";
 const std::string kAuthRemoteProxyJson = "auth_remote_proxy";
 const std::string kRemoteProxyUserJson = "remote_proxy_user";
 const std::string kRemoteProxyPasswordJson = "remote_proxy_password";
+const std::string kRemoteProxyHttp2Json = "remote_proxy_http2";
+const std::string kUpstreamsJson = "upstreams";
+const std::string kHostJson = "host";
+const std::string kPortJson = "port";
+const std::string kWeightJson = "weight";
+const std::string kUpstreamBalanceJson = "upstream_balance";
+const std::string kRoutesJson = "routes";
+const std::string kDestinationJson = "destination";
 const std::string kHeaderFiltersJson = "header_filters";
 const std::string kRequestJson = "request";
 const std::string kResponseJson = "response";
@@ -46,6 +68,132 @@ const std::string kActionJson = "action";
 const std::string kNameJson = "name";
 const std::string kValueJson = "value";
 const std::string kReplaceJson = "replace";
+const std::string kCollapseTimeoutJson = "collapse_timeout";
+const std::string kCompressResponsesJson = "compress_responses";
+const std::string kCompressTypesJson = "compress_types";
+
+const int kDefaultCollapseTimeout = 3 * 1000;  // 3 sec
+
+// Text which compresses well, but not event streams, which would be held
+// back.
+const char* const kDefaultCompressTypes[] = {
+    "text/html",
+    "text/plain",
+    "text/css",
+    "text/javascript",
+    "text/xml",
+    "text/csv",
+    "application/javascript",
+    "application/json",
+    "application/xml",
+    "application/xhtml+xml",
+    "image/svg+xml",
+};
+
+std::vector<std::string> GetDefaultCompressTypes() {
+  return std::vector<std::string>(std::begin(kDefaultCompressTypes),
+                                  std::end(kDefaultCompressTypes));
+}
+
+void LoadUpstreams(const base::win::RegKey& key,
+                   std::vector<HttpProxyConfig::Upstream>* upstreams) {
+  base::win::RegKey upstreams_key(key.Handle(), kUpstreamsReg,
+                                  KEY_ENUMERATE_SUB_KEYS);
+  if (!upstreams_key.Valid())
+    return;
+
+  for (base::win::RegistryKeyIterator i(upstreams_key.Handle(), nullptr);
+       i.Valid(); ++i) {
+    base::win::RegKey upstream_key(upstreams_key.Handle(), i.Name(), KEY_READ);
+    if (!upstream_key.Valid())
+      continue;
+
+    std::wstring host;
+    DWORD port, weight;
+    if (upstream_key.ReadValue(kHostReg, &host) != ERROR_SUCCESS ||
+        upstream_key.ReadValueDW(kPortReg, &port) != ERROR_SUCCESS ||
+        port <= 0 || 65536 <= port)
+      continue;
+
+    if (upstream_key.ReadValueDW(kWeightReg, &weight) != ERROR_SUCCESS)
+      weight = 1;
+
+    HttpProxyConfig::Upstream upstream{};
+    upstream.host = base::SysWideToNativeMB(host);
+    upstream.port = port;
+    upstream.weight = weight;
+    upstreams->push_back(std::move(upstream));
+  }
+}
+
+void SaveUpstreams(const std::vector<HttpProxyConfig::Upstream>& upstreams,
+                   base::win::RegKey* key) {
+  key->DeleteKey(kUpstreamsReg);
+
+  base::win::RegKey upstreams_key(key->Handle(), kUpstreamsReg,
+                                  KEY_ALL_ACCESS);
+  auto index = 1;
+
+  for (const auto& upstream : upstreams) {
+    base::win::RegKey upstream_key(upstreams_key.Handle(),
+                                   base::IntToString16(index).c_str(),
+                                   KEY_ALL_ACCESS);
+    if (!upstream_key.Valid())
+      continue;
+
+    upstream_key.WriteValue(kHostReg,
+                            base::SysNativeMBToWide(upstream.host).c_str());
+    upstream_key.WriteValue(kPortReg, upstream.port);
+    upstream_key.WriteValue(kWeightReg, upstream.weight);
+
+    ++index;
+  }
+}
+
+std::unique_ptr<base::ListValue> ConvertUpstreams(
+    const std::vector<HttpProxyConfig::Upstream>& upstreams) {
+  auto list = std::make_unique<base::ListValue>();
+  if (list == nullptr)
+    return nullptr;
+
+  for (const auto& upstream : upstreams) {
+    auto item = std::make_unique<base::DictionaryValue>();
+    if (item == nullptr)
+      return nullptr;
+
+    item->SetString(kHostJson, upstream.host);
+    item->SetInteger(kPortJson, upstream.port);
+    item->SetInteger(kWeightJson, upstream.weight);
+
+    list->Append(std::move(item));
+  }
+
+  return list;
+}
+
+void ConvertUpstreams(const base::DictionaryValue* value,
+                      std::vector<HttpProxyConfig::Upstream>* upstreams) {
+  const base::ListValue* list;
+  if (!value->GetList(kUpstreamsJson, &list))
+    return;
+
+  for (const auto& item : *list) {
+    const base::DictionaryValue* upstream_value;
+    if (!item.GetAsDictionary(&upstream_value))
+      continue;
+
+    HttpProxyConfig::Upstream upstream{};
+    upstream.weight = 1;
+
+    if (!upstream_value->GetString(kHostJson, &upstream.host) ||
+        !upstream_value->GetInteger(kPortJson, &upstream.port) ||
+        upstream.port <= 0 || 65536 <= upstream.port)
+      continue;
+    upstream_value->GetInteger(kWeightJson, &upstream.weight);
+
+    upstreams->push_back(std::move(upstream));
+  }
+}
 
 }  // namespace
 
@@ -102,6 +250,61 @@ std::unique_ptr<ServiceConfig> HttpProxyProvider::LoadConfig(
     }
   }
 
+  if (key.ReadValueDW(kRemoteProxyHttp2Reg, &int_value) == ERROR_SUCCESS)
+    config->remote_proxy_http2_ = int_value != 0;
+
+  if (key.ReadValueDW(kCollapseTimeoutReg, &int_value) == ERROR_SUCCESS)
+    config->collapse_timeout_ = int_value;
+  else
+    config->collapse_timeout_ = kDefaultCollapseTimeout;
+
+  if (key.ReadValueDW(kCompressResponsesReg, &int_value) == ERROR_SUCCESS)
+    config->compress_responses_ = int_value != 0;
+
+  // Stored as a comma separated list.
+  if (key.ReadValue(kCompressTypesReg, &string_value) == ERROR_SUCCESS) {
+    http_util::ForEachElement(
+        base::SysWideToUTF8(string_value),
+        [&config](const std::string& type) {
+          config->compress_types_.push_back(type);
+        });
+  } else {
+    config->compress_types_ = GetDefaultCompressTypes();
+  }
+
+  if (key.ReadValueDW(kUpstreamBalanceReg, &int_value) == ERROR_SUCCESS)
+    config->upstream_balance_ =
+        static_cast<HttpProxyConfig::UpstreamBalance>(int_value);
+
+  LoadUpstreams(key, &config->upstreams_);
+
+  // The group does not need the single remote proxy.
+  if (!config->upstreams_.empty() &&
+      key.ReadValueDW(kUseRemoteProxyReg, &int_value) == ERROR_SUCCESS)
+    config->use_remote_proxy_ = int_value != 0;
+
+  RegKey routes_key(key.Handle(), kRoutesReg, KEY_ENUMERATE_SUB_KEYS);
+  if (routes_key.Valid()) {
+    for (RegistryKeyIterator i(routes_key.Handle(), nullptr); i.Valid(); ++i) {
+      RegKey route_key(routes_key.Handle(), i.Name(), KEY_READ);
+      if (!route_key.Valid())
+        continue;
+
+      std::wstring destination;
+      DWORD action;
+      if (route_key.ReadValue(kDestinationReg, &destination) !=
+              ERROR_SUCCESS ||
+          route_key.ReadValueDW(kActionReg, &action) != ERROR_SUCCESS)
+        continue;
+
+      HttpProxyConfig::Route route{};
+      route.destination = base::SysWideToUTF8(destination);
+      route.action = static_cast<HttpProxyConfig::RouteAction>(action);
+      LoadUpstreams(route_key, &route.upstreams);
+      config->routes_.push_back(std::move(route));
+    }
+  }
+
   RegKey filters_key(key.Handle(), kHeaderFiltersReg, KEY_ENUMERATE_SUB_KEYS);
   if (filters_key.Valid()) {
     for (RegistryKeyIterator i(filters_key.Handle(), nullptr); i.Valid(); ++i) {
@@ -162,10 +365,46 @@ bool HttpProxyProvider::SaveConfig(const ServiceConfig* base_config,
     }
   }
 
+  key->WriteValue(kRemoteProxyHttp2Reg, config->remote_proxy_http2_);
+  key->WriteValue(kCollapseTimeoutReg, config->collapse_timeout_);
+  key->WriteValue(kCompressResponsesReg, config->compress_responses_);
+
+  std::string types;
+  for (const auto& type : config->compress_types_) {
+    if (!types.empty())
+      types.append(", ");
+    types.append(type);
+  }
+  key->WriteValue(kCompressTypesReg, base::SysUTF8ToWide(types).c_str());
+
+  key->WriteValue(kUpstreamBalanceReg,
+                  static_cast<int>(config->upstream_balance_));
+
+  SaveUpstreams(config->upstreams_, key);
+
+  key->DeleteKey(kRoutesReg);
+
+  RegKey routes_key(key->Handle(), kRoutesReg, KEY_ALL_ACCESS);
+  auto index = 1;
+
+  for (const auto& route : config->routes_) {
+    RegKey route_key(routes_key.Handle(), base::IntToString16(index).c_str(),
+                     KEY_ALL_ACCESS);
+    if (!route_key.Valid())
+      continue;
+
+    route_key.WriteValue(kDestinationReg,
+                         base::SysUTF8ToWide(route.destination).c_str());
+    route_key.WriteValue(kActionReg, static_cast<int>(route.action));
+    SaveUpstreams(route.upstreams, &route_key);
+
+    ++index;
+  }
+
   key->DeleteKey(kHeaderFiltersReg);
 
   RegKey filters_key(key->Handle(), kHeaderFiltersReg, KEY_ALL_ACCESS);
-  auto index = 1;
+  index = 1;
 
   for (const auto& filter : config->header_filters_) {
     RegKey filter_key(filters_key.Handle(), base::IntToString16(index).c_str(),
@@ -211,6 +450,37 @@ std::unique_ptr<base::DictionaryValue> HttpProxyProvider::ConvertConfig(
   if (filters == nullptr)
     return nullptr;
 
+  auto types = std::make_unique<base::ListValue>();
+  if (types == nullptr)
+    return nullptr;
+
+  for (const auto& type : config->compress_types_)
+    types->AppendString(type);
+
+  auto upstreams = ConvertUpstreams(config->upstreams_);
+  if (upstreams == nullptr)
+    return nullptr;
+
+  auto routes = std::make_unique<base::ListValue>();
+  if (routes == nullptr)
+    return nullptr;
+
+  for (const auto& route : config->routes_) {
+    auto item = std::make_unique<base::DictionaryValue>();
+    if (item == nullptr)
+      return nullptr;
+
+    auto route_upstreams = ConvertUpstreams(route.upstreams);
+    if (route_upstreams == nullptr)
+      return nullptr;
+
+    item->SetString(kDestinationJson, route.destination);
+    item->SetInteger(kActionJson, static_cast<int>(route.action));
+    item->Set(kUpstreamsJson, std::move(route_upstreams));
+
+    routes->Append(std::move(item));
+  }
+
   for (const auto& header_filter : config->header_filters_) {
     auto filter = std::make_unique<base::DictionaryValue>();
     if (filter == nullptr)
@@ -232,7 +502,15 @@ std::unique_ptr<base::DictionaryValue> HttpProxyProvider::ConvertConfig(
   value->SetBoolean(kAuthRemoteProxyJson, config->auth_remote_proxy_);
   value->SetString(kRemoteProxyUserJson, config->remote_proxy_user_);
   value->SetString(kRemoteProxyPasswordJson, config->remote_proxy_password_);
+  value->SetBoolean(kRemoteProxyHttp2Json, config->remote_proxy_http2_);
+  value->Set(kUpstreamsJson, std::move(upstreams));
+  value->SetInteger(kUpstreamBalanceJson,
+                    static_cast<int>(config->upstream_balance_));
+  value->Set(kRoutesJson, std::move(routes));
   value->Set(kHeaderFiltersJson, std::move(filters));
+  value->SetInteger(kCollapseTimeoutJson, config->collapse_timeout_);
+  value->SetBoolean(kCompressResponsesJson, config->compress_responses_);
+  value->Set(kCompressTypesJson, std::move(types));
 
   return std::move(value);
 }
@@ -252,6 +530,50 @@ std::unique_ptr<ServiceConfig> HttpProxyProvider::ConvertConfig(
   value->GetBoolean(kAuthRemoteProxyJson, &config->auth_remote_proxy_);
   value->GetString(kRemoteProxyUserJson, &config->remote_proxy_user_);
   value->GetString(kRemoteProxyPasswordJson, &config->remote_proxy_password_);
+  value->GetBoolean(kRemoteProxyHttp2Json, &config->remote_proxy_http2_);
+
+  ConvertUpstreams(value, &config->upstreams_);
+
+  int balance;
+  if (value->GetInteger(kUpstreamBalanceJson, &balance))
+    config->upstream_balance_ =
+        static_cast<HttpProxyConfig::UpstreamBalance>(balance);
+
+  const base::ListValue* routes;
+  if (value->GetList(kRoutesJson, &routes)) {
+    for (const auto& item : *routes) {
+      const base::DictionaryValue* route_value;
+      if (!item.GetAsDictionary(&route_value))
+        continue;
+
+      HttpProxyConfig::Route route{};
+      int action;
+      if (!route_value->GetString(kDestinationJson, &route.destination) ||
+          !route_value->GetInteger(kActionJson, &action))
+        continue;
+
+      route.action = static_cast<HttpProxyConfig::RouteAction>(action);
+      ConvertUpstreams(route_value, &route.upstreams);
+      config->routes_.push_back(std::move(route));
+    }
+  }
+
+  config->collapse_timeout_ = kDefaultCollapseTimeout;
+  value->GetInteger(kCollapseTimeoutJson, &config->collapse_timeout_);
+
+  config->compress_responses_ = false;
+  value->GetBoolean(kCompressResponsesJson, &config->compress_responses_);
+
+  const base::ListValue* types;
+  if (value->GetList(kCompressTypesJson, &types)) {
+    for (const auto& item : *types) {
+      std::string type;
+      if (item.GetAsString(&type))
+        config->compress_types_.push_back(type);
+    }
+  } else {
+    config->compress_types_ = GetDefaultCompressTypes();
+  }
 
   const base::ListValue* filters;
   if (value->GetList(kHeaderFiltersJson, &filters)) {
@@ -2,6 +2,9 @@
 
 #include "service/http/http_proxy_session.h"
 
+#include <stdio.h>
+#include <string.h>
+
 #include <base/logging.h>
 
 #include <url/gurl.h>
@@ -11,6 +14,10 @@
 
 #include "io/net/socket_channel.h"
 #include "misc/tunneling_service.h"
+#include "service/http/http2_connection.h"
+#include "service/http/http2_upstream.h"
+#include "service/http/http_connection_pool.h"
+#include "service/http/http_preconnector.h"
 #include "service/http/http_proxy.h"
 #include "service/http/http_proxy_config.h"
 #include "service/http/http_util.h"
@@ -25,7 +32,35 @@ enum class HttpProxySession::State {
   kRequestHeader,
   kRequestBody,
   kResponseHeader,
-  kResponseBody
+  kResponseBody,
+  kCollapsed,
+  // The response is sent, while pipelined requests are still being written.
+  kPipelineWait,
+  // The request header is sent, and the remote server is yet to answer.
+  kContinueWait,
+};
+
+// Marks a callback as running, so the session is not reclaimed meanwhile.
+// Declared before the lock guard, it is released after the lock is, waking
+// the destructor if it waits for the last callback.
+class HttpProxySession::ScopedCallback {
+ public:
+  explicit ScopedCallback(HttpProxySession* session) : session_(session) {
+    base::AtomicRefCountInc(&session_->ref_count_);
+  }
+
+  ~ScopedCallback() {
+    base::AutoLock guard(session_->lock_);
+
+    if (!base::AtomicRefCountDec(&session_->ref_count_))
+      session_->free_.Broadcast();
+  }
+
+ private:
+  HttpProxySession* const session_;
+
+  ScopedCallback(const ScopedCallback&) = delete;
+  ScopedCallback& operator=(const ScopedCallback&) = delete;
 };
 
 HttpProxySession::HttpProxySession(HttpProxy* proxy,
@@ -35,27 +70,79 @@ HttpProxySession::HttpProxySession(HttpProxy* proxy,
       config_(config),
       ref_count_(0),
       free_(&lock_),
+      ending_(),
       timer_(misc::TimerService::GetDefault()->Create(this)),
+      body_buffer_size_(kBodyBufferSize),
       state_(State::kIdle),
       tunnel_(),
       last_port_(-1),
       retry_(),
       client_(std::move(client)),
-      close_remote_() {
+      close_client_(),
+      request_body_sent_(),
+      expect_continue_(),
+      continue_waiting_(),
+      continue_reading_(),
+      request_input_(),
+      request_input_size_(0),
+      request_offset_(0),
+      remote_persistent_(),
+      remote_multiplexed_(),
+      close_remote_(),
+      chunk_input_(),
+      chunk_input_size_(0),
+      chunk_offset_(0),
+      serving_cache_(),
+      cache_offset_(0),
+      encoding_(),
+      encoded_length_(0),
+      encoding_ended_(),
+      leading_(),
+      following_(),
+      collapsed_(),
+      pipeline_writing_() {
   DLOG(INFO) << this << " session created";
 }
 
 HttpProxySession::~HttpProxySession() {
-  if (timer_ != nullptr)
-    timer_->Stop();
+  std::unique_ptr<misc::TimerService::Timer> timer;
+
+  {
+    base::AutoLock guard(lock_);
+
+    // No callback goes on from here, nor is notified of a flight.
+    ending_ = true;
+    timer = std::move(timer_);
+    LeaveFlight();
+
+    if (remote_ != nullptr)
+      remote_->Close();
 
+    if (client_ != nullptr)
+      client_->Close();
+  }
+
+  // Waits for the timeout running, if any.
+  timer.reset();
+
+  // Channels owned only by this session wait for their callbacks as they are
+  // destroyed.
+  retired_remote_.reset();
   remote_.reset();
   client_.reset();
 
-  base::AutoLock guard(lock_);
+  EndUpstream(HttpUpstreamGroup::Member::Result::kCancelled);
 
-  while (!base::AtomicRefCountIsZero(&ref_count_))
-    free_.Wait();
+  {
+    base::AutoLock guard(lock_);
+
+    // Callbacks which started after the session was found reclaimable.
+    while (!IsReclaimable())
+      free_.Wait();
+  }
+
+  // Aborted, if not ended yet.
+  access_.End();
 
   DLOG(INFO) << this << " session destroyed";
 }
@@ -69,14 +156,35 @@ bool HttpProxySession::Start() {
 
   DLOG(INFO) << this << " session started";
 
+  access_.SetClient(client_.get());
   EndResponse();
 
   return true;
 }
 
+bool HttpProxySession::Reject(StatusCode status) {
+  base::AutoLock guard(lock_);
+
+  if (proxy_ == nullptr || client_ == nullptr)
+    return false;
+
+  DLOG(INFO) << this << " session rejected: " << status;
+
+  access_.SetClient(client_.get());
+  access_.Begin(misc::AccessLog::Service::kHttp, std::string());
+
+  close_client_ = true;
+  SendError(status);
+
+  return true;
+}
+
 void HttpProxySession::Stop() {
   base::AutoLock guard(lock_);
 
+  if (ending_)
+    return;
+
   DLOG(INFO) << this << " stop requested";
 
   if (timer_ != nullptr)
@@ -87,14 +195,30 @@ void HttpProxySession::Stop() {
 
   if (client_ != nullptr)
     client_->Close();
+
+  // Nothing is in progress to end the session otherwise.
+  if (state_ == State::kCollapsed) {
+    LeaveFlight();
+    proxy_->EndSession(this);
+  }
 }
 
 void HttpProxySession::ReceiveRequest() {
   if (timer_ == nullptr)
     return;
 
+  // An idle session returns the buffer of the last body to the pool.
+  auto size = state_ == State::kRequestBody ? body_buffer_size_
+                                            : kHeaderBufferSize;
+  if (!ReserveBuffer(size)) {
+    LOG(ERROR) << this << " failed to allocate buffer";
+    proxy_->EndSession(this);
+    return;
+  }
+
   timer_->Start(kTimeout, 0);
-  auto result = client_->ReadAsync(buffer_, kBufferSize, this);
+  auto result = client_->ReadAsync(buffer_.data(),
+                                   static_cast<int>(buffer_.size()), this);
   if (FAILED(result)) {
     LOG(ERROR) << this << " failed to receive from client: 0x" << std::hex
                << result;
@@ -104,6 +228,21 @@ void HttpProxySession::ReceiveRequest() {
 
 // not safe to call from remote_'s event handler.
 void HttpProxySession::ProcessRequest() {
+  // HTTP/2 with prior knowledge, or negotiated by ALPN.
+  auto preface = std::min(client_buffer_.size(),
+                          Http2Connection::kPrefaceLength);
+  if (client_buffer_.compare(0, preface, Http2Connection::kPreface,
+                             preface) == 0) {
+    if (preface < Http2Connection::kPrefaceLength) {
+      ReceiveRequest();
+    } else {
+      DLOG(INFO) << this << " switching to HTTP/2";
+      proxy_->StartHttp2(std::move(client_), client_buffer_);
+      proxy_->EndSession(this);
+    }
+    return;
+  }
+
   auto result = request_.Parse(client_buffer_);
   if (result > 0) {
     client_buffer_.erase(0, result);
@@ -111,6 +250,7 @@ void HttpProxySession::ProcessRequest() {
     ReceiveRequest();
     return;
   } else {
+    access_.Begin(misc::AccessLog::Service::kHttp, std::string());
     close_client_ = true;
     SendError(BAD_REQUEST);
     return;
@@ -118,15 +258,16 @@ void HttpProxySession::ProcessRequest() {
 
   DLOG(INFO) << this << " " << request_.method() << " " << request_.path();
 
+  access_.Begin(misc::AccessLog::Service::kHttp, request_.method());
+  body_buffer_size_ = kBodyBufferSize;
+
   request_length_ = http_util::GetContentLength(request_);
-  if (request_length_ == -2) {
-    request_chunked_ = true;
-    request_length_ = http_util::ParseChunk(client_buffer_, &last_chunk_size_);
-  } else {
-    request_chunked_ = false;
-  }
+  request_chunked_ = request_length_ == -2;
 
   request_version_ = request_.minor_version();
+  expect_continue_ =
+      request_version_ == 1 && (request_chunked_ || request_length_ > 0) &&
+      http_util::HasElement(request_, kExpect, "100-continue");
 
   if (request_.method().compare("CONNECT") == 0) {
     if (request_chunked_ || request_length_ > 0) {
@@ -155,13 +296,22 @@ void HttpProxySession::ProcessRequest() {
   request_.set_minor_version(1);
   http_util::ProcessHopByHopHeaders(&request_);
   proxy_->FilterHeaders(&request_, true);
-  proxy_->ProcessAuthorization(&request_);
 
   DispatchRequest();
 }
 
 // not safe to call from remote_'s event handler.
 void HttpProxySession::DispatchRequest() {
+  // Sent again after a challenge only if the body is not sent yet, so it is
+  // decoded from the start each time.
+  request_body_sent_ = false;
+  if (request_chunked_) {
+    request_decoder_.Reset();
+    request_input_ = client_buffer_.data();
+    request_input_size_ = client_buffer_.size();
+    request_offset_ = 0;
+  }
+
   GURL url;
   if (tunnel_) {
     url = GURL("http://" + request_.path());
@@ -171,80 +321,295 @@ void HttpProxySession::DispatchRequest() {
       SetError(BAD_REQUEST);
       return;
     }
+  }
 
-    if (!config_->use_remote_proxy_) {
-      if (!url.SchemeIs("http")) {
-        SetError(NOT_IMPLEMENTED);
-        return;
-      }
+  access_.SetHost(url.host(), url.EffectiveIntPort());
+
+  route_ = proxy_->FindRoute(url.host());
+  if (route_.action == HttpProxyConfig::RouteAction::kBlock) {
+    SetError(FORBIDDEN);
+    return;
+  }
 
-      request_.set_path(url.PathForRequest());
+  if (ViaRemoteProxy()) {
+    proxy_->ProcessAuthorization(&request_, &digest_context_);
+  } else if (!tunnel_) {
+    if (!url.SchemeIs("http")) {
+      SetError(NOT_IMPLEMENTED);
+      return;
     }
+
+    request_.set_path(url.PathForRequest());
   }
 
-  int new_port;
-  std::string new_host;
-  if (config_->use_remote_proxy_) {
-    new_host = config_->remote_proxy_host_;
-    new_port = config_->remote_proxy_port_;
-  } else {
-    new_host = url.host();
-    new_port = url.EffectiveIntPort();
+  if (!tunnel_ && !retry_) {
+    request_url_ = url.spec();
+    if (LookupCache(request_url_))
+      return;
+  }
+
+  ConnectRemote(url);
+}
+
+void HttpProxySession::ConnectRemote(const GURL& url) {
+  if (!ViaRemoteProxy()) {
+    ConnectTo(url.host(), url.EffectiveIntPort());
+    return;
   }
 
-  if (new_port <= 0 || 65536 <= new_port) {
+  EndUpstream(HttpUpstreamGroup::Member::Result::kCancelled);
+  tried_upstreams_.clear();
+
+  if (!ConnectUpstream())
+    SetError(BAD_GATEWAY);
+}
+
+bool HttpProxySession::ConnectUpstream() {
+  if (route_.upstreams == nullptr)
+    return false;
+
+  upstream_ = route_.upstreams->Select(tried_upstreams_);
+  if (upstream_ == nullptr)
+    return false;
+
+  upstream_->OnStarted();
+  upstream_start_ = base::TimeTicks::Now();
+
+  ConnectTo(upstream_->host(), upstream_->port());
+  return true;
+}
+
+void HttpProxySession::ConnectTo(const std::string& host, int port) {
+  if (port <= 0 || 65536 <= port) {
     SetError(BAD_REQUEST);
     return;
   }
 
-  if (new_host == last_host_ && new_port == last_port_) {
+  // Each request takes a stream of its own, never reused.
+  if (ViaRemoteProxy() && config_->remote_proxy_http2_) {
+    auto stream = Http2Upstream::Open(host, port);
+    if (stream == nullptr) {
+      FailOver();
+      return;
+    }
+
+    retired_remote_ = std::move(remote_);
+    remote_ = std::move(stream);
+    remote_persistent_ = false;
+    remote_multiplexed_ = true;
+    SendRequest();
+    return;
+  }
+
+  if (host == last_host_ && port == last_port_) {
     SendRequest();
     return;
   }
 
-  last_host_ = std::move(new_host);
-  last_port_ = new_port;
+  last_host_ = host;
+  last_port_ = port;
+
+  // Tunnels are never pooled, as the connection is handed over to
+  // TunnelingService, but may take a fresh one, made ahead and never used.
+  auto fresh = false;
+  std::shared_ptr<io::net::SocketChannel> pooled;
+  if (tunnel_)
+    pooled = HttpConnectionPool::AcquireFresh(host, port);
+  else
+    pooled = HttpConnectionPool::Acquire(host, port, &fresh);
+
+  // Learns how often a new connection is wanted, whether made ahead or not.
+  if (tunnel_ || pooled == nullptr || fresh)
+    HttpPreconnector::Learn(host, port);
+
+  if (pooled != nullptr) {
+    DLOG(INFO) << this << " reusing connection to " << last_host_ << ":"
+               << last_port_;
+    retired_remote_ = std::move(remote_);
+    remote_ = std::move(pooled);
+    remote_persistent_ = !tunnel_;
+    remote_multiplexed_ = false;
+    OnRemoteReady();
+    return;
+  }
 
   auto result = resolver_.Resolve(last_host_, last_port_);
   if (FAILED(result)) {
-    SetError(BAD_GATEWAY);
+    FailOver();
     return;
   }
 
-  remote_ = std::make_shared<io::net::SocketChannel>();
-  if (remote_ == nullptr) {
+  auto socket = std::make_shared<io::net::SocketChannel>();
+  if (socket == nullptr) {
     SetError(INTERNAL_SERVER_ERROR);
     return;
   }
 
+  retired_remote_ = std::move(remote_);
+  remote_ = socket;
+  remote_persistent_ = false;
+  remote_multiplexed_ = false;
+
   state_ = State::kConnecting;
-  remote_->ConnectAsync(resolver_.begin()->get(), this);
+  socket->ConnectAsync(resolver_.begin()->get(), this);
+}
+
+void HttpProxySession::FailOver() {
+  last_host_.clear();
+  last_port_ = -1;
+
+  if (upstream_ == nullptr) {
+    SetError(BAD_GATEWAY);
+    return;
+  }
+
+  DLOG(INFO) << this << " failed to connect to " << upstream_->host() << ":"
+             << upstream_->port();
+
+  tried_upstreams_.push_back(upstream_.get());
+  EndUpstream(HttpUpstreamGroup::Member::Result::kConnectFailed);
+
+  if (!ConnectUpstream())
+    SetError(BAD_GATEWAY);
+}
+
+void HttpProxySession::OnRemoteReady() {
+  if (tunnel_ && !ViaRemoteProxy()) {
+    access_.status = OK;
+    if (misc::TunnelingService::Bind(client_, remote_, &access_)) {
+      response_.Clear();
+      response_.SetStatus(OK, "Connection Established");
+      SendResponse();
+    } else {
+      SendError(INTERNAL_SERVER_ERROR);
+    }
+  } else {
+    SendRequest();
+  }
+}
+
+void HttpProxySession::EndUpstream(HttpUpstreamGroup::Member::Result result) {
+  if (upstream_ == nullptr)
+    return;
+
+  upstream_->OnEnded(result, base::TimeTicks::Now() - upstream_start_);
+  upstream_.reset();
 }
 
 void HttpProxySession::SendRequest() {
   state_ = State::kRequestHeader;
 
-  std::string message;
-  request_.Serialize(&message);
-  memmove(buffer_, message.data(), message.size());
+  // Nothing is pipelined ahead of a request sent on its own, so what is left
+  // from the connection does not belong to its response.
+  remote_buffer_.clear();
+
+  // Reuses the capacity of the last message.
+  header_buffer_.resize(request_.GetSerializedSize());
+  request_.Serialize(&header_buffer_[0]);
 
   auto result =
-      remote_->WriteAsync(buffer_, static_cast<int>(message.size()), this);
+      remote_->WriteAsync(header_buffer_.data(),
+                          static_cast<int>(header_buffer_.size()), this);
   if (FAILED(result)) {
     LOG(ERROR) << this << " failed to send to remote: 0x" << std::hex << result;
     SendError(INTERNAL_SERVER_ERROR);
   }
 }
 
-void HttpProxySession::ProcessRequestChunk() {
-  request_length_ = http_util::ParseChunk(client_buffer_, &last_chunk_size_);
-  if (request_length_ > 0) {
-    SendToRemote(client_buffer_.data(), static_cast<int>(request_length_));
-  } else if (request_length_ == -2) {
+void HttpProxySession::WaitContinue() {
+  state_ = State::kContinueWait;
+  continue_waiting_ = true;
+  continue_reading_ = true;
+
+  remote_buffer_.clear();
+  response_.Clear();
+  response_length_ = 0;
+  response_chunked_ = false;
+  close_remote_ = false;
+  body_buffer_size_ = kBodyBufferSize;
+
+  // Servers not answering are given the body anyway after a while.
+  timer_->Start(kContinueTimeout, 0);
+
+  continue_buffer_.resize(kHeaderBufferSize);
+  auto result = remote_->ReadAsync(&continue_buffer_[0],
+                                   static_cast<int>(continue_buffer_.size()),
+                                   this);
+  if (FAILED(result)) {
+    LOG(ERROR) << this << " failed to receive response: 0x" << std::hex
+               << result;
+    continue_reading_ = false;
+    timer_->Stop();
+    SendError(INTERNAL_SERVER_ERROR);
+  }
+}
+
+void HttpProxySession::SendRequestBody() {
+  state_ = State::kRequestBody;
+  request_body_sent_ = true;
+
+  if (request_chunked_) {
+    ProcessRequestChunk();
+  } else if (client_buffer_.empty()) {
     ReceiveRequest();
+  } else if (ReserveBuffer(body_buffer_size_)) {
+    auto size = std::min({client_buffer_.size(),
+                          static_cast<size_t>(request_length_),
+                          buffer_.size()});
+    memmove(buffer_.data(), client_buffer_.data(), size);
+    client_buffer_.erase(0, size);
+
+    SendToRemote(buffer_.data(), static_cast<int>(size));
   } else {
-    LOG(ERROR) << this << " invalid request chunk";
-    SetError(BAD_REQUEST);
+    SendError(INTERNAL_SERVER_ERROR);
+  }
+}
+
+void HttpProxySession::ProcessRequestChunk() {
+  auto start = request_offset_;
+
+  // The chunks are forwarded as they are, so all the input is decoded at once
+  // only to find the end of the body.
+  while (request_offset_ < request_input_size_ &&
+         !request_decoder_.IsComplete()) {
+    const char* payload;
+    size_t payload_length;
+    auto consumed = request_decoder_.Decode(
+        request_input_ + request_offset_, request_input_size_ - request_offset_,
+        &payload, &payload_length);
+    if (consumed < 0) {
+      LOG(ERROR) << this << " invalid request chunk";
+      close_client_ = true;
+      SendError(BAD_REQUEST);
+      return;
+    }
+
+    request_offset_ += static_cast<size_t>(consumed);
+  }
+
+  // The body is only drained if the request is not to be sent.
+  if (request_offset_ > start && status_code_ == 0)
+    SendToRemote(request_input_ + start,
+                 static_cast<int>(request_offset_ - start));
+  else
+    OnRequestChunkSent();
+}
+
+void HttpProxySession::OnRequestChunkSent() {
+  if (request_decoder_.IsComplete()) {
+    // Keeps what follows the body for the next request.
+    if (request_input_ == buffer_.data())
+      client_buffer_.assign(buffer_.data() + request_offset_,
+                            request_input_size_ - request_offset_);
+    else
+      client_buffer_.erase(0, request_offset_);
+
+    EndRequest();
+  } else if (request_offset_ < request_input_size_) {
+    ProcessRequestChunk();
+  } else {
+    client_buffer_.clear();
+    ReceiveRequest();
   }
 }
 
@@ -254,25 +619,46 @@ void HttpProxySession::EndRequest() {
   if (status_code_ == 0) {
     state_ = State::kResponseHeader;
 
-    remote_buffer_.clear();
+    // remote_buffer_ is kept, as it may hold the response already: read while
+    // the body was held, or after the response to a pipelined request.
     response_.Clear();
     response_length_ = 0;
     response_chunked_ = false;
     close_remote_ = false;
+    body_buffer_size_ = kBodyBufferSize;
+
+    if (continue_reading_) {
+      state_ = State::kContinueWait;
+      return;
+    }
+
+    if (!remote_buffer_.empty()) {
+      ProcessResponse();
+      return;
+    }
 
     auto result = ReceiveResponse();
     if (FAILED(result)) {
       LOG(ERROR) << this << " failed to receive response: 0x" << std::hex
                  << result;
       SendError(INTERNAL_SERVER_ERROR);
+      return;
     }
+
+    PipelineRequests();
   } else {
     SendError(static_cast<StatusCode>(status_code_));
   }
 }
 
 HRESULT HttpProxySession::ReceiveResponse() {
-  return remote_->ReadAsync(buffer_, kBufferSize, this);
+  auto size = state_ == State::kResponseBody ? body_buffer_size_
+                                             : kHeaderBufferSize;
+  if (!ReserveBuffer(size))
+    return E_OUTOFMEMORY;
+
+  return remote_->ReadAsync(buffer_.data(), static_cast<int>(buffer_.size()),
+                            this);
 }
 
 void HttpProxySession::ProcessResponse() {
@@ -292,6 +678,8 @@ void HttpProxySession::ProcessResponse() {
     return;
   }
 
+  EndUpstream(HttpUpstreamGroup::Member::Result::kSucceeded);
+
   auto status = response_.status();
 
   DLOG(INFO) << this << " " << status << " " << response_.message();
@@ -303,8 +691,10 @@ void HttpProxySession::ProcessResponse() {
     response_length_ = http_util::GetContentLength(response_);
     if (response_length_ == -2) {
       response_chunked_ = true;
-      response_length_ =
-          http_util::ParseChunk(remote_buffer_, &last_chunk_size_);
+      chunk_decoder_.Reset();
+      chunk_input_ = remote_buffer_.data();
+      chunk_input_size_ = remote_buffer_.size();
+      chunk_offset_ = 0;
 
       // HTTP/1.0: notify response end by connection close.
       if (request_version_ == 0) {
@@ -328,7 +718,9 @@ void HttpProxySession::ProcessResponse() {
 
   switch (status) {
     case PROXY_AUTHENTICATION_REQUIRED:
-      retry_ = !retry_;
+      // The body is not kept, so a request which has sent it is not sent
+      // again, and the client is given the challenge instead.
+      retry_ = !retry_ && !request_body_sent_;
       break;
 
     default:
@@ -336,46 +728,73 @@ void HttpProxySession::ProcessResponse() {
       break;
   }
 
-  if (retry_ && config_->use_remote_proxy_ && config_->auth_remote_proxy_) {
+  // Answered before the body is sent, which the remote server may still
+  // wait for, and the client may still send unless asked again.
+  if (continue_waiting_ && status / 100 != 1) {
+    continue_waiting_ = false;
+    close_remote_ = true;
+    if (!retry_)
+      close_client_ = true;
+  }
+
+  if (retry_ && ViaRemoteProxy() && config_->auth_remote_proxy_) {
     request_.RemoveHeader(kProxyAuthorization);
-    proxy_->ProcessAuthenticate(&response_, &request_);
+    proxy_->ProcessAuthenticate(&response_, &request_, &digest_context_);
 
     if (response_chunked_ || response_length_ == -1 || response_length_ > 0) {
       state_ = State::kResponseBody;
 
-      if (response_chunked_) {
+      if (response_chunked_)
         ProcessResponseChunk();
-      } else {
-        if (response_length_ > 0)
-          response_length_ -= remote_buffer_.size();
-        remote_buffer_.clear();
-
-        if (response_length_ == -1 || response_length_ > 0) {
-          auto result = ReceiveResponse();
-          if (FAILED(result)) {
-            LOG(ERROR) << this << " failed to receive response: 0x" << std::hex
-                       << result;
-            proxy_->EndSession(this);
-          }
-        } else {
-          SendRequest();
-        }
-      }
+      else
+        ReceiveResponseBody();
     } else {
-      SendRequest();
+      EndResponse();
     }
 
     return;
   }
 
+  if (!cache_key_.empty() && !tunnel_) {
+    if (status == NOT_MODIFIED && cached_ != nullptr) {
+      cached_ =
+          HttpCache::Update(cache_key_, *cached_, response_, request_time_);
+
+      // The others find the entry freshened.
+      LeaveFlight();
+
+      if (cached_ != nullptr)
+        SendCachedResponse();
+      else
+        SendError(INTERNAL_SERVER_ERROR);
+      return;
+    }
+
+    cached_.reset();
+    auto length = response_chunked_ ? -1 : response_length_;
+    storing_ = HttpCache::CreateWriter(cache_key_, request_, response_, length,
+                                       request_time_);
+
+    if (leading_) {
+      std::unique_ptr<HttpCache::Entry> entry;
+      if (storing_ != nullptr)
+        entry = HttpCache::CreateEntry(request_, response_, request_time_);
+
+      storing_ = HttpCollapser::Publish(flight_, std::move(entry), length,
+                                        std::move(storing_));
+    }
+  }
+
   if (tunnel_ && status == OK) {
-    if (!misc::TunnelingService::Bind(client_, remote_)) {
+    access_.status = status;
+    if (!misc::TunnelingService::Bind(client_, remote_, &access_)) {
       SendError(INTERNAL_SERVER_ERROR);
       return;
     }
   }
 
   if (!tunnel_) {
+    StartEncoding();
     proxy_->FilterHeaders(&response_, false);
 
     if (request_version_ == 1 && close_client_)
@@ -388,47 +807,135 @@ void HttpProxySession::ProcessResponse() {
 }
 
 void HttpProxySession::ProcessResponseChunk() {
-  response_length_ = http_util::ParseChunk(remote_buffer_, &last_chunk_size_);
-  if (response_length_ > 0) {
-    if (retry_) {
-      OnResponseBodySent(0, static_cast<int>(response_length_));
-    } else {
-      if (request_version_ == 0) {
-        // As HTTP/1.0 does not support chunked encoding, send raw bytes only.
-        response_length_ =
-            http_util::MergeChunks(&remote_buffer_, response_length_);
-      }
+  auto start = chunk_offset_;
+  const char* payload = nullptr;
+  size_t payload_length = 0;
+
+  // As HTTP/1.0 does not support chunked encoding, send raw bytes only, one
+  // chunk-data at a time. Otherwise the chunks are forwarded as they are.
+  auto merge = request_version_ == 0 && !retry_;
+
+  while (chunk_offset_ < chunk_input_size_ && !chunk_decoder_.IsComplete()) {
+    auto consumed = chunk_decoder_.Decode(chunk_input_ + chunk_offset_,
+                                          chunk_input_size_ - chunk_offset_,
+                                          &payload, &payload_length);
+    if (consumed < 0) {
+      LOG(ERROR) << this << " invalid response chunk";
+      proxy_->EndSession(this);
+      return;
+    }
 
-      auto result = client_->WriteAsync(
-          remote_buffer_.data(), static_cast<int>(response_length_), this);
-      if (FAILED(result)) {
-        LOG(ERROR) << this << " failed to send to client: 0x" << std::hex
-                   << result;
-        proxy_->EndSession(this);
-      }
+    chunk_offset_ += static_cast<size_t>(consumed);
+
+    // All the chunk-data in the input is compressed, then sent at once.
+    if (encoding_) {
+      if (payload_length > 0)
+        EncodeBody(payload, payload_length);
+      continue;
     }
-  } else if (response_length_ == -2) {
+
+    if (merge && payload_length > 0)
+      break;
+  }
+
+  if (encoding_) {
+    // A short read means the server sends no more for now, so nothing is
+    // held back.
+    auto flush = chunk_input_ == buffer_.data() &&
+                 chunk_input_size_ < buffer_.size();
+    auto last = chunk_decoder_.IsComplete();
+
+    // The input is no longer needed, as what is sent is compressed.
+    if (last)
+      KeepResponseRest();
+
+    SendEncoded(0, flush, last);
+    return;
+  }
+
+  auto data = merge ? payload : chunk_input_ + start;
+  auto length = merge ? payload_length : chunk_offset_ - start;
+  if (retry_ || length == 0) {
+    OnResponseChunkSent();
+    return;
+  }
+
+  auto result = client_->WriteAsync(data, static_cast<int>(length), this);
+  if (FAILED(result)) {
+    LOG(ERROR) << this << " failed to send to client: 0x" << std::hex
+               << result;
+    proxy_->EndSession(this);
+  }
+}
+
+void HttpProxySession::OnResponseChunkSent() {
+  if (chunk_decoder_.IsComplete()) {
+    KeepResponseRest();
+    EndResponse();
+  } else if (chunk_offset_ < chunk_input_size_) {
+    ProcessResponseChunk();
+  } else {
+    remote_buffer_.clear();
+
     auto result = ReceiveResponse();
     if (FAILED(result)) {
       LOG(ERROR) << this << " failed to receive response: 0x" << std::hex
                  << result;
       proxy_->EndSession(this);
     }
-  } else {
-    LOG(ERROR) << this << " invalid response chunk";
+  }
+}
+
+void HttpProxySession::KeepResponseRest() {
+  if (chunk_input_ == buffer_.data())
+    remote_buffer_.assign(buffer_.data() + chunk_offset_,
+                          chunk_input_size_ - chunk_offset_);
+  else
+    remote_buffer_.erase(0, chunk_offset_);
+
+  chunk_input_ = nullptr;
+  chunk_input_size_ = 0;
+  chunk_offset_ = 0;
+}
+
+void HttpProxySession::ReceiveResponseBody() {
+  if (remote_buffer_.empty()) {
+    auto result = ReceiveResponse();
+    if (FAILED(result)) {
+      LOG(ERROR) << this << " failed to receive response: 0x" << std::hex
+                 << result;
+      proxy_->EndSession(this);
+    }
+    return;
+  }
+
+  if (!ReserveBuffer(body_buffer_size_)) {
+    LOG(ERROR) << this << " failed to allocate buffer";
     proxy_->EndSession(this);
+    return;
   }
+
+  auto size = std::min(remote_buffer_.size(), buffer_.size());
+  if (response_length_ >= 0)
+    size = std::min(size, static_cast<size_t>(response_length_));
+  memmove(buffer_.data(), remote_buffer_.data(), size);
+  remote_buffer_.erase(0, size);
+
+  RelayResponseBody(static_cast<int>(size));
 }
 
 void HttpProxySession::SendResponse() {
   state_ = State::kResponseHeader;
+  access_.status = response_.status();
+  access_.Respond();
 
-  std::string message;
-  response_.Serialize(&message);
-  memmove(buffer_, message.data(), message.size());
+  // Reuses the capacity of the last message.
+  header_buffer_.resize(response_.GetSerializedSize());
+  response_.Serialize(&header_buffer_[0]);
 
   auto result =
-      client_->WriteAsync(buffer_, static_cast<int>(message.size()), this);
+      client_->WriteAsync(header_buffer_.data(),
+                          static_cast<int>(header_buffer_.size()), this);
   if (FAILED(result)) {
     LOG(ERROR) << this << " failed to send to client: 0x" << std::hex << result;
     proxy_->EndSession(this);
@@ -439,17 +946,24 @@ void HttpProxySession::SendResponse() {
 void HttpProxySession::EndResponse() {
   DLOG(INFO) << this << " response completed";
 
-  if (close_remote_) {
-    if (remote_ != nullptr)
-      remote_->Close();
+  if (close_remote_)
+    CloseRemote();
 
-    last_host_.clear();
-    last_port_ = -1;
+  if (response_.status() == CONTINUE && continue_waiting_) {
+    continue_waiting_ = false;
+    SendRequestBody();
+    return;
   }
 
   if (response_.status() / 100 == 1) {
     state_ = State::kResponseHeader;
 
+    // The final response may have been read along with it.
+    if (!remote_buffer_.empty()) {
+      ProcessResponse();
+      return;
+    }
+
     auto result = ReceiveResponse();
     if (FAILED(result)) {
       LOG(ERROR) << this << " failed to receive response: 0x" << std::hex
@@ -460,18 +974,54 @@ void HttpProxySession::EndResponse() {
     return;
   }
 
+  EndCache();
+
   if (retry_) {
+    // The request cannot be sent again ahead of those pipelined after it.
+    if (!pipeline_.empty()) {
+      proxy_->EndSession(this);
+      return;
+    }
+
     DispatchRequest();
     return;
   }
 
-  if (close_client_ || tunnel_) {
+  access_.End();
+
+  // Nothing else is written to remote_ until the pipelined requests are.
+  if (pipeline_writing_) {
+    state_ = State::kPipelineWait;
+    return;
+  }
+
+  StartNextRequest();
+}
+
+// not safe to call from remote_'s event handler.
+void HttpProxySession::StartNextRequest() {
+  if (!pipeline_.empty() && !close_client_) {
+    ProcessPipelinedRequest();
+    return;
+  }
+
+  // The next request may go to another host, so the connection is returned to
+  // the pool rather than kept for this session.
+  if (remote_ != nullptr && !close_remote_ && !tunnel_ &&
+      !remote_multiplexed_) {
+    HttpConnectionPool::Release(
+        std::static_pointer_cast<io::net::SocketChannel>(remote_));
+    remote_.reset();
+    last_host_.clear();
+    last_port_ = -1;
+  }
+
+  if (close_client_ || tunnel_) {
     proxy_->EndSession(this);
     return;
   }
 
   state_ = State::kRequestHeader;
-  last_chunk_size_ = 0;
   tunnel_ = false;
   retry_ = false;
   status_code_ = 0;
@@ -480,6 +1030,9 @@ void HttpProxySession::EndResponse() {
   request_length_ = 0;
   request_chunked_ = false;
   close_client_ = false;
+  cache_key_.clear();
+  collapsed_ = false;
+  encoding_ = false;
 
   if (client_buffer_.empty())
     ReceiveRequest();
@@ -487,22 +1040,513 @@ void HttpProxySession::EndResponse() {
     ProcessRequest();
 }
 
+void HttpProxySession::CloseRemote() {
+  if (remote_ != nullptr)
+    remote_->Close();
+
+  last_host_.clear();
+  last_port_ = -1;
+
+  // The requests written ahead are not answered, and sent again later.
+  for (auto& pipelined : pipeline_)
+    pipelined.sent = false;
+}
+
+void HttpProxySession::PipelineRequests() {
+  // A remote proxy may answer 407, upon which the request is sent again.
+  if (tunnel_ || close_client_ || retry_ || !remote_persistent_ ||
+      (ViaRemoteProxy() && config_->auth_remote_proxy_))
+    return;
+
+  while (pipeline_.size() < kMaxPipelineDepth && ParsePipelinedRequest())
+    continue;
+
+  WritePipeline();
+}
+
+// Takes the first request in client_buffer_ into pipeline_, if it goes to the
+// same server without a body, and is idempotent. Otherwise it is left to be
+// processed in turn.
+bool HttpProxySession::ParsePipelinedRequest() {
+  if (client_buffer_.empty())
+    return false;
+
+  HttpRequest request;
+  auto length = request.Parse(client_buffer_);
+  if (length <= 0)
+    return false;
+
+  auto content_length = http_util::GetContentLength(request);
+  if ((request.method().compare("GET") != 0 &&
+       request.method().compare("HEAD") != 0) ||
+      request.minor_version() != 1 || request.HeaderExists(kExpect) ||
+      content_length > 0 || content_length == -2)
+    return false;
+
+  GURL url(request.path());
+  if (!url.is_valid() || !url.has_host())
+    return false;
+
+  // The route is decided once for the connection.
+  auto route = proxy_->FindRoute(url.host());
+  if (route.action != route_.action || route.upstreams != route_.upstreams)
+    return false;
+
+  if (!ViaRemoteProxy() &&
+      (!url.SchemeIs("http") || url.host() != last_host_ ||
+       url.EffectiveIntPort() != last_port_))
+    return false;
+
+  // The cache may answer the request, or its validators may be added.
+  if (request.method().compare("GET") == 0 &&
+      HttpCache::Lookup(HttpCache::GetKey(url.spec()), request) != nullptr)
+    return false;
+
+  if (http_util::ProcessHopByHopHeaders(&request))
+    return false;
+
+  client_buffer_.erase(0, length);
+
+  DLOG(INFO) << this << " pipelining " << request.method() << " "
+             << request.path();
+
+  proxy_->FilterHeaders(&request, true);
+
+  if (ViaRemoteProxy())
+    proxy_->ProcessAuthorization(&request, &digest_context_);
+  else
+    request.set_path(url.PathForRequest());
+
+  PipelinedRequest pipelined;
+  request.Serialize(&pipelined.message);
+  pipelined.url = url.spec();
+  pipelined.request_time = base::Time::Now();
+  pipelined.sent = false;
+  pipeline_.push_back(std::move(pipelined));
+
+  return true;
+}
+
+// The requests not sent yet are written at once.
+void HttpProxySession::WritePipeline() {
+  if (pipeline_writing_)
+    return;
+
+  pipeline_buffer_.clear();
+  for (auto& pipelined : pipeline_) {
+    if (!pipelined.sent) {
+      pipeline_buffer_.append(pipelined.message);
+      pipelined.sent = true;
+    }
+  }
+
+  if (pipeline_buffer_.empty())
+    return;
+
+  pipeline_writing_ = true;
+
+  auto result = remote_->WriteAsync(
+      pipeline_buffer_.data(), static_cast<int>(pipeline_buffer_.size()),
+      this);
+  if (FAILED(result)) {
+    LOG(WARNING) << this << " failed to pipeline requests: 0x" << std::hex
+                 << result;
+    pipeline_writing_ = false;
+    close_remote_ = true;
+  }
+}
+
+void HttpProxySession::OnPipelineSent(io::Channel* channel, HRESULT result,
+                                      int length) {
+  pipeline_writing_ = false;
+
+  if (FAILED(result) || length == 0) {
+    LOG_IF(WARNING, FAILED(result))
+        << this << " failed to pipeline requests: 0x" << std::hex << result;
+
+    // The requests are sent again on another connection, after the current
+    // response if any.
+    if (channel == remote_.get() && !close_remote_) {
+      close_remote_ = true;
+      if (state_ == State::kPipelineWait)
+        CloseRemote();
+    }
+  }
+
+  // Resumed from the timer, as remote_ may be released.
+  if (state_ == State::kPipelineWait)
+    timer_->Start(0, 0);
+}
+
+// not safe to call from remote_'s event handler.
+void HttpProxySession::ProcessPipelinedRequest() {
+  auto pipelined = std::move(pipeline_.front());
+  pipeline_.pop_front();
+
+  tunnel_ = false;
+  retry_ = false;
+  status_code_ = 0;
+
+  request_.Clear();
+  request_.Parse(pipelined.message);
+  request_length_ = 0;
+  request_chunked_ = false;
+  request_version_ = 1;
+  request_url_ = std::move(pipelined.url);
+  expect_continue_ = false;
+  request_body_sent_ = false;
+  collapsed_ = false;
+
+  DLOG(INFO) << this << " " << request_.method() << " " << request_.path();
+
+  GURL url(request_url_);
+  access_.Begin(misc::AccessLog::Service::kHttp, request_.method());
+  access_.SetHost(url.host(), url.EffectiveIntPort());
+
+  cache_key_.clear();
+  cached_.reset();
+  if (request_.method().compare("GET") == 0) {
+    cache_key_ = HttpCache::GetKey(request_url_);
+    cache_start_ = base::TimeTicks::Now();
+    request_time_ = pipelined.request_time;
+  }
+
+  if (pipelined.sent)
+    EndRequest();
+  else
+    ConnectRemote(url);
+}
+
+bool HttpProxySession::LookupCache(const std::string& url) {
+  cache_key_.clear();
+  cached_.reset();
+
+  if (request_.method().compare("GET") != 0) {
+    // RFC 9111 4.4: unsafe methods invalidate the stored response.
+    if (request_.method().compare("HEAD") != 0 &&
+        request_.method().compare("OPTIONS") != 0 &&
+        request_.method().compare("TRACE") != 0)
+      HttpCache::Invalidate(HttpCache::GetKey(url));
+
+    return false;
+  }
+
+  if (request_chunked_ || request_length_ > 0)
+    return false;
+
+  cache_key_ = HttpCache::GetKey(url);
+  cache_start_ = base::TimeTicks::Now();
+  request_time_ = base::Time::Now();
+
+  // The response may still be stored.
+  if (HttpCache::IsConditional(request_))
+    return false;
+
+  auto entry = HttpCache::Lookup(cache_key_, request_);
+  if (entry != nullptr && HttpCache::IsFresh(*entry, request_, request_time_)) {
+    DLOG(INFO) << this << " serving from cache";
+
+    cached_ = std::move(entry);
+    SendCachedResponse();
+    return true;
+  }
+
+  if (entry != nullptr && HttpCache::AddValidators(*entry, &request_))
+    cached_ = std::move(entry);
+
+  return JoinFlight();
+}
+
+void HttpProxySession::SendCachedResponse() {
+  const auto& entry = following_ ? flight_->entry() : *cached_;
+  HttpCache::BuildResponse(entry, base::Time::Now(), &response_);
+  response_.set_minor_version(request_version_);
+  response_length_ = following_ ? flight_->length()
+                                : static_cast<int64_t>(cached_->body_size);
+  response_chunked_ = false;
+
+  serving_cache_ = true;
+  cache_offset_ = 0;
+  storing_.reset();
+
+  if (!following_)
+    StartEncoding();
+  proxy_->FilterHeaders(&response_, false);
+
+  if (request_version_ == 1 && close_client_)
+    response_.SetHeader(kConnection, "close");
+  else if (request_version_ == 0 && !close_client_)
+    response_.SetHeader(kConnection, "keep-alive");
+
+  SendResponse();
+}
+
+void HttpProxySession::SendCachedBody() {
+  if (following_) {
+    FollowFlight();
+    return;
+  }
+
+  // Large bodies are mapped from the disk, and sent a part at a time.
+  auto length = std::min(cached_->body_size - cache_offset_, kCacheWriteSize);
+
+  if (encoding_) {
+    EncodeBody(cached_->body.get() + cache_offset_, length);
+    SendEncoded(length, false, cache_offset_ + length == cached_->body_size);
+    return;
+  }
+
+  auto result = client_->WriteAsync(cached_->body.get() + cache_offset_,
+                                    static_cast<int>(length), this);
+  if (FAILED(result)) {
+    LOG(ERROR) << this << " failed to send to client: 0x" << std::hex << result;
+    proxy_->EndSession(this);
+  }
+}
+
+void HttpProxySession::EndCache() {
+  if (serving_cache_ && !following_) {
+    HttpCache::RecordServed(cache_offset_,
+                            base::TimeTicks::Now() - cache_start_);
+  } else if (storing_ != nullptr) {
+    storing_->Commit();
+  }
+
+  serving_cache_ = false;
+  cached_.reset();
+  storing_.reset();
+
+  LeaveFlight();
+}
+
+bool HttpProxySession::StartEncoding() {
+  encoding_ = false;
+
+  if (!config_->compress_responses_ || tunnel_ || response_length_ == 0 ||
+      response_.status() != OK)
+    return false;
+  if (0 < response_length_ && response_length_ < kMinEncodeSize)
+    return false;
+  if (response_.HeaderExists(kContentEncoding) ||
+      http_util::HasElement(response_, kCacheControl, "no-transform"))
+    return false;
+  if (!response_.HeaderExists(kContentType) ||
+      !http_util::MatchMediaType(response_.GetHeader(kContentType),
+                                 config_->compress_types_))
+    return false;
+  if (!http_util::AcceptsEncoding(request_, "gzip"))
+    return false;
+
+  // Kept for the following responses, so that nothing is allocated again.
+  if (encoder_ == nullptr)
+    encoder_ = std::make_unique<HttpGzipEncoder>();
+
+  encoded_buffer_.assign(kChunkHeaderSize, '\0');
+  encoder_->Reset(&encoded_buffer_);
+  encoding_time_ = base::TimeDelta();
+  encoding_ended_ = false;
+  encoding_ = true;
+
+  response_.RemoveHeader(kContentLength);
+  response_.SetHeader(kContentEncoding, "gzip");
+  if (request_version_ == 1) {
+    response_.SetHeader(kTransferEncoding, "chunked");
+  } else {
+    // HTTP/1.0: notify response end by connection close.
+    response_.RemoveHeader(kTransferEncoding);
+    close_client_ = true;
+  }
+  response_.MergeHeader(kVary, kAcceptEncoding);
+
+  // The representation differs from the origin's, byte by byte.
+  if (response_.HeaderExists(kETag)) {
+    auto etag = response_.GetHeader(kETag);
+    if (etag.compare(0, 2, "W/") != 0)
+      response_.SetHeader(kETag, "W/" + etag);
+  }
+
+  return true;
+}
+
+void HttpProxySession::EncodeBody(const char* data, size_t length) {
+  auto start = base::TimeTicks::Now();
+  encoder_->Encode(data, length, &encoded_buffer_);
+  encoding_time_ += base::TimeTicks::Now() - start;
+}
+
+void HttpProxySession::SendEncoded(size_t length, bool flush, bool last) {
+  auto start = base::TimeTicks::Now();
+  if (last)
+    encoder_->Finish(&encoded_buffer_);
+  else if (flush)
+    encoder_->Flush(&encoded_buffer_);
+  encoding_time_ += base::TimeTicks::Now() - start;
+
+  encoded_length_ = length;
+  encoding_ended_ = last;
+
+  // The encoder holds the input back until a block fills.
+  auto size = encoded_buffer_.size() - kChunkHeaderSize;
+  if (size == 0) {
+    ContinueResponseBody(static_cast<int>(length));
+    return;
+  }
+
+  // The size of the chunk is written right before the data.
+  auto offset = kChunkHeaderSize;
+  if (request_version_ == 1) {
+    char header[kChunkHeaderSize + 1];
+    auto header_length = sprintf_s(header, "%zx\r\n", size);
+    offset -= header_length;
+    memcpy(&encoded_buffer_[offset], header, header_length);
+
+    encoded_buffer_.append("\r\n");
+    if (last)
+      encoded_buffer_.append("0\r\n\r\n");
+  }
+
+  auto result = client_->WriteAsync(encoded_buffer_.data() + offset,
+                                    static_cast<int>(encoded_buffer_.size() -
+                                                     offset),
+                                    this);
+  if (FAILED(result)) {
+    LOG(ERROR) << this << " failed to send to client: 0x" << std::hex << result;
+    proxy_->EndSession(this);
+  }
+}
+
+bool HttpProxySession::JoinFlight() {
+  if (collapsed_ || config_->collapse_timeout_ <= 0)
+    return false;
+
+  auto leader = false;
+  flight_ = HttpCollapser::Join(cache_key_, this, &leader);
+  if (flight_ == nullptr || leader) {
+    leading_ = leader;
+    return false;
+  }
+
+  DLOG(INFO) << this << " waiting for another request";
+
+  collapsed_ = true;
+  state_ = State::kCollapsed;
+  timer_->Start(config_->collapse_timeout_, 0);
+
+  return true;
+}
+
+// Sends the response of flight_ as far as it has arrived.
+void HttpProxySession::FollowFlight() {
+  const char* data;
+  size_t length;
+  auto state = flight_->Read(this, cache_offset_, &data, &length);
+
+  switch (state) {
+    case HttpCollapser::Flight::State::kPending:
+      state_ = State::kCollapsed;
+      return;
+
+    case HttpCollapser::Flight::State::kStreaming:
+    case HttpCollapser::Flight::State::kCompleted:
+      break;
+
+    default:
+      if (following_) {
+        LOG(ERROR) << this << " collapsed response aborted";
+        proxy_->EndSession(this);
+      } else {
+        // Resumed from the timer, not to hold the thread of the leader.
+        state_ = State::kCollapsed;
+        timer_->Start(0, 0);
+      }
+      return;
+  }
+
+  if (!following_) {
+    if (!HttpCache::MatchVary(flight_->entry(), request_)) {
+      state_ = State::kCollapsed;
+      timer_->Start(0, 0);
+      return;
+    }
+
+    DLOG(INFO) << this << " following another request";
+
+    timer_->Stop();
+    following_ = true;
+    SendCachedResponse();
+    return;
+  }
+
+  if (length > 0) {
+    state_ = State::kResponseBody;
+
+    length = std::min(length, kCacheWriteSize);
+    auto result = client_->WriteAsync(data, static_cast<int>(length), this);
+    if (FAILED(result)) {
+      LOG(ERROR) << this << " failed to send to client: 0x" << std::hex
+                 << result;
+      proxy_->EndSession(this);
+    }
+  } else if (state == HttpCollapser::Flight::State::kCompleted) {
+    EndResponse();
+  } else {
+    // Notified when more arrives.
+    state_ = State::kCollapsed;
+  }
+}
+
+void HttpProxySession::LeaveFlight() {
+  if (flight_ == nullptr)
+    return;
+
+  if (leading_)
+    HttpCollapser::End(flight_);
+  else
+    flight_->Unsubscribe(this);
+
+  flight_.reset();
+  leading_ = false;
+  following_ = false;
+}
+
+void HttpProxySession::ResumeRequest() {
+  DLOG(INFO) << this << " sending request on its own";
+
+  LeaveFlight();
+
+  if (LookupCache(request_url_))
+    return;
+
+  ConnectRemote(GURL(request_url_));
+}
+
+bool HttpProxySession::ReserveBuffer(size_t size) {
+  if (buffer_.size() != size)
+    buffer_ = HttpBufferPool::Acquire(size);
+
+  return buffer_.data() != nullptr;
+}
+
+void HttpProxySession::OnBodyRead(int length) {
+  // A read filling the buffer means the peer sends faster than the body is
+  // relayed, so more is read at a time.
+  if (static_cast<size_t>(length) == buffer_.size() &&
+      body_buffer_size_ < HttpBufferPool::kMaxSize)
+    body_buffer_size_ *= 4;
+}
+
 void HttpProxySession::SetError(StatusCode status) {
   DLOG(INFO) << this << " setting error: " << status;
 
   status_code_ = status;
 
-  if (request_chunked_) {
+  // The client waits to be asked for the body, which is then not drained.
+  if (expect_continue_ && client_buffer_.empty()) {
+    close_client_ = true;
+    EndRequest();
+  } else if (request_chunked_) {
     state_ = State::kRequestBody;
-
-    if (request_length_ < 0) {  // bad chunk
-      close_client_ = true;
-      SendError(status);
-    } else if (last_chunk_size_ == 0) {
-      EndRequest();
-    } else {
-      ProcessRequestChunk();
-    }
+    ProcessRequestChunk();
   } else if (request_length_ > 0) {
     state_ = State::kRequestBody;
 
@@ -519,9 +1563,25 @@ void HttpProxySession::SetError(StatusCode status) {
 void HttpProxySession::SendError(StatusCode status) {
   DLOG(INFO) << this << " sending error: " << status;
 
+  // Only the remote server is to blame for a bad gateway.
+  EndUpstream(status == BAD_GATEWAY
+                  ? HttpUpstreamGroup::Member::Result::kFailed
+                  : HttpUpstreamGroup::Member::Result::kCancelled);
+
   tunnel_ = false;
   retry_ = false;
 
+  // The client may still send the body held.
+  if (continue_waiting_) {
+    continue_waiting_ = false;
+    close_client_ = true;
+  }
+
+  serving_cache_ = false;
+  cached_.reset();
+  storing_.reset();
+  LeaveFlight();
+
   response_.Clear();
   response_length_ = 0;
   response_chunked_ = false;
@@ -547,17 +1607,70 @@ void HttpProxySession::SendToRemote(const void* buffer, int length) {
 }
 
 void HttpProxySession::OnTimeout() {
+  ScopedCallback callback(this);
+
+  {
+    base::AutoLock guard(lock_);
+
+    if (ending_)
+      return;
+
+    if (state_ == State::kCollapsed && !following_) {
+      ResumeRequest();
+      return;
+    }
+
+    if (state_ == State::kPipelineWait && !pipeline_writing_) {
+      StartNextRequest();
+      return;
+    }
+
+    // The answer is processed when read, after the body.
+    if (state_ == State::kContinueWait && continue_waiting_) {
+      continue_waiting_ = false;
+      SendRequestBody();
+      return;
+    }
+  }
+
   LOG(WARNING) << this << " request timed-out";
   Stop();
   proxy_->EndSession(this);
 }
 
-void HttpProxySession::OnRead(io::Channel* /*channel*/, HRESULT result,
-                              void* /*buffer*/, int length) {
+void HttpProxySession::AddRef() {
   base::AtomicRefCountInc(&ref_count_);
+}
+
+void HttpProxySession::OnFlightUpdated(HttpCollapser::Flight* flight) {
+  ScopedCallback callback(this);
+  base::AtomicRefCountDec(&ref_count_);  // Taken by AddRef.
+  base::AutoLock guard(lock_);
+
+  if (ending_)
+    return;
 
+  if (state_ == State::kCollapsed && flight == flight_.get())
+    FollowFlight();
+}
+
+void HttpProxySession::OnRead(io::Channel* channel, HRESULT result,
+                              void* buffer, int length) {
+  ScopedCallback callback(this);
   base::AutoLock guard(lock_);
 
+  if (ending_)
+    return;
+
+  if (channel == client_.get() && SUCCEEDED(result) && length > 0)
+    access_.bytes_in += length;
+
+  // Read from remote_ while the body may be read from the client.
+  if (continue_reading_ && buffer == continue_buffer_.data()) {
+    OnContinueReceived(result, length);
+    return;
+  }
+
   switch (state_) {
     case State::kRequestHeader:
       OnRequestReceived(result, length);
@@ -579,17 +1692,25 @@ void HttpProxySession::OnRead(io::Channel* /*channel*/, HRESULT result,
       proxy_->EndSession(this);
       break;
   }
-
-  if (!base::AtomicRefCountDec(&ref_count_))
-    free_.Broadcast();
 }
 
-void HttpProxySession::OnWritten(io::Channel* /*channel*/, HRESULT result,
-                                 void* /*buffer*/, int length) {
-  base::AtomicRefCountInc(&ref_count_);
-
+void HttpProxySession::OnWritten(io::Channel* channel, HRESULT result,
+                                 void* buffer, int length) {
+  ScopedCallback callback(this);
   base::AutoLock guard(lock_);
 
+  if (ending_)
+    return;
+
+  if (channel == client_.get() && SUCCEEDED(result) && length > 0)
+    access_.bytes_out += length;
+
+  // Pipelined requests are written while a response is being received.
+  if (pipeline_writing_ && buffer == pipeline_buffer_.data()) {
+    OnPipelineSent(channel, result, length);
+    return;
+  }
+
   switch (state_) {
     case State::kRequestHeader:
       OnRequestSent(result, length);
@@ -611,26 +1732,6 @@ void HttpProxySession::OnWritten(io::Channel* /*channel*/, HRESULT result,
       proxy_->EndSession(this);
       break;
   }
-
-  if (!base::AtomicRefCountDec(&ref_count_))
-    free_.Broadcast();
-}
-
-void HttpProxySession::OnClosed(io::net::SocketChannel* socket,
-                                HRESULT /*result*/) {
-  base::AtomicRefCountInc(&ref_count_);
-
-  base::AutoLock guard(lock_);
-
-  if (socket == remote_.get()) {
-    LOG(WARNING) << this << " socket disconnected";
-
-    last_host_.clear();
-    last_port_ = -1;
-  }
-
-  if (!base::AtomicRefCountDec(&ref_count_))
-    free_.Broadcast();
 }
 
 void HttpProxySession::OnRequestReceived(HRESULT result, int length) {
@@ -643,38 +1744,29 @@ void HttpProxySession::OnRequestReceived(HRESULT result, int length) {
     return;
   }
 
-  client_buffer_.append(buffer_, length);
+  client_buffer_.append(buffer_.data(), length);
   ProcessRequest();
 }
 
-void HttpProxySession::OnConnected(io::net::SocketChannel* socket,
+void HttpProxySession::OnConnected(io::net::SocketChannel* /*socket*/,
                                    HRESULT result) {
-  base::AtomicRefCountInc(&ref_count_);
-
+  ScopedCallback callback(this);
   base::AutoLock guard(lock_);
 
+  if (ending_)
+    return;
+
   if (SUCCEEDED(result)) {
     if (!tunnel_)
-      socket->MonitorConnection(this);
+      HttpConnectionPool::Add(
+          last_host_, last_port_,
+          std::static_pointer_cast<io::net::SocketChannel>(remote_));
 
-    if (tunnel_ && !config_->use_remote_proxy_) {
-      if (misc::TunnelingService::Bind(client_, remote_)) {
-        response_.Clear();
-        response_.SetStatus(OK, "Connection Established");
-        SendResponse();
-      } else {
-        SendError(INTERNAL_SERVER_ERROR);
-      }
-    } else {
-      SendRequest();
-    }
+    OnRemoteReady();
   } else {
     LOG(ERROR) << this << " failed to connect: 0x" << std::hex << result;
-    SendError(BAD_GATEWAY);
+    FailOver();
   }
-
-  if (!base::AtomicRefCountDec(&ref_count_))
-    free_.Broadcast();
 }
 
 void HttpProxySession::OnRequestSent(HRESULT result, int length) {
@@ -686,25 +1778,42 @@ void HttpProxySession::OnRequestSent(HRESULT result, int length) {
   }
 
   if (request_chunked_ || request_length_ > 0) {
-    state_ = State::kRequestBody;
-
-    if (request_chunked_) {
-      ProcessRequestChunk();
-    } else if (client_buffer_.empty()) {
-      ReceiveRequest();
+    // Unless the client has not waited for it.
+    if (expect_continue_ && client_buffer_.empty()) {
+      WaitContinue();
     } else {
-      auto size = std::min({client_buffer_.size(),
-                            static_cast<size_t>(request_length_), kBufferSize});
-      memmove(buffer_, client_buffer_.data(), size);
-      client_buffer_.erase(0, size);
-
-      SendToRemote(buffer_, static_cast<int>(size));
+      expect_continue_ = false;
+      SendRequestBody();
     }
   } else {
     EndRequest();
   }
 }
 
+void HttpProxySession::OnContinueReceived(HRESULT result, int length) {
+  continue_reading_ = false;
+
+  // Otherwise the body is being sent, which notices the failure.
+  if (FAILED(result) || length == 0) {
+    LOG_IF(ERROR, FAILED(result)) << this << " failed to receive response: 0x"
+                                  << std::hex << result;
+    if (state_ == State::kContinueWait) {
+      timer_->Stop();
+      SendError(BAD_GATEWAY);
+    }
+    return;
+  }
+
+  remote_buffer_.append(continue_buffer_.data(), length);
+
+  // Otherwise the response is processed after the body is sent.
+  if (state_ == State::kContinueWait) {
+    timer_->Stop();
+    state_ = State::kResponseHeader;
+    ProcessResponse();
+  }
+}
+
 void HttpProxySession::OnRequestBodyReceived(HRESULT result, int length) {
   timer_->Stop();
 
@@ -715,11 +1824,15 @@ void HttpProxySession::OnRequestBodyReceived(HRESULT result, int length) {
     return;
   }
 
+  OnBodyRead(length);
+
   if (request_chunked_) {
-    client_buffer_.append(buffer_, length);
+    request_input_ = buffer_.data();
+    request_input_size_ = static_cast<size_t>(length);
+    request_offset_ = 0;
     ProcessRequestChunk();
   } else {
-    SendToRemote(buffer_, length);
+    SendToRemote(buffer_.data(), length);
   }
 }
 
@@ -732,12 +1845,7 @@ void HttpProxySession::OnRequestBodySent(HRESULT result, int length) {
   }
 
   if (request_chunked_) {
-    client_buffer_.erase(0, length);
-
-    if (last_chunk_size_ == 0)
-      EndRequest();
-    else
-      ProcessRequestChunk();
+    OnRequestChunkSent();
   } else if (request_length_ > length) {
     request_length_ -= length;
     ReceiveRequest();
@@ -754,7 +1862,7 @@ void HttpProxySession::OnResponseReceived(HRESULT result, int length) {
     return;
   }
 
-  remote_buffer_.append(buffer_, length);
+  remote_buffer_.append(buffer_.data(), length);
   ProcessResponse();
 }
 
@@ -773,39 +1881,24 @@ void HttpProxySession::OnResponseSent(HRESULT result, int length) {
 
   state_ = State::kResponseBody;
 
-  if (response_chunked_) {
+  if (serving_cache_)
+    SendCachedBody();
+  else if (response_chunked_)
     ProcessResponseChunk();
-  } else if (remote_buffer_.empty()) {
-    result = ReceiveResponse();
-    if (FAILED(result)) {
-      LOG(ERROR) << this << " failed to receive response: 0x" << std::hex
-                 << result;
-      proxy_->EndSession(this);
-    }
-  } else if (response_length_ < 0) {
-    result = client_->WriteAsync(remote_buffer_.data(),
-                                 static_cast<int>(remote_buffer_.size()), this);
-    if (FAILED(result)) {
-      LOG(ERROR) << this << " faield to send to client: 0x" << std::hex
-                 << result;
-      proxy_->EndSession(this);
-    }
-  } else {
-    auto size = std::min({remote_buffer_.size(),
-                          static_cast<size_t>(response_length_), kBufferSize});
-    memmove(buffer_, remote_buffer_.data(), size);
-    remote_buffer_.erase(0, size);
-
-    result = client_->WriteAsync(buffer_, static_cast<int>(size), this);
-    if (FAILED(result)) {
-      LOG(ERROR) << this << " failed to send to client: 0x" << std::hex
-                 << result;
-      proxy_->EndSession(this);
-    }
-  }
+  else
+    ReceiveResponseBody();
 }
 
 void HttpProxySession::OnResponseBodyReceived(HRESULT result, int length) {
+  // The body delimited by the connection close ends, and the client is told
+  // so by the last chunk rather than by closing.
+  if (SUCCEEDED(result) && length == 0 && encoding_ && !response_chunked_ &&
+      response_length_ == -1) {
+    close_remote_ = true;
+    SendEncoded(0, false, true);
+    return;
+  }
+
   if (FAILED(result) || length == 0) {
     LOG_IF(ERROR, FAILED(result))
         << this << " failed to receive response body: 0x" << std::hex << result;
@@ -813,14 +1906,41 @@ void HttpProxySession::OnResponseBodyReceived(HRESULT result, int length) {
     return;
   }
 
+  OnBodyRead(length);
+  RelayResponseBody(length);
+}
+
+void HttpProxySession::RelayResponseBody(int length) {
+  // What follows the body is the next response, read ahead.
+  if (!response_chunked_ && response_length_ >= 0 &&
+      length > response_length_) {
+    remote_buffer_.insert(0, buffer_.data() + response_length_,
+                          static_cast<size_t>(length - response_length_));
+    length = static_cast<int>(response_length_);
+  }
+
   if (response_chunked_) {
-    remote_buffer_.append(buffer_, length);
+    chunk_input_ = buffer_.data();
+    chunk_input_size_ = static_cast<size_t>(length);
+    chunk_offset_ = 0;
     ProcessResponseChunk();
   } else {
     if (retry_) {
       OnResponseBodySent(0, length);
     } else {
-      result = client_->WriteAsync(buffer_, length, this);
+      if (storing_ != nullptr)
+        storing_->Append(buffer_.data(), length);
+
+      if (encoding_) {
+        // A short read means the server sends no more for now, so nothing is
+        // held back.
+        EncodeBody(buffer_.data(), length);
+        SendEncoded(length, static_cast<size_t>(length) < buffer_.size(),
+                    response_length_ >= 0 && length >= response_length_);
+        return;
+      }
+
+      auto result = client_->WriteAsync(buffer_.data(), length, this);
       if (FAILED(result)) {
         LOG(ERROR) << this << " failed to send to client: 0x" << std::hex
                    << result;
@@ -838,23 +1958,41 @@ void HttpProxySession::OnResponseBodySent(HRESULT result, int length) {
     return;
   }
 
-  if (response_chunked_) {
-    remote_buffer_.erase(0, length);
+  if (encoding_) {
+    // Sent compressed, so the body goes on by what is consumed.
+    encoded_buffer_.resize(kChunkHeaderSize);
+
+    if (encoding_ended_) {
+      if (serving_cache_)
+        cache_offset_ += encoded_length_;
 
-    if (last_chunk_size_ == 0)
+      proxy_->RecordEncoding(encoder_->total_in(), encoder_->total_out(),
+                             encoding_time_);
+      encoding_ = false;
       EndResponse();
+      return;
+    }
+
+    length = static_cast<int>(encoded_length_);
+  }
+
+  ContinueResponseBody(length);
+}
+
+void HttpProxySession::ContinueResponseBody(int length) {
+  if (serving_cache_) {
+    cache_offset_ += length;
+    if (following_ || cache_offset_ < cached_->body_size)
+      SendCachedBody();
     else
-      ProcessResponseChunk();
+      EndResponse();
+  } else if (response_chunked_) {
+    OnResponseChunkSent();
   } else if (response_length_ == -1 || response_length_ > length) {
     if (response_length_ > length)
       response_length_ -= length;
 
-    result = ReceiveResponse();
-    if (FAILED(result)) {
-      LOG(ERROR) << this << " failed to receive response: 0x" << std::hex
-                 << result;
-      proxy_->EndSession(this);
-    }
+    ReceiveResponseBody();
   } else {
     EndResponse();
   }
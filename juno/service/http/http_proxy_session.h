@@ -8,47 +8,113 @@
 #include <base/atomic_ref_count.h>
 #include <base/synchronization/condition_variable.h>
 #include <base/synchronization/lock.h>
+#include <base/time/time.h>
 
+#include <deque>
 #include <memory>
 #include <string>
+#include <vector>
 
 #include "io/net/socket_channel.h"
 #include "io/net/socket_resolver.h"
+#include "misc/access_log.h"
+#include "misc/reclamation_queue.h"
+#include "misc/session_registry.h"
 #include "misc/timer_service.h"
 #include "service/service.h"
+#include "service/http/http_buffer_pool.h"
+#include "service/http/http_cache.h"
+#include "service/http/http_chunked_decoder.h"
+#include "service/http/http_collapser.h"
+#include "service/http/http_digest.h"
+#include "service/http/http_gzip_encoder.h"
 #include "service/http/http_request.h"
 #include "service/http/http_response.h"
+#include "service/http/http_router.h"
+#include "service/http/http_upstream_group.h"
+
+class GURL;
 
 namespace juno {
 namespace service {
 namespace http {
 
-struct HttpProxyConfig;
-
 class HttpProxy;
 
-class HttpProxySession : private io::Channel::Listener,
+class HttpProxySession : public misc::RegistryEntry,
+                         public misc::ReclamationEntry,
+                         private io::Channel::Listener,
                          private io::net::SocketChannel::Listener,
-                         private misc::TimerService::Callback {
+                         private misc::TimerService::Callback,
+                         private HttpCollapser::Subscriber {
  public:
   HttpProxySession(HttpProxy* proxy, const HttpProxyConfig* config,
                    std::unique_ptr<io::Channel>&& client);
   ~HttpProxySession();
 
   bool Start();
+  // Starts the session only to answer |status| and close the connection.
+  bool Reject(StatusCode status);
   void Stop();
 
+  // Returns true if no callback is running on this session. One may start
+  // later still, which the destructor waits for.
+  bool IsReclaimable() {
+    return base::AtomicRefCountIsZero(&ref_count_);
+  }
+
  private:
   enum class State;
+  class ScopedCallback;
+
+  // Headers are read into a small buffer, which is also all an idle session
+  // holds. A body starts with a larger one, and grows up to
+  // HttpBufferPool::kMaxSize as long as reads fill it.
+  static const size_t kHeaderBufferSize = HttpBufferPool::kMinSize;
+  static const size_t kBodyBufferSize = 16 * 1024;    // 16 KiB
+  static const size_t kCacheWriteSize = 256 * 1024;  // 256 KiB
+  static const int kTimeout = 15 * 1000;              // 15 sec
+  // How long the body is held for the remote server to ask for it.
+  static const int kContinueTimeout = 1000;           // 1 sec
+  static const size_t kMaxPipelineDepth = 8;
+  // Room left ahead of the compressed data for the size of its chunk.
+  static const size_t kChunkHeaderSize = 10;
+  // Smaller bodies are not worth compressing.
+  static const int64_t kMinEncodeSize = 256;
 
-  static const size_t kBufferSize = 8 * 1024;  // 8 KiB
-  static const int kTimeout = 15 * 1000;       // 15 sec
+  // A request written to the remote server ahead of its turn.
+  struct PipelinedRequest {
+    // Serialized as it is written.
+    std::string message;
+    std::string url;
+    base::Time request_time;
+    // Written to the current connection.
+    bool sent;
+  };
 
   void ReceiveRequest();
   void ProcessRequest();
   void DispatchRequest();
+  void ConnectRemote(const GURL& url);
+  bool ViaRemoteProxy() const {
+    return route_.action == HttpProxyConfig::RouteAction::kProxy;
+  }
+  // Returns false if no parent proxy is left to try.
+  bool ConnectUpstream();
+  void ConnectTo(const std::string& host, int port);
+  // Tries the next parent proxy, as upstream_ cannot be connected.
+  void FailOver();
+  // Starts using remote_, just connected or taken from the pool.
+  void OnRemoteReady();
+  void EndUpstream(HttpUpstreamGroup::Member::Result result);
   void SendRequest();
+  // Holds the body of a request with Expect: 100-continue until the remote
+  // server answers, so that the client sends it only if it is to be sent.
+  void WaitContinue();
+  void SendRequestBody();
   void ProcessRequestChunk();
+  // Called when the chunks decoded are sent, to decode the rest.
+  void OnRequestChunkSent();
   // Called when all the request is sent to the remote server,
   // and begins receiving response.
   void EndRequest();
@@ -56,8 +122,59 @@ class HttpProxySession : private io::Channel::Listener,
   HRESULT ReceiveResponse();
   void ProcessResponse();
   void ProcessResponseChunk();
+  void OnResponseChunkSent();
+  // Keeps what follows the chunked body in remote_buffer_, as the beginning
+  // of the next response.
+  void KeepResponseRest();
+  // Relays the body already read into remote_buffer_, or reads more if none
+  // is left.
+  void ReceiveResponseBody();
   void SendResponse();
   void EndResponse();
+  // Begins the next request, either pipelined or from the client.
+  void StartNextRequest();
+  void CloseRemote();
+
+  // Writes the requests following the current one in client_buffer_, if the
+  // remote server is known to keep connections alive and they are safe to
+  // send again.
+  void PipelineRequests();
+  bool ParsePipelinedRequest();
+  void WritePipeline();
+  void OnPipelineSent(io::Channel* channel, HRESULT result, int length);
+  // Makes the first of pipeline_ current, receiving its response.
+  void ProcessPipelinedRequest();
+
+  // Returns true if the request is answered from the cache.
+  bool LookupCache(const std::string& url);
+  void SendCachedResponse();
+  void SendCachedBody();
+  void EndCache();
+
+  // Returns true if the request waits for the response to another one.
+  bool JoinFlight();
+  void FollowFlight();
+  void LeaveFlight();
+  // Sends the request on its own after waiting for a flight in vain.
+  void ResumeRequest();
+
+  // Makes buffer_ of |size| for the next read or copy, returning false if out
+  // of memory. It must not be in use.
+  bool ReserveBuffer(size_t size);
+  // Called when a read of a body returned |length| bytes.
+  void OnBodyRead(int length);
+
+  // Returns true if the response body is to be compressed for the client,
+  // modifying the response header for it.
+  bool StartEncoding();
+  // Compresses |length| bytes of the response body at |data|.
+  void EncodeBody(const char* data, size_t length);
+  // Sends what is compressed so far, |length| bytes of the body, ending the
+  // body if |last|. Unless |flush|, some of it may be held back until more
+  // follows.
+  void SendEncoded(size_t length, bool flush, bool last);
+  // Goes on with the response body after |length| bytes of it are sent.
+  void ContinueResponseBody(int length);
 
   void SetError(StatusCode status);
   void SendError(StatusCode status);
@@ -65,22 +182,30 @@ class HttpProxySession : private io::Channel::Listener,
 
   void OnTimeout() override;
 
+  void AddRef() override;
+  void OnFlightUpdated(HttpCollapser::Flight* flight) override;
+
   void OnRead(io::Channel* channel, HRESULT result, void* buffer,
               int length) override;
   void OnWritten(io::Channel* channel, HRESULT result, void* buffer,
                  int length) override;
 
-  void OnClosed(io::net::SocketChannel* socket, HRESULT result) override;
+  // Connections are monitored by HttpConnectionPool.
+  void OnClosed(io::net::SocketChannel* /*socket*/,
+                HRESULT /*result*/) override {}
 
   void OnRequestReceived(HRESULT result, int length);
   void OnConnected(io::net::SocketChannel* socket, HRESULT result) override;
   void OnRequestSent(HRESULT result, int length);
+  void OnContinueReceived(HRESULT result, int length);
   void OnRequestBodyReceived(HRESULT result, int length);
   void OnRequestBodySent(HRESULT result, int length);
 
   void OnResponseReceived(HRESULT result, int length);
   void OnResponseSent(HRESULT result, int length);
   void OnResponseBodyReceived(HRESULT result, int length);
+  // Sends |length| bytes of the body in buffer_, keeping what follows it.
+  void RelayResponseBody(int length);
   void OnResponseBodySent(HRESULT result, int length);
 
   HttpProxy* const proxy_;
@@ -89,33 +214,116 @@ class HttpProxySession : private io::Channel::Listener,
   base::AtomicRefCount ref_count_;
   base::Lock lock_;
   base::ConditionVariable free_;
+  // Set by the destructor, after which callbacks return at once.
+  bool ending_;
 
   std::unique_ptr<misc::TimerService::Timer> timer_;
-  char buffer_[kBufferSize];
+  HttpBufferPool::Buffer buffer_;
+  // The size of buffer_ for the next read of a body.
+  size_t body_buffer_size_;
+  // The request or response header being sent, serialized in place.
+  std::string header_buffer_;
   State state_;
-  int64_t last_chunk_size_;
   bool tunnel_;
   std::string last_host_;
   int last_port_;
   io::net::SocketResolver resolver_;
+  // How the current request goes, kept by those pipelined after it.
+  HttpRouter::Route route_;
+  // The parent proxy the request is sent to, until it responds.
+  std::shared_ptr<HttpUpstreamGroup::Member> upstream_;
+  base::TimeTicks upstream_start_;
+  std::vector<HttpUpstreamGroup::Member*> tried_upstreams_;
   bool retry_;
   int status_code_;
+  // Kept across requests, authorized by the remote proxy.
+  HttpDigest::Context digest_context_;
 
   std::shared_ptr<io::Channel> client_;
   std::string client_buffer_;
+  // The current request, with the bytes of the client counted since the last
+  // one ended.
+  misc::AccessLog::Record access_;
   HttpRequest request_;
   int64_t request_length_;
   bool request_chunked_;
   int request_version_;
   bool close_client_;
+  // The body has started to be sent, after which the request is not sent
+  // again.
+  bool request_body_sent_;
+  std::string request_url_;
+  // The request has a body, which the client sends when asked by 100.
+  bool expect_continue_;
+  // The body is held until the remote server answers.
+  bool continue_waiting_;
+  // The answer is read into continue_buffer_, while the body may be sent.
+  bool continue_reading_;
+  std::string continue_buffer_;
+  // Decodes the chunked body of the request being forwarded. The input is the
+  // rest of client_buffer_ after the header, then buffer_ for each read.
+  HttpChunkedDecoder request_decoder_;
+  const char* request_input_;
+  size_t request_input_size_;
+  size_t request_offset_;
 
-  std::shared_ptr<io::net::SocketChannel> remote_;
+  std::shared_ptr<io::Channel> remote_;
+  // remote_ is taken from the pool, so it has kept a connection alive.
+  bool remote_persistent_;
+  // remote_ is a stream multiplexed by Http2Upstream, rather than a socket.
+  bool remote_multiplexed_;
+  // The channel replaced last, kept as it may not be destroyed from its own
+  // callback, from which a request may be sent again.
+  std::shared_ptr<io::Channel> retired_remote_;
   std::string remote_buffer_;
   HttpResponse response_;
   int64_t response_length_;
   bool response_chunked_;
   bool close_remote_;
 
+  // Decodes the chunked body of the response being forwarded. The input is the
+  // rest of remote_buffer_ after the header, then buffer_ for each read.
+  HttpChunkedDecoder chunk_decoder_;
+  const char* chunk_input_;
+  size_t chunk_input_size_;
+  size_t chunk_offset_;
+
+  // The key of the request if its response may be cached, empty otherwise.
+  std::string cache_key_;
+  base::Time request_time_;
+  base::TimeTicks cache_start_;
+  // The entry being served or validated.
+  std::shared_ptr<const HttpCache::Entry> cached_;
+  bool serving_cache_;
+  size_t cache_offset_;
+  // Stores the response being forwarded.
+  std::unique_ptr<HttpCache::Writer> storing_;
+
+  // Compresses the response body for the client. Created on first use, and
+  // kept for the following responses.
+  std::unique_ptr<HttpGzipEncoder> encoder_;
+  bool encoding_;
+  // What encoder_ puts out, after the room for the chunk size.
+  std::string encoded_buffer_;
+  // The size of the body compressed into encoded_buffer_ being sent.
+  size_t encoded_length_;
+  // encoded_buffer_ ends the body.
+  bool encoding_ended_;
+  base::TimeDelta encoding_time_;
+
+  // The flight led or followed by the request.
+  std::shared_ptr<HttpCollapser::Flight> flight_;
+  bool leading_;
+  // Sending the response of flight_.
+  bool following_;
+  // The request has waited for a flight already.
+  bool collapsed_;
+
+  // The requests following the current one, in the order received.
+  std::deque<PipelinedRequest> pipeline_;
+  std::string pipeline_buffer_;
+  bool pipeline_writing_;
+
   HttpProxySession(const HttpProxySession&) = delete;
   HttpProxySession& operator=(const HttpProxySession&) = delete;
 };
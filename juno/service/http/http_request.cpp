@@ -2,6 +2,7 @@
 
 #include "service/http/http_request.h"
 
+#include <base/logging.h>
 #include <picohttpparser/picohttpparser.h>
 
 #include <string>
@@ -10,6 +11,13 @@ namespace juno {
 namespace service {
 namespace http {
 
+namespace {
+
+// The length of " HTTP/1.x" and CRLF.
+const size_t kVersionLength = 11;
+
+}  // namespace
+
 HttpRequest::HttpRequest() : minor_version_(0) {}
 
 int HttpRequest::Parse(const char* data, size_t length) {
@@ -31,7 +39,7 @@ int HttpRequest::Parse(const char* data, size_t length) {
     path_.assign(path, path_length);
     minor_version_ = minor_version;
 
-    AddHeaders(headers, header_count);
+    AddHeaders(data, result, headers, header_count);
   }
 
   return result;
@@ -44,13 +52,28 @@ void HttpRequest::Clear() {
   ClearHeaders();
 }
 
-void HttpRequest::Serialize(std::string* output) const {
-  char version[12];
-  sprintf_s(version, " HTTP/1.%d\x0D\x0A", minor_version_);
+size_t HttpRequest::GetSerializedSize() const {
+  return method_.size() + 1 + path_.size() + kVersionLength +
+         GetHeadersSize() + 2;
+}
 
-  output->append(method_).append(" ").append(path_).append(version);
-  SerializeHeaders(output);
-  output->append("\x0D\x0A");
+char* HttpRequest::Serialize(char* output) const {
+  DCHECK(0 <= minor_version_ && minor_version_ <= 9);
+
+  output = Append(output, method_.data(), method_.size());
+  *output++ = ' ';
+  output = Append(output, path_.data(), path_.size());
+  output = Append(output, " HTTP/1.", 8);
+  *output++ = static_cast<char>('0' + minor_version_);
+  output = Append(output, "\x0D\x0A", 2);
+  output = SerializeHeaders(output);
+  return Append(output, "\x0D\x0A", 2);
+}
+
+void HttpRequest::Serialize(std::string* output) const {
+  auto offset = output->size();
+  output->resize(offset + GetSerializedSize());
+  Serialize(&(*output)[offset]);
 }
 
 }  // namespace http
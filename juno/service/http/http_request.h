@@ -25,6 +25,14 @@ class HttpRequest : public HttpHeaders {
 
   void Clear();
 
+  // Returns the exact number of bytes Serialize writes.
+  size_t GetSerializedSize() const;
+
+  // Writes the message header to |output|, which must have room for
+  // GetSerializedSize() bytes, and returns the end of what is written.
+  char* Serialize(char* output) const;
+
+  // Appends the message header to |output|.
   void Serialize(std::string* output) const;
 
   const std::string& method() const {
@@ -30,7 +30,7 @@ int HttpResponse::Parse(const char* data, size_t length) {
     status_ = status;
     message_.assign(message, message_length);
 
-    AddHeaders(headers, header_count);
+    AddHeaders(data, result, headers, header_count);
   }
 
   return result;
@@ -43,13 +43,39 @@ void HttpResponse::Clear() {
   ClearHeaders();
 }
 
-void HttpResponse::Serialize(std::string* output) const {
-  char status[14];
-  sprintf_s(status, "HTTP/1.%d %d ", minor_version_, status_);
+size_t HttpResponse::GetSerializedSize() const {
+  auto size = GetStatusLine(minor_version_, status_, message_).size();
+  if (size == 0) {
+    char status[14];
+    size = sprintf_s(status, "HTTP/1.%d %d ", minor_version_, status_) +
+           message_.size() + 2;
+  }
 
-  output->append(status).append(message_).append("\x0D\x0A");
-  SerializeHeaders(output);
-  output->append("\x0D\x0A");
+  return size + GetHeadersSize() + 2;
+}
+
+char* HttpResponse::Serialize(char* output) const {
+  // Most responses have the standard message, of which the status line is
+  // copied as a whole.
+  auto line = GetStatusLine(minor_version_, status_, message_);
+  if (!line.empty()) {
+    output = Append(output, line.data(), line.size());
+  } else {
+    char status[14];
+    auto length = sprintf_s(status, "HTTP/1.%d %d ", minor_version_, status_);
+    output = Append(output, status, length);
+    output = Append(output, message_.data(), message_.size());
+    output = Append(output, "\x0D\x0A", 2);
+  }
+
+  output = SerializeHeaders(output);
+  return Append(output, "\x0D\x0A", 2);
+}
+
+void HttpResponse::Serialize(std::string* output) const {
+  auto offset = output->size();
+  output->resize(offset + GetSerializedSize());
+  Serialize(&(*output)[offset]);
 }
 
 }  // namespace http
@@ -0,0 +1,333 @@
+// Copyright (c) 2017 dacci.org
+
+#include "service/http/http_router.h"
+
+#include <base/logging.h>
+#include <base/strings/string_number_conversions.h>
+
+#include <url/url_canon_ip.h>
+
+#include <algorithm>
+#include <utility>
+
+namespace juno {
+namespace service {
+namespace http {
+namespace {
+
+// Top-level domains are not numeric, so only a name ending with a digit may
+// be an IPv4 address. Single-label names like "build2" end with one as well.
+bool EndsWithDigit(const std::string& text) {
+  return !text.empty() && '0' <= text.back() && text.back() <= '9';
+}
+
+bool ParseIPv4(const std::string& text, uint32_t* address) {
+  unsigned char bytes[4];
+  int components;
+  auto family = url::IPv4AddressToNumber(
+      text.c_str(), url::Component(0, static_cast<int>(text.size())), bytes,
+      &components);
+  if (family != url::CanonHostInfo::IPV4 || components != 4)
+    return false;
+
+  *address = static_cast<uint32_t>(bytes[0]) << 24 | bytes[1] << 16 |
+             bytes[2] << 8 | bytes[3];
+  return true;
+}
+
+// |text| is enclosed in brackets, as GURL keeps it.
+bool ParseIPv6(const std::string& text, std::string* address) {
+  unsigned char bytes[16];
+  if (!url::IPv6AddressToNumber(
+          text.c_str(), url::Component(0, static_cast<int>(text.size())),
+          bytes))
+    return false;
+
+  address->assign(reinterpret_cast<char*>(bytes), sizeof(bytes));
+  return true;
+}
+
+uint32_t MaskIPv4(uint32_t address, int length) {
+  if (length == 0)
+    return 0;
+
+  return address & (0xFFFFFFFF << (32 - length));
+}
+
+void MaskIPv6(std::string* address, int length) {
+  for (auto i = length / 8; i < 16; ++i) {
+    auto bits = length - i * 8;
+    auto mask = bits > 0 ? 0xFF << (8 - bits) : 0;
+    (*address)[i] = static_cast<char>((*address)[i] & mask);
+  }
+}
+
+// Writes to |edge| the key of the child of |node| labeled |label|.
+void MakeEdge(int node, const char* label, size_t length, std::string* edge) {
+  edge->assign(reinterpret_cast<const char*>(&node), sizeof(node));
+  edge->append(label, length);
+}
+
+// Inserts |route| into the table of |length|, keeping the first route of
+// the same prefix.
+template <typename Table, typename Address>
+void InsertPrefix(std::vector<Table>* tables, int length, Address&& address,
+                  int route) {
+  auto table = std::find_if(
+      tables->begin(), tables->end(),
+      [length](const Table& table) { return table.length == length; });
+  if (table == tables->end()) {
+    tables->emplace_back();
+    table = tables->end() - 1;
+    table->length = length;
+  }
+
+  table->routes.emplace(std::forward<Address>(address), route);
+}
+
+}  // namespace
+
+HttpRouter::HttpRouter(const HttpProxyConfig& config) : nodes_(1, -1) {
+  if (config.use_remote_proxy_) {
+    default_route_.action = HttpProxyConfig::RouteAction::kProxy;
+    default_route_.upstreams = GetUpstreams(config, {});
+  }
+
+  for (const auto& route : config.routes_) {
+    auto index = static_cast<int>(routes_.size());
+    const auto& destination = route.destination;
+
+    bool added;
+    uint32_t address;
+    if (destination == "*") {
+      if (nodes_[0] < 0)
+        nodes_[0] = index;
+      added = true;
+    } else if (destination.find_first_of("/:") != std::string::npos ||
+               (EndsWithDigit(destination) &&
+                ParseIPv4(destination, &address))) {
+      added = AddPrefix(destination, index);
+    } else {
+      added = AddDomain(destination, index);
+    }
+
+    if (!added) {
+      LOG(WARNING) << "Invalid route destination: " << destination;
+      continue;
+    }
+
+    routes_.push_back(Route());
+    auto& compiled = routes_.back();
+    compiled.action = route.action;
+    if (route.action == HttpProxyConfig::RouteAction::kProxy)
+      compiled.upstreams = GetUpstreams(config, route.upstreams);
+  }
+
+  auto longer = [](const auto& a, const auto& b) {
+    return a.length > b.length;
+  };
+  std::sort(ipv4_.begin(), ipv4_.end(), longer);
+  std::sort(ipv6_.begin(), ipv6_.end(), longer);
+}
+
+HttpRouter::~HttpRouter() {}
+
+const HttpRouter::Route& HttpRouter::Find(const std::string& host) const {
+  const Route* route = nullptr;
+
+  if (!host.empty() && host[0] == '[') {
+    std::string address;
+    if (!ipv6_.empty() && ParseIPv6(host, &address))
+      route = FindIPv6(address);
+  } else {
+    uint32_t address;
+    if (EndsWithDigit(host) && ParseIPv4(host, &address)) {
+      if (!ipv4_.empty())
+        route = FindIPv4(address);
+    } else {
+      route = FindDomain(host);
+    }
+  }
+
+  if (route != nullptr)
+    return *route;
+
+  if (nodes_[0] >= 0)
+    return routes_[nodes_[0]];
+
+  return default_route_;
+}
+
+std::shared_ptr<const HttpUpstreamGroup> HttpRouter::GetUpstreams(
+    const HttpProxyConfig& config,
+    const std::vector<HttpProxyConfig::Upstream>& upstreams) {
+  std::string key;
+  for (const auto& upstream : upstreams) {
+    key.append(upstream.host);
+    key.append(":" + std::to_string(upstream.port));
+    key.append("*" + std::to_string(upstream.weight));
+    key.push_back(',');
+  }
+
+  auto& group = groups_[key];
+  if (group == nullptr) {
+    if (upstreams.empty())
+      group = std::make_shared<HttpUpstreamGroup>(config);
+    else
+      group = std::make_shared<HttpUpstreamGroup>(upstreams,
+                                                  config.upstream_balance_);
+  }
+
+  return group;
+}
+
+bool HttpRouter::AddDomain(const std::string& domain, int route) {
+  size_t first = 0, last = domain.size();
+
+  // "*.example.com" and ".example.com" are the same as "example.com".
+  if (domain.compare(0, 2, "*.") == 0)
+    first = 2;
+  else if (domain.compare(0, 1, ".") == 0)
+    first = 1;
+
+  if (last > first && domain[last - 1] == '.')
+    --last;
+
+  if (first >= last)
+    return false;
+
+  std::string lower(domain, first, last - first);
+  for (auto& c : lower) {
+    if ('A' <= c && c <= 'Z')
+      c += 'a' - 'A';
+  }
+
+  auto node = 0;
+  std::string edge;
+  for (auto end = lower.size(); end > 0;) {
+    auto dot = lower.rfind('.', end - 1);
+    auto begin = dot == std::string::npos ? 0 : dot + 1;
+    if (begin == end)
+      return false;
+
+    MakeEdge(node, lower.data() + begin, end - begin, &edge);
+    auto& child = edges_[edge];
+    if (child == 0) {
+      child = static_cast<int>(nodes_.size());
+      nodes_.push_back(-1);
+    }
+    node = child;
+
+    if (dot == std::string::npos)
+      break;
+    end = dot;
+  }
+
+  if (nodes_[node] < 0)
+    nodes_[node] = route;
+
+  return true;
+}
+
+bool HttpRouter::AddPrefix(const std::string& prefix, int route) {
+  auto slash = prefix.find('/');
+  std::string address(prefix, 0, slash);
+
+  // The whole address if no length is given.
+  int length = -1;
+  if (slash != std::string::npos &&
+      (!base::StringToInt(prefix.substr(slash + 1), &length) || length < 0))
+    return false;
+
+  if (address.find(':') != std::string::npos) {
+    if (address[0] != '[')
+      address = "[" + address + "]";
+
+    std::string number;
+    if (!ParseIPv6(address, &number))
+      return false;
+
+    if (length < 0)
+      length = 128;
+    else if (length > 128)
+      return false;
+
+    MaskIPv6(&number, length);
+    InsertPrefix(&ipv6_, length, std::move(number), route);
+  } else {
+    uint32_t number;
+    if (!ParseIPv4(address, &number))
+      return false;
+
+    if (length < 0)
+      length = 32;
+    else if (length > 32)
+      return false;
+
+    InsertPrefix(&ipv4_, length, MaskIPv4(number, length), route);
+  }
+
+  return true;
+}
+
+const HttpRouter::Route* HttpRouter::FindDomain(
+    const std::string& host) const {
+  const Route* found = nullptr;
+  auto node = 0;
+
+  // Reused, so that the keys of short labels are not allocated.
+  std::string edge;
+
+  auto end = host.size();
+  if (end > 0 && host[end - 1] == '.')
+    --end;
+
+  while (end > 0) {
+    auto dot = host.rfind('.', end - 1);
+    auto begin = dot == std::string::npos ? 0 : dot + 1;
+
+    MakeEdge(node, host.data() + begin, end - begin, &edge);
+    auto child = edges_.find(edge);
+    if (child == edges_.end())
+      break;
+
+    node = child->second;
+    if (nodes_[node] >= 0)
+      found = &routes_[nodes_[node]];
+
+    if (dot == std::string::npos)
+      break;
+    end = dot;
+  }
+
+  return found;
+}
+
+const HttpRouter::Route* HttpRouter::FindIPv4(uint32_t address) const {
+  for (const auto& table : ipv4_) {
+    auto found = table.routes.find(MaskIPv4(address, table.length));
+    if (found != table.routes.end())
+      return &routes_[found->second];
+  }
+
+  return nullptr;
+}
+
+const HttpRouter::Route* HttpRouter::FindIPv6(
+    const std::string& address) const {
+  std::string masked;
+  for (const auto& table : ipv6_) {
+    masked = address;
+    MaskIPv6(&masked, table.length);
+
+    auto found = table.routes.find(masked);
+    if (found != table.routes.end())
+      return &routes_[found->second];
+  }
+
+  return nullptr;
+}
+
+}  // namespace http
+}  // namespace service
+}  // namespace juno
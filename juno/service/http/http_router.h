@@ -0,0 +1,89 @@
+// Copyright (c) 2017 dacci.org
+
+#ifndef JUNO_SERVICE_HTTP_HTTP_ROUTER_H_
+#define JUNO_SERVICE_HTTP_HTTP_ROUTER_H_
+
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "service/http/http_proxy_config.h"
+#include "service/http/http_upstream_group.h"
+
+namespace juno {
+namespace service {
+namespace http {
+
+// Decides how a request goes to its destination, by the routes of the
+// config compiled into a trie of domain labels, from the top-level one down,
+// and into tables of IP address prefixes by length. Finding the most specific
+// route takes as many lookups as the host has labels, or as there are prefix
+// lengths, however many routes there are.
+// Immutable once built, so it is shared by sessions without locking.
+class HttpRouter {
+ public:
+  struct Route {
+    Route() : action(HttpProxyConfig::RouteAction::kDirect) {}
+
+    HttpProxyConfig::RouteAction action;
+    // The parent proxies, if action is kProxy.
+    std::shared_ptr<const HttpUpstreamGroup> upstreams;
+  };
+
+  explicit HttpRouter(const HttpProxyConfig& config);
+  ~HttpRouter();
+
+  // Returns the route to |host|, canonicalized as by GURL.
+  const Route& Find(const std::string& host) const;
+
+  size_t GetRouteCount() const {
+    return routes_.size();
+  }
+
+ private:
+  // A prefix length, and the routes of the prefixes of that length, masked.
+  template <typename Address>
+  struct PrefixTable {
+    int length;
+    std::unordered_map<Address, int> routes;
+  };
+
+  std::shared_ptr<const HttpUpstreamGroup> GetUpstreams(
+      const HttpProxyConfig& config,
+      const std::vector<HttpProxyConfig::Upstream>& upstreams);
+
+  bool AddDomain(const std::string& domain, int route);
+  bool AddPrefix(const std::string& prefix, int route);
+
+  const Route* FindDomain(const std::string& host) const;
+  const Route* FindIPv4(uint32_t address) const;
+  const Route* FindIPv6(const std::string& address) const;
+
+  std::vector<Route> routes_;
+  Route default_route_;
+
+  // The route of each node of the trie, or -1. The root is 0, matching "*".
+  std::vector<int> nodes_;
+  // The child of a node, keyed by the index of the node followed by the
+  // label, all in one table.
+  std::unordered_map<std::string, int> edges_;
+  // From the longest prefix.
+  std::vector<PrefixTable<uint32_t>> ipv4_;
+  std::vector<PrefixTable<std::string>> ipv6_;
+
+  // Groups of the same parent proxies are shared by the routes.
+  std::unordered_map<std::string, std::shared_ptr<const HttpUpstreamGroup>>
+      groups_;
+
+  HttpRouter(const HttpRouter&) = delete;
+  HttpRouter& operator=(const HttpRouter&) = delete;
+};
+
+}  // namespace http
+}  // namespace service
+}  // namespace juno
+
+#endif  // JUNO_SERVICE_HTTP_HTTP_ROUTER_H_
@@ -0,0 +1,245 @@
+// Copyright (c) 2017 dacci.org
+
+#include "service/http/http_scan.h"
+
+#include <immintrin.h>
+#include <intrin.h>
+
+namespace juno {
+namespace service {
+namespace http {
+namespace http_scan {
+
+namespace {
+
+const size_t kMinVectorLength = 16;
+
+struct Scanner {
+  size_t (*find_char)(const char* data, size_t length, char c);
+  size_t (*find_line_end)(const char* data, size_t length);
+  size_t (*count_hex_digits)(const char* data, size_t length);
+  const char* name;
+};
+
+inline bool IsHexDigit(char c) {
+  return ('0' <= c && c <= '9') || ('A' <= c && c <= 'F') ||
+         ('a' <= c && c <= 'f');
+}
+
+inline size_t FirstBit(unsigned int mask) {
+  unsigned long index;  // NOLINT(runtime/int)
+  _BitScanForward(&index, mask);
+  return index;
+}
+
+// Scalar tails, shared by all the sets.
+
+size_t FindCharTail(const char* data, size_t offset, size_t length, char c) {
+  for (; offset < length; ++offset) {
+    if (data[offset] == c)
+      break;
+  }
+
+  return offset;
+}
+
+size_t FindLineEndTail(const char* data, size_t offset, size_t length) {
+  for (; offset < length; ++offset) {
+    if (data[offset] == '\x0D' || data[offset] == '\x0A')
+      break;
+  }
+
+  return offset;
+}
+
+size_t CountHexDigitsTail(const char* data, size_t offset, size_t length) {
+  for (; offset < length; ++offset) {
+    if (!IsHexDigit(data[offset]))
+      break;
+  }
+
+  return offset;
+}
+
+// SSE2, available on every CPU this runs on.
+
+size_t FindCharSse2(const char* data, size_t length, char c) {
+  auto pattern = _mm_set1_epi8(c);
+  size_t offset = 0;
+
+  for (; offset + 16 <= length; offset += 16) {
+    auto chunk =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + offset));
+    auto mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, pattern));
+    if (mask != 0)
+      return offset + FirstBit(mask);
+  }
+
+  return FindCharTail(data, offset, length, c);
+}
+
+size_t FindLineEndSse2(const char* data, size_t length) {
+  auto cr = _mm_set1_epi8('\x0D');
+  auto lf = _mm_set1_epi8('\x0A');
+  size_t offset = 0;
+
+  for (; offset + 16 <= length; offset += 16) {
+    auto chunk =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + offset));
+    auto mask = _mm_movemask_epi8(
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, cr), _mm_cmpeq_epi8(chunk, lf)));
+    if (mask != 0)
+      return offset + FirstBit(mask);
+  }
+
+  return FindLineEndTail(data, offset, length);
+}
+
+// Returns the bytes of |chunk| which are within |count| from |first|, as
+// unsigned comparison is done with the minimum.
+inline __m128i InRangeSse2(__m128i chunk, char first, char count) {
+  auto shifted = _mm_sub_epi8(chunk, _mm_set1_epi8(first));
+  return _mm_cmpeq_epi8(
+      _mm_min_epu8(shifted, _mm_set1_epi8(count - 1)), shifted);
+}
+
+size_t CountHexDigitsSse2(const char* data, size_t length) {
+  auto lower = _mm_set1_epi8(0x20);
+  size_t offset = 0;
+
+  for (; offset + 16 <= length; offset += 16) {
+    auto chunk =
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + offset));
+    auto hex =
+        _mm_or_si128(InRangeSse2(chunk, '0', 10),
+                     InRangeSse2(_mm_or_si128(chunk, lower), 'a', 6));
+    auto mask = ~_mm_movemask_epi8(hex) & 0xFFFF;
+    if (mask != 0)
+      return offset + FirstBit(mask);
+  }
+
+  return CountHexDigitsTail(data, offset, length);
+}
+
+// AVX2, if both the CPU and the OS support it.
+
+size_t FindCharAvx2(const char* data, size_t length, char c) {
+  auto pattern = _mm256_set1_epi8(c);
+  size_t offset = 0;
+
+  for (; offset + 32 <= length; offset += 32) {
+    auto chunk =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + offset));
+    auto mask = static_cast<unsigned int>(
+        _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, pattern)));
+    if (mask != 0)
+      return offset + FirstBit(mask);
+  }
+
+  return offset + FindCharSse2(data + offset, length - offset, c);
+}
+
+size_t FindLineEndAvx2(const char* data, size_t length) {
+  auto cr = _mm256_set1_epi8('\x0D');
+  auto lf = _mm256_set1_epi8('\x0A');
+  size_t offset = 0;
+
+  for (; offset + 32 <= length; offset += 32) {
+    auto chunk =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + offset));
+    auto mask = static_cast<unsigned int>(_mm256_movemask_epi8(_mm256_or_si256(
+        _mm256_cmpeq_epi8(chunk, cr), _mm256_cmpeq_epi8(chunk, lf))));
+    if (mask != 0)
+      return offset + FirstBit(mask);
+  }
+
+  return offset + FindLineEndSse2(data + offset, length - offset);
+}
+
+inline __m256i InRangeAvx2(__m256i chunk, char first, char count) {
+  auto shifted = _mm256_sub_epi8(chunk, _mm256_set1_epi8(first));
+  return _mm256_cmpeq_epi8(
+      _mm256_min_epu8(shifted, _mm256_set1_epi8(count - 1)), shifted);
+}
+
+size_t CountHexDigitsAvx2(const char* data, size_t length) {
+  auto lower = _mm256_set1_epi8(0x20);
+  size_t offset = 0;
+
+  for (; offset + 32 <= length; offset += 32) {
+    auto chunk =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + offset));
+    auto hex =
+        _mm256_or_si256(InRangeAvx2(chunk, '0', 10),
+                        InRangeAvx2(_mm256_or_si256(chunk, lower), 'a', 6));
+    auto mask = ~static_cast<unsigned int>(_mm256_movemask_epi8(hex));
+    if (mask != 0)
+      return offset + FirstBit(mask);
+  }
+
+  return offset + CountHexDigitsSse2(data + offset, length - offset);
+}
+
+bool IsAvx2Supported() {
+  int info[4];
+  __cpuid(info, 0);
+  if (info[0] < 7)
+    return false;
+
+  // The OS must save the YMM registers.
+  __cpuid(info, 1);
+  const int kOsXsave = 1 << 27;
+  const int kAvx = 1 << 28;
+  if ((info[2] & kOsXsave) == 0 || (info[2] & kAvx) == 0 ||
+      (_xgetbv(0) & 6) != 6)
+    return false;
+
+  __cpuidex(info, 7, 0);
+  const int kAvx2 = 1 << 5;
+  return (info[1] & kAvx2) != 0;
+}
+
+const Scanner& GetScanner() {
+  static const Scanner kSse2 = {FindCharSse2, FindLineEndSse2,
+                                CountHexDigitsSse2, "SSE2"};
+  static const Scanner kAvx2 = {FindCharAvx2, FindLineEndAvx2,
+                                CountHexDigitsAvx2, "AVX2"};
+  static const Scanner& scanner = IsAvx2Supported() ? kAvx2 : kSse2;
+
+  return scanner;
+}
+
+}  // namespace
+
+// Most header values and chunk-size lines are shorter than a vector, which
+// are scanned without the indirect call.
+
+size_t FindChar(const char* data, size_t length, char c) {
+  if (length < kMinVectorLength)
+    return FindCharTail(data, 0, length, c);
+
+  return GetScanner().find_char(data, length, c);
+}
+
+size_t FindLineEnd(const char* data, size_t length) {
+  if (length < kMinVectorLength)
+    return FindLineEndTail(data, 0, length);
+
+  return GetScanner().find_line_end(data, length);
+}
+
+size_t CountHexDigits(const char* data, size_t length) {
+  if (length < kMinVectorLength)
+    return CountHexDigitsTail(data, 0, length);
+
+  return GetScanner().count_hex_digits(data, length);
+}
+
+const char* GetInstructionSet() {
+  return GetScanner().name;
+}
+
+}  // namespace http_scan
+}  // namespace http
+}  // namespace service
+}  // namespace juno
@@ -0,0 +1,34 @@
+// Copyright (c) 2017 dacci.org
+
+#ifndef JUNO_SERVICE_HTTP_HTTP_SCAN_H_
+#define JUNO_SERVICE_HTTP_HTTP_SCAN_H_
+
+#include <stddef.h>
+
+namespace juno {
+namespace service {
+namespace http {
+namespace http_scan {
+
+// Byte scanners for the parsing hot paths. They use AVX2 or SSE2, whichever
+// the CPU supports best, chosen once at the first call.
+
+// Returns the offset of the first |c| in |length| bytes at |data|, or
+// |length| if not found.
+size_t FindChar(const char* data, size_t length, char c);
+
+// Returns the offset of the first CR or LF, or |length| if not found.
+size_t FindLineEnd(const char* data, size_t length);
+
+// Returns the number of hexadecimal digits at the start of |data|.
+size_t CountHexDigits(const char* data, size_t length);
+
+// Returns the name of the instruction set in use.
+const char* GetInstructionSet();
+
+}  // namespace http_scan
+}  // namespace http
+}  // namespace service
+}  // namespace juno
+
+#endif  // JUNO_SERVICE_HTTP_HTTP_SCAN_H_
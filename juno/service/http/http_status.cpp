@@ -2,6 +2,11 @@
 
 #include "service/http/http_status.h"
 
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
 namespace juno {
 namespace service {
 namespace http {
@@ -83,6 +88,32 @@ STATUS_MESSAGE http_status_messages[] = {
 };
 // clang-format on
 
+const int kMinStatus = 100;
+const int kMaxStatus = 599;
+const int kStatusCount = kMaxStatus - kMinStatus + 1;
+
+// The length of "HTTP/1.x NNN ".
+const size_t kStatusPrefixLength = 13;
+
+// The status lines of HTTP/1.0 followed by those of HTTP/1.1, indexed by
+// the status code.
+std::vector<std::string> BuildStatusLines() {
+  std::vector<std::string> lines(kStatusCount * 2);
+
+  for (auto entry = http_status_messages; entry->status; ++entry) {
+    for (auto minor_version = 0; minor_version <= 1; ++minor_version) {
+      char prefix[kStatusPrefixLength + 1];
+      sprintf_s(prefix, "HTTP/1.%d %d ", minor_version, entry->status);
+
+      auto& line =
+          lines[minor_version * kStatusCount + entry->status - kMinStatus];
+      line.assign(prefix).append(entry->message).append("\x0D\x0A");
+    }
+  }
+
+  return lines;
+}
+
 }  // namespace
 
 const char* GetStatusMessage(StatusCode status) {
@@ -98,6 +129,24 @@ const char* GetStatusMessage(StatusCode status) {
   return entry->message;
 }
 
+base::StringPiece GetStatusLine(int minor_version, int status,
+                                base::StringPiece message) {
+  if (minor_version < 0 || 1 < minor_version || status < kMinStatus ||
+      kMaxStatus < status)
+    return base::StringPiece();
+
+  static const std::vector<std::string> lines = BuildStatusLines();
+
+  auto& line = lines[minor_version * kStatusCount + status - kMinStatus];
+  if (line.empty() ||
+      line.size() - kStatusPrefixLength - 2 != message.size() ||
+      line.compare(kStatusPrefixLength, message.size(), message.data(),
+                   message.size()) != 0)
+    return base::StringPiece();
+
+  return line;
+}
+
 }  // namespace http
 }  // namespace service
 }  // namespace juno
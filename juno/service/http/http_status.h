@@ -3,6 +3,8 @@
 #ifndef JUNO_SERVICE_HTTP_HTTP_STATUS_H_
 #define JUNO_SERVICE_HTTP_HTTP_STATUS_H_
 
+#include <base/strings/string_piece.h>
+
 namespace juno {
 namespace service {
 namespace http {
@@ -77,6 +79,13 @@ enum StatusCode {
 
 const char* GetStatusMessage(StatusCode status);
 
+// Returns the status line, "HTTP/1.x NNN Message" and CRLF, built once for
+// the known status with its standard message. Returns an empty one if either
+// of |status| or |message| is not standard, or |minor_version| is neither 0
+// nor 1.
+base::StringPiece GetStatusLine(int minor_version, int status,
+                                base::StringPiece message);
+
 }  // namespace http
 }  // namespace service
 }  // namespace juno
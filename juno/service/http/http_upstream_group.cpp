@@ -0,0 +1,475 @@
+// Copyright (c) 2017 dacci.org
+
+#include "service/http/http_upstream_group.h"
+
+#include <base/logging.h>
+#include <base/values.h>
+
+#include <algorithm>
+#include <unordered_map>
+#include <utility>
+
+#include "io/net/socket_channel.h"
+#include "io/net/socket_resolver.h"
+#include "misc/timer_service.h"
+
+namespace juno {
+namespace service {
+namespace http {
+
+using ::juno::io::net::SocketChannel;
+using ::juno::io::net::SocketResolver;
+
+namespace {
+
+// Weight of the latest sample in the latency average.
+const double kLatencyAlpha = 0.2;
+
+// Taken as the latency of members not measured yet, if none is.
+const double kSeedLatency = 100.0;  // msec
+
+std::string MakeKey(const std::string& host, int port) {
+  return host + ":" + std::to_string(port);
+}
+
+}  // namespace
+
+// Keeps all the members, and probes those down or idle with a connection, so
+// that one recovered is put back without waiting for a request to fail on it.
+class HttpUpstreamGroup::Checker : private SocketChannel::Listener,
+                                   private misc::TimerService::Callback {
+ public:
+  Checker() {}
+  ~Checker();
+
+  HRESULT Start();
+
+  std::shared_ptr<Member> GetMember(const std::string& host, int port);
+  void GetStatistics(base::DictionaryValue* stats);
+
+ private:
+  static const DWORD kCheckInterval = 5 * 1000;  // 5 sec
+
+  struct Probe {
+    std::shared_ptr<Member> member;
+    // Read by socket while connecting, so destroyed after it.
+    std::unique_ptr<SocketResolver> resolver;
+    std::shared_ptr<SocketChannel> socket;
+  };
+
+  void StartProbe(const std::shared_ptr<Member>& member);
+
+  void OnTimeout() override;
+
+  void OnConnected(SocketChannel* socket, HRESULT result) override;
+  void OnClosed(SocketChannel* /*socket*/, HRESULT /*result*/) override {}
+
+  base::Lock lock_;
+  std::unordered_map<std::string, std::weak_ptr<Member>> members_;
+  std::unordered_map<SocketChannel*, Probe> probes_;
+
+  // Probes done. They are destroyed on the next check, since a socket cannot
+  // be destroyed from its own callback.
+  std::vector<Probe> closed_;
+
+  std::unique_ptr<misc::TimerService::Timer> timer_;
+
+  Checker(const Checker&) = delete;
+  Checker& operator=(const Checker&) = delete;
+};
+
+HttpUpstreamGroup::Checker::~Checker() {
+  timer_.reset();
+
+  std::vector<Probe> probes;
+
+  {
+    base::AutoLock guard(lock_);
+
+    probes.swap(closed_);
+    for (auto& pair : probes_)
+      probes.push_back(std::move(pair.second));
+    probes_.clear();
+  }
+
+  for (auto& probe : probes)
+    probe.socket->Close();
+
+  // Destroying a socket calls back OnClosed, so the lock must not be held.
+  // Each socket is destroyed before its resolver.
+  probes.clear();
+}
+
+HRESULT HttpUpstreamGroup::Checker::Start() {
+  timer_ = misc::TimerService::GetDefault()->Create(this);
+  if (timer_ == nullptr) {
+    LOG(ERROR) << "Failed to create timer.";
+    return E_OUTOFMEMORY;
+  }
+
+  timer_->Start(kCheckInterval, kCheckInterval);
+
+  return S_OK;
+}
+
+std::shared_ptr<HttpUpstreamGroup::Member>
+HttpUpstreamGroup::Checker::GetMember(const std::string& host, int port) {
+  base::AutoLock guard(lock_);
+
+  auto& entry = members_[MakeKey(host, port)];
+  auto member = entry.lock();
+  if (member == nullptr) {
+    member = std::make_shared<Member>(host, port);
+    entry = member;
+  }
+
+  return member;
+}
+
+void HttpUpstreamGroup::Checker::GetStatistics(base::DictionaryValue* stats) {
+  base::AutoLock guard(lock_);
+
+  for (const auto& pair : members_) {
+    auto member = pair.second.lock();
+    if (member == nullptr)
+      continue;
+
+    auto member_stats = std::make_unique<base::DictionaryValue>();
+    if (member_stats == nullptr)
+      continue;
+
+    member->GetStatistics(member_stats.get());
+    stats->SetWithoutPathExpansion(pair.first, std::move(member_stats));
+  }
+}
+
+void HttpUpstreamGroup::Checker::StartProbe(
+    const std::shared_ptr<Member>& member) {
+  Probe probe;
+  probe.member = member;
+
+  probe.resolver = std::make_unique<SocketResolver>();
+  probe.socket = std::make_shared<SocketChannel>();
+  if (probe.resolver == nullptr || probe.socket == nullptr)
+    return;
+
+  auto result = probe.resolver->Resolve(member->host(), member->port());
+  if (FAILED(result)) {
+    DLOG(WARNING) << "Failed to resolve " << member->host() << ": 0x"
+                  << std::hex << result;
+    member->OnChecked(false);
+    return;
+  }
+
+  auto socket = probe.socket.get();
+  auto end_point = probe.resolver->begin()->get();
+
+  {
+    base::AutoLock guard(lock_);
+    probes_.emplace(socket, std::move(probe));
+  }
+
+  result = socket->ConnectAsync(end_point, this);
+  if (FAILED(result))
+    OnConnected(socket, result);
+}
+
+void HttpUpstreamGroup::Checker::OnTimeout() {
+  std::vector<Probe> probes;
+  std::vector<std::shared_ptr<Member>> failed;
+  std::vector<std::shared_ptr<Member>> checking;
+
+  {
+    base::AutoLock guard(lock_);
+
+    probes.swap(closed_);
+
+    // Probes not connected by now are taken as failed.
+    for (auto& pair : probes_) {
+      failed.push_back(std::move(pair.second.member));
+      probes.push_back(std::move(pair.second));
+    }
+    probes_.clear();
+
+    for (auto i = members_.begin(), l = members_.end(); i != l;) {
+      auto member = i->second.lock();
+      if (member == nullptr) {
+        i = members_.erase(i);
+        continue;
+      }
+
+      if (member->NeedsCheck())
+        checking.push_back(std::move(member));
+      ++i;
+    }
+  }
+
+  for (auto& member : failed)
+    member->OnChecked(false);
+
+  for (auto& probe : probes)
+    probe.socket->Close();
+  probes.clear();
+
+  // Resolving takes time, so the lock is not held.
+  for (auto& member : checking)
+    StartProbe(member);
+}
+
+void HttpUpstreamGroup::Checker::OnConnected(SocketChannel* socket,
+                                             HRESULT result) {
+  std::shared_ptr<Member> member;
+
+  {
+    base::AutoLock guard(lock_);
+
+    auto found = probes_.find(socket);
+    if (found == probes_.end())
+      return;
+
+    member = std::move(found->second.member);
+    closed_.push_back(std::move(found->second));
+    probes_.erase(found);
+  }
+
+  socket->Close();
+  member->OnChecked(SUCCEEDED(result));
+}
+
+HttpUpstreamGroup::Member::Member(const std::string& host, int port)
+    : host_(host),
+      port_(port),
+      outstanding_(0),
+      latency_(0.0),
+      failures_(0),
+      up_(true),
+      used_(false),
+      requests_(0),
+      errors_(0),
+      connect_errors_(0),
+      failed_checks_(0) {}
+
+void HttpUpstreamGroup::Member::OnStarted() {
+  base::AutoLock guard(lock_);
+
+  ++outstanding_;
+  ++requests_;
+  used_ = true;
+}
+
+void HttpUpstreamGroup::Member::OnEnded(Result result,
+                                        base::TimeDelta latency) {
+  base::AutoLock guard(lock_);
+
+  --outstanding_;
+
+  switch (result) {
+    case Result::kSucceeded: {
+      auto sample = latency.InMillisecondsF();
+      if (latency_ == 0.0)
+        latency_ = sample;
+      else
+        latency_ += (sample - latency_) * kLatencyAlpha;
+
+      failures_ = 0;
+      up_ = true;
+      break;
+    }
+
+    case Result::kConnectFailed:
+      ++connect_errors_;
+      // Fall through.
+
+    case Result::kFailed:
+      ++errors_;
+      if (++failures_ >= kMaxFailures && up_) {
+        LOG(WARNING) << "Upstream " << host_ << ":" << port_ << " is down.";
+        up_ = false;
+      }
+      break;
+
+    case Result::kCancelled:
+      break;
+  }
+}
+
+double HttpUpstreamGroup::Member::GetLoad(
+    HttpProxyConfig::UpstreamBalance balance, double seed, bool* up) const {
+  base::AutoLock guard(lock_);
+
+  *up = up_;
+
+  // Counts the request to be sent as well, so that idle members still differ
+  // by weight.
+  auto requests = outstanding_ + 1.0;
+  if (balance == HttpProxyConfig::UpstreamBalance::kLatency)
+    return (latency_ == 0.0 ? seed : latency_) * requests;
+  else
+    return requests;
+}
+
+double HttpUpstreamGroup::Member::GetLatency() const {
+  base::AutoLock guard(lock_);
+  return latency_;
+}
+
+bool HttpUpstreamGroup::Member::NeedsCheck() {
+  base::AutoLock guard(lock_);
+
+  auto needed = !up_ || (!used_ && outstanding_ == 0);
+  used_ = false;
+
+  return needed;
+}
+
+void HttpUpstreamGroup::Member::OnChecked(bool succeeded) {
+  base::AutoLock guard(lock_);
+
+  if (succeeded) {
+    if (!up_)
+      LOG(INFO) << "Upstream " << host_ << ":" << port_ << " is up.";
+
+    failures_ = 0;
+    up_ = true;
+  } else {
+    ++failed_checks_;
+
+    // As many in a row as failed requests take it down, so that a check
+    // lost once does not take an idle member down.
+    if (++failures_ >= kMaxFailures && up_) {
+      LOG(WARNING) << "Upstream " << host_ << ":" << port_ << " is down.";
+      up_ = false;
+    }
+  }
+}
+
+void HttpUpstreamGroup::Member::GetStatistics(
+    base::DictionaryValue* stats) const {
+  base::AutoLock guard(lock_);
+
+  stats->SetBoolean("up", up_);
+  stats->SetInteger("outstanding", outstanding_);
+  stats->SetDouble("latency_ms", latency_);
+  stats->SetDouble("requests", static_cast<double>(requests_));
+  stats->SetDouble("errors", static_cast<double>(errors_));
+  stats->SetDouble("connect_errors", static_cast<double>(connect_errors_));
+  stats->SetDouble("failed_checks", static_cast<double>(failed_checks_));
+}
+
+HttpUpstreamGroup::Checker* HttpUpstreamGroup::checker_ = nullptr;
+
+HttpUpstreamGroup::HttpUpstreamGroup(const HttpProxyConfig& config)
+    : balance_(config.upstream_balance_), next_(0) {
+  if (config.upstreams_.empty()) {
+    members_.push_back({GetMember(config.remote_proxy_host_,
+                                  config.remote_proxy_port_),
+                        1});
+    return;
+  }
+
+  for (const auto& upstream : config.upstreams_) {
+    members_.push_back({GetMember(upstream.host, upstream.port),
+                        std::max(upstream.weight, 1)});
+  }
+}
+
+HttpUpstreamGroup::HttpUpstreamGroup(
+    const std::vector<HttpProxyConfig::Upstream>& upstreams,
+    HttpProxyConfig::UpstreamBalance balance)
+    : balance_(balance), next_(0) {
+  for (const auto& upstream : upstreams) {
+    members_.push_back({GetMember(upstream.host, upstream.port),
+                        std::max(upstream.weight, 1)});
+  }
+}
+
+HttpUpstreamGroup::~HttpUpstreamGroup() {}
+
+std::shared_ptr<HttpUpstreamGroup::Member> HttpUpstreamGroup::Select(
+    const std::vector<Member*>& tried) const {
+  auto count = members_.size();
+  auto start = next_++;
+
+  // A member not measured yet would have no load at all, and take all the
+  // requests until its first response. It is taken as the mean of the
+  // members measured instead.
+  auto seed = kSeedLatency;
+  if (balance_ == HttpProxyConfig::UpstreamBalance::kLatency) {
+    auto total = 0.0;
+    auto measured = 0;
+    for (const auto& entry : members_) {
+      auto latency = entry.member->GetLatency();
+      if (latency > 0.0) {
+        total += latency;
+        ++measured;
+      }
+    }
+
+    if (measured > 0)
+      seed = total / measured;
+  }
+
+  const Entry* selected = nullptr;
+  auto selected_load = 0.0;
+  auto selected_up = false;
+
+  for (size_t i = 0; i < count; ++i) {
+    const auto& entry = members_[(start + i) % count];
+    if (std::find(tried.begin(), tried.end(), entry.member.get()) !=
+        tried.end())
+      continue;
+
+    bool up;
+    auto load = entry.member->GetLoad(balance_, seed, &up) / entry.weight;
+
+    if (selected == nullptr || (up && !selected_up) ||
+        (up == selected_up && load < selected_load)) {
+      selected = &entry;
+      selected_load = load;
+      selected_up = up;
+    }
+  }
+
+  if (selected == nullptr)
+    return nullptr;
+
+  return selected->member;
+}
+
+HRESULT HttpUpstreamGroup::Init() {
+  Term();
+
+  checker_ = new Checker();
+  if (checker_ == nullptr)
+    return E_OUTOFMEMORY;
+
+  auto result = checker_->Start();
+  if (FAILED(result))
+    Term();
+
+  return result;
+}
+
+void HttpUpstreamGroup::Term() {
+  if (checker_ != nullptr) {
+    delete checker_;
+    checker_ = nullptr;
+  }
+}
+
+void HttpUpstreamGroup::GetStatistics(base::DictionaryValue* stats) {
+  if (checker_ != nullptr)
+    checker_->GetStatistics(stats);
+}
+
+std::shared_ptr<HttpUpstreamGroup::Member> HttpUpstreamGroup::GetMember(
+    const std::string& host, int port) {
+  if (checker_ == nullptr)
+    return std::make_shared<Member>(host, port);
+
+  return checker_->GetMember(host, port);
+}
+
+}  // namespace http
+}  // namespace service
+}  // namespace juno
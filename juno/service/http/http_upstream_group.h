@@ -0,0 +1,144 @@
+// Copyright (c) 2017 dacci.org
+
+#ifndef JUNO_SERVICE_HTTP_HTTP_UPSTREAM_GROUP_H_
+#define JUNO_SERVICE_HTTP_HTTP_UPSTREAM_GROUP_H_
+
+#include <windows.h>
+
+#include <base/synchronization/lock.h>
+#include <base/time/time.h>
+
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "service/http/http_proxy_config.h"
+
+namespace base {
+
+class DictionaryValue;
+
+}  // namespace base
+
+namespace juno {
+namespace service {
+namespace http {
+
+// Balances the requests of an HTTP proxy over its parent proxies, picking the
+// least loaded of those up, either by outstanding requests or by latency,
+// divided by the weight.
+// A parent proxy is taken down after failing several requests or checks in a
+// row, and taken up again once it accepts a connection. Members are shared
+// by all the groups naming the same parent proxy, and checked in the
+// background while down or idle.
+class HttpUpstreamGroup {
+ public:
+  class Member {
+   public:
+    enum class Result {
+      kSucceeded,
+      // The member failed the request, before or after connected.
+      kFailed,
+      kConnectFailed,
+      // The request ended for another reason.
+      kCancelled,
+    };
+
+    Member(const std::string& host, int port);
+
+    // A request is sent to the member.
+    void OnStarted();
+    // The request ended with |result|, the response header received in
+    // |latency| since it started if succeeded.
+    void OnEnded(Result result, base::TimeDelta latency);
+
+    const std::string& host() const {
+      return host_;
+    }
+
+    int port() const {
+      return port_;
+    }
+
+   private:
+    friend class HttpUpstreamGroup;
+
+    static const int kMaxFailures = 3;
+
+    // Returns the load by |balance|, setting |up| to whether the member is.
+    // The latency is taken as |seed| until measured.
+    double GetLoad(HttpProxyConfig::UpstreamBalance balance, double seed,
+                   bool* up) const;
+    // Returns 0 until measured.
+    double GetLatency() const;
+    // Returns true if the member needs checking, clearing the usage.
+    bool NeedsCheck();
+    void OnChecked(bool succeeded);
+    void GetStatistics(base::DictionaryValue* stats) const;
+
+    const std::string host_;
+    const int port_;
+
+    mutable base::Lock lock_;
+    int outstanding_;
+    // The exponentially weighted moving average, 0 until measured.
+    double latency_;  // msec
+    // Requests or checks failed in a row.
+    int failures_;
+    bool up_;
+    // Used since the last check.
+    bool used_;
+
+    uint64_t requests_;
+    uint64_t errors_;
+    uint64_t connect_errors_;
+    uint64_t failed_checks_;
+
+    Member(const Member&) = delete;
+    Member& operator=(const Member&) = delete;
+  };
+
+  // Of the remote proxy in |config|.
+  explicit HttpUpstreamGroup(const HttpProxyConfig& config);
+  HttpUpstreamGroup(const std::vector<HttpProxyConfig::Upstream>& upstreams,
+                    HttpProxyConfig::UpstreamBalance balance);
+  ~HttpUpstreamGroup();
+
+  // Returns the member to send a request to, other than those |tried|, or
+  // nullptr if none is left. Members down are picked only if all are.
+  std::shared_ptr<Member> Select(const std::vector<Member*>& tried) const;
+
+  static HRESULT Init();
+  static void Term();
+
+  static void GetStatistics(base::DictionaryValue* stats);
+
+ private:
+  class Checker;
+
+  struct Entry {
+    std::shared_ptr<Member> member;
+    int weight;
+  };
+
+  static std::shared_ptr<Member> GetMember(const std::string& host, int port);
+
+  static Checker* checker_;
+
+  std::vector<Entry> members_;
+  HttpProxyConfig::UpstreamBalance balance_;
+  // Rotates the first of the members equally loaded.
+  mutable std::atomic<size_t> next_;
+
+  HttpUpstreamGroup(const HttpUpstreamGroup&) = delete;
+  HttpUpstreamGroup& operator=(const HttpUpstreamGroup&) = delete;
+};
+
+}  // namespace http
+}  // namespace service
+}  // namespace juno
+
+#endif  // JUNO_SERVICE_HTTP_HTTP_UPSTREAM_GROUP_H_
@@ -3,21 +3,30 @@
 #include "service/http/http_util.h"
 
 #include <stdlib.h>
+#include <string.h>
 
 #include <string>
 
+#include "service/http/http_scan.h"
+
 namespace juno {
 namespace service {
 namespace http {
 
+const std::string kAcceptEncoding("Accept-Encoding");
+const std::string kCacheControl("Cache-Control");
 const std::string kConnection("Connection");
+const std::string kContentEncoding("Content-Encoding");
 const std::string kContentLength("Content-Length");
+const std::string kContentType("Content-Type");
+const std::string kETag("ETag");
 const std::string kExpect("Expect");
 const std::string kKeepAlive("Keep-Alive");
 const std::string kProxyAuthenticate("Proxy-Authenticate");
 const std::string kProxyAuthorization("Proxy-Authorization");
 const std::string kProxyConnection("Proxy-Connection");
 const std::string kTransferEncoding("Transfer-Encoding");
+const std::string kVary("Vary");
 
 namespace http_util {
 
@@ -32,105 +41,25 @@ int64_t GetContentLength(const HttpHeaders& headers) {
     return -1;
 }
 
-int64_t ParseChunk(const std::string& buffer, int64_t* chunk_size) {
-  if (buffer.empty())
-    return -2;
-
-  auto start = const_cast<char*>(buffer.c_str());
-  auto end = start;
-  *chunk_size = _strtoi64(start, &end, 16);
-
-  if (*end == '\0')
-    return -2;
-  if (*end == '\x0D')
-    ++end;
-
-  if (*end == '\0')
-    return -2;
-  if (*end != '\x0A')
-    return -1;
-
-  if (*++end == '\0')
-    return -2;
-
-  auto length = *chunk_size + (end - start);
-  if (buffer.size() < static_cast<size_t>(length))
-    return -2;
-
-  end = start + length;
-
-  if (*end == '\0')
-    return -2;
-  if (*end == '\x0D')
-    ++end;
-
-  if (*end == '\0')
-    return -2;
-  if (*end != '\x0A')
-    return -1;
-
-  ++end;
-
-  return end - start;
-}
-
-int64_t MergeChunks(std::string* buffer, int64_t length) {
-  auto merged = length;
-  auto offset = 0LL;
-
-  for (auto left = &(*buffer)[0]; offset < merged;) {
-    char* right;
-    auto chunk_length = _strtoi64(left, &right, 16);
-    if (*right == '\x0D')
-      ++right;
-    if (*right == '\x0A')
-      ++right;
-    else
-      return -1;
-
-    auto purge = right - left;
-    buffer->erase(static_cast<size_t>(offset), purge);
-    merged -= purge;
-
-    offset += chunk_length;
-    left += chunk_length;
-
-    right = left;
-    if (*right == '\x0D')
-      ++right;
-    if (*right == '\x0A')
-      ++right;
-    else
-      return -1;
-
-    purge = right - left;
-    buffer->erase(static_cast<size_t>(offset), purge);
-    merged -= purge;
-  }
-
-  return merged;
-}
-
 bool ProcessHopByHopHeaders(HttpHeaders* headers) {
   auto has_close = false;
 
   if (headers->HeaderExists(kConnection)) {
-    auto& connection = headers->GetHeader(kConnection);
+    // Copied, as removing the headers nominated moves the fields.
+    auto connection = headers->GetHeader(kConnection);
     size_t start = 0;
 
-    while (true) {
-      auto end = connection.find_first_of(',', start);
-      auto length = std::string::npos;
-      if (end != std::string::npos)
-        length = end - start;
+    while (start < connection.size()) {
+      auto end = start + http_scan::FindChar(connection.data() + start,
+                                             connection.size() - start, ',');
 
-      auto token = connection.substr(start, length);
+      auto token = connection.substr(start, end - start);
       if (_stricmp(token.c_str(), "close") == 0)
         has_close = true;
       else
         headers->RemoveHeader(token);
 
-      if (end == std::string::npos)
+      if (end == connection.size())
         break;
 
       start = connection.find_first_not_of(" \t", end + 1);
@@ -149,6 +78,73 @@ bool ProcessHopByHopHeaders(HttpHeaders* headers) {
   return has_close;
 }
 
+bool HasElement(const HttpHeaders& headers, const std::string& name,
+                const char* token) {
+  auto found = false;
+
+  for (auto& value : headers.GetAllHeaders(name)) {
+    ForEachElement(value, [&](const std::string& element) {
+      auto name = element.substr(0, element.find('='));
+      if (_stricmp(name.c_str(), token) == 0)
+        found = true;
+    });
+  }
+
+  return found;
+}
+
+bool AcceptsEncoding(const HttpHeaders& headers, const char* coding) {
+  // The quality of |coding| and of any other, or -1 if not given.
+  double quality = -1.0, any = -1.0;
+
+  for (auto& value : headers.GetAllHeaders(kAcceptEncoding)) {
+    ForEachElement(value, [&](const std::string& element) {
+      auto end = element.find(';');
+      auto name = element.substr(0, element.find_last_not_of(" \t", end - 1) +
+                                        1);
+
+      auto weight = 1.0;
+      if (end != std::string::npos) {
+        auto parameter = element.find_first_not_of(" \t", end + 1);
+        if (parameter != std::string::npos &&
+            _strnicmp(element.c_str() + parameter, "q=", 2) == 0)
+          weight = strtod(element.c_str() + parameter + 2, nullptr);
+      }
+
+      if (_stricmp(name.c_str(), coding) == 0)
+        quality = weight;
+      else if (name == "*")
+        any = weight;
+    });
+  }
+
+  return quality >= 0.0 ? quality > 0.0 : any > 0.0;
+}
+
+bool MatchMediaType(const std::string& content_type,
+                    const std::vector<std::string>& types) {
+  auto end = content_type.find(';');
+  auto first = content_type.find_first_not_of(" \t");
+  auto last = content_type.find_last_not_of(" \t", end - 1);
+  if (first == std::string::npos || last == std::string::npos || last < first)
+    return false;
+
+  auto type = content_type.substr(first, last - first + 1);
+
+  for (auto& pattern : types) {
+    if (pattern.size() > 2 &&
+        pattern.compare(pattern.size() - 2, 2, "/*") == 0) {
+      if (type.size() > pattern.size() - 1 &&
+          _strnicmp(type.c_str(), pattern.c_str(), pattern.size() - 1) == 0)
+        return true;
+    } else if (_stricmp(type.c_str(), pattern.c_str()) == 0) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
 }  // namespace http_util
 }  // namespace http
 }  // namespace service
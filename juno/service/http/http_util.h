@@ -6,6 +6,7 @@
 #include <stdint.h>
 
 #include <string>
+#include <vector>
 
 #include "service/http/http_headers.h"
 
@@ -13,14 +14,20 @@ namespace juno {
 namespace service {
 namespace http {
 
+extern const std::string kAcceptEncoding;
+extern const std::string kCacheControl;
 extern const std::string kConnection;
+extern const std::string kContentEncoding;
 extern const std::string kContentLength;
+extern const std::string kContentType;
+extern const std::string kETag;
 extern const std::string kExpect;
 extern const std::string kKeepAlive;
 extern const std::string kProxyAuthenticate;
 extern const std::string kProxyAuthorization;
 extern const std::string kProxyConnection;
 extern const std::string kTransferEncoding;
+extern const std::string kVary;
 
 namespace http_util {
 
@@ -28,13 +35,40 @@ namespace http_util {
 // -2 if the message is chunked or -1 if unknown.
 int64_t GetContentLength(const HttpHeaders& headers);
 
-// returns the size of chunk-size + chunk-data if successful,
-// -2 if the chunk is partial or -1 on error.
-int64_t ParseChunk(const std::string& buffer, int64_t* chunk_size);
+bool ProcessHopByHopHeaders(HttpHeaders* headers);
 
-int64_t MergeChunks(std::string* buffer, int64_t length);
+// Calls |function| with each element of the comma separated list |value|,
+// stripped of surrounding whitespace.
+template <class Function>
+void ForEachElement(const std::string& value, Function function) {
+  size_t start = 0;
 
-bool ProcessHopByHopHeaders(HttpHeaders* headers);
+  while (start < value.size()) {
+    auto end = value.find(',', start);
+    if (end == std::string::npos)
+      end = value.size();
+
+    auto first = value.find_first_not_of(" \t", start);
+    auto last = value.find_last_not_of(" \t", end - 1);
+    if (first != std::string::npos && first < end && last >= first)
+      function(value.substr(first, last - first + 1));
+
+    start = end + 1;
+  }
+}
+
+// Returns true if the element |token| is in any of the |name| headers.
+bool HasElement(const HttpHeaders& headers, const std::string& name,
+                const char* token);
+
+// Returns true if the request |headers| accept the content |coding| by
+// Accept-Encoding, RFC 9110 12.5.3.
+bool AcceptsEncoding(const HttpHeaders& headers, const char* coding);
+
+// Returns true if the media type of |content_type| is one of |types|, each
+// either type/subtype or type/*.
+bool MatchMediaType(const std::string& content_type,
+                    const std::vector<std::string>& types);
 
 }  // namespace http_util
 }  // namespace http
@@ -3,7 +3,9 @@
 #include "service/scissors/scissors.h"
 
 #include <base/logging.h>
+#include <base/values.h>
 
+#include <algorithm>
 #include <memory>
 
 #include "io/net/datagram.h"
@@ -19,8 +21,73 @@ namespace juno {
 namespace service {
 namespace scissors {
 
+using ::juno::io::net::SocketChannel;
+
+class Scissors::WarmChannel : public SocketChannel::Listener,
+                              public io::Channel::Listener {
+ public:
+  explicit WarmChannel(Scissors* service) : service_(service), ready_(0) {}
+
+  HRESULT Start() {
+    auto socket = std::make_unique<SocketChannel>();
+    if (socket == nullptr)
+      return E_OUTOFMEMORY;
+
+    auto result = service_->Connect(socket.get(), this);
+    if (SUCCEEDED(result))
+      socket.release();
+
+    return result;
+  }
+
+  void OnConnected(SocketChannel* channel, HRESULT result) override {
+    std::unique_ptr<SocketChannel> socket(channel);
+    std::unique_ptr<io::Channel> customized;
+
+    if (SUCCEEDED(result)) {
+      customized = service_->CreateChannel(std::move(socket));
+      if (customized == nullptr)
+        result = E_FAIL;
+    }
+
+    service_->OnWarmConnected(this, std::move(customized), result);
+  }
+
+  void OnClosed(SocketChannel* /*channel*/, HRESULT /*result*/) override {}
+
+  void OnRead(io::Channel* /*channel*/, HRESULT /*result*/, void* /*buffer*/,
+              int /*length*/) override {}
+
+  // Negotiated.
+  void OnWritten(io::Channel* /*channel*/, HRESULT result, void* /*buffer*/,
+                 int /*length*/) override {
+    base::AutoLock guard(service_->lock_);
+    service_->EndWarming(this, result);
+  }
+
+  Scissors* const service_;
+  std::unique_ptr<io::Channel> channel_;
+  // When became ready, or 0 while being made.
+  ULONGLONG ready_;
+
+ private:
+  WarmChannel(const WarmChannel&) = delete;
+  WarmChannel& operator=(const WarmChannel&) = delete;
+};
+
 Scissors::Scissors()
-    : stopped_(), config_(nullptr), not_connecting_(&lock_), empty_(&lock_) {}
+    : stopped_(),
+      config_(nullptr),
+      not_connecting_(&lock_),
+      empty_(&lock_),
+      reclamation_(this),
+      warming_(0),
+      tcp_started_(0),
+      warm_started_(0),
+      warm_used_(0),
+      warm_wasted_(0),
+      warm_failed_(0),
+      timer_(misc::TimerService::GetDefault()->Create(this)) {}
 
 Scissors::~Scissors() {
   Scissors::Stop();
@@ -29,10 +96,18 @@ Scissors::~Scissors() {
 bool Scissors::UpdateConfig(const ServiceConfig* config) {
   base::AutoLock guard(lock_);
 
-  while (!connecting_.empty())
+  while (!connecting_.empty() || warming_ > 0)
     not_connecting_.Wait();
 
+  // The remote may have changed.
+  for (auto& warm : warm_) {
+    ++warm_wasted_;
+    expired_.push_back(std::move(warm));
+  }
+  warm_.clear();
+
   config_ = static_cast<const ScissorsConfig*>(config);
+  admission_.SetLimits(config_->max_sessions_, 0, config_->max_queue_delay_);
 
   if (config_->remote_udp_)
     resolver_.SetType(SOCK_DGRAM);
@@ -62,40 +137,64 @@ bool Scissors::UpdateConfig(const ServiceConfig* config) {
     }
   }
 
+  if (timer_ != nullptr && !timer_->IsStarted())
+    timer_->Start(kWarmInterval, kWarmInterval);
+
   return true;
 }
 
 void Scissors::Stop() {
-  base::AutoLock guard(lock_);
+  timer_.reset();
+
+  std::vector<std::unique_ptr<WarmChannel>> warm;
+
+  {
+    base::AutoLock guard(lock_);
+
+    stopped_ = true;
+
+    for (auto& session : sessions_)
+      session->Stop();
 
-  stopped_ = true;
+    while (!sessions_.empty())
+      empty_.Wait();
 
-  for (auto& session : sessions_)
-    session->Stop();
+    while (!connecting_.empty() || warming_ > 0)
+      not_connecting_.Wait();
 
-  while (!sessions_.empty())
-    empty_.Wait();
+    warm.swap(warm_);
+    warm.insert(warm.end(), std::make_move_iterator(expired_.begin()),
+                std::make_move_iterator(expired_.end()));
+    expired_.clear();
+  }
+
+  // Closes the channels, which may call back.
+  warm.clear();
 }
 
 bool Scissors::StartSession(std::unique_ptr<Session>&& session) {
   if (session == nullptr)
     return false;
 
-  if (!session->Start())
-    return false;
+  // Registered before started, as a session may end while starting.
+  auto started = session.get();
 
   lock_.Acquire();
-  sessions_.push_back(std::move(session));
+  sessions_.Add(std::move(session));
   lock_.Release();
 
+  if (!started->Start()) {
+    EndSession(started);
+    return false;
+  }
+
   return true;
 }
 
 void Scissors::EndSession(Session* session) {
   DLOG(INFO) << session << " " __FUNCTION__;
 
-  if (!TrySubmitThreadpoolCallback(EndSessionImpl, session, nullptr))
-    EndSessionImpl(session);
+  reclamation_.Retire(session);
 }
 
 std::unique_ptr<io::net::DatagramChannel> Scissors::CreateSocket() {
@@ -140,47 +239,204 @@ HRESULT Scissors::ConnectSocket(io::net::SocketChannel* channel,
                                 io::net::SocketChannel::Listener* listener) {
   base::AutoLock guard(lock_);
 
-  connecting_.insert({channel, listener});
-  return channel->ConnectAsync(resolver_.begin()->get(), this);
+  return Connect(channel, listener);
+}
+
+std::unique_ptr<io::Channel> Scissors::TakeWarmChannel() {
+  base::AutoLock guard(lock_);
+
+  ++tcp_started_;
+
+  // The most recently made one is the least likely to be timed out by the
+  // remote.
+  for (auto i = warm_.rbegin(), l = warm_.rend(); i != l; ++i) {
+    if ((*i)->ready_ == 0)
+      continue;
+
+    auto channel = std::move((*i)->channel_);
+    warm_.erase(std::next(i).base());
+
+    ++warm_used_;
+    return channel;
+  }
+
+  return nullptr;
 }
 
-void CALLBACK Scissors::EndSessionImpl(PTP_CALLBACK_INSTANCE /*instance*/,
-                                       void* param) {
-  auto session = static_cast<Session*>(param);
-  session->service_->EndSessionImpl(session);
+void Scissors::BeginAccess(misc::AccessLog::Record* record,
+                           const std::string& protocol) const {
+  base::AutoLock guard(lock_);
+
+  record->Begin(misc::AccessLog::Service::kScissors, protocol);
+  record->SetHost(config_->remote_address_, config_->remote_port_);
 }
 
-void Scissors::EndSessionImpl(Session* session) {
-  std::unique_ptr<Session> removed;
+void Scissors::GetStatistics(base::DictionaryValue* stats) const {
+  base::AutoLock guard(lock_);
 
-  lock_.Acquire();
+  stats->SetInteger("sessions", static_cast<int>(sessions_.size()));
+  stats->SetInteger("udp_sessions", static_cast<int>(udp_sessions_.size()));
+  admission_.GetStatistics(stats);
+
+  auto preconnect = std::make_unique<base::DictionaryValue>();
+  preconnect->SetInteger("ready",
+                         static_cast<int>(warm_.size() - warming_));
+  preconnect->SetInteger("connecting", static_cast<int>(warming_));
+  preconnect->SetDouble("started", static_cast<double>(warm_started_));
+  preconnect->SetDouble("used", static_cast<double>(warm_used_));
+  preconnect->SetDouble("wasted", static_cast<double>(warm_wasted_));
+  preconnect->SetDouble("failed", static_cast<double>(warm_failed_));
+  auto warmed = warm_used_ + warm_wasted_;
+  if (warmed > 0)
+    preconnect->SetDouble("use_rate",
+                          static_cast<double>(warm_used_) / warmed);
+  stats->Set("preconnect", std::move(preconnect));
+
+  auto access_log = std::make_unique<base::DictionaryValue>();
+  misc::AccessLog::GetStatistics(access_log.get());
+  stats->Set("access_log", std::move(access_log));
+}
 
-  for (auto i = sessions_.begin(), l = sessions_.end(); i != l; ++i) {
-    if (i->get() == session) {
-      removed = std::move(*i);
-      sessions_.erase(i);
+void Scissors::Reclaim(std::vector<Session*>* sessions,
+                       std::vector<std::unique_ptr<Session>>* reclaimed) {
+  base::AutoLock guard(lock_);
 
-      if (sessions_.empty())
-        empty_.Broadcast();
+  for (auto session : *sessions) {
+    auto removed = sessions_.Remove(session);
+    if (removed == nullptr)
+      continue;
 
-      break;
+    auto key = removed->udp_key();
+    if (key != nullptr) {
+      auto found = udp_sessions_.find(*key);
+      if (found != udp_sessions_.end() && found->second == session)
+        udp_sessions_.erase(found);
+    }
+
+    reclaimed->push_back(std::move(removed));
+  }
+  sessions->clear();
+
+  if (!reclaimed->empty() && sessions_.empty())
+    empty_.Broadcast();
+}
+
+bool Scissors::Admit() {
+  base::AutoLock guard(lock_);
+
+  return admission_.Admit(sessions_.size()) ==
+         AdmissionController::Decision::kAdmit;
+}
+
+HRESULT Scissors::Connect(io::net::SocketChannel* channel,
+                          io::net::SocketChannel::Listener* listener) {
+  lock_.AssertAcquired();
+
+  connecting_.insert({channel, listener});
+
+  auto result = channel->ConnectAsync(resolver_.begin()->get(), this);
+  if (FAILED(result)) {
+    connecting_.erase(channel);
+    if (connecting_.empty())
+      not_connecting_.Broadcast();
+  }
+
+  return result;
+}
+
+void Scissors::OnWarmConnected(WarmChannel* warm,
+                               std::unique_ptr<io::Channel>&& channel,
+                               HRESULT result) {
+  base::AutoLock guard(lock_);
+
+  if (SUCCEEDED(result)) {
+    warm->channel_ = std::move(channel);
+
+    // Writes nothing, which completes once negotiated.
+    if (config_->remote_ssl_) {
+      result = warm->channel_->WriteAsync(nullptr, 0, warm);
+      if (SUCCEEDED(result))
+        return;
     }
   }
 
-  for (auto i = udp_sessions_.begin(), l = udp_sessions_.end(); i != l; ++i) {
-    if (i->second == session) {
-      udp_sessions_.erase(i);
-      break;
+  EndWarming(warm, result);
+}
+
+void Scissors::EndWarming(WarmChannel* warm, HRESULT result) {
+  lock_.AssertAcquired();
+
+  if (--warming_ == 0)
+    not_connecting_.Broadcast();
+
+  if (SUCCEEDED(result) && !stopped_) {
+    warm->ready_ = GetTickCount64();
+    return;
+  }
+
+  LOG_IF(WARNING, FAILED(result))
+      << "failed to preconnect to " << config_->remote_address_ << ":"
+      << config_->remote_port_ << " (error: 0x" << std::hex << result << ")";
+  if (FAILED(result))
+    ++warm_failed_;
+
+  auto found = std::find_if(
+      warm_.begin(), warm_.end(),
+      [warm](const auto& pointer) { return pointer.get() == warm; });
+  expired_.push_back(std::move(*found));
+  warm_.erase(found);
+}
+
+void Scissors::OnTimeout() {
+  // Destroyed after the lock is released, as closing a channel may call back.
+  std::vector<std::unique_ptr<WarmChannel>> expired;
+
+  base::AutoLock guard(lock_);
+
+  expired.swap(expired_);
+
+  if (stopped_ || config_ == nullptr)
+    return;
+
+  auto now = GetTickCount64();
+  for (auto i = warm_.begin(); i != warm_.end();) {
+    auto ready = (*i)->ready_;
+    if (ready == 0 || now - ready < kWarmTimeout) {
+      ++i;
+      continue;
     }
+
+    ++warm_wasted_;
+    expired.push_back(std::move(*i));
+    i = warm_.erase(i);
   }
 
-  lock_.Release();
+  // As many as TCP sessions started since the last tick.
+  auto wanted = config_->remote_udp_
+                    ? 0
+                    : std::min<size_t>(kMaxWarmChannels, tcp_started_);
+  tcp_started_ = 0;
+
+  while (warm_.size() < wanted) {
+    auto warm = std::make_unique<WarmChannel>(this);
+    if (warm == nullptr)
+      break;
+
+    auto result = warm->Start();
+    if (FAILED(result)) {
+      LOG(WARNING) << "failed to preconnect: 0x" << std::hex << result;
+      ++warm_failed_;
+      break;
+    }
 
-  removed.reset();
+    ++warm_started_;
+    ++warming_;
+    warm_.push_back(std::move(warm));
+  }
 }
 
 void Scissors::OnAccepted(std::unique_ptr<io::Channel>&& client) {
-  if (stopped_)
+  if (stopped_ || !Admit())
     return;
 
   if (config_->remote_udp_)
@@ -206,6 +462,11 @@ void Scissors::OnReceivedFrom(std::unique_ptr<io::net::Datagram>&& datagram) {
   lock_.Release();
 
   if (found == end) {
+    if (!Admit()) {
+      DLOG(WARNING) << this << " session not admitted, datagram dropped";
+      return;
+    }
+
     LOG(INFO) << this << " session not found, creating new one";
 
     std::unique_ptr<UdpSession> session;
@@ -217,6 +478,7 @@ void Scissors::OnReceivedFrom(std::unique_ptr<io::net::Datagram>&& datagram) {
           std::make_unique<ScissorsWrappingSession>(this, datagram.get()));
 
     udp_session = session.get();
+    udp_session->udp_key_ = key;
     if (StartSession(std::move(session))) {
       base::AutoLock guard(lock_);
       udp_sessions_.insert({key, udp_session});
@@ -10,6 +10,8 @@
 #include <base/synchronization/condition_variable.h>
 #include <base/synchronization/lock.h>
 
+#include <stdint.h>
+
 #include <map>
 #include <memory>
 #include <string>
@@ -18,6 +20,11 @@
 
 #include "io/net/socket_channel.h"
 #include "io/net/socket_resolver.h"
+#include "misc/access_log.h"
+#include "misc/reclamation_queue.h"
+#include "misc/session_registry.h"
+#include "misc/timer_service.h"
+#include "service/admission_controller.h"
 #include "service/service.h"
 #include "service/scissors/scissors_config.h"
 
@@ -41,25 +48,45 @@ class SchannelCredential;
 namespace service {
 namespace scissors {
 
-class Scissors : public Service, private io::net::SocketChannel::Listener {
+class Scissors : public Service,
+                 private io::net::SocketChannel::Listener,
+                 private misc::TimerService::Callback {
  public:
-  class Session {
+  class Session : public misc::RegistryEntry, public misc::ReclamationEntry {
    public:
     explicit Session(Scissors* service) : service_(service) {}
-    virtual ~Session() {}
+    virtual ~Session() {
+      access_.End();
+    }
 
     virtual bool Start() = 0;
     virtual void Stop() = 0;
 
+    // Returns the key of udp_sessions_ this session is stored with.
+    virtual const sockaddr_storage* udp_key() const {
+      return nullptr;
+    }
+
     Scissors* const service_;
+    // Started by the session, and ended with it.
+    misc::AccessLog::Record access_;
   };
 
   class UdpSession : public Session {
    public:
-    explicit UdpSession(Scissors* service) : Session(service) {}
+    explicit UdpSession(Scissors* service) : Session(service), udp_key_() {}
     virtual ~UdpSession() {}
 
     virtual void OnReceived(std::unique_ptr<io::net::Datagram>&& datagram) = 0;
+
+    const sockaddr_storage* udp_key() const override {
+      return &udp_key_;
+    }
+
+   private:
+    friend class Scissors;
+
+    sockaddr_storage udp_key_;
   };
 
   Scissors();
@@ -78,12 +105,29 @@ class Scissors : public Service, private io::net::SocketChannel::Listener {
   HRESULT ConnectSocket(io::net::SocketChannel* channel,
                         io::net::SocketChannel::Listener* listener);
 
+  // Returns a channel to the remote made ahead, or nullptr if none. Called
+  // for each TCP session, to learn how many to make.
+  std::unique_ptr<io::Channel> TakeWarmChannel();
+
+  // Starts |record| of a session from a client speaking |protocol|.
+  void BeginAccess(misc::AccessLog::Record* record,
+                   const std::string& protocol) const;
+
+  void GetStatistics(base::DictionaryValue* stats) const override;
+
   const ScissorsConfig* config() const {
     return config_;
   }
 
  private:
   static const int kBufferSize = 8192;
+  static const size_t kMaxWarmChannels = 4;
+  static const DWORD kWarmInterval = 1000;      // 1 sec
+  static const DWORD kWarmTimeout = 10 * 1000;  // 10 sec
+
+  // A connection to the remote made ahead of a TCP session, and negotiated
+  // if remote_ssl_.
+  class WarmChannel;
 
   struct Hash {
     size_t operator()(const sockaddr_storage& address) const {
@@ -102,9 +146,20 @@ class Scissors : public Service, private io::net::SocketChannel::Listener {
   typedef std::unordered_map<sockaddr_storage, UdpSession*, Hash, EqualTo>
       UdpSessionMap;
 
-  static void CALLBACK EndSessionImpl(PTP_CALLBACK_INSTANCE instance,
-                                      void* param);
-  void EndSessionImpl(Session* session);
+  friend class misc::ReclamationQueue<Session, Scissors>;
+
+  void Reclaim(std::vector<Session*>* sessions,
+               std::vector<std::unique_ptr<Session>>* reclaimed);
+
+  bool Admit();
+
+  HRESULT Connect(io::net::SocketChannel* channel,
+                  io::net::SocketChannel::Listener* listener);
+  void OnWarmConnected(WarmChannel* warm,
+                       std::unique_ptr<io::Channel>&& channel, HRESULT result);
+  void EndWarming(WarmChannel* warm, HRESULT result);
+
+  void OnTimeout() override;
 
   void OnAccepted(std::unique_ptr<io::Channel>&& client) override;
   void OnReceivedFrom(std::unique_ptr<io::net::Datagram>&& datagram) override;
@@ -116,18 +171,36 @@ class Scissors : public Service, private io::net::SocketChannel::Listener {
   bool stopped_;
   const ScissorsConfig* config_;
   std::unique_ptr<misc::schannel::SchannelCredential> credential_;
-  base::Lock lock_;
+  mutable base::Lock lock_;
+  AdmissionController admission_;
 
   io::net::SocketResolver resolver_;
   std::map<io::net::SocketChannel*, io::net::SocketChannel::Listener*>
       connecting_;
   base::ConditionVariable not_connecting_;
 
-  std::vector<std::unique_ptr<Session>> sessions_;
+  misc::SessionRegistry<Session> sessions_;
   base::ConditionVariable empty_;
 
   UdpSessionMap udp_sessions_;
 
+  misc::ReclamationQueue<Session, Scissors> reclamation_;
+
+  // Made ahead as many as TCP sessions started in the last tick, and kept
+  // for kWarmTimeout once ready. A warm channel is destroyed only when no
+  // callback is pending, and those being made are waited for with
+  // not_connecting_.
+  std::vector<std::unique_ptr<WarmChannel>> warm_;
+  size_t warming_;
+  size_t tcp_started_;
+  // Destroyed on the next tick, out of the lock.
+  std::vector<std::unique_ptr<WarmChannel>> expired_;
+  uint64_t warm_started_;
+  uint64_t warm_used_;
+  uint64_t warm_wasted_;
+  uint64_t warm_failed_;
+  std::unique_ptr<misc::TimerService::Timer> timer_;
+
   Scissors(const Scissors&) = delete;
   Scissors& operator=(const Scissors&) = delete;
 };
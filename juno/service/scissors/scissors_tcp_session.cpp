@@ -28,6 +28,16 @@ ScissorsTcpSession::~ScissorsTcpSession() {
 }
 
 bool ScissorsTcpSession::Start() {
+  access_.SetClient(source_.get());
+  service_->BeginAccess(&access_, "TCP");
+
+  sink_ = service_->TakeWarmChannel();
+  if (sink_ != nullptr) {
+    DLOG(INFO) << this << " took a warm channel";
+    BindChannels();
+    return true;
+  }
+
   auto socket = std::make_unique<SocketChannel>();
   if (socket == nullptr) {
     LOG(ERROR) << this << " failed to create socket";
@@ -39,6 +49,7 @@ bool ScissorsTcpSession::Start() {
     socket.release();
   } else {
     LOG(ERROR) << this << " failed to connect: 0x" << std::hex << result;
+    access_.status = result;
     return false;
   }
 
@@ -62,23 +73,32 @@ void ScissorsTcpSession::OnConnected(SocketChannel* channel, HRESULT result) {
   do {
     if (FAILED(result)) {
       LOG(ERROR) << this << " failed to connect: 0x" << std::hex << result;
+      access_.status = result;
       break;
     }
 
     sink_ = service_->CreateChannel(std::move(socket));
     if (sink_ == nullptr) {
       LOG(ERROR) << this << " failed to customize channel.";
+      access_.status = E_FAIL;
       break;
     }
 
-    if (!misc::TunnelingService::Bind(source_, sink_)) {
-      LOG(ERROR) << this << " failed to bind channels";
-      break;
-    }
+    BindChannels();
+    return;
+  } while (false);
 
+  service_->EndSession(this);
+}
+
+void ScissorsTcpSession::BindChannels() {
+  if (misc::TunnelingService::Bind(source_, sink_, &access_)) {
     source_.reset();
     sink_.reset();
-  } while (false);
+  } else {
+    LOG(ERROR) << this << " failed to bind channels";
+    access_.status = E_FAIL;
+  }
 
   service_->EndSession(this);
 }
@@ -24,6 +24,9 @@ class ScissorsTcpSession : public Scissors::Session,
  private:
   static const size_t kBufferSize = 8192;
 
+  // Hands the channels over to TunnelingService, and ends this session.
+  void BindChannels();
+
   std::shared_ptr<io::Channel> source_;
   std::shared_ptr<io::Channel> sink_;
 
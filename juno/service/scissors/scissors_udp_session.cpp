@@ -36,6 +36,8 @@ bool ScissorsUdpSession::Start() {
     return false;
   }
 
+  service_->BeginAccess(&access_, "UDP");
+
   timer_->Start(kTimeout, 0);
   sink_->ReadAsync(buffer_, sizeof(buffer_), this);
 
@@ -60,6 +62,8 @@ void ScissorsUdpSession::OnReceived(
 
   memmove(&address_, &datagram->from, datagram->from_length);
   address_length_ = datagram->from_length;
+  access_.SetClient(&address_, address_length_);
+  access_.bytes_in += datagram->data_length;
 
   auto sent = sink_->Send(datagram->data.get(), datagram->data_length, 0);
   if (sent == datagram->data_length) {
@@ -81,6 +85,7 @@ void ScissorsUdpSession::OnRead(io::Channel* /*channel*/, HRESULT result,
     auto sent = source_->SendTo(buffer, length, 0, &address_, address_length_);
     if (sent == length) {
       DLOG(INFO) << this << " " << sent << " bytes sent to the source";
+      access_.bytes_out += sent;
       timer_->Start(kTimeout, 0);
       result = sink_->ReadAsync(buffer_, sizeof(buffer_), this);
       if (FAILED(result)) {
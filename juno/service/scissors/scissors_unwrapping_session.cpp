@@ -33,6 +33,9 @@ bool ScissorsUnwrappingSession::Start() {
     return false;
   }
 
+  access_.SetClient(stream_.get());
+  service_->BeginAccess(&access_, "TCP");
+
   datagram_ = service_->CreateSocket();
   if (datagram_ == nullptr) {
     LOG(ERROR) << "Failed to create datagram channel.";
@@ -112,6 +115,7 @@ bool ScissorsUnwrappingSession::OnStreamRead(Channel* /*channel*/,
   }
 
   stream_message_.append(stream_buffer_, length);
+  access_.bytes_in += length;
 
   do {
     if (stream_message_.size() < kHeaderSize) {
@@ -178,6 +182,7 @@ bool ScissorsUnwrappingSession::OnDatagramReceived(Channel* /*channel*/,
   result = stream_->WriteAsync(buffer.get(), kHeaderSize + length, this);
   if (SUCCEEDED(result)) {
     buffer.release();
+    access_.bytes_out += kHeaderSize + length;
   } else {
     LOG(ERROR) << "Failed to write to stream: 0x" << std::hex << result;
     return false;
@@ -45,6 +45,9 @@ bool ScissorsWrappingSession::Start() {
     return false;
   }
 
+  access_.SetClient(&address_, address_length_);
+  service_->BeginAccess(&access_, "UDP");
+
   auto remote = std::make_unique<io::net::SocketChannel>();
   if (remote == nullptr) {
     LOG(ERROR) << "Failed to create socket.";
@@ -79,6 +82,7 @@ void ScissorsWrappingSession::Stop() {
 void ScissorsWrappingSession::OnReceived(
     std::unique_ptr<io::net::Datagram>&& datagram) {
   timer_->Start(kTimeout, 0);
+  access_.bytes_in += datagram->data_length;
 
   if (datagram->data_length <= kDataSize) {
     base::AutoLock guard(lock_);
@@ -129,6 +133,7 @@ void ScissorsWrappingSession::OnRead(io::Channel* /*channel*/, HRESULT result,
                                    address_length_, this);
     if (SUCCEEDED(result)) {
       buffer.release();
+      access_.bytes_out += length;
     } else {
       LOG(ERROR) << "Failed to send datagram: 0x" << std::hex << result;
       break;
@@ -165,6 +170,7 @@ void ScissorsWrappingSession::OnConnected(io::net::SocketChannel* /*channel*/,
                                           HRESULT result) {
   if (FAILED(result)) {
     LOG(ERROR) << "Failed to connect: 0x" << std::hex << result;
+    access_.status = result;
     service_->EndSession(this);
     return;
   }
@@ -3,6 +3,12 @@
 #ifndef JUNO_SERVICE_SERVER_H_
 #define JUNO_SERVICE_SERVER_H_
 
+namespace base {
+
+class DictionaryValue;
+
+}  // namespace base
+
 namespace juno {
 namespace service {
 
@@ -17,6 +23,9 @@ class __declspec(novtable) Server {
   virtual void Stop() = 0;
 
   virtual void SetService(Service* service) = 0;
+
+  // Adds the counters of this server to |stats|.
+  virtual void GetStatistics(base::DictionaryValue* /*stats*/) const {}
 };
 
 }  // namespace service
@@ -22,6 +22,10 @@ struct ServerConfig {
   std::wstring service_;
   int enabled_;
   std::string cert_hash_;
+
+  // Admission limits, zero means unlimited.
+  int max_accept_rate_;  // connections per second
+  int max_queue_delay_;  // msec
 };
 
 }  // namespace service
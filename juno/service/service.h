@@ -6,6 +6,14 @@
 #include <winerror.h>
 
 #include <memory>
+#include <string>
+#include <vector>
+
+namespace base {
+
+class DictionaryValue;
+
+}  // namespace base
 
 namespace juno {
 namespace io {
@@ -33,6 +41,15 @@ class __declspec(novtable) Service {
   virtual void OnAccepted(std::unique_ptr<io::Channel>&& client) = 0;
   virtual void OnReceivedFrom(
       std::unique_ptr<io::net::Datagram>&& datagram) = 0;
+
+  // Adds the counters of this service to |stats|.
+  virtual void GetStatistics(base::DictionaryValue* /*stats*/) const {}
+
+  // Returns the protocols offered by ALPN when served over TLS, most
+  // preferred first.
+  virtual std::vector<std::string> GetApplicationProtocols() const {
+    return {};
+  }
 };
 
 }  // namespace service
@@ -14,6 +14,10 @@ struct ServiceConfig {
   std::wstring id_;
   std::wstring name_;
   std::wstring provider_;
+
+  // Admission limits, zero means unlimited.
+  int max_sessions_;
+  int max_queue_delay_;  // msec
 };
 
 }  // namespace service
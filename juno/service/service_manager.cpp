@@ -40,6 +40,9 @@ const wchar_t kTypeReg[] = L"Type";
 const wchar_t kServiceReg[] = L"Service";
 const wchar_t kEnabledReg[] = L"Enabled";
 const wchar_t kCertificateReg[] = L"Certificate";
+const wchar_t kMaxSessionsReg[] = L"MaxSessions";
+const wchar_t kMaxAcceptRateReg[] = L"MaxAcceptRate";
+const wchar_t kMaxQueueDelayReg[] = L"MaxQueueDelay";
 
 const std::string kIdJson = "id";
 const std::string kNameJson = "name";
@@ -50,16 +53,24 @@ const std::string kTypeJson = "type";
 const std::string kServiceJson = "service";
 const std::string kEnabledJson = "enabled";
 const std::string kCertificateJson = "certificate";
+const std::string kMaxSessionsJson = "max_sessions";
+const std::string kMaxAcceptRateJson = "max_accept_rate";
+const std::string kMaxQueueDelayJson = "max_queue_delay";
 
 class SecureChannelCustomizer : public TcpServer::ChannelCustomizer {
  public:
   std::unique_ptr<io::Channel> Customize(
       std::unique_ptr<io::Channel>&& channel) override {
-    return std::make_unique<io::SecureChannel>(&credential_, std::move(channel),
-                                               true);
+    auto secure_channel = std::make_unique<io::SecureChannel>(
+        &credential_, std::move(channel), true);
+    if (secure_channel != nullptr && !protocols_.empty())
+      secure_channel->SetApplicationProtocols(protocols_);
+
+    return std::move(secure_channel);
   }
 
   misc::schannel::SchannelCredential credential_;
+  std::vector<std::string> protocols_;
 };
 
 misc::CertificateStore certificate_store(L"MY");
@@ -92,6 +103,7 @@ ServiceManager::ServiceManager() : root_key_(NULL) {
   if (rpc_service != nullptr) {
     rpc_service->RegisterMethod(kConfigGetMethod, GetConfig, this);
     rpc_service->RegisterMethod(kConfigSetMethod, SetConfig, this);
+    rpc_service->RegisterMethod(kStatsGetMethod, GetStatistics, this);
   }
 }
 
@@ -103,6 +115,7 @@ ServiceManager::~ServiceManager() {
   if (rpc_service != nullptr) {
     rpc_service->UnregisterMethod(kConfigGetMethod);
     rpc_service->UnregisterMethod(kConfigSetMethod);
+    rpc_service->UnregisterMethod(kStatsGetMethod);
   }
 }
 
@@ -316,6 +329,8 @@ std::unique_ptr<base::DictionaryValue> ServiceManager::ConvertServiceConfig(
   value->SetString(kIdJson, config->id_);
   value->SetString(kNameJson, config->name_);
   value->SetString(kProviderJson, config->provider_);
+  value->SetInteger(kMaxSessionsJson, config->max_sessions_);
+  value->SetInteger(kMaxQueueDelayJson, config->max_queue_delay_);
 
   return std::move(value);
 }
@@ -365,6 +380,9 @@ std::unique_ptr<ServiceConfig> ServiceManager::ConvertServiceConfig(
 
   config->provider_ = std::move(provider_name);
 
+  value->GetInteger(kMaxSessionsJson, &config->max_sessions_);
+  value->GetInteger(kMaxQueueDelayJson, &config->max_queue_delay_);
+
   return std::move(config);
 }
 
@@ -403,6 +421,8 @@ std::unique_ptr<base::DictionaryValue> ServiceManager::ConvertServerConfig(
   value->SetInteger(kTypeJson, config->type_);
   value->SetString(kServiceJson, config->service_);
   value->SetInteger(kEnabledJson, config->enabled_);
+  value->SetInteger(kMaxAcceptRateJson, config->max_accept_rate_);
+  value->SetInteger(kMaxQueueDelayJson, config->max_queue_delay_);
 
   if (!config->cert_hash_.empty()) {
     auto cert_hash = base::Value::CreateWithCopiedBuffer(
@@ -449,6 +469,8 @@ std::unique_ptr<ServerConfig> ServiceManager::ConvertServerConfig(
   value->GetInteger(kTypeJson, &config->type_);
   value->GetString(kServiceJson, &config->service_);
   value->GetInteger(kEnabledJson, &config->enabled_);
+  value->GetInteger(kMaxAcceptRateJson, &config->max_accept_rate_);
+  value->GetInteger(kMaxQueueDelayJson, &config->max_queue_delay_);
 
   const base::Value* cert_hash;
   if (value->GetBinary(kCertificateJson, &cert_hash) &&
@@ -486,6 +508,12 @@ bool ServiceManager::LoadService(const RegKey& parent, const wchar_t* id) {
 
   config->provider_ = provider_name;
 
+  DWORD limit;
+  if (reg_key.ReadValueDW(kMaxSessionsReg, &limit) == ERROR_SUCCESS)
+    config->max_sessions_ = limit;
+  if (reg_key.ReadValueDW(kMaxQueueDelayReg, &limit) == ERROR_SUCCESS)
+    config->max_queue_delay_ = limit;
+
   auto service_id = config->id_;
   service_configs_.insert({service_id, std::move(config)});
 
@@ -504,6 +532,9 @@ bool ServiceManager::SaveService(const RegKey& parent,
           ERROR_SUCCESS)
     return false;
 
+  service_key.WriteValue(kMaxSessionsReg, config->max_sessions_);
+  service_key.WriteValue(kMaxQueueDelayReg, config->max_queue_delay_);
+
   return providers_[config->provider_]->SaveConfig(config, &service_key);
 }
 
@@ -541,6 +572,12 @@ bool ServiceManager::LoadServer(const RegKey& parent, const wchar_t* id) {
   config->service_ = std::move(service);
   config->enabled_ = enabled;
 
+  DWORD limit;
+  if (reg_key.ReadValueDW(kMaxAcceptRateReg, &limit) == ERROR_SUCCESS)
+    config->max_accept_rate_ = limit;
+  if (reg_key.ReadValueDW(kMaxQueueDelayReg, &limit) == ERROR_SUCCESS)
+    config->max_queue_delay_ = limit;
+
   // convert server name to GUID
   if (reg_key.HasValue(L"Name"))
     config->id_ = misc::GenerateGUID16();
@@ -583,9 +620,15 @@ bool ServiceManager::CreateServer(const std::wstring& id) {
 
   std::unique_ptr<Server> server;
   switch (static_cast<ServerConfig::Protocol>(config->type_)) {
-    case ServerConfig::Protocol::kTCP:
-      server = std::make_unique<TcpServer>();
+    case ServerConfig::Protocol::kTCP: {
+      auto tcp_server = std::make_unique<TcpServer>();
+      if (tcp_server != nullptr) {
+        tcp_server->SetAdmissionLimits(config->max_accept_rate_,
+                                       config->max_queue_delay_);
+        server = std::move(tcp_server);
+      }
       break;
+    }
 
     case ServerConfig::Protocol::kUDP:
       server = std::make_unique<UdpServer>();
@@ -596,6 +639,8 @@ bool ServiceManager::CreateServer(const std::wstring& id) {
       if (factory == nullptr)
         break;
 
+      factory->protocols_ = service->second->GetApplicationProtocols();
+
       auto& credential = factory->credential_;
       credential.SetEnabledProtocols(SP_PROT_SSL3TLS1_X_SERVERS);
       credential.SetFlags(SCH_CRED_MANUAL_CRED_VALIDATION);
@@ -619,6 +664,8 @@ bool ServiceManager::CreateServer(const std::wstring& id) {
       auto tcp_server = std::make_unique<TcpServer>();
       if (tcp_server != nullptr) {
         tcp_server->SetChannelCustomizer(factory.get());
+        tcp_server->SetAdmissionLimits(config->max_accept_rate_,
+                                       config->max_queue_delay_);
 
         channel_customizers.push_back(std::move(factory));
         server = std::move(tcp_server);
@@ -654,6 +701,8 @@ bool ServiceManager::SaveServer(const RegKey& parent,
   key.WriteValue(kTypeReg, config->type_);
   key.WriteValue(kServiceReg, config->service_.c_str());
   key.WriteValue(kEnabledReg, config->enabled_);
+  key.WriteValue(kMaxAcceptRateReg, config->max_accept_rate_);
+  key.WriteValue(kMaxQueueDelayReg, config->max_queue_delay_);
 
   if (!config->cert_hash_.empty())
     key.WriteValue(kCertificateReg, config->cert_hash_.data(),
@@ -692,6 +741,57 @@ void ServiceManager::GetConfig(void* context, const base::Value* /*params*/,
   response->SetInteger(rpc::properties::kErrorData, result);
 }
 
+void ServiceManager::GetStatistics(void* context,
+                                   const base::Value* /*params*/,
+                                   base::DictionaryValue* response) {
+  if (response == nullptr) {
+    LOG(ERROR) << "Method called as notification.";
+    return;
+  }
+
+  auto manager = static_cast<const ServiceManager*>(context);
+  HRESULT result;
+
+  do {
+    auto services = std::make_unique<base::DictionaryValue>();
+    auto servers = std::make_unique<base::DictionaryValue>();
+    if (services == nullptr || servers == nullptr) {
+      result = E_OUTOFMEMORY;
+      break;
+    }
+
+    for (const auto& pair : manager->services_) {
+      auto stats = std::make_unique<base::DictionaryValue>();
+      if (stats == nullptr)
+        continue;
+
+      pair.second->GetStatistics(stats.get());
+      services->SetWithoutPathExpansion(base::SysWideToUTF8(pair.first),
+                                        std::move(stats));
+    }
+
+    for (const auto& pair : manager->servers_) {
+      auto stats = std::make_unique<base::DictionaryValue>();
+      if (stats == nullptr)
+        continue;
+
+      pair.second->GetStatistics(stats.get());
+      servers->SetWithoutPathExpansion(base::SysWideToUTF8(pair.first),
+                                       std::move(stats));
+    }
+
+    response->Set("result.services", std::move(services));
+    response->Set("result.servers", std::move(servers));
+
+    return;
+  } while (false);
+
+  response->SetInteger(rpc::properties::kErrorCode, rpc::codes::kServerError);
+  response->SetString(rpc::properties::kErrorMessage,
+                      rpc::messages::kServerError);
+  response->SetInteger(rpc::properties::kErrorData, result);
+}
+
 void ServiceManager::SetConfig(void* context, const base::Value* params,
                                base::DictionaryValue* response) {
   if (response == nullptr) {
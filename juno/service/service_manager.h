@@ -103,6 +103,8 @@ class ServiceManager {
                         base::DictionaryValue* response);
   static void SetConfig(void* context, const base::Value* params,
                         base::DictionaryValue* response);
+  static void GetStatistics(void* context, const base::Value* params,
+                            base::DictionaryValue* response);
 
   static ServiceManager* instance_;
 
@@ -3,7 +3,10 @@
 #include "service/socks/socks_proxy.h"
 
 #include <base/logging.h>
+#include <base/values.h>
 
+#include "misc/access_log.h"
+#include "service/service_config.h"
 #include "service/socks/socks_session_4.h"
 #include "service/socks/socks_session_5.h"
 
@@ -11,17 +14,23 @@ namespace juno {
 namespace service {
 namespace socks {
 
-SocksProxy::SocksProxy() : empty_(&lock_), stopped_() {}
+SocksProxy::SocksProxy()
+    : empty_(&lock_), stopped_(), reclamation_(this) {}
 
 SocksProxy::~SocksProxy() {}
 
+bool SocksProxy::UpdateConfig(const ServiceConfig* config) {
+  admission_.SetLimits(config->max_sessions_, 0, config->max_queue_delay_);
+  return true;
+}
+
 void SocksProxy::Stop() {
   base::AutoLock guard(lock_);
 
   stopped_ = true;
 
   for (auto& candidate : candidates_)
-    candidate->Close();
+    candidate.second->Close();
 
   for (auto& session : sessions_)
     session->Stop();
@@ -30,12 +39,7 @@ void SocksProxy::Stop() {
 }
 
 void SocksProxy::EndSession(SocksSession* session) {
-  auto pair = new ServiceSessionPair(this, session);
-  if (pair == nullptr ||
-      !TrySubmitThreadpoolCallback(EndSessionImpl, pair, nullptr)) {
-    delete pair;
-    EndSessionImpl(session);
-  }
+  reclamation_.Retire(session);
 }
 
 void SocksProxy::OnAccepted(std::unique_ptr<io::Channel>&& client) {
@@ -44,6 +48,10 @@ void SocksProxy::OnAccepted(std::unique_ptr<io::Channel>&& client) {
   if (stopped_)
     return;
 
+  auto decision = admission_.Admit(candidates_.size() + sessions_.size());
+  if (decision != AdmissionController::Decision::kAdmit)
+    return;
+
   auto buffer = std::make_unique<char[]>(kBufferSize);
   if (buffer == nullptr) {
     LOG(ERROR) << "Failed to allocate buffer.";
@@ -52,7 +60,8 @@ void SocksProxy::OnAccepted(std::unique_ptr<io::Channel>&& client) {
 
   auto result = client->ReadAsync(buffer.get(), kBufferSize, this);
   if (SUCCEEDED(result)) {
-    candidates_.push_back(std::move(client));
+    auto key = client.get();
+    candidates_.insert({key, std::move(client)});
     buffer.release();
   } else {
     LOG(ERROR) << "Failed to receive: 0x" << std::hex << result;
@@ -64,6 +73,18 @@ void SocksProxy::OnReceivedFrom(
   // do nothing
 }
 
+void SocksProxy::GetStatistics(base::DictionaryValue* stats) const {
+  base::AutoLock guard(lock_);
+
+  stats->SetInteger("sessions", static_cast<int>(sessions_.size()));
+  stats->SetInteger("candidates", static_cast<int>(candidates_.size()));
+  admission_.GetStatistics(stats);
+
+  auto access_log = std::make_unique<base::DictionaryValue>();
+  misc::AccessLog::GetStatistics(access_log.get());
+  stats->Set("access_log", std::move(access_log));
+}
+
 void SocksProxy::CheckEmpty() {
   if (candidates_.empty() && sessions_.empty())
     empty_.Broadcast();
@@ -81,13 +102,11 @@ void SocksProxy::OnRead(io::Channel* channel, HRESULT result, void* buffer,
 
   base::AutoLock guard(lock_);
 
-  for (auto i = candidates_.begin(), l = candidates_.end(); i != l; ++i) {
-    if (i->get() == channel) {
-      candidate = std::move(*i);
-      candidates_.erase(i);
-      CheckEmpty();
-      break;
-    }
+  auto found = candidates_.find(channel);
+  if (found != candidates_.end()) {
+    candidate = std::move(found->second);
+    candidates_.erase(found);
+    CheckEmpty();
   }
   CHECK(candidate != nullptr) << "Candidate not found.";
 
@@ -128,13 +147,17 @@ void SocksProxy::OnRead(io::Channel* channel, HRESULT result, void* buffer,
     return;
   }
 
-  result = session->Start(std::move(message), length);
+  // The session may end before Start() returns, so it has to be registered
+  // beforehand.
+  auto started = session.get();
+  sessions_.Add(std::move(session));
+
+  result = started->Start(std::move(message), length);
   if (FAILED(result)) {
     LOG(ERROR) << "Failed to start session: 0x" << std::hex << result;
-    return;
+    sessions_.Remove(started);
+    CheckEmpty();
   }
-
-  sessions_.push_back(std::move(session));
 }
 
 void SocksProxy::OnWritten(io::Channel* /*channel*/, HRESULT /*result*/,
@@ -142,33 +165,21 @@ void SocksProxy::OnWritten(io::Channel* /*channel*/, HRESULT /*result*/,
   DLOG(FATAL) << "It's not intended to be used like this.";
 }
 
-void CALLBACK SocksProxy::EndSessionImpl(PTP_CALLBACK_INSTANCE /*instance*/,
-                                         void* param) {
-  auto pair = static_cast<ServiceSessionPair*>(param);
-  pair->first->EndSessionImpl(pair->second);
-  delete pair;
-}
-
-void SocksProxy::EndSessionImpl(SocksSession* session) {
-  std::unique_ptr<SocksSession> removed;
-
-  lock_.Acquire();
+void SocksProxy::Reclaim(
+    std::vector<SocksSession*>* sessions,
+    std::vector<std::unique_ptr<SocksSession>>* reclaimed) {
+  base::AutoLock guard(lock_);
 
-  for (auto i = sessions_.begin(), l = sessions_.end(); i != l; ++i) {
-    if (i->get() == session) {
-      removed = std::move(*i);
-      sessions_.erase(i);
-      CheckEmpty();
-      break;
-    }
+  for (auto session : *sessions) {
+    auto removed = sessions_.Remove(session);
+    if (removed != nullptr)
+      reclaimed->push_back(std::move(removed));
+    else
+      DLOG(WARNING) << "Session not found.";
   }
+  sessions->clear();
 
-  lock_.Release();
-
-  if (removed == nullptr)
-    DLOG(WARNING) << "Session not found.";
-
-  removed.reset();
+  CheckEmpty();
 }
 
 }  // namespace socks
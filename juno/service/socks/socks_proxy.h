@@ -6,11 +6,15 @@
 #include <base/synchronization/condition_variable.h>
 #include <base/synchronization/lock.h>
 
-#include <list>
 #include <memory>
+#include <unordered_map>
 #include <utility>
+#include <vector>
 
 #include "io/channel.h"
+#include "misc/reclamation_queue.h"
+#include "misc/session_registry.h"
+#include "service/admission_controller.h"
 #include "service/service.h"
 
 namespace juno {
@@ -19,7 +23,8 @@ namespace socks {
 
 class SocksProxy;
 
-class __declspec(novtable) SocksSession {
+class __declspec(novtable) SocksSession : public misc::RegistryEntry,
+                                          public misc::ReclamationEntry {
  public:
   SocksSession(SocksProxy* proxy, std::unique_ptr<io::Channel>&& channel)
       : proxy_(proxy), client_(std::move(channel)) {}
@@ -41,18 +46,17 @@ class SocksProxy : public Service, private io::Channel::Listener {
   SocksProxy();
   ~SocksProxy();
 
-  bool UpdateConfig(const ServiceConfig* /*config*/) override {
-    return true;
-  }
-
+  bool UpdateConfig(const ServiceConfig* config) override;
   void Stop() override;
   void EndSession(SocksSession* session);
 
   void OnAccepted(std::unique_ptr<io::Channel>&& client) override;
   void OnReceivedFrom(std::unique_ptr<io::net::Datagram>&& datagram) override;
 
+  void GetStatistics(base::DictionaryValue* stats) const override;
+
  private:
-  typedef std::pair<SocksProxy*, SocksSession*> ServiceSessionPair;
+  friend class misc::ReclamationQueue<SocksSession, SocksProxy>;
 
   static const int kBufferSize = 1024;
 
@@ -64,15 +68,16 @@ class SocksProxy : public Service, private io::Channel::Listener {
   void OnWritten(io::Channel* channel, HRESULT result, void* buffer,
                  int length) override;
 
-  static void CALLBACK EndSessionImpl(PTP_CALLBACK_INSTANCE instance,
-                                      void* param);
-  void EndSessionImpl(SocksSession* session);
+  void Reclaim(std::vector<SocksSession*>* sessions,
+               std::vector<std::unique_ptr<SocksSession>>* reclaimed);
 
-  base::Lock lock_;
+  mutable base::Lock lock_;
   base::ConditionVariable empty_;
-  std::list<std::unique_ptr<io::Channel>> candidates_;
-  std::list<std::unique_ptr<SocksSession>> sessions_;
+  std::unordered_map<io::Channel*, std::unique_ptr<io::Channel>> candidates_;
+  misc::SessionRegistry<SocksSession> sessions_;
   bool stopped_;
+  AdmissionController admission_;
+  misc::ReclamationQueue<SocksSession, SocksProxy> reclamation_;
 
   SocksProxy(const SocksProxy&) = delete;
   SocksProxy& operator=(const SocksProxy&) = delete;
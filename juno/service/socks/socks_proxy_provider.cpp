@@ -57,7 +57,14 @@ std::unique_ptr<Service> SocksProxyProvider::CreateService(
   if (base_config == nullptr)
     return nullptr;
 
-  return std::make_unique<SocksProxy>();
+  auto service = std::make_unique<SocksProxy>();
+  if (service == nullptr)
+    return nullptr;
+
+  if (!service->UpdateConfig(base_config))
+    return nullptr;
+
+  return std::move(service);
 }
 
 INT_PTR SocksProxyProvider::Configure(ServiceConfig* /*base_config*/,
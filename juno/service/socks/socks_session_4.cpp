@@ -18,6 +18,7 @@ SocksSession4::SocksSession4(SocksProxy* proxy,
 
 SocksSession4::~SocksSession4() {
   SocksSession4::Stop();
+  access_.End();
 }
 
 HRESULT SocksSession4::Start(std::unique_ptr<char[]>&& request, int length) {
@@ -60,6 +61,11 @@ HRESULT SocksSession4::ProcessRequest() {
   auto request = reinterpret_cast<const SOCKS4::REQUEST*>(message_.data());
   auto code = SOCKS4::FAILED;
 
+  access_.SetClient(client_.get());
+  access_.Begin(misc::AccessLog::Service::kSocks,
+                request->command == SOCKS4::CONNECT ? "CONNECT" : "BIND");
+  access_.status = code;
+
   do {
     if (request->command != SOCKS4::CONNECT) {
       LOG(ERROR) << "Command " << request->command << " is requested.";
@@ -76,6 +82,7 @@ HRESULT SocksSession4::ProcessRequest() {
         htonl(request->address.s_addr) <= 0x000000FF) {
       // SOCKS4a extension
       auto host = request->user_id + strlen(request->user_id) + 1;
+      access_.SetHost(host, ntohs(request->port));
 
       auto resolver = std::make_unique<io::net::SocketResolver>();
       if (resolver == nullptr) {
@@ -109,6 +116,7 @@ HRESULT SocksSession4::ProcessRequest() {
       address->ai_socktype = SOCK_STREAM;
       address->sin_port = request->port;
       address->sin_addr = request->address;
+      access_.SetHost(address->ai_addr);
 
       end_point_ = address.get();
 
@@ -210,12 +218,18 @@ void SocksSession4::OnConnected(io::net::SocketChannel* channel,
   else
     delete static_cast<SocketAddress4*>(end_point_);
 
+  // Taken over by the tunnel if bound.
+  access_.status = SOCKS4::GRANTED;
+
   SOCKS4::CODE code;
-  if (SUCCEEDED(result) && misc::TunnelingService::Bind(client_, remote_))
+  if (SUCCEEDED(result) &&
+      misc::TunnelingService::Bind(client_, remote_, &access_))
     code = SOCKS4::GRANTED;
   else
     code = SOCKS4::FAILED;
 
+  access_.status = code;
+
   result = SendResponse(code);
   if (FAILED(result)) {
     LOG(ERROR) << "Failed to send response: 0x" << std::hex << result;
@@ -7,6 +7,7 @@
 #include <string>
 
 #include "io/net/socket_channel.h"
+#include "misc/access_log.h"
 #include "service/socks/socks4.h"
 #include "service/socks/socks_proxy.h"
 
@@ -40,6 +41,7 @@ class SocksSession4 : public SocksSession,
   std::string message_;
   void* end_point_;
   std::shared_ptr<io::net::SocketChannel> remote_;
+  misc::AccessLog::Record access_;
 
   SocksSession4(const SocksSession4&) = delete;
   SocksSession4& operator=(const SocksSession4&) = delete;
@@ -6,23 +6,39 @@
 
 #include <string>
 
+#include "io/channel_awaitable.h"
+#include "io/net/socket_channel_awaitable.h"
 #include "io/net/socket_resolver.h"
 #include "misc/tunneling_service.h"
 #include "service/socks/socket_address.h"
-#include "service/socks/socks5.h"
 
 namespace juno {
 namespace service {
 namespace socks {
+namespace {
+
+const char* GetCommandName(uint8_t command) {
+  switch (command) {
+    case SOCKS5::CONNECT:
+      return "CONNECT";
+    case SOCKS5::BIND:
+      return "BIND";
+    case SOCKS5::UDP_ASSOCIATE:
+      return "UDP_ASSOCIATE";
+    default:
+      return "";
+  }
+}
+
+}  // namespace
 
 SocksSession5::SocksSession5(SocksProxy* proxy,
                              std::unique_ptr<io::Channel>&& channel)
-    : SocksSession(proxy, std::move(channel)),
-      state_(State::kInit),
-      end_point_(nullptr) {}
+    : SocksSession(proxy, std::move(channel)) {}
 
 SocksSession5::~SocksSession5() {
   SocksSession5::Stop();
+  access_.End();
 }
 
 HRESULT SocksSession5::Start(std::unique_ptr<char[]>&& request, int length) {
@@ -31,10 +47,14 @@ HRESULT SocksSession5::Start(std::unique_ptr<char[]>&& request, int length) {
     return E_ILLEGAL_METHOD_CALL;
   }
 
-  state_ = State::kNegotiation;
   message_.assign(request.get(), length);
 
-  return ProcessRequest();
+  misc::coroutine::FrameAllocator::Scope scope(&frame_allocator_);
+  auto task = Run();
+  DCHECK_EQ(0u, frame_allocator_.fallbacks()) << "Frame exceeds kFrameSize.";
+  task.Start(this);
+
+  return S_OK;
 }
 
 void SocksSession5::Stop() {
@@ -45,413 +65,225 @@ void SocksSession5::Stop() {
     remote_->Close();
 }
 
-HRESULT SocksSession5::ReadRequest() {
-  auto buffer = std::make_unique<char[]>(kBufferSize);
-  if (buffer == nullptr) {
-    LOG(ERROR) << "Failed to allocate buffer.";
-    return E_OUTOFMEMORY;
-  }
-
-  auto result = client_->ReadAsync(buffer.get(), kBufferSize, this);
-  if (FAILED(result)) {
-    LOG(ERROR) << "Failed to receive: 0x" << std::hex << result;
-    return result;
-  }
-
-  buffer.release();
-
-  return S_OK;
-}
-
-HRESULT SocksSession5::EnsureRead(size_t min_length) {
-  if (min_length <= message_.size())
-    return S_OK;
-
-  auto result = ReadRequest();
-  if (FAILED(result)) {
-    LOG(ERROR) << "Failed to read request: 0x" << std::hex << result;
-    return result;
-  }
-
-  return S_FALSE;
-}
-
-HRESULT SocksSession5::ProcessRequest() {
-  switch (state_) {
-    case State::kNegotiation:
-      return ProcessNegotiation();
-
-    case State::kCommand:
-      return ProcessCommand();
-
-    default:
-      LOG(FATAL) << "Unknown state: " << static_cast<int>(state_);
-      return E_UNEXPECTED;
-  }
-}
-
-HRESULT SocksSession5::ProcessNegotiation() {
-  auto result = EnsureRead(sizeof(SOCKS5::METHOD_REQUEST));
-  if (result != S_OK) {
-    if (FAILED(result))
-      LOG(ERROR) << "Failed to ensure read: 0x" << std::hex << result;
-
-    return result;
-  }
+size_t SocksSession5::GetMethodRequestSize() const {
+  if (message_.size() < sizeof(SOCKS5::METHOD_REQUEST))
+    return sizeof(SOCKS5::METHOD_REQUEST);
 
   auto request =
       reinterpret_cast<const SOCKS5::METHOD_REQUEST*>(message_.data());
-  result =
-      EnsureRead(sizeof(SOCKS5::METHOD_REQUEST) - 1 + request->method_count);
-  if (result != S_OK) {
-    if (FAILED(result))
-      LOG(ERROR) << "Failed to ensure read: 0x" << std::hex << result;
-
-    return result;
-  }
-
-  auto method = SOCKS5::UNSUPPORTED;
-  for (auto i = 0; i < request->method_count; ++i) {
-    if (request->methods[i] == SOCKS5::NO_AUTH) {
-      method = SOCKS5::NO_AUTH;
-      break;
-    }
-  }
-
-  auto buffer = std::make_unique<char[]>(sizeof(SOCKS5::METHOD_RESPONSE));
-  if (buffer == nullptr) {
-    LOG(ERROR) << "Failed to allocate buffer.";
-    return E_OUTOFMEMORY;
-  }
-
-  auto response = reinterpret_cast<SOCKS5::METHOD_RESPONSE*>(buffer.get());
-  response->version = 5;
-  response->method = method;
-
-  result = client_->WriteAsync(response, sizeof(*response), this);
-  if (FAILED(result)) {
-    LOG(ERROR) << "Failed to send: 0x" << std::hex << result;
-    return result;
-  }
-
-  buffer.release();
-  return S_OK;
+  return sizeof(SOCKS5::METHOD_REQUEST) - 1 + request->method_count;
 }
 
-HRESULT SocksSession5::ProcessCommand() {
-  auto result =
-      EnsureRead(offsetof(SOCKS5::REQUEST, address.domain.domain_len));
-  if (result != S_OK) {
-    if (FAILED(result))
-      LOG(ERROR) << "Failed to ensure read: 0x" << std::hex << result;
+size_t SocksSession5::GetCommandRequestSize() const {
+  const size_t kHeaderSize = offsetof(SOCKS5::REQUEST, address);
+  const size_t kPortSize = sizeof(uint16_t);
 
-    return result;
-  }
+  if (message_.size() < kHeaderSize + 1)
+    return kHeaderSize + 1;
 
   auto request = reinterpret_cast<const SOCKS5::REQUEST*>(message_.data());
-  if (request->command != SOCKS5::CONNECT) {
-    auto buffer = std::make_unique<char[]>(sizeof(SOCKS5::RESPONSE));
-    if (buffer == nullptr) {
-      LOG(ERROR) << "Failed to allocate buffer.";
-      return E_OUTOFMEMORY;
-    }
-
-    auto response = reinterpret_cast<SOCKS5::RESPONSE*>(buffer.get());
-    memset(response, 0, sizeof(*response));
-    response->version = 5;
-    response->code = SOCKS5::COMMAND_NOT_SUPPORTED;
+  if (request->command != SOCKS5::CONNECT)
+    return kHeaderSize;
 
-    result = client_->WriteAsync(response, sizeof(*response), this);
-    if (FAILED(result)) {
-      LOG(ERROR) << "Failed to send: 0x" << std::hex << result;
-      return result;
-    }
-
-    buffer.release();
-    return S_OK;
-  }
-
-  auto request_size = 4 + 2;  // common part + port number
   switch (request->type) {
     case SOCKS5::IP_V4:
-      request_size += sizeof(SOCKS5::ADDRESS::ipv4.ipv4_addr);
-      break;
+      return kHeaderSize + sizeof(SOCKS5::ADDRESS::ipv4.ipv4_addr) + kPortSize;
 
     case SOCKS5::DOMAINNAME:
-      request_size += request->address.domain.domain_len;
-      break;
+      return kHeaderSize + 1 + request->address.domain.domain_len + kPortSize;
 
     case SOCKS5::IP_V6:
-      request_size += sizeof(SOCKS5::ADDRESS::ipv6.ipv6_addr);
-      break;
+      return kHeaderSize + sizeof(SOCKS5::ADDRESS::ipv6.ipv6_addr) + kPortSize;
 
     default:
-      LOG(ERROR) << "Illegal address type: " << request->type;
-      return E_INVALID_PROTOCOL_FORMAT;
-  }
-
-  result = EnsureRead(request_size);
-  if (result != S_OK) {
-    if (FAILED(result))
-      LOG(ERROR) << "Failed to ensure read: 0x" << std::hex << result;
-
-    return result;
-  }
-
-  remote_ = std::make_shared<io::net::SocketChannel>();
-  if (remote_ == nullptr) {
-    LOG(ERROR) << "Failed to allocate SocketChannel.";
-    return E_OUTOFMEMORY;
+      return kHeaderSize;
   }
+}
 
-  if (request->type == SOCKS5::IP_V4) {
-    auto address = std::make_unique<SocketAddress4>();
-    if (address == nullptr) {
-      LOG(ERROR) << "Failed to allocate SocketAddress4.";
-      return E_OUTOFMEMORY;
-    }
+int SocksSession5::BuildResponse(SOCKS5::CODE code,
+                                 SOCKS5::RESPONSE* response) const {
+  memset(response, 0, sizeof(*response));
+  response->version = 5;
+  response->code = code;
+  response->type = SOCKS5::IP_V4;
 
-    address->ai_socktype = SOCK_STREAM;
-    address->sin_port = request->address.ipv4.ipv4_port;
-    address->sin_addr = request->address.ipv4.ipv4_addr;
+  int length = offsetof(SOCKS5::RESPONSE, address);
 
-    end_point_ = address.get();
+  sockaddr_storage address;
+  int address_length = sizeof(address);
+  if (remote_ != nullptr &&
+      remote_->GetLocalEndPoint(&address, &address_length)) {
+    switch (address.ss_family) {
+      case AF_INET: {
+        auto address4 = reinterpret_cast<sockaddr_in*>(&address);
+        response->address.ipv4.ipv4_addr = address4->sin_addr;
+        response->address.ipv4.ipv4_port = address4->sin_port;
+        break;
+      }
 
-    result = remote_->ConnectAsync(address.get(), this);
-    if (FAILED(result)) {
-      LOG(ERROR) << "Failed to connect: 0x" << std::hex << result;
-      return result;
+      case AF_INET6: {
+        auto address6 = reinterpret_cast<sockaddr_in6*>(&address);
+        response->type = SOCKS5::IP_V6;
+        response->address.ipv6.ipv6_addr = address6->sin6_addr;
+        response->address.ipv6.ipv6_port = address6->sin6_port;
+        return length + sizeof(SOCKS5::ADDRESS::ipv6);
+      }
     }
-
-    address.release();
-    return S_OK;
   }
 
-  if (request->type == SOCKS5::DOMAINNAME) {
-    std::string host(request->address.domain.domain_name,
-                     request->address.domain.domain_len);
-    auto port =
-        *reinterpret_cast<const uint16_t*>(request->address.domain.domain_name +
-                                           request->address.domain.domain_len);
-
-    auto resolver = std::make_unique<io::net::SocketResolver>();
-    if (resolver == nullptr) {
-      LOG(ERROR) << "Failed to allocate SocketResolver.";
-      return E_OUTOFMEMORY;
-    }
-
-    result = resolver->Resolve(host.c_str(), htons(port));
-    if (FAILED(result)) {
-      LOG(ERROR) << "Failed to resolve " << host << ": 0x" << std::hex
-                 << result;
-      return result;
-    }
-
-    end_point_ = resolver.get();
+  return length + sizeof(SOCKS5::ADDRESS::ipv4);
+}
 
-    result = remote_->ConnectAsync(resolver->begin()->get(), this);
-    if (FAILED(result)) {
-      LOG(ERROR) << "Failed to connect: 0x" << std::hex << result;
-      return result;
+misc::coroutine::Task SocksSession5::Run() {
+  while (message_.size() < GetMethodRequestSize()) {
+    auto read = co_await io::ReadAsync(client_.get(), buffer_, kBufferSize);
+    if (!read.succeeded()) {
+      LOG_IF(ERROR, FAILED(read.result)) << "Failed to receive: 0x" << std::hex
+                                         << read.result;
+      co_return;
     }
 
-    resolver.release();
-    return S_OK;
+    message_.append(buffer_, read.length);
   }
 
-  if (request->type == SOCKS5::IP_V6) {
-    auto address = std::make_unique<SocketAddress6>();
-    if (address == nullptr) {
-      LOG(ERROR) << "Failed to allocate SocketAddress6.";
-      return E_OUTOFMEMORY;
-    }
-
-    address->ai_socktype = SOCK_STREAM;
-    address->sin6_port = request->address.ipv6.ipv6_port;
-    address->sin6_addr = request->address.ipv6.ipv6_addr;
-
-    end_point_ = address.get();
-
-    result = remote_->ConnectAsync(address.get(), this);
-    if (FAILED(result)) {
-      LOG(ERROR) << "Failed to connect: 0x" << std::hex << result;
-      return result;
+  SOCKS5::METHOD_RESPONSE method_response{5, SOCKS5::UNSUPPORTED};
+  auto method_request =
+      reinterpret_cast<const SOCKS5::METHOD_REQUEST*>(message_.data());
+  for (auto i = 0; i < method_request->method_count; ++i) {
+    if (method_request->methods[i] == SOCKS5::NO_AUTH) {
+      method_response.method = SOCKS5::NO_AUTH;
+      break;
     }
-
-    address.release();
-    return S_OK;
   }
 
-  LOG(ERROR) << "Invalid address type: " << request->type;
-  return E_INVALID_PROTOCOL_FORMAT;
-}
-
-void SocksSession5::OnRead(io::Channel* channel, HRESULT result, void* buffer,
-                           int length) {
-  DCHECK(channel == client_.get());
+  auto written = co_await io::WriteAsync(client_.get(), &method_response,
+                                         sizeof(method_response));
+  if (!written.succeeded()) {
+    LOG_IF(ERROR, FAILED(written.result)) << "Failed to send: 0x" << std::hex
+                                          << written.result;
+    co_return;
+  }
 
-  std::unique_ptr<char[]> message(static_cast<char*>(buffer));
+  if (method_response.method == SOCKS5::UNSUPPORTED)
+    co_return;
 
-  do {
-    if (FAILED(result)) {
-      LOG(ERROR) << "Failed to receive: 0x" << std::hex << result;
-      break;
-    }
+  message_.clear();
 
-    if (length <= 0) {
-      LOG(WARNING) << "Channel closed.";
-      break;
+  while (message_.size() < GetCommandRequestSize()) {
+    auto read = co_await io::ReadAsync(client_.get(), buffer_, kBufferSize);
+    if (!read.succeeded()) {
+      LOG_IF(ERROR, FAILED(read.result)) << "Failed to receive: 0x" << std::hex
+                                         << read.result;
+      co_return;
     }
 
-    message_.append(message.get(), length);
-
-    result = ProcessRequest();
-    if (FAILED(result)) {
-      LOG(ERROR) << "Failed to process request: 0x" << std::hex << result;
-      break;
-    }
+    message_.append(buffer_, read.length);
+  }
 
-    return;
-  } while (false);
+  SOCKS5::RESPONSE response;
+  auto request = reinterpret_cast<const SOCKS5::REQUEST*>(message_.data());
 
-  proxy_->EndSession(this);
-}
+  access_.SetClient(client_.get());
+  access_.Begin(misc::AccessLog::Service::kSocks,
+                GetCommandName(request->command));
+  access_.status = SOCKS5::GENERAL_FAILURE;
 
-void SocksSession5::OnWritten(io::Channel* channel, HRESULT result,
-                              void* buffer, int length) {
-  DCHECK(channel == client_.get());
+  if (request->command != SOCKS5::CONNECT) {
+    access_.status = SOCKS5::COMMAND_NOT_SUPPORTED;
+    auto length = BuildResponse(SOCKS5::COMMAND_NOT_SUPPORTED, &response);
+    co_await io::WriteAsync(client_.get(), &response, length);
+    co_return;
+  }
 
-  std::unique_ptr<char[]> message(static_cast<char*>(buffer));
+  remote_ = std::make_shared<io::net::SocketChannel>();
+  if (remote_ == nullptr) {
+    LOG(ERROR) << "Failed to allocate SocketChannel.";
+    co_return;
+  }
 
-  do {
-    if (FAILED(result)) {
-      LOG(ERROR) << "Failed to receive: 0x" << std::hex << result;
-      break;
-    }
+  HRESULT result = E_FAIL;
 
-    if (length <= 0) {
-      LOG(WARNING) << "Channel closed.";
+  switch (request->type) {
+    case SOCKS5::IP_V4: {
+      SocketAddress4 address;
+      address.ai_socktype = SOCK_STREAM;
+      address.sin_port = request->address.ipv4.ipv4_port;
+      address.sin_addr = request->address.ipv4.ipv4_addr;
+      access_.SetHost(address.ai_addr);
+
+      result = co_await io::net::ConnectAsync(remote_.get(), &address);
       break;
     }
 
-    switch (state_) {
-      case State::kNegotiation:
-        state_ = State::kCommand;
-        message_.clear();
-
-        result = ReadRequest();
-        if (FAILED(result)) {
-          LOG(ERROR) << "Failed to read request: 0x" << std::hex << result;
-          break;
-        }
-        return;
-
-      case State::kCommand: {
-        auto response = static_cast<SOCKS5::RESPONSE*>(buffer);
-        if (response->code == SOCKS5::SUCCEEDED) {
-          client_.reset();
-          remote_.reset();
-        }
+    case SOCKS5::DOMAINNAME: {
+      std::string host(request->address.domain.domain_name,
+                       request->address.domain.domain_len);
+      auto port = *reinterpret_cast<const uint16_t*>(
+          request->address.domain.domain_name +
+          request->address.domain.domain_len);
+      access_.SetHost(host, ntohs(port));
+
+      io::net::SocketResolver resolver;
+      result = resolver.Resolve(host.c_str(), htons(port));
+      if (FAILED(result)) {
+        LOG(ERROR) << "Failed to resolve " << host << ": 0x" << std::hex
+                   << result;
         break;
       }
 
-      default:
-        LOG(FATAL) << "Unknown state: " << static_cast<int>(state_);
-        break;
-    }
-  } while (false);
-
-  proxy_->EndSession(this);
-}
-
-void SocksSession5::OnConnected(io::net::SocketChannel* channel,
-                                HRESULT result) {
-  DCHECK(channel == remote_.get());
-
-  auto request = reinterpret_cast<const SOCKS5::REQUEST*>(message_.data());
-  switch (request->type) {
-    case SOCKS5::IP_V4:
-      delete static_cast<SocketAddress4*>(end_point_);
+      auto end_point = resolver.begin()->get();
+      result = co_await io::net::ConnectAsync(remote_.get(), end_point);
       break;
+    }
 
-    case SOCKS5::DOMAINNAME:
-      delete static_cast<io::net::SocketResolver*>(end_point_);
-      break;
+    case SOCKS5::IP_V6: {
+      SocketAddress6 address;
+      address.ai_socktype = SOCK_STREAM;
+      address.sin6_port = request->address.ipv6.ipv6_port;
+      address.sin6_addr = request->address.ipv6.ipv6_addr;
+      access_.SetHost(address.ai_addr);
 
-    case SOCKS5::IP_V6:
-      delete static_cast<SocketAddress6*>(end_point_);
+      result = co_await io::net::ConnectAsync(remote_.get(), &address);
       break;
+    }
 
     default:
-      LOG(FATAL) << "Unknown address type: " << request->type;
+      LOG(ERROR) << "Invalid address type: " << request->type;
+      result = E_INVALID_PROTOCOL_FORMAT;
       break;
   }
 
+  LOG_IF(ERROR, FAILED(result)) << "Failed to connect: 0x" << std::hex
+                                << result;
+
+  // Taken over by the tunnel if bound.
+  access_.status = SOCKS5::SUCCEEDED;
+
   SOCKS5::CODE code;
-  if (SUCCEEDED(result) && misc::TunnelingService::Bind(client_, remote_))
+  if (SUCCEEDED(result) &&
+      misc::TunnelingService::Bind(client_, remote_, &access_))
     code = SOCKS5::SUCCEEDED;
   else
     code = SOCKS5::GENERAL_FAILURE;
 
-  auto buffer = std::make_unique<char[]>(sizeof(SOCKS5::RESPONSE));
-  if (buffer == nullptr) {
-    LOG(ERROR) << "Failed to allocate buffer.";
-    proxy_->EndSession(this);
-    return;
-  }
-
-  auto response = reinterpret_cast<SOCKS5::RESPONSE*>(buffer.get());
-  memset(response, 0, sizeof(*response));
-  response->version = 5;
-  response->code = code;
-
-  sockaddr_storage address;
-  int length = sizeof(address);
-  if (remote_->GetLocalEndPoint(&address, &length)) {
-    length = offsetof(SOCKS5::RESPONSE, address);
+  access_.status = code;
 
-    switch (address.ss_family) {
-      case AF_INET: {
-        auto address4 = reinterpret_cast<sockaddr_in*>(&address);
-        response->type = SOCKS5::IP_V4;
-        response->address.ipv4.ipv4_addr = address4->sin_addr;
-        response->address.ipv4.ipv4_port = address4->sin_port;
-        length += sizeof(SOCKS5::ADDRESS::ipv4);
-        break;
-      }
-
-      case AF_INET6: {
-        auto address6 = reinterpret_cast<sockaddr_in6*>(&address);
-        response->type = SOCKS5::IP_V6;
-        response->address.ipv6.ipv6_addr = address6->sin6_addr;
-        response->address.ipv6.ipv6_port = address6->sin6_port;
-        length += sizeof(SOCKS5::ADDRESS::ipv6);
-        break;
-      }
-
-      default:
-        response->type = SOCKS5::IP_V4;
-        length += sizeof(SOCKS5::ADDRESS::ipv4);
-        break;
-    }
-  } else {
-    response->type = SOCKS5::IP_V4;
-    length =
-        offsetof(SOCKS5::RESPONSE, address) + sizeof(SOCKS5::ADDRESS::ipv4);
+  auto length = BuildResponse(code, &response);
+  written = co_await io::WriteAsync(client_.get(), &response, length);
+  if (!written.succeeded()) {
+    LOG_IF(ERROR, FAILED(written.result)) << "Failed to send: 0x" << std::hex
+                                          << written.result;
+    co_return;
   }
 
-  result = client_->WriteAsync(response, length, this);
-  if (FAILED(result)) {
-    LOG(ERROR) << "Failed to send: 0x" << std::hex << result;
-    proxy_->EndSession(this);
-    return;
+  if (code == SOCKS5::SUCCEEDED) {
+    client_.reset();
+    remote_.reset();
   }
-
-  buffer.release();
 }
 
-void SocksSession5::OnClosed(io::net::SocketChannel* channel, HRESULT result) {
-  LOG(FATAL) << "channel: " << channel << ", result: 0x" << std::hex << result;
+void SocksSession5::OnTaskCompleted() {
+  proxy_->EndSession(this);
 }
 
 }  // namespace socks
@@ -9,14 +9,17 @@
 #include <string>
 
 #include "io/net/socket_channel.h"
+#include "misc/access_log.h"
+#include "misc/coroutine/frame_allocator.h"
+#include "misc/coroutine/task.h"
+#include "service/socks/socks5.h"
 
 namespace juno {
 namespace service {
 namespace socks {
 
 class SocksSession5 : public SocksSession,
-                      private io::Channel::Listener,
-                      private io::net::SocketChannel::Listener {
+                      private misc::coroutine::TaskOwner {
  public:
   SocksSession5(SocksProxy* proxy, std::unique_ptr<io::Channel>&& channel);
   ~SocksSession5();
@@ -26,31 +29,22 @@ class SocksSession5 : public SocksSession,
 
  private:
   static const int kBufferSize = 1024;
+  // Room for the frame of Run(), checked when it is created.
+  static const size_t kFrameSize = 1024;
 
-  enum class State {
-    kInit,
-    kNegotiation,
-    kCommand,
-  };
+  size_t GetMethodRequestSize() const;
+  size_t GetCommandRequestSize() const;
+  int BuildResponse(SOCKS5::CODE code, SOCKS5::RESPONSE* response) const;
 
-  HRESULT ReadRequest();
-  HRESULT EnsureRead(size_t min_length);
+  misc::coroutine::Task Run();
 
-  HRESULT ProcessRequest();
-  HRESULT ProcessNegotiation();
-  HRESULT ProcessCommand();
+  void OnTaskCompleted() override;
 
-  void OnRead(io::Channel* channel, HRESULT result, void* buffer,
-              int length) override;
-  void OnWritten(io::Channel* channel, HRESULT result, void* buffer,
-                 int length) override;
-  void OnConnected(io::net::SocketChannel* channel, HRESULT result) override;
-  void OnClosed(io::net::SocketChannel* channel, HRESULT result) override;
-
-  State state_;
   std::string message_;
-  void* end_point_;
   std::shared_ptr<io::net::SocketChannel> remote_;
+  misc::AccessLog::Record access_;
+  char buffer_[kBufferSize];
+  misc::coroutine::InlineFrameAllocator<kFrameSize> frame_allocator_;
 
   SocksSession5(const SocksSession5&) = delete;
   SocksSession5& operator=(const SocksSession5&) = delete;
@@ -2,6 +2,8 @@
 
 #include "service/tcp_server.h"
 
+#include <base/values.h>
+
 #include "io/net/socket_channel.h"
 #include "service/service.h"
 
@@ -9,7 +11,11 @@ namespace juno {
 namespace service {
 
 TcpServer::TcpServer()
-    : channel_customizer_(nullptr), service_(nullptr), empty_(&lock_) {}
+    : channel_customizer_(nullptr),
+      service_(nullptr),
+      empty_(&lock_),
+      stopped_(),
+      timer_(misc::TimerService::GetDefault()->Create(this)) {}
 
 TcpServer::~TcpServer() {
   TcpServer::Stop();
@@ -59,13 +65,24 @@ bool TcpServer::Start() {
 void TcpServer::Stop() {
   base::AutoLock guard(lock_);
 
+  stopped_ = true;
+
   for (auto& server : servers_)
     server->Close();
 
+  // Paused servers have no accept pending that would fail.
+  for (auto server : paused_)
+    DeleteServer(server);
+  paused_.clear();
+
   while (!servers_.empty())
     empty_.Wait();
 }
 
+void TcpServer::GetStatistics(base::DictionaryValue* stats) const {
+  admission_.GetStatistics(stats);
+}
+
 void TcpServer::DeleteServer(AsyncServerSocket* server) {
   auto pair = new ServerSocketPair(this, server);
   if (pair == nullptr ||
@@ -104,6 +121,23 @@ void TcpServer::DeleteServerImpl(AsyncServerSocket* server) {
   removed.reset();
 }
 
+HRESULT TcpServer::AcceptNext(AsyncServerSocket* server) {
+  if (timer_ == nullptr ||
+      admission_.Admit(0) == AdmissionController::Decision::kAdmit)
+    return server->AcceptAsync(this);
+
+  base::AutoLock guard(lock_);
+
+  if (stopped_)
+    return E_ABORT;
+
+  paused_.push_back(server);
+  if (paused_.size() == 1)
+    timer_->Start(admission_.GetRetryDelay(), 0);
+
+  return S_OK;
+}
+
 void TcpServer::OnAccepted(AsyncServerSocket* server, HRESULT result,
                            AsyncServerSocket::Context* context) {
   do {
@@ -124,12 +158,26 @@ void TcpServer::OnAccepted(AsyncServerSocket* server, HRESULT result,
 
     service_->OnAccepted(std::move(channel));
 
-    result = server->AcceptAsync(this);
+    result = AcceptNext(server);
   } while (false);
 
   if (FAILED(result))
     DeleteServer(server);
 }
 
+void TcpServer::OnTimeout() {
+  std::vector<AsyncServerSocket*> paused;
+
+  lock_.Acquire();
+  paused.swap(paused_);
+  lock_.Release();
+
+  for (auto server : paused) {
+    auto result = AcceptNext(server);
+    if (FAILED(result))
+      DeleteServer(server);
+  }
+}
+
 }  // namespace service
 }  // namespace juno
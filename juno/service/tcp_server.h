@@ -12,6 +12,8 @@
 
 #include "io/net/async_server_socket.h"
 #include "io/net/socket_resolver.h"
+#include "misc/timer_service.h"
+#include "service/admission_controller.h"
 #include "service/server.h"
 #include "service/service.h"
 
@@ -20,7 +22,9 @@ namespace service {
 
 using ::juno::io::net::AsyncServerSocket;
 
-class TcpServer : public Server, private AsyncServerSocket::Listener {
+class TcpServer : public Server,
+                  private AsyncServerSocket::Listener,
+                  private misc::TimerService::Callback {
  public:
   class __declspec(novtable) ChannelCustomizer {
    public:
@@ -46,6 +50,14 @@ class TcpServer : public Server, private AsyncServerSocket::Listener {
     service_ = service;
   }
 
+  // Accepting is paused while either limit is exceeded; pending connections
+  // stay in the backlog of the listening socket meanwhile.
+  void SetAdmissionLimits(int max_accept_rate, int max_queue_delay) {
+    admission_.SetLimits(0, max_accept_rate, max_queue_delay);
+  }
+
+  void GetStatistics(base::DictionaryValue* stats) const override;
+
  private:
   typedef std::pair<TcpServer*, AsyncServerSocket*> ServerSocketPair;
 
@@ -54,9 +66,13 @@ class TcpServer : public Server, private AsyncServerSocket::Listener {
                                         void* param);
   void DeleteServerImpl(AsyncServerSocket* server);
 
+  HRESULT AcceptNext(AsyncServerSocket* server);
+
   void OnAccepted(AsyncServerSocket* server, HRESULT result,
                   AsyncServerSocket::Context* context) override;
 
+  void OnTimeout() override;
+
   ChannelCustomizer* channel_customizer_;
   io::net::SocketResolver resolver_;
   std::vector<std::unique_ptr<AsyncServerSocket>> servers_;
@@ -64,6 +80,11 @@ class TcpServer : public Server, private AsyncServerSocket::Listener {
 
   base::Lock lock_;
   base::ConditionVariable empty_;
+  bool stopped_;
+
+  AdmissionController admission_;
+  std::vector<AsyncServerSocket*> paused_;
+  std::unique_ptr<misc::TimerService::Timer> timer_;
 
   TcpServer(const TcpServer&) = delete;
   TcpServer& operator=(const TcpServer&) = delete;